@@ -47,6 +47,9 @@
 #include <sys/un.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -80,6 +83,7 @@
 #include "authfd.h"
 #include "pathnames.h"
 #include "match.h"
+#include "metrics.h"
 
 /* XXX remove once we're satisfied there's no lurking bugs */
 /* #define DEBUG_CHANNEL_POLL 1 */
@@ -151,6 +155,11 @@ struct ssh_channel_timeout {
 	int timeout_secs;
 };
 
+struct ssh_channel_weight {
+	char *type_pattern;
+	u_int weight;
+};
+
 /* Master structure for channels state */
 struct ssh_channels {
 	/*
@@ -211,10 +220,47 @@ struct ssh_channels {
 	/* Global timeout for all OPEN channels */
 	int global_deadline;
 	time_t lastused;
+	/* Output weights by type */
+	struct ssh_channel_weight *weights;
+	size_t nweights;
 	/* pattern-lists used to classify channels as bulk */
 	char *bulk_classifier_tty, *bulk_classifier_notty;
-	/* Number of active bulk channels (set by channel_handler) */
+	/* Number of active bulk channels (set by channel_sweep) */
 	u_int nbulk;
+	/* Grow the windows of forwarding channels (HPN dynamic windows) */
+	int dynamic_windows;
+	/* Channel index channel_output_poll starts its next round at */
+	u_int drr_next;
+	/* Set if that channel was cut short and keeps its credit */
+	int drr_resume;
+	/* Window target from channel_tcpwinsz, valid for one poll pass */
+	u_int32_t tcpwinsz;
+	int tcpwinsz_valid;
+
+	/*
+	 * Ids of the channels the pre and post handlers run for: those
+	 * that were ready, were looked up (e.g. for a packet) or changed
+	 * state since they were last handled. Freed slots are -1.
+	 */
+	int *dirty;
+	u_int ndirty, dirty_alloc;
+	/* monotime() of the last pass that handled every channel */
+	time_t sweep_time;
+	/* earliest inactivity or pause deadline seen since then */
+	time_t timer_deadline;
+	/* Channel id for each pollfd entry, -1 for the caller's */
+	int *pfd_chan;
+	u_int pfd_chan_alloc;
+#ifdef USE_EPOLL
+	/* epoll set holding the channel descriptors, -1 if not in use */
+	int epfd;
+	pid_t epfd_pid;		/* process that created it */
+	int epoll_failed;
+	/* pollfd entry of the set this pass, -1 if channels were polled */
+	int epoll_pfd;
+	struct epoll_event *epoll_evs;
+	u_int epoll_nevs;
+#endif
 };
 
 /* helper */
@@ -230,6 +276,9 @@ static int rdynamic_connect_finish(struct ssh *, Channel *);
 /* Setup helper */
 static void channel_handler_init(struct ssh_channels *sc);
 
+/* drop a descriptor from the epoll set before it is closed */
+static void channel_epoll_forget(struct ssh *, Channel *, int);
+
 /* default values to enable hpn and the initial buffer size */
 static int hpn_disabled = 0;
 
@@ -247,11 +296,37 @@ channel_init_channels(struct ssh *ssh)
 	sc->IPv4or6 = AF_UNSPEC;
 	sc->bulk_classifier_tty = xstrdup(CHANNEL_BULK_TTY);
 	sc->bulk_classifier_notty = xstrdup(CHANNEL_BULK_NOTTY);
+#ifdef USE_EPOLL
+	sc->epfd = sc->epoll_pfd = -1;
+#endif
 	channel_handler_init(sc);
 
 	ssh->chanctxt = sc;
 }
 
+/*
+ * Queue a channel for the pre and post handlers. Anything that changes a
+ * channel outside its own handlers finds it through one of the lookups
+ * below, which call this, so the handlers need not visit idle channels.
+ */
+static void
+channel_mark_dirty(struct ssh *ssh, Channel *c)
+{
+	struct ssh_channels *sc = ssh->chanctxt;
+
+	if (c->dirty != 0) {
+		c->dirty = CHAN_DIRTY_TOUCHED;
+		return;
+	}
+	if (sc->ndirty >= sc->dirty_alloc) {
+		sc->dirty = xrecallocarray(sc->dirty, sc->dirty_alloc,
+		    sc->dirty_alloc + 64, sizeof(*sc->dirty));
+		sc->dirty_alloc += 64;
+	}
+	sc->dirty[sc->ndirty++] = c->self;
+	c->dirty = CHAN_DIRTY_TOUCHED;
+}
+
 Channel *
 channel_by_id(struct ssh *ssh, int id)
 {
@@ -266,6 +341,7 @@ channel_by_id(struct ssh *ssh, int id)
 		logit_f("%d: bad id: channel free", id);
 		return NULL;
 	}
+	channel_mark_dirty(ssh, c);
 	return c;
 }
 
@@ -277,8 +353,11 @@ channel_by_remote_id(struct ssh *ssh, u_int remote_id)
 
 	for (i = 0; i < ssh->chanctxt->channels_alloc; i++) {
 		c = ssh->chanctxt->channels[i];
-		if (c != NULL && c->have_remote_id && c->remote_id == remote_id)
+		if (c != NULL && c->have_remote_id &&
+		    c->remote_id == remote_id) {
+			channel_mark_dirty(ssh, c);
 			return c;
+		}
 	}
 	return NULL;
 }
@@ -351,6 +430,40 @@ channel_clear_timeouts(struct ssh *ssh)
 	sc->ntimeouts = 0;
 }
 
+/*
+ * Add an output weight for channels whose c->ctype (or c->xctype if it is
+ * set) match type_pattern. Such a channel may queue up to weight packets
+ * each time channel_output_poll() runs, where others queue one, so it
+ * gets that many times their share of a busy connection.
+ */
+void
+channel_add_weight(struct ssh *ssh, const char *type_pattern, u_int weight)
+{
+	struct ssh_channels *sc = ssh->chanctxt;
+
+	debug2_f("channel type \"%s\" weight %u", type_pattern, weight);
+	sc->weights = xrecallocarray(sc->weights, sc->nweights,
+	    sc->nweights + 1, sizeof(*sc->weights));
+	sc->weights[sc->nweights].type_pattern = xstrdup(type_pattern);
+	sc->weights[sc->nweights].weight = weight;
+	sc->nweights++;
+}
+
+/* Clears all previously-added channel weights */
+void
+channel_clear_weights(struct ssh *ssh)
+{
+	struct ssh_channels *sc = ssh->chanctxt;
+	size_t i;
+
+	debug3_f("clearing");
+	for (i = 0; i < sc->nweights; i++)
+		free(sc->weights[i].type_pattern);
+	free(sc->weights);
+	sc->weights = NULL;
+	sc->nweights = 0;
+}
+
 static int
 lookup_timeout(struct ssh *ssh, const char *type)
 {
@@ -365,6 +478,20 @@ lookup_timeout(struct ssh *ssh, const char *type)
 	return 0;
 }
 
+static u_int
+lookup_weight(struct ssh *ssh, const char *type)
+{
+	struct ssh_channels *sc = ssh->chanctxt;
+	size_t i;
+
+	for (i = 0; i < sc->nweights; i++) {
+		if (match_pattern(type, sc->weights[i].type_pattern))
+			return sc->weights[i].weight;
+	}
+
+	return 1;
+}
+
 static void
 channel_classify(struct ssh *ssh, Channel *c)
 {
@@ -394,6 +521,7 @@ channel_set_xtype(struct ssh *ssh, int id, const char *xctype)
 	c->xctype = xstrdup(xctype);
 	/* Type has changed, so look up inactivity deadline again */
 	c->inactive_deadline = lookup_timeout(ssh, c->xctype);
+	c->weight = lookup_weight(ssh, c->xctype);
 	channel_classify(ssh, c);
 	debug2_f("labeled channel %d as %s (inactive timeout %u)", id, xctype,
 	    c->inactive_deadline);
@@ -569,14 +697,29 @@ channel_new(struct ssh *ssh, char *ctype, int type, int rfd, int wfd, int efd,
 	c->ctype = ctype;
 	c->local_window = window;
 	c->local_window_max = window;
+	c->local_window_min = window;
+	/* bulk channels get the bigger packets an HPN peer agreed to.
+	 * Interactive sessions ask for less than the default and keep it */
+	if ((maxpack == CHAN_SES_PACKET_DEFAULT ||
+	    maxpack == CHAN_TCP_PACKET_DEFAULT) &&
+	    ssh_packet_get_hpn_max_packet(ssh) > maxpack)
+		maxpack = ssh_packet_get_hpn_max_packet(ssh);
 	c->local_maxpacket = maxpack;
 	c->dynamic_window = 0;
 	c->remote_name = xstrdup(remote_name);
 	c->ctl_chan = -1;
+	c->pfds[0] = c->pfds[1] = c->pfds[2] = c->pfds[3] = -1;
+#ifdef USE_EPOLL
+	c->ep_fd[0] = c->ep_fd[1] = c->ep_fd[2] = c->ep_fd[3] = -1;
+	c->ep_refused[0] = c->ep_refused[1] = -1;
+	c->ep_refused[2] = c->ep_refused[3] = -1;
+#endif
 	c->delayed = 1;		/* prevent call to channel_post handler */
 	c->inactive_deadline = lookup_timeout(ssh, c->ctype);
+	c->weight = lookup_weight(ssh, c->ctype);
 	TAILQ_INIT(&c->status_confirms);
 	channel_classify(ssh, c);
+	channel_mark_dirty(ssh, c);
 	debug("channel %d: new %s [%s] (inactive timeout: %u)",
 	    found, c->ctype, remote_name, c->inactive_deadline);
 	return c;
@@ -633,6 +776,7 @@ channel_close_fd(struct ssh *ssh, Channel *c, int *fdp)
 		c->pfds[3] = -1;
 	}
 
+	channel_epoll_forget(ssh, c, fd);
 	ret = close(fd);
 	*fdp = -1; /* probably redundant */
 	return ret;
@@ -800,6 +944,7 @@ channel_free(struct ssh *ssh, Channel *c)
 			other->type = SSH_CHANNEL_OPEN;
 			other->istate = CHAN_INPUT_CLOSED;
 			other->ostate = CHAN_OUTPUT_CLOSED;
+			channel_mark_dirty(ssh, other);
 		}
 	}
 	debug("channel %d: free: %s, nchannels %u", c->self,
@@ -841,6 +986,13 @@ channel_free(struct ssh *ssh, Channel *c)
 	}
 	if (c->filter_cleanup != NULL && c->filter_ctx != NULL)
 		c->filter_cleanup(ssh, c->self, c->filter_ctx);
+	/* leave a hole so a handler pass walking the list isn't upset */
+	if (c->dirty != 0) {
+		for (i = 0; i < sc->ndirty; i++) {
+			if (sc->dirty[i] == c->self)
+				sc->dirty[i] = -1;
+		}
+	}
 	sc->channels[c->self] = NULL;
 	freezero(c, sizeof(*c));
 }
@@ -858,6 +1010,21 @@ channel_free_all(struct ssh *ssh)
 	free(sc->channels);
 	sc->channels = NULL;
 	sc->channels_alloc = 0;
+	free(sc->dirty);
+	sc->dirty = NULL;
+	sc->ndirty = sc->dirty_alloc = 0;
+	free(sc->pfd_chan);
+	sc->pfd_chan = NULL;
+	sc->pfd_chan_alloc = 0;
+#ifdef USE_EPOLL
+	/* in a forked child this only closes our copy */
+	if (sc->epfd != -1)
+		close(sc->epfd);
+	sc->epfd = sc->epoll_pfd = -1;
+	free(sc->epoll_evs);
+	sc->epoll_evs = NULL;
+	sc->epoll_nevs = 0;
+#endif
 
 	free(sc->x11_saved_display);
 	sc->x11_saved_display = NULL;
@@ -889,6 +1056,7 @@ channel_free_channels(struct ssh *ssh)
 	sc = ssh->chanctxt;
 	free(sc->bulk_classifier_tty);
 	free(sc->bulk_classifier_notty);
+	channel_clear_weights(ssh);
 	free(sc->channel_pre);
 	free(sc->channel_post);
 	freezero(sc, sizeof(*sc));
@@ -1344,22 +1512,49 @@ channel_pre_connecting(struct ssh *ssh, Channel *c)
 	c->io_want = SSH_CHAN_IO_SOCK_W;
 }
 
-static int
+/*
+ * Returns the window dynamic channels should aim for. This is twice the
+ * bandwidth-delay product of the connection as seen by TCP_INFO, which
+ * leaves room for the window adjust to reach the peer and for data
+ * waiting in our own buffers. The BDP is the larger of what the kernel
+ * receives per RTT (tcpi_rcv_space) and what it delivers per RTT. Where
+ * TCP_INFO isn't available we fall back to the size of the receive
+ * buffer. The sockets are only queried once per poll pass.
+ */
+static u_int32_t
 channel_tcpwinsz(struct ssh *ssh)
 {
+	struct ssh_channels *sc = ssh->chanctxt;
+	struct metrics_transport mt;
+	u_int64_t bdp;
 	u_int32_t tcpwinsz = 0;
 	socklen_t optsz = sizeof(tcpwinsz);
-	int ret = -1;
+	int sock, ret = -1;
+
+	if (sc->tcpwinsz_valid)
+		return sc->tcpwinsz;
+	sc->tcpwinsz_valid = 1;
 
 	/* if we aren't on a socket return 128KB */
-	if (!ssh_packet_connection_is_on_socket(ssh))
-		return 128 * 1024;
-
-	ret = getsockopt(ssh_packet_get_connection_in(ssh),
-			 SOL_SOCKET, SO_RCVBUF, &tcpwinsz, &optsz);
-	/* return no more than SSHBUF_SIZE_MAX (currently 256MB) */
-	if ((ret == 0) && tcpwinsz > SSHBUF_SIZE_MAX)
-		tcpwinsz = SSHBUF_SIZE_MAX;
+	if (!ssh_packet_connection_is_on_socket(ssh)) {
+		sc->tcpwinsz = 128 * 1024;
+		return sc->tcpwinsz;
+	}
+
+	sock = ssh_packet_get_connection_in(ssh);
+	if (metrics_read_transport(sock, &mt) == 0 && mt.rtt > 0) {
+		bdp = mt.delivery_rate * mt.rtt / 1000000;
+		bdp = MAXIMUM(bdp, mt.rcv_space);
+		tcpwinsz = MINIMUM(bdp * 2, SSHBUF_SIZE_MAX);
+	} else {
+		ret = getsockopt(sock, SOL_SOCKET, SO_RCVBUF,
+		    &tcpwinsz, &optsz);
+		/* return no more than SSHBUF_SIZE_MAX (currently 256MB) */
+		if (ret != 0)
+			tcpwinsz = 0;
+		else if (tcpwinsz > SSHBUF_SIZE_MAX)
+			tcpwinsz = SSHBUF_SIZE_MAX;
+	}
 	/* if the remote side is OpenSSH after version 8.8 we need to restrict
 	 * the size of the advertised window. Now this means that any HPN to non-HPN
 	 * connection will be window limited to 15MB of receive space. This is a
@@ -1368,6 +1563,7 @@ channel_tcpwinsz(struct ssh *ssh)
 
 	if ((ssh->compat & SSH_RESTRICT_WINDOW) && (tcpwinsz > NON_HPN_WINDOW_MAX))
 		tcpwinsz = NON_HPN_WINDOW_MAX;
+	sc->tcpwinsz = tcpwinsz;
 	return (tcpwinsz);
 }
 
@@ -1812,6 +2008,7 @@ channel_connect_stdio_fwd(struct ssh *ssh,
 	c = channel_new(ssh, "stdio-forward", SSH_CHANNEL_OPENING, in, out,
 	    -1, CHAN_TCP_WINDOW_DEFAULT, CHAN_TCP_PACKET_DEFAULT,
 	    0, "stdio-forward", nonblock);
+	c->dynamic_window = ssh->chanctxt->dynamic_windows;
 
 	c->path = xstrdup(host_to_connect);
 	c->host_port = port_to_connect;
@@ -2053,6 +2250,16 @@ channel_set_x11_refuse_time(struct ssh *ssh, time_t refuse_time)
 	ssh->chanctxt->x11_refuse_time = refuse_time;
 }
 
+/*
+ * Enables dynamic windows for the channels created for port and
+ * streamlocal forwarding and stdio forwarding from here on.
+ */
+void
+channel_set_dynamic_windows(struct ssh *ssh, int enable)
+{
+	ssh->chanctxt->dynamic_windows = enable;
+}
+
 /*
  * This socket is listening for connections to a forwarded TCP/IP port.
  */
@@ -2102,6 +2309,7 @@ channel_post_port_listener(struct ssh *ssh, Channel *c)
 		set_nodelay(newsock);
 	nc = channel_new(ssh, rtype, nextstate, newsock, newsock, -1,
 	    c->local_window_max, c->local_maxpacket, 0, rtype, 1);
+	nc->dynamic_window = ssh->chanctxt->dynamic_windows;
 	nc->listening_port = c->listening_port;
 	nc->host_port = c->host_port;
 	if (c->path != NULL)
@@ -2211,10 +2419,24 @@ channel_post_connecting(struct ssh *ssh, Channel *c)
 	}
 
 	/* New non-blocking connection in progress */
+	channel_epoll_forget(ssh, c, c->sock);
 	close(c->sock);
 	c->sock = c->rfd = c->wfd = sock;
 }
 
+/*
+ * Bytes an open channel may read per pass: what one channel_output_poll
+ * turn lets it send, so reading more would only queue it in c->input.
+ * Other channels, and ttys, read once.
+ */
+static size_t
+channel_read_budget(Channel *c, int force)
+{
+	if (c->type != SSH_CHANNEL_OPEN || c->isatty || force)
+		return 0;
+	return (size_t)CHAN_DRR_QUANTUM * MAXIMUM(c->weight, 1);
+}
+
 static int
 channel_handle_rfd(struct ssh *ssh, Channel *c)
 {
@@ -2222,6 +2444,7 @@ channel_handle_rfd(struct ssh *ssh, Channel *c)
 	ssize_t len;
 	int r, force;
 	size_t nr = 0, have, avail, maxlen = CHANNEL_MAX_READ;
+	size_t want, budget, base, total = 0;
 	int pty_zeroread = 0;
 
 #ifdef PTY_ZEROREAD
@@ -2235,6 +2458,7 @@ channel_handle_rfd(struct ssh *ssh, Channel *c)
 		return 1;
 	if ((avail = sshbuf_avail(c->input)) == 0)
 		return 1; /* Shouldn't happen */
+	budget = channel_read_budget(c, force);
 
 	/*
 	 * For "simple" channels (i.e. not datagram or filtered), we can
@@ -2243,59 +2467,101 @@ channel_handle_rfd(struct ssh *ssh, Channel *c)
 	if (!pty_zeroread && c->input_filter == NULL && !c->datagram) {
 		/* Only OPEN channels have valid rwin */
 		if (c->type == SSH_CHANNEL_OPEN) {
+			/* enough to fill the bigger packets an HPN peer
+			 * agreed to */
+			if (maxlen < c->remote_maxpacket &&
+			    ssh_packet_get_hpn_max_packet(ssh) != 0)
+				maxlen = c->remote_maxpacket;
 			if ((have = sshbuf_len(c->input)) >= c->remote_window)
 				return 1; /* shouldn't happen */
 			if (maxlen > c->remote_window - have)
 				maxlen = c->remote_window - have;
+			budget = MINIMUM(budget, c->remote_window - have);
 		}
-		if (maxlen > avail)
-			maxlen = avail;
-		if ((r = sshbuf_read(c->rfd, c->input, maxlen, &nr)) != 0) {
-			if (errno == EINTR || (!force &&
-			    (errno == EAGAIN || errno == EWOULDBLOCK)))
-				return 1;
-			debug2("channel %d: read failed rfd %d maxlen %zu: %s",
-			    c->self, c->rfd, maxlen, ssh_err(r));
-			goto rfail;
-		}
-		if (nr != 0)
+		/*
+		 * Keep reading while the reads come back full, doubling
+		 * their size, until the budget or window is used up. The
+		 * size is remembered, and halved again once reads come
+		 * back mostly empty, so idle channels don't hold big
+		 * buffers.
+		 */
+		base = maxlen;
+		if (c->read_size > maxlen && budget > maxlen)
+			maxlen = MINIMUM(c->read_size, budget);
+		do {
+			want = MINIMUM(maxlen, budget > total ?
+			    budget - total : maxlen);
+			if (want > (avail = sshbuf_avail(c->input)))
+				want = avail;
+			if (want == 0)
+				break;
+			if ((r = sshbuf_read(c->rfd, c->input, want,
+			    &nr)) != 0) {
+				if (errno == EINTR || (!force &&
+				    (errno == EAGAIN || errno == EWOULDBLOCK)))
+					break;
+				debug2("channel %d: read failed rfd %d "
+				    "maxlen %zu: %s", c->self, c->rfd, want,
+				    ssh_err(r));
+				if (total != 0)
+					channel_set_used_time(ssh, c);
+				goto rfail;
+			}
+			total += nr;
+			if (nr == want && maxlen < budget)
+				maxlen = MINIMUM(maxlen * 2, budget);
+			else if (nr < want / 4 && maxlen > base)
+				maxlen = MAXIMUM(maxlen / 2, base);
+		} while (nr == want && total < budget);
+		c->read_size = maxlen;
+		if (total != 0)
 			channel_set_used_time(ssh, c);
 		return 1;
 	}
 
-	errno = 0;
-	len = read(c->rfd, buf, sizeof(buf));
-	/* fixup AIX zero-length read with errno set to look more like errors */
-	if (pty_zeroread && len == 0 && errno != 0)
-		len = -1;
-	if (len == -1 && (errno == EINTR ||
-	    ((errno == EAGAIN || errno == EWOULDBLOCK) && !force)))
-		return 1;
-	if (len < 0 || (!pty_zeroread && len == 0)) {
-		debug2("channel %d: read<=0 rfd %d len %zd: %s",
-		    c->self, c->rfd, len,
-		    len == 0 ? "closed" : strerror(errno));
+	do {
+		errno = 0;
+		len = read(c->rfd, buf, sizeof(buf));
+		/* fixup AIX zero-length read with errno set to look more
+		 * like errors */
+		if (pty_zeroread && len == 0 && errno != 0)
+			len = -1;
+		if (len == -1 && (errno == EINTR ||
+		    ((errno == EAGAIN || errno == EWOULDBLOCK) && !force)))
+			break;
+		if (len < 0 || (!pty_zeroread && len == 0)) {
+			debug2("channel %d: read<=0 rfd %d len %zd: %s",
+			    c->self, c->rfd, len,
+			    len == 0 ? "closed" : strerror(errno));
  rfail:
-		if (c->type != SSH_CHANNEL_OPEN) {
-			debug2("channel %d: not open", c->self);
-			chan_mark_dead(ssh, c);
+			if (c->type != SSH_CHANNEL_OPEN) {
+				debug2("channel %d: not open", c->self);
+				chan_mark_dead(ssh, c);
+				return -1;
+			} else {
+				chan_read_failed(ssh, c);
+			}
 			return -1;
-		} else {
-			chan_read_failed(ssh, c);
 		}
-		return -1;
-	}
-	channel_set_used_time(ssh, c);
-	if (c->input_filter != NULL) {
-		if (c->input_filter(ssh, c, buf, len) == -1) {
-			debug2("channel %d: filter stops", c->self);
-			chan_read_failed(ssh, c);
-		}
-	} else if (c->datagram) {
-		if ((r = sshbuf_put_string(c->input, buf, len)) != 0)
-			fatal_fr(r, "channel %i: put datagram", c->self);
-	} else if ((r = sshbuf_put(c->input, buf, len)) != 0)
-		fatal_fr(r, "channel %i: put data", c->self);
+		channel_set_used_time(ssh, c);
+		if (c->input_filter != NULL) {
+			if (c->input_filter(ssh, c, buf, len) == -1) {
+				debug2("channel %d: filter stops", c->self);
+				chan_read_failed(ssh, c);
+			}
+		} else if (c->datagram) {
+			if ((r = sshbuf_put_string(c->input, buf, len)) != 0)
+				fatal_fr(r, "channel %i: put datagram",
+				    c->self);
+		} else if ((r = sshbuf_put(c->input, buf, len)) != 0)
+			fatal_fr(r, "channel %i: put data", c->self);
+		total += len;
+		/* a short stream read drained it; datagrams come singly */
+		if (!c->datagram && (size_t)len < sizeof(buf))
+			break;
+	} while (total < budget && c->istate == CHAN_INPUT_OPEN &&
+	    sshbuf_len(c->input) < c->remote_window &&
+	    sshbuf_check_reserve(c->input, CHAN_RBUF) == 0);
 
 	return 1;
 }
@@ -2477,15 +2743,30 @@ channel_check_window(struct ssh *ssh, Channel *c)
 	    c->local_window < c->local_window_max/2) &&
 	    c->local_consumed > 0) {
 		int addition = 0;
-		u_int32_t tcpwinsz = channel_tcpwinsz(ssh);
+		u_int32_t tcpwinsz, floor;
+
 		/* adjust max window size if we are in a dynamic environment
-		 * and the tcp receive buffer is larger than the ssh window */
-		if (c->dynamic_window && (tcpwinsz > c->local_window_max)) {
-			/* aggressively grow the window */
-			addition = tcpwinsz - c->local_window_max;
-			c->local_window_max += addition;
-			debug_f("Channel %d: Window growth to %d by %d bytes",c->self,
-			      c->local_window_max, addition);
+		 * and the connection's BDP calls for a different window */
+		if (c->dynamic_window) {
+			tcpwinsz = channel_tcpwinsz(ssh);
+			floor = MAXIMUM(tcpwinsz, c->local_window_min);
+			if (tcpwinsz > c->local_window_max) {
+				/* aggressively grow the window */
+				addition = tcpwinsz - c->local_window_max;
+				c->local_window_max += addition;
+				debug_f("Channel %d: Window growth to %d by %d "
+				    "bytes", c->self, c->local_window_max,
+				    addition);
+			} else if (floor < c->local_window_max / 2) {
+				/* shrink gently by handing back less than was
+				 * consumed, but always hand back something */
+				addition = -(int)MINIMUM(c->local_window_max -
+				    floor, c->local_consumed / 2);
+				c->local_window_max += addition;
+				debug2_f("Channel %d: Window shrink to %d by %d "
+				    "bytes", c->self, c->local_window_max,
+				    -addition);
+			}
 		}
 		if (!c->have_remote_id)
 			fatal_f("channel %d: no remote id", c->self);
@@ -2717,23 +2998,94 @@ channel_garbage_collect(struct ssh *ssh, Channel *c)
 
 enum channel_table { CHAN_PRE, CHAN_POST };
 
+/*
+ * Channels that may have work to do without being ready or looked up
+ * stay on the dirty list: listeners, connecting and other transitional
+ * channels, and ttys, which are read on close regardless. So do those
+ * with descriptors epoll refused, which are only polled while listed.
+ */
+static int
+channel_stays_dirty(Channel *c)
+{
+#ifdef USE_EPOLL
+	if (c->ep_polled != 0)
+		return 1;
+#endif
+	return c->type != SSH_CHANNEL_OPEN || c->isatty;
+}
+
+/*
+ * Once a second every channel is handled, which catches inactivity and
+ * pause timers, and the bulk channels are counted.
+ */
+static void
+channel_sweep(struct ssh *ssh, time_t now)
+{
+	struct ssh_channels *sc = ssh->chanctxt;
+	u_int i;
+	Channel *c;
+
+	sc->sweep_time = now;
+	sc->timer_deadline = 0;
+	for (sc->nbulk = i = 0; i < sc->channels_alloc; i++) {
+		if ((c = sc->channels[i]) == NULL)
+			continue;
+		/* Count open channels in bulk state */
+		if (c->type == SSH_CHANNEL_OPEN && c->bulk)
+			sc->nbulk++;
+		channel_mark_dirty(ssh, c);
+	}
+}
+
+/* Drop channels that had nothing to do this pass from the dirty list */
+static void
+channel_prune_dirty(struct ssh *ssh)
+{
+	struct ssh_channels *sc = ssh->chanctxt;
+	u_int i, n;
+	Channel *c;
+
+	for (i = n = 0; i < sc->ndirty; i++) {
+		if (sc->dirty[i] == -1 ||
+		    (c = sc->channels[sc->dirty[i]]) == NULL)
+			continue;
+		if (c->dirty == CHAN_DIRTY_LISTED && c->io_ready == 0 &&
+		    !channel_stays_dirty(c)) {
+			c->dirty = 0;
+			continue;
+		}
+		sc->dirty[n++] = sc->dirty[i];
+	}
+	sc->ndirty = n;
+}
+
+static void
+channel_timer_deadline(struct ssh_channels *sc, struct timespec *timeout,
+    time_t when)
+{
+	ptimeout_deadline_monotime(timeout, when);
+	if (sc->timer_deadline == 0 || when < sc->timer_deadline)
+		sc->timer_deadline = when;
+}
+
 static void
 channel_handler(struct ssh *ssh, int table, struct timespec *timeout)
 {
 	struct ssh_channels *sc = ssh->chanctxt;
 	chan_fn **ftab = table == CHAN_PRE ? sc->channel_pre : sc->channel_post;
-	u_int i, oalloc;
+	u_int i, n;
 	Channel *c;
 	time_t now;
 
 	now = monotime();
-	for (sc->nbulk = i = 0, oalloc = sc->channels_alloc; i < oalloc; i++) {
-		c = sc->channels[i];
-		if (c == NULL)
+	/* channels queued by the handlers wait for the next pass */
+	for (i = 0, n = sc->ndirty; i < n; i++) {
+		if (sc->dirty[i] == -1 ||
+		    (c = sc->channels[sc->dirty[i]]) == NULL)
 			continue;
-		/* Count open channels in bulk state */
-		if (c->type == SSH_CHANNEL_OPEN && c->bulk)
-			sc->nbulk++;
+		c->dirty = CHAN_DIRTY_LISTED;
+		if (table == CHAN_PRE)
+			c->io_want = 0;
 		/* Try to keep IO going while rekeying */
 		if (ssh_packet_is_rekeying(ssh) && c->type != SSH_CHANNEL_OPEN)
 			continue;
@@ -2759,7 +3111,7 @@ channel_handler(struct ssh *ssh, int table, struct timespec *timeout)
 				if (timeout != NULL &&
 				    c->type == SSH_CHANNEL_OPEN &&
 				    channel_get_expiry(ssh, c) != 0) {
-					ptimeout_deadline_monotime(timeout,
+					channel_timer_deadline(sc, timeout,
 					    channel_get_expiry(ssh, c));
 				}
 			} else if (timeout != NULL) {
@@ -2767,7 +3119,7 @@ channel_handler(struct ssh *ssh, int table, struct timespec *timeout)
 				 * Arrange for poll() wakeup when channel pause
 				 * timer expires.
 				 */
-				ptimeout_deadline_monotime(timeout,
+				channel_timer_deadline(sc, timeout,
 				    c->notbefore);
 			}
 		}
@@ -2786,11 +3138,12 @@ channel_before_prepare_io(struct ssh *ssh)
 {
 	struct ssh_channels *sc = ssh->chanctxt;
 	Channel *c;
-	u_int i, oalloc;
+	u_int i, n;
 
-	for (i = 0, oalloc = sc->channels_alloc; i < oalloc; i++) {
-		c = sc->channels[i];
-		if (c == NULL)
+	/* these are not OPEN so they are always on the dirty list */
+	for (i = 0, n = sc->ndirty; i < n; i++) {
+		if (sc->dirty[i] == -1 ||
+		    (c = sc->channels[sc->dirty[i]]) == NULL)
 			continue;
 		if (c->type == SSH_CHANNEL_RDYNAMIC_OPEN)
 			channel_before_prepare_io_rdynamic(ssh, c);
@@ -2812,21 +3165,17 @@ dump_channel_poll(const char *func, const char *what, Channel *c,
 #endif
 }
 
-/* Prepare pollfd entries for a single channel */
+/*
+ * The descriptor and events to poll for each of a channel's rfd, wfd,
+ * efd and sock, or -1 if no IO is wanted from it.
+ */
 static void
-channel_prepare_pollfd(Channel *c, u_int *next_pollfd,
-    struct pollfd *pfd, u_int npfd)
+channel_poll_events(Channel *c, int fds[4], short events[4])
 {
-	u_int ev, p = *next_pollfd;
+	u_int ev;
 
-	if (c == NULL)
-		return;
-	if (p + 4 > npfd) {
-		/* Shouldn't happen */
-		fatal_f("channel %d: bad pfd offset %u (max %u)",
-		    c->self, p, npfd);
-	}
-	c->pfds[0] = c->pfds[1] = c->pfds[2] = c->pfds[3] = -1;
+	fds[0] = fds[1] = fds[2] = fds[3] = -1;
+	events[0] = events[1] = events[2] = events[3] = 0;
 	/*
 	 * prepare c->rfd
 	 *
@@ -2857,13 +3206,10 @@ channel_prepare_pollfd(Channel *c, u_int *next_pollfd,
 			if ((c->io_want & SSH_CHAN_IO_SOCK_W) != 0)
 				ev |= POLLOUT;
 		}
-		/* Pack a pfd entry if any event armed for this fd */
+		/* Poll the fd if any event armed for it */
 		if (ev != 0) {
-			c->pfds[0] = p;
-			pfd[p].fd = c->rfd;
-			pfd[p].events = ev;
-			dump_channel_poll(__func__, "rfd", c, p, &pfd[p]);
-			p++;
+			fds[0] = c->rfd;
+			events[0] = ev;
 		}
 	}
 	/* prepare c->wfd if wanting IO and not already handled above */
@@ -2871,13 +3217,9 @@ channel_prepare_pollfd(Channel *c, u_int *next_pollfd,
 		ev = 0;
 		if ((c->io_want & SSH_CHAN_IO_WFD))
 			ev |= POLLOUT;
-		/* Pack a pfd entry if any event armed for this fd */
 		if (ev != 0) {
-			c->pfds[1] = p;
-			pfd[p].fd = c->wfd;
-			pfd[p].events = ev;
-			dump_channel_poll(__func__, "wfd", c, p, &pfd[p]);
-			p++;
+			fds[1] = c->wfd;
+			events[1] = ev;
 		}
 	}
 	/* prepare c->efd if wanting IO and not already handled above */
@@ -2887,13 +3229,9 @@ channel_prepare_pollfd(Channel *c, u_int *next_pollfd,
 			ev |= POLLIN;
 		if ((c->io_want & SSH_CHAN_IO_EFD_W) != 0)
 			ev |= POLLOUT;
-		/* Pack a pfd entry if any event armed for this fd */
 		if (ev != 0) {
-			c->pfds[2] = p;
-			pfd[p].fd = c->efd;
-			pfd[p].events = ev;
-			dump_channel_poll(__func__, "efd", c, p, &pfd[p]);
-			p++;
+			fds[2] = c->efd;
+			events[2] = ev;
 		}
 	}
 	/* prepare c->sock if wanting IO and not already handled above */
@@ -2903,33 +3241,264 @@ channel_prepare_pollfd(Channel *c, u_int *next_pollfd,
 			ev |= POLLIN;
 		if ((c->io_want & SSH_CHAN_IO_SOCK_W) != 0)
 			ev |= POLLOUT;
-		/* Pack a pfd entry if any event armed for this fd */
 		if (ev != 0) {
-			c->pfds[3] = p;
-			pfd[p].fd = c->sock;
-			pfd[p].events = 0;
-			dump_channel_poll(__func__, "sock", c, p, &pfd[p]);
-			p++;
+			fds[3] = c->sock;
+			events[3] = 0;
 		}
 	}
+}
+
+/* Prepare pollfd entries for a single channel */
+static void
+channel_prepare_pollfd(Channel *c, u_int *next_pollfd,
+    struct pollfd *pfd, u_int npfd)
+{
+	static const char *what[4] = { "rfd", "wfd", "efd", "sock" };
+	int fds[4];
+	short events[4];
+	u_int k, p = *next_pollfd;
+
+	if (c == NULL)
+		return;
+	if (p + 4 > npfd) {
+		/* Shouldn't happen */
+		fatal_f("channel %d: bad pfd offset %u (max %u)",
+		    c->self, p, npfd);
+	}
+	channel_poll_events(c, fds, events);
+	/* Pack a pfd entry for each fd with events armed */
+	for (k = 0; k < 4; k++) {
+		c->pfds[k] = -1;
+		if (fds[k] == -1)
+			continue;
+		c->pfds[k] = p;
+		pfd[p].fd = fds[k];
+		pfd[p].events = events[k];
+		dump_channel_poll(__func__, what[k], c, p, &pfd[p]);
+		p++;
+	}
 	*next_pollfd = p;
 }
 
+#ifdef USE_EPOLL
+/*
+ * With epoll the channel descriptors stay registered in one set between
+ * passes. A channel's io_want only changes while it is on the dirty list,
+ * so only those channels are compared against the set, and the channels
+ * the set reports ready go straight onto the dirty list. The caller polls
+ * the set's descriptor along with the connection.
+ */
+
+/* Take slot k of a channel out of the set */
+static void
+channel_epoll_del(struct ssh_channels *sc, Channel *c, u_int k)
+{
+	/* a set inherited over fork() is the parent's; leave it be */
+	if ((c->ep_polled & (1 << k)) == 0 && sc->epfd != -1 &&
+	    sc->epfd_pid == getpid())
+		(void)epoll_ctl(sc->epfd, EPOLL_CTL_DEL, c->ep_fd[k], NULL);
+	c->ep_fd[k] = -1;
+	c->ep_events[k] = c->ep_revents[k] = 0;
+	c->ep_polled &= ~(1 << k);
+}
+
+/* Bring the set in line with the IO a channel wants */
+static void
+channel_epoll_update(struct ssh *ssh, Channel *c)
+{
+	struct ssh_channels *sc = ssh->chanctxt;
+	struct epoll_event ev;
+	int fds[4], op, r;
+	short events[4];
+	u_int k;
+
+	channel_poll_events(c, fds, events);
+	for (k = 0; k < 4; k++) {
+		if (c->ep_fd[k] == fds[k] && c->ep_events[k] == events[k])
+			continue;
+		if (c->ep_fd[k] != -1 && c->ep_fd[k] != fds[k])
+			channel_epoll_del(sc, c, k);
+		if (fds[k] == -1)
+			continue;
+		op = c->ep_fd[k] == -1 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+		c->ep_fd[k] = fds[k];
+		c->ep_events[k] = events[k];
+		if ((c->ep_polled & (1 << k)) != 0)
+			continue;
+		/* don't ask again each time a file becomes wanted */
+		if (fds[k] == c->ep_refused[k]) {
+			c->ep_polled |= 1 << k;
+			channel_mark_dirty(ssh, c);
+			continue;
+		}
+		memset(&ev, 0, sizeof(ev));
+		/* the epoll event bits are the poll(2) ones on Linux */
+		ev.events = events[k];
+		ev.data.u64 = ((uint64_t)c->self << 2) | k;
+		r = epoll_ctl(sc->epfd, op, fds[k], &ev);
+		/* closed and reopened under the same number */
+		if (r == -1 && errno == ENOENT && op == EPOLL_CTL_MOD)
+			r = epoll_ctl(sc->epfd, EPOLL_CTL_ADD, fds[k], &ev);
+		if (r == 0)
+			continue;
+		/*
+		 * Regular files (EPERM), descriptors already in the set
+		 * under another slot (EEXIST) and the like are polled
+		 * directly, which keeps the channel on the dirty list.
+		 */
+		debug3_f("channel %d: fd %d: %s, polling it directly",
+		    c->self, fds[k], strerror(errno));
+		c->ep_refused[k] = fds[k];
+		c->ep_polled |= 1 << k;
+		channel_mark_dirty(ssh, c);
+	}
+}
+
+/*
+ * Returns 0 if the channels are polled through the epoll set, creating it
+ * and registering every channel on first use or in a forked child.
+ */
+static int
+channel_epoll_init(struct ssh *ssh)
+{
+	struct ssh_channels *sc = ssh->chanctxt;
+	u_int i, k;
+	Channel *c;
+
+	if (sc->epfd != -1 && sc->epfd_pid == getpid())
+		return 0;
+	if (sc->epoll_failed)
+		return -1;
+	/* only our copy of an inherited set is closed */
+	if (sc->epfd != -1)
+		close(sc->epfd);
+	for (i = 0; i < sc->channels_alloc; i++) {
+		if ((c = sc->channels[i]) == NULL)
+			continue;
+		for (k = 0; k < 4; k++) {
+			c->ep_fd[k] = c->ep_refused[k] = -1;
+			c->ep_events[k] = c->ep_revents[k] = 0;
+		}
+		c->ep_polled = 0;
+	}
+	if ((sc->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		debug_f("epoll_create1: %s, using ppoll", strerror(errno));
+		sc->epoll_failed = 1;
+		return -1;
+	}
+	sc->epfd_pid = getpid();
+	if (sc->epoll_evs == NULL) {
+		sc->epoll_nevs = 64;
+		sc->epoll_evs = xcalloc(sc->epoll_nevs,
+		    sizeof(*sc->epoll_evs));
+	}
+	for (i = 0; i < sc->channels_alloc; i++) {
+		if ((c = sc->channels[i]) != NULL)
+			channel_epoll_update(ssh, c);
+	}
+	debug_f("channels polled through epoll");
+	return 0;
+}
+
+/* Allocate/prepare poll structure when the channels are in the set */
+static void
+channel_prepare_epoll(struct ssh *ssh, struct pollfd **pfdp,
+    u_int *npfd_allocp, u_int *npfd_activep, u_int npfd_reserved,
+    struct timespec *timeout, time_t now)
+{
+	struct ssh_channels *sc = ssh->chanctxt;
+	u_int i, k, p, npfd;
+	Channel *c;
+
+	channel_handler(ssh, CHAN_PRE, timeout);
+	/* wake up for the sweep that handles timers of idle channels */
+	if (sc->timer_deadline != 0)
+		ptimeout_deadline_monotime(timeout,
+		    MAXIMUM(sc->timer_deadline, now + 1));
+
+	/* only the channels just handled can want different IO */
+	for (i = 0; i < sc->ndirty; i++) {
+		if (sc->dirty[i] != -1 &&
+		    (c = sc->channels[sc->dirty[i]]) != NULL)
+			channel_epoll_update(ssh, c);
+	}
+
+	/* The set, then up to 4x pollfd for each channel it refused */
+	if (sc->ndirty >= (INT_MAX / 4) - npfd_reserved - 1)
+		fatal_f("too many channels"); /* shouldn't happen */
+	npfd = npfd_reserved + 1 + sc->ndirty * 4;
+	if (npfd > *npfd_allocp) {
+		*pfdp = xrecallocarray(*pfdp, *npfd_allocp,
+		    npfd, sizeof(**pfdp));
+		*npfd_allocp = npfd;
+	}
+	if (npfd > sc->pfd_chan_alloc) {
+		sc->pfd_chan = xrecallocarray(sc->pfd_chan,
+		    sc->pfd_chan_alloc, npfd, sizeof(*sc->pfd_chan));
+		sc->pfd_chan_alloc = npfd;
+	}
+	for (p = 0; p < npfd_reserved; p++)
+		sc->pfd_chan[p] = -1;
+	sc->epoll_pfd = p;
+	(*pfdp)[p].fd = sc->epfd;
+	(*pfdp)[p].events = POLLIN;
+	sc->pfd_chan[p++] = -1;
+	for (i = 0; i < sc->ndirty; i++) {
+		if (sc->dirty[i] == -1 ||
+		    (c = sc->channels[sc->dirty[i]]) == NULL ||
+		    c->ep_polled == 0)
+			continue;
+		for (k = 0; k < 4; k++) {
+			if ((c->ep_polled & (1 << k)) == 0)
+				continue;
+			(*pfdp)[p].fd = c->ep_fd[k];
+			(*pfdp)[p].events = c->ep_events[k];
+			sc->pfd_chan[p++] = c->self;
+		}
+	}
+	*npfd_activep = p;
+}
+#endif /* USE_EPOLL */
+
+/* fd is about to be closed, so take it out of the epoll set first */
+static void
+channel_epoll_forget(struct ssh *ssh, Channel *c, int fd)
+{
+#ifdef USE_EPOLL
+	u_int k;
+
+	for (k = 0; fd != -1 && k < 4; k++) {
+		if (c->ep_fd[k] == fd)
+			channel_epoll_del(ssh->chanctxt, c, k);
+		if (c->ep_refused[k] == fd)
+			c->ep_refused[k] = -1;
+	}
+#endif
+}
+
 /* * Allocate/prepare poll structure */
 void
 channel_prepare_poll(struct ssh *ssh, struct pollfd **pfdp, u_int *npfd_allocp,
     u_int *npfd_activep, u_int npfd_reserved, struct timespec *timeout)
 {
 	struct ssh_channels *sc = ssh->chanctxt;
-	u_int i, oalloc, p, npfd = npfd_reserved;
+	u_int i, j, oalloc, p, npfd = npfd_reserved;
+	time_t now = monotime();
 
+	/*
+	 * Only the channels on the dirty list are handled; the others
+	 * keep the io_want they had and are polled for it again.
+	 */
+	if (now != sc->sweep_time)
+		channel_sweep(ssh, now);
 	channel_before_prepare_io(ssh); /* might create a new channel */
-	/* clear out I/O flags from last poll */
-	for (i = 0; i < sc->channels_alloc; i++) {
-		if (sc->channels[i] == NULL)
-			continue;
-		sc->channels[i]->io_want = sc->channels[i]->io_ready = 0;
+#ifdef USE_EPOLL
+	if (channel_epoll_init(ssh) == 0) {
+		channel_prepare_epoll(ssh, pfdp, npfd_allocp, npfd_activep,
+		    npfd_reserved, timeout, now);
+		return;
 	}
+#endif
 	/* Allocate 4x pollfd for each channel (rfd, wfd, efd, sock) */
 	if (sc->channels_alloc >= (INT_MAX / 4) - npfd_reserved)
 		fatal_f("too many channels"); /* shouldn't happen */
@@ -2939,10 +3508,19 @@ channel_prepare_poll(struct ssh *ssh, struct pollfd **pfdp, u_int *npfd_allocp,
 		    npfd, sizeof(**pfdp));
 		*npfd_allocp = npfd;
 	}
+	if (npfd > sc->pfd_chan_alloc) {
+		sc->pfd_chan = xrecallocarray(sc->pfd_chan,
+		    sc->pfd_chan_alloc, npfd, sizeof(*sc->pfd_chan));
+		sc->pfd_chan_alloc = npfd;
+	}
 	*npfd_activep = npfd_reserved;
 	oalloc = sc->channels_alloc;
 
 	channel_handler(ssh, CHAN_PRE, timeout);
+	/* wake up for the sweep that handles timers of idle channels */
+	if (sc->timer_deadline != 0)
+		ptimeout_deadline_monotime(timeout,
+		    MAXIMUM(sc->timer_deadline, now + 1));
 
 	if (oalloc != sc->channels_alloc) {
 		/* shouldn't happen */
@@ -2951,9 +3529,14 @@ channel_prepare_poll(struct ssh *ssh, struct pollfd **pfdp, u_int *npfd_allocp,
 	}
 
 	/* Prepare pollfd */
-	p = npfd_reserved;
-	for (i = 0; i < sc->channels_alloc; i++)
-		channel_prepare_pollfd(sc->channels[i], &p, *pfdp, npfd);
+	for (p = 0; p < npfd_reserved; p++)
+		sc->pfd_chan[p] = -1;
+	for (i = 0; i < sc->channels_alloc; i++) {
+		j = p;
+		channel_prepare_pollfd(sc->channels[i], &j, *pfdp, npfd);
+		for (; p < j; p++)
+			sc->pfd_chan[p] = i;
+	}
 	*npfd_activep = p;
 }
 
@@ -2981,6 +3564,140 @@ fd_ready(Channel *c, int p, struct pollfd *pfds, u_int npfd, int fd,
 		c->io_ready |= ready & c->io_want;
 }
 
+/* Convert the pollfd entries of a channel into c->io_ready */
+static void
+channel_poll_ready(Channel *c, struct pollfd *pfd, u_int npfd)
+{
+	int p;
+
+	/* if rfd is shared with efd/sock then wfd should be too */
+	if (c->rfd != -1 && c->wfd != -1 && c->rfd != c->wfd &&
+	    (c->rfd == c->efd || c->rfd == c->sock)) {
+		/* Shouldn't happen */
+		fatal_f("channel %d: unexpected fds r%d w%d e%d s%d",
+		    c->self, c->rfd, c->wfd, c->efd, c->sock);
+	}
+	c->io_ready = 0;
+	/* rfd, potentially shared with wfd, efd and sock */
+	if (c->rfd != -1 && (p = c->pfds[0]) != -1) {
+		fd_ready(c, p, pfd, npfd, c->rfd,
+		    "rfd", POLLIN, SSH_CHAN_IO_RFD);
+		if (c->rfd == c->wfd) {
+			fd_ready(c, p, pfd, npfd, c->wfd,
+			    "wfd/r", POLLOUT, SSH_CHAN_IO_WFD);
+		}
+		if (c->rfd == c->efd) {
+			fd_ready(c, p, pfd, npfd, c->efd,
+			    "efdr/r", POLLIN, SSH_CHAN_IO_EFD_R);
+			fd_ready(c, p, pfd, npfd, c->efd,
+			    "efdw/r", POLLOUT, SSH_CHAN_IO_EFD_W);
+		}
+		if (c->rfd == c->sock) {
+			fd_ready(c, p, pfd, npfd, c->sock,
+			    "sockr/r", POLLIN, SSH_CHAN_IO_SOCK_R);
+			fd_ready(c, p, pfd, npfd, c->sock,
+			    "sockw/r", POLLOUT, SSH_CHAN_IO_SOCK_W);
+		}
+		dump_channel_poll(__func__, "rfd", c, p, pfd);
+	}
+	/* wfd */
+	if (c->wfd != -1 && c->wfd != c->rfd &&
+	    (p = c->pfds[1]) != -1) {
+		fd_ready(c, p, pfd, npfd, c->wfd,
+		    "wfd", POLLOUT, SSH_CHAN_IO_WFD);
+		dump_channel_poll(__func__, "wfd", c, p, pfd);
+	}
+	/* efd */
+	if (c->efd != -1 && c->efd != c->rfd &&
+	    (p = c->pfds[2]) != -1) {
+		fd_ready(c, p, pfd, npfd, c->efd,
+		    "efdr", POLLIN, SSH_CHAN_IO_EFD_R);
+		fd_ready(c, p, pfd, npfd, c->efd,
+		    "efdw", POLLOUT, SSH_CHAN_IO_EFD_W);
+		dump_channel_poll(__func__, "efd", c, p, pfd);
+	}
+	/* sock */
+	if (c->sock != -1 && c->sock != c->rfd &&
+	    (p = c->pfds[3]) != -1) {
+		fd_ready(c, p, pfd, npfd, c->sock,
+		    "sockr", POLLIN, SSH_CHAN_IO_SOCK_R);
+		fd_ready(c, p, pfd, npfd, c->sock,
+		    "sockw", POLLOUT, SSH_CHAN_IO_SOCK_W);
+		dump_channel_poll(__func__, "sock", c, p, pfd);
+	}
+}
+
+#ifdef USE_EPOLL
+/* Queue the channels the epoll set reports and convert their events */
+static void
+channel_after_epoll(struct ssh *ssh, struct pollfd *pfd, u_int npfd)
+{
+	struct ssh_channels *sc = ssh->chanctxt;
+	struct pollfd ep[4];
+	u_int i, k, id, p = sc->epoll_pfd;
+	int n;
+	Channel *c;
+
+	sc->epoll_pfd = -1;
+	if (p >= npfd || pfd[p].fd != sc->epfd)
+		fatal_f("bad epoll pollfd entry %u (max %u)", p, npfd);
+	if ((pfd[p].revents & POLLIN) != 0) {
+		if ((n = epoll_wait(sc->epfd, sc->epoll_evs,
+		    sc->epoll_nevs, 0)) == -1) {
+			if (errno != EINTR)
+				fatal_f("epoll_wait: %s", strerror(errno));
+			n = 0;
+		}
+		for (i = 0; i < (u_int)n; i++) {
+			id = sc->epoll_evs[i].data.u64 >> 2;
+			k = sc->epoll_evs[i].data.u64 & 3;
+			if (id >= sc->channels_alloc ||
+			    (c = sc->channels[id]) == NULL ||
+			    c->ep_fd[k] == -1 || (c->ep_polled & (1 << k)) != 0)
+				continue;
+			c->ep_revents[k] |= sc->epoll_evs[i].events &
+			    (POLLIN|POLLPRI|POLLOUT|POLLERR|POLLHUP);
+			channel_mark_dirty(ssh, c);
+		}
+		/* a full batch; the rest are still ready next pass */
+		if ((u_int)n == sc->epoll_nevs && sc->epoll_nevs < 65536) {
+			sc->epoll_evs = xrecallocarray(sc->epoll_evs,
+			    sc->epoll_nevs, sc->epoll_nevs * 2,
+			    sizeof(*sc->epoll_evs));
+			sc->epoll_nevs *= 2;
+		}
+	}
+	/* the descriptors it refused follow it */
+	for (p++; p < npfd && p < sc->pfd_chan_alloc; p++) {
+		if (pfd[p].revents == 0 || sc->pfd_chan[p] == -1 ||
+		    (u_int)sc->pfd_chan[p] >= sc->channels_alloc ||
+		    (c = sc->channels[sc->pfd_chan[p]]) == NULL)
+			continue;
+		for (k = 0; k < 4; k++) {
+			if ((c->ep_polled & (1 << k)) != 0 &&
+			    c->ep_fd[k] == pfd[p].fd)
+				c->ep_revents[k] |= pfd[p].revents &
+				    (c->ep_events[k]|POLLERR|POLLHUP|POLLNVAL);
+		}
+		channel_mark_dirty(ssh, c);
+	}
+	/* Convert the events into c->io_ready */
+	for (i = 0; i < sc->ndirty; i++) {
+		if (sc->dirty[i] == -1 ||
+		    (c = sc->channels[sc->dirty[i]]) == NULL)
+			continue;
+		for (k = 0; k < 4; k++) {
+			ep[k].fd = c->ep_fd[k];
+			ep[k].events = c->ep_events[k];
+			ep[k].revents = c->ep_revents[k];
+			c->ep_revents[k] = 0;
+			c->pfds[k] = c->ep_fd[k] == -1 ? -1 : (int)k;
+		}
+		channel_poll_ready(c, ep, 4);
+	}
+}
+#endif /* USE_EPOLL */
+
 /*
  * After poll, perform any appropriate operations for channels which have
  * events pending.
@@ -2989,12 +3706,14 @@ void
 channel_after_poll(struct ssh *ssh, struct pollfd *pfd, u_int npfd)
 {
 	struct ssh_channels *sc = ssh->chanctxt;
-	u_int i;
-	int p;
+	u_int i, p;
 	Channel *c;
 
+	/* query the connection's transport state afresh this pass */
+	sc->tcpwinsz_valid = 0;
+
 #ifdef DEBUG_CHANNEL_POLL
-	for (p = 0; p < (int)npfd; p++) {
+	for (p = 0; p < npfd; p++) {
 		if (pfd[p].revents == 0)
 			continue;
 		debug_f("pfd[%u].fd %d rev 0x%04x",
@@ -3002,75 +3721,37 @@ channel_after_poll(struct ssh *ssh, struct pollfd *pfd, u_int npfd)
 	}
 #endif
 
-	/* Convert pollfd into c->io_ready */
-	for (i = 0; i < sc->channels_alloc; i++) {
-		c = sc->channels[i];
-		if (c == NULL)
+#ifdef USE_EPOLL
+	if (sc->epoll_pfd != -1) {
+		channel_after_epoll(ssh, pfd, npfd);
+		channel_handler(ssh, CHAN_POST, NULL);
+		channel_prune_dirty(ssh);
+		return;
+	}
+#endif
+	/* Queue the channels that have events */
+	for (p = 0; p < npfd && p < sc->pfd_chan_alloc; p++) {
+		if (pfd[p].revents == 0 || sc->pfd_chan[p] == -1 ||
+		    (u_int)sc->pfd_chan[p] >= sc->channels_alloc)
 			continue;
-		/* if rfd is shared with efd/sock then wfd should be too */
-		if (c->rfd != -1 && c->wfd != -1 && c->rfd != c->wfd &&
-		    (c->rfd == c->efd || c->rfd == c->sock)) {
-			/* Shouldn't happen */
-			fatal_f("channel %d: unexpected fds r%d w%d e%d s%d",
-			    c->self, c->rfd, c->wfd, c->efd, c->sock);
-		}
-		c->io_ready = 0;
-		/* rfd, potentially shared with wfd, efd and sock */
-		if (c->rfd != -1 && (p = c->pfds[0]) != -1) {
-			fd_ready(c, p, pfd, npfd, c->rfd,
-			    "rfd", POLLIN, SSH_CHAN_IO_RFD);
-			if (c->rfd == c->wfd) {
-				fd_ready(c, p, pfd, npfd, c->wfd,
-				    "wfd/r", POLLOUT, SSH_CHAN_IO_WFD);
-			}
-			if (c->rfd == c->efd) {
-				fd_ready(c, p, pfd, npfd, c->efd,
-				    "efdr/r", POLLIN, SSH_CHAN_IO_EFD_R);
-				fd_ready(c, p, pfd, npfd, c->efd,
-				    "efdw/r", POLLOUT, SSH_CHAN_IO_EFD_W);
-			}
-			if (c->rfd == c->sock) {
-				fd_ready(c, p, pfd, npfd, c->sock,
-				    "sockr/r", POLLIN, SSH_CHAN_IO_SOCK_R);
-				fd_ready(c, p, pfd, npfd, c->sock,
-				    "sockw/r", POLLOUT, SSH_CHAN_IO_SOCK_W);
-			}
-			dump_channel_poll(__func__, "rfd", c, p, pfd);
-		}
-		/* wfd */
-		if (c->wfd != -1 && c->wfd != c->rfd &&
-		    (p = c->pfds[1]) != -1) {
-			fd_ready(c, p, pfd, npfd, c->wfd,
-			    "wfd", POLLOUT, SSH_CHAN_IO_WFD);
-			dump_channel_poll(__func__, "wfd", c, p, pfd);
-		}
-		/* efd */
-		if (c->efd != -1 && c->efd != c->rfd &&
-		    (p = c->pfds[2]) != -1) {
-			fd_ready(c, p, pfd, npfd, c->efd,
-			    "efdr", POLLIN, SSH_CHAN_IO_EFD_R);
-			fd_ready(c, p, pfd, npfd, c->efd,
-			    "efdw", POLLOUT, SSH_CHAN_IO_EFD_W);
-			dump_channel_poll(__func__, "efd", c, p, pfd);
-		}
-		/* sock */
-		if (c->sock != -1 && c->sock != c->rfd &&
-		    (p = c->pfds[3]) != -1) {
-			fd_ready(c, p, pfd, npfd, c->sock,
-			    "sockr", POLLIN, SSH_CHAN_IO_SOCK_R);
-			fd_ready(c, p, pfd, npfd, c->sock,
-			    "sockw", POLLOUT, SSH_CHAN_IO_SOCK_W);
-			dump_channel_poll(__func__, "sock", c, p, pfd);
-		}
+		if ((c = sc->channels[sc->pfd_chan[p]]) != NULL)
+			channel_mark_dirty(ssh, c);
+	}
+	/* Convert pollfd into c->io_ready */
+	for (i = 0; i < sc->ndirty; i++) {
+		if (sc->dirty[i] != -1 &&
+		    (c = sc->channels[sc->dirty[i]]) != NULL)
+			channel_poll_ready(c, pfd, npfd);
 	}
 	channel_handler(ssh, CHAN_POST, NULL);
+	channel_prune_dirty(ssh);
 }
 
 /*
  * Enqueue data for channels with open or draining c->input.
- * Returns non-zero if a packet was enqueued.
+ * Returns the number of bytes enqueued.
  */
-static int
+static size_t
 channel_output_poll_input_open(struct ssh *ssh, Channel *c)
 {
 	size_t len, plen;
@@ -3117,7 +3798,7 @@ channel_output_poll_input_open(struct ssh *ssh, Channel *c)
 		    (r = sshpkt_send(ssh)) != 0)
 			fatal_fr(r, "channel %i: send datagram", c->self);
 		c->remote_window -= plen;
-		return 1;
+		return plen;
 	}
 
 	/* Enqueue packet for buffered data. */
@@ -3135,7 +3816,7 @@ channel_output_poll_input_open(struct ssh *ssh, Channel *c)
 	if ((r = sshbuf_consume(c->input, len)) != 0)
 		fatal_fr(r, "channel %i: consume", c->self);
 	c->remote_window -= len;
-	return 1;
+	return len;
 }
 
 /*
@@ -3174,8 +3855,73 @@ channel_output_poll_extended_read(struct ssh *ssh, Channel *c)
 	return 1;
 }
 
+/*
+ * Give one channel its turn in the deficit round robin. The channel is
+ * credited with its quantum and sends whole packets while it has credit
+ * left, so it may end up to one packet in debt. Credit isn't banked by
+ * a channel with nothing to send, and a channel held up by the remote
+ * window keeps at most one quantum.
+ * A bulk channel also stops once the connection has enough queued; it
+ * then sets *held and keeps its credit, and a resumed turn adds none.
+ * Returns non-zero if data was enqueued.
+ */
+static int
+channel_output_poll_drr(struct ssh *ssh, Channel *c, int resume, int *held)
+{
+	int64_t quantum = (int64_t)CHAN_DRR_QUANTUM * MAXIMUM(c->weight, 1);
+	size_t len;
+	int ret = 0;
+
+	*held = 0;
+
+	/*
+	 * We are only interested in channels that can have buffered
+	 * incoming data.
+	 */
+	if (c->type != SSH_CHANNEL_OPEN)
+		return 0;
+	if ((c->flags & (CHAN_CLOSE_SENT|CHAN_CLOSE_RCVD))) {
+		/* XXX is this true? */
+		debug3("channel %d: will not send data after close",
+		       c->self);
+		return 0;
+	}
+
+	/* Get the amount of buffered data for this channel. */
+	if (c->istate == CHAN_INPUT_OPEN ||
+	    c->istate == CHAN_INPUT_WAIT_DRAIN) {
+		if (!resume)
+			c->deficit += quantum;
+		while (c->deficit > 0) {
+			if (c->bulk && ret && sshbuf_len(c->input) != 0 &&
+			    !ssh_packet_not_very_much_data_to_write(ssh)) {
+				*held = 1;
+				break;
+			}
+			if ((len = channel_output_poll_input_open(ssh, c)) == 0)
+				break;
+			c->deficit -= len;
+			ret = 1;
+		}
+		if (sshbuf_len(c->input) == 0)
+			c->deficit = 0;
+		else if (!*held && c->deficit > quantum)
+			c->deficit = quantum;
+	}
+	/* Send extended data, i.e. stderr */
+	if (!(c->flags & CHAN_EOF_SENT) &&
+	    c->extended_usage == CHAN_EXTENDED_READ)
+		ret |= channel_output_poll_extended_read(ssh, c);
+	return ret;
+}
+
 /*
  * If there is data to send to the connection, enqueue some of it now.
+ * Each call is one round of a deficit round robin over the channels, so
+ * they share the connection in proportion to their weights whatever
+ * their packet sizes. Interactive channels go first, then the bulk
+ * channels until the connection has enough queued; the next round
+ * starts with the bulk channel that was cut short or missed out.
  * Returns non-zero if data was enqueued.
  */
 int
@@ -3183,36 +3929,39 @@ channel_output_poll(struct ssh *ssh)
 {
 	struct ssh_channels *sc = ssh->chanctxt;
 	Channel *c;
-	u_int i;
-	int ret = 0;
-
-	for (i = 0; i < sc->channels_alloc; i++) {
-		c = sc->channels[i];
-		if (c == NULL)
-			continue;
+	u_int i, n, start, istate;
+	int bulk, sent, held, resume, ret = 0;
 
-		/*
-		 * We are only interested in channels that can have buffered
-		 * incoming data.
-		 */
-		if (c->type != SSH_CHANNEL_OPEN)
-			continue;
-		if ((c->flags & (CHAN_CLOSE_SENT|CHAN_CLOSE_RCVD))) {
-			/* XXX is this true? */
-			debug3("channel %d: will not send data after close",
-			       c->self);
-			continue;
+	if (sc->channels_alloc == 0)
+		return 0;
+	start = sc->drr_next % sc->channels_alloc;
+	resume = sc->drr_resume;
+	sc->drr_resume = 0;
+	for (bulk = 0; bulk <= 1; bulk++) {
+		for (n = 0; n < sc->channels_alloc; n++) {
+			i = (start + n) % sc->channels_alloc;
+			if ((c = sc->channels[i]) == NULL || c->bulk != bulk)
+				continue;
+			if (bulk && ret &&
+			    !ssh_packet_not_very_much_data_to_write(ssh)) {
+				sc->drr_next = i;
+				return ret;
+			}
+			istate = c->istate;
+			sent = channel_output_poll_drr(ssh, c,
+			    resume && i == start, &held);
+			/* room in c->input or EOF sent, the handlers must know */
+			if (sent || c->istate != istate)
+				channel_mark_dirty(ssh, c);
+			ret |= sent;
+			if (held) {
+				sc->drr_next = i;
+				sc->drr_resume = 1;
+				return ret;
+			}
 		}
-
-		/* Get the amount of buffered data for this channel. */
-		if (c->istate == CHAN_INPUT_OPEN ||
-		    c->istate == CHAN_INPUT_WAIT_DRAIN)
-			ret |= channel_output_poll_input_open(ssh, c);
-		/* Send extended data, i.e. stderr */
-		if (!(c->flags & CHAN_EOF_SENT) &&
-		    c->extended_usage == CHAN_EXTENDED_READ)
-			ret |= channel_output_poll_extended_read(ssh, c);
 	}
+	sc->drr_next = start + 1;
 	return ret;
 }
 
@@ -4866,6 +5615,7 @@ connect_to(struct ssh *ssh, const char *host, int port,
 	}
 	c = channel_new(ssh, ctype, SSH_CHANNEL_CONNECTING, sock, sock, -1,
 	    CHAN_TCP_WINDOW_DEFAULT, CHAN_TCP_PACKET_DEFAULT, 0, rname, 1);
+	c->dynamic_window = ssh->chanctxt->dynamic_windows;
 	c->host_port = port;
 	c->path = xstrdup(host);
 	c->connect_ctx = cctx;
@@ -4981,6 +5731,7 @@ channel_connect_to_port(struct ssh *ssh, const char *host, u_short port,
 
 	c = channel_new(ssh, ctype, SSH_CHANNEL_CONNECTING, sock, sock, -1,
 	    CHAN_TCP_WINDOW_DEFAULT, CHAN_TCP_PACKET_DEFAULT, 0, rname, 1);
+	c->dynamic_window = ssh->chanctxt->dynamic_windows;
 	c->host_port = port;
 	c->path = xstrdup(host);
 	c->connect_ctx = cctx;
@@ -5061,6 +5812,7 @@ rdynamic_connect_prepare(struct ssh *ssh, char *ctype, char *rname)
 
 	c = channel_new(ssh, ctype, SSH_CHANNEL_RDYNAMIC_OPEN, -1, -1, -1,
 	    CHAN_TCP_WINDOW_DEFAULT, CHAN_TCP_PACKET_DEFAULT, 0, rname, 1);
+	c->dynamic_window = ssh->chanctxt->dynamic_windows;
 	c->host_port = 0;
 	c->path = NULL;
 
@@ -82,6 +82,16 @@
 #define FORWARD_ADM		0x100
 #define FORWARD_USER		0x101
 
+/* upper limit for a ChannelWeights weight */
+#define CHANNEL_WEIGHT_MAX	64
+
+/* bytes a channel of weight 1 may send per channel_output_poll round */
+#define CHAN_DRR_QUANTUM	(256*1024)
+
+/* c->dirty: on the list channel_handler walks, and changed since handled */
+#define CHAN_DIRTY_LISTED	1
+#define CHAN_DIRTY_TOUCHED	2
+
 /* default pattern-lists used to classify channel types as bulk */
 #define CHANNEL_BULK_TTY	""
 #define CHANNEL_BULK_NOTTY	"direct-*,forwarded-*,tun-*,x11-*,session*"
@@ -142,6 +152,14 @@ struct Channel {
 	u_int	io_want;	/* bitmask of SSH_CHAN_IO_* */
 	u_int	io_ready;	/* bitmask of SSH_CHAN_IO_* */
 	int	pfds[4];	/* pollfd entries for rfd/wfd/efd/sock */
+	int	dirty;		/* on the handler list, CHAN_DIRTY_* */
+#ifdef USE_EPOLL
+	int	ep_fd[4];	/* rfd/wfd/efd/sock as given to the epoll set */
+	short	ep_events[4];	/* events registered for them */
+	short	ep_revents[4];	/* events reported this pass */
+	int	ep_refused[4];	/* descriptors epoll refused for them */
+	u_int	ep_polled;	/* slots polled directly instead */
+#endif
 	int     ctl_chan;	/* control channel (multiplexed connections) */
 	uint32_t ctl_child_id;	/* child session for mux controllers */
 	int	have_ctl_child_id;/* non-zero if ctl_child_id is valid */
@@ -178,6 +196,8 @@ struct Channel {
 	u_int	local_window;
 	u_int	local_window_exceeded;
 	u_int	local_window_max;
+	u_int	local_window_min;	/* dynamic window never shrinks below */
+	u_int	read_size;	/* direct read size, adapts to the backlog */
 	u_int	local_consumed;
 	u_int	local_maxpacket;
 	int	dynamic_window;
@@ -188,6 +208,8 @@ struct Channel {
 	char   *ctype;		/* const type - NB. not freed on channel_free */
 	char   *xctype;		/* extended type */
 	int	bulk;		/* channel is non-interactive */
+	u_int	weight;		/* quanta per round in channel_output_poll */
+	int64_t	deficit;	/* DRR credit in bytes, may go negative */
 
 	/* callback */
 	channel_open_fn		*open_confirm;
@@ -266,7 +288,10 @@ struct Channel {
 /* Read buffer size */
 #define CHAN_RBUF       CHAN_SES_PACKET_DEFAULT
 
-/* Maximum size for direct reads to buffers */
+/*
+ * Size of the first direct read to buffers. Busy channels double it up to
+ * their read budget, a weight's worth of CHAN_DRR_QUANTUM per pass.
+ */
 #define CHANNEL_MAX_READ	CHAN_SES_PACKET_DEFAULT
 
 /* Maximum channel input buffer size */
@@ -324,6 +349,10 @@ int	 channel_has_bulk(struct ssh *);
 void channel_add_timeout(struct ssh *, const char *, int);
 void channel_clear_timeouts(struct ssh *);
 
+/* channel output weights */
+void channel_add_weight(struct ssh *, const char *, u_int);
+void channel_clear_weights(struct ssh *);
+
 /* mux proxy support */
 
 int	 channel_proxy_downstream(struct ssh *, Channel *mc);
@@ -386,6 +415,7 @@ int	 channel_cancel_rport_listener(struct ssh *, struct Forward *);
 int	 channel_cancel_lport_listener(struct ssh *, struct Forward *,
 	    int, struct ForwardOptions *);
 int	 permitopen_port(const char *);
+void	 channel_set_dynamic_windows(struct ssh *, int);
 
 /* x11 forwarding */
 
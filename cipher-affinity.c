@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2026 The Board of Trustees of Carnegie Mellon University.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT License.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the MIT License for more details.
+ *
+ * You should have received a copy of the MIT License along with this library;
+ * if not, see http://opensource.org/licenses/MIT.
+ *
+ */
+
+/* CPU and NUMA placement for the parallel cipher and MAC workers.
+ *
+ * Left alone the scheduler is free to put the keystream workers on the
+ * other socket from the main thread, and then every keystream block
+ * crosses the interconnect twice. CipherThreadAffinity lets the user
+ * keep them together:
+ *   none  - leave it to the scheduler (the default)
+ *   auto  - the CPUs of the NUMA node the main thread is running on,
+ *           less the main thread's own CPU if the node has others
+ *   list  - an explicit list of CPUs such as 2-7,10
+ * Each worker is bound to the whole set rather than one CPU so that
+ * several pools can share it without stacking up on the same core.
+ *
+ * The node layout is read from sysfs when the option is set, which is
+ * before we drop privileges or chroot. Only Linux is supported; on
+ * anything else the option is accepted and ignored. */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#ifdef __linux__
+# include <sys/syscall.h>
+#endif
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+# include <sched.h>
+#endif
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "cipher-affinity.h"
+
+#define AFFINITY_NONE	0
+#define AFFINITY_AUTO	1
+#define AFFINITY_LIST	2
+
+/* bounds for the CPU list and the nodes we keep track of */
+#define AFFINITY_MAX_CPUS	1024
+#define AFFINITY_MAX_NODES	64
+
+/* from linux/mempolicy.h which we don't want to depend on */
+#define AFFINITY_MPOL_PREFERRED	1
+
+/* parse a list of CPUs like 0-3,8,10-11 calling add for each one.
+ * Returns -1 if the list is malformed */
+static int
+parse_cpulist(const char *s, void (*add)(int, void *), void *arg)
+{
+	char *ep;
+	long lo, hi, cpu;
+
+	if (s == NULL || *s == '\0')
+		return -1;
+	for (;;) {
+		errno = 0;
+		lo = strtol(s, &ep, 10);
+		if (ep == s || errno != 0 || lo < 0 || lo >= AFFINITY_MAX_CPUS)
+			return -1;
+		hi = lo;
+		if (*ep == '-') {
+			s = ep + 1;
+			hi = strtol(s, &ep, 10);
+			if (ep == s || errno != 0 || hi < lo ||
+			    hi >= AFFINITY_MAX_CPUS)
+				return -1;
+		}
+		if (add != NULL)
+			for (cpu = lo; cpu <= hi; cpu++)
+				add((int)cpu, arg);
+		if (*ep == '\0' || *ep == '\n')
+			return 0;
+		if (*ep != ',')
+			return -1;
+		s = ep + 1;
+	}
+}
+
+int
+cipher_affinity_valid(const char *spec)
+{
+	if (spec == NULL)
+		return -1;
+	if (strcmp(spec, "none") == 0 || strcmp(spec, "auto") == 0)
+		return 0;
+	return parse_cpulist(spec, NULL, NULL);
+}
+
+#if defined(HAVE_SCHED_SETAFFINITY) && defined(CPU_SET)
+
+static int affinity_mode = AFFINITY_NONE;
+static cpu_set_t affinity_list;
+static cpu_set_t node_cpus[AFFINITY_MAX_NODES];
+static int nnodes = 0;
+/* the CPU the last pool was started from. Written by whichever thread
+ * starts a pool and only used as a hint so we don't lock it */
+static volatile int anchor_cpu = -1;
+
+static void
+add_cpu(int cpu, void *arg)
+{
+	CPU_SET(cpu, (cpu_set_t *)arg);
+}
+
+/* read the CPUs of each NUMA node from sysfs */
+static void
+load_nodes(void)
+{
+	DIR *dir;
+	struct dirent *dp;
+	FILE *f;
+	char path[PATH_MAX], line[4096];
+	const char *errstr;
+	int node;
+
+	nnodes = 0;
+	if ((dir = opendir("/sys/devices/system/node")) == NULL) {
+		debug_f("no NUMA information: %s", strerror(errno));
+		return;
+	}
+	while ((dp = readdir(dir)) != NULL) {
+		if (strncmp(dp->d_name, "node", 4) != 0)
+			continue;
+		node = (int)strtonum(dp->d_name + 4, 0,
+		    AFFINITY_MAX_NODES - 1, &errstr);
+		if (errstr != NULL)
+			continue;
+		snprintf(path, sizeof(path),
+		    "/sys/devices/system/node/%s/cpulist", dp->d_name);
+		if ((f = fopen(path, "r")) == NULL)
+			continue;
+		CPU_ZERO(&node_cpus[node]);
+		if (fgets(line, sizeof(line), f) != NULL &&
+		    parse_cpulist(line, add_cpu, &node_cpus[node]) == 0 &&
+		    node >= nnodes)
+			nnodes = node + 1;
+		fclose(f);
+	}
+	closedir(dir);
+	debug_f("%d NUMA nodes", nnodes);
+}
+
+static int
+cpu_node(int cpu)
+{
+	int node;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return -1;
+	for (node = 0; node < nnodes; node++)
+		if (CPU_ISSET(cpu, &node_cpus[node]))
+			return node;
+	return -1;
+}
+
+/* the node we want the workers' memory on */
+static int
+affinity_node(void)
+{
+	int cpu;
+
+	if (affinity_mode == AFFINITY_AUTO)
+		return cpu_node(anchor_cpu);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &affinity_list))
+			return cpu_node(cpu);
+	return -1;
+}
+
+void
+cipher_affinity_set(const char *spec)
+{
+	cpu_set_t allowed;
+
+	affinity_mode = AFFINITY_NONE;
+	if (spec == NULL || strcmp(spec, "none") == 0)
+		return;
+	if (strcmp(spec, "auto") == 0)
+		affinity_mode = AFFINITY_AUTO;
+	else {
+		CPU_ZERO(&affinity_list);
+		if (parse_cpulist(spec, add_cpu, &affinity_list) != 0) {
+			error_f("invalid CPU list \"%s\"", spec);
+			return;
+		}
+		/* drop anything we aren't allowed to run on anyway */
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+			CPU_AND(&affinity_list, &affinity_list, &allowed);
+		if (CPU_COUNT(&affinity_list) == 0) {
+			logit("CipherThreadAffinity %s: none of those CPUs "
+			    "are available, ignoring", spec);
+			return;
+		}
+		affinity_mode = AFFINITY_LIST;
+	}
+	load_nodes();
+	cipher_affinity_prepare();
+	debug_f("%s, workers on node %d", spec, affinity_node());
+}
+
+void
+cipher_affinity_prepare(void)
+{
+#ifdef HAVE_SCHED_GETCPU
+	int cpu;
+
+	if (affinity_mode == AFFINITY_AUTO && (cpu = sched_getcpu()) >= 0)
+		anchor_cpu = cpu;
+#endif
+}
+
+void
+cipher_affinity_apply(void)
+{
+	cpu_set_t set;
+	int anchor, node;
+
+	switch (affinity_mode) {
+	case AFFINITY_LIST:
+		set = affinity_list;
+		break;
+	case AFFINITY_AUTO:
+		anchor = anchor_cpu;
+		if ((node = cpu_node(anchor)) == -1)
+			return;
+		set = node_cpus[node];
+		/* leave the main thread its core if there's anywhere else */
+		if (CPU_COUNT(&set) > 1)
+			CPU_CLR(anchor, &set);
+		break;
+	default:
+		return;
+	}
+	if (sched_setaffinity(0, sizeof(set), &set) != 0)
+		debug_f("sched_setaffinity: %s", strerror(errno));
+}
+
+void
+cipher_affinity_place(void *p, size_t len)
+{
+#ifdef SYS_mbind
+	unsigned long mask;
+	uintptr_t start, end;
+	long pagesz;
+	int node;
+
+	if (affinity_mode == AFFINITY_NONE)
+		return;
+	cipher_affinity_prepare();
+	if ((node = affinity_node()) == -1 ||
+	    node >= (int)(sizeof(mask) * 8))
+		return;
+	if ((pagesz = sysconf(_SC_PAGESIZE)) <= 0)
+		return;
+	/* only whole pages inside the buffer so we don't change the
+	 * policy of anything we share a page with */
+	start = ((uintptr_t)p + pagesz - 1) & ~((uintptr_t)pagesz - 1);
+	end = ((uintptr_t)p + len) & ~((uintptr_t)pagesz - 1);
+	if (end <= start)
+		return;
+	mask = 1UL << node;
+	/* preferred rather than bound so we still get memory when the
+	 * node is full. Pages already touched stay where they are */
+	if (syscall(SYS_mbind, (void *)start, (unsigned long)(end - start),
+	    AFFINITY_MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0) != 0)
+		debug_f("mbind: %s", strerror(errno));
+#endif
+}
+
+#else /* HAVE_SCHED_SETAFFINITY && CPU_SET */
+
+void
+cipher_affinity_set(const char *spec)
+{
+	if (spec != NULL && strcmp(spec, "none") != 0)
+		verbose("CipherThreadAffinity is not supported on this "
+		    "platform");
+}
+
+void
+cipher_affinity_prepare(void)
+{
+}
+
+void
+cipher_affinity_apply(void)
+{
+}
+
+void
+cipher_affinity_place(void *p, size_t len)
+{
+}
+
+#endif /* HAVE_SCHED_SETAFFINITY && CPU_SET */
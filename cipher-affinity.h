@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2026 The Board of Trustees of Carnegie Mellon University.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT License.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the MIT License for more details.
+ *
+ * You should have received a copy of the MIT License along with this library;
+ * if not, see http://opensource.org/licenses/MIT.
+ *
+ */
+
+#ifndef CIPHER_AFFINITY_H
+#define CIPHER_AFFINITY_H
+
+#include <sys/types.h>
+
+/* 0 if spec is a valid CipherThreadAffinity value */
+int	 cipher_affinity_valid(const char *spec);
+
+/* called by the client and server once the config has been read.
+ * NULL or "none" turns pinning off */
+void	 cipher_affinity_set(const char *spec);
+
+/* called by the thread that is about to start a pool of workers */
+void	 cipher_affinity_prepare(void);
+
+/* called by each worker thread before it does any work */
+void	 cipher_affinity_apply(void);
+
+/* ask for the pages of a freshly allocated buffer to come from the
+ * workers' NUMA node */
+void	 cipher_affinity_place(void *p, size_t len);
+
+#endif /* CIPHER_AFFINITY_H */
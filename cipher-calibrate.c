@@ -0,0 +1,424 @@
+/*
+ * Copyright (c) 2026 The Board of Trustees of Carnegie Mellon University.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT License.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the MIT License for more details.
+ *
+ * You should have received a copy of the MIT License along with this library;
+ * if not, see http://opensource.org/licenses/MIT.
+ *
+ */
+
+/* Ordering the cipher proposal by how fast each cipher is on this host.
+ *
+ * Which cipher is fastest depends a lot on the hardware: aes-gcm on
+ * anything with AES instructions, chacha20-poly1305-mt on older ARM
+ * and MTR-AES-CTR when there are cores to spare. With CipherCalibration
+ * the client encrypts a few MB with each cipher in its proposal, the
+ * way the packet code does after authentication, and puts the fastest
+ * first. Ciphers that need a MAC are charged for the first MAC in the
+ * proposal. The negotiated cipher is the first one in the client's
+ * list that the server also has, so this is the fastest both ends
+ * support, at least as far as this end can tell.
+ *
+ * The results are cached, one line per host and cipher, so a home
+ * directory shared between different machines works. An entry is
+ * measured again after CAL_MAX_AGE or if the number of cores or
+ * CipherThreads changes. */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+#include "log.h"
+#include "misc.h"
+#include "match.h"
+#include "ssherr.h"
+#include "cipher.h"
+#include "mac.h"
+#include "mac-mt.h"
+#include "cipher-calibrate.h"
+
+#define CAL_PACKET	32768	/* bytes of payload per packet */
+#define CAL_BATCH	64	/* packets between looking at the clock */
+#define CAL_AADLEN	4
+#define CAL_MAXTAG	64
+#define CAL_WARMUP	0.02	/* seconds for the workers to get going */
+#define CAL_TIME	0.1	/* seconds we count for */
+#define CAL_MAX_AGE	(30 * 24 * 60 * 60)
+#define CAL_MAX_ENTRIES	512
+
+/* which the kex swaps for the threaded one when both are offered */
+#define CAL_CHACHA	"chacha20-poly1305@openssh.com"
+#define CAL_CHACHA_MT	"chacha20-poly1305-mt@hpnssh.org"
+
+struct cal_entry {
+	char *host;
+	u_int cores;
+	u_int threads;
+	long long when;
+	char *cipher;
+	char *mac;	/* "-" for the AEAD ciphers */
+	double rate;	/* MB/s */
+};
+
+struct cal_cipher {
+	char *name;
+	double rate;	/* -1 if we couldn't measure it */
+	u_int idx;	/* position in the original list */
+};
+
+/* MB/s for cname with mname, or -1 */
+static double
+cal_measure(const char *cname, const char *mname, int threaded)
+{
+	const struct sshcipher *c;
+	struct sshcipher_ctx *cc = NULL;
+	struct sshmac mac;
+	struct mac_mt_ctx *mt = NULL;
+	u_char key[64], iv[32], tag[CAL_MAXTAG], *src = NULL, *out = NULL;
+	u_char *p;
+	u_int i, seqnr = 0, authlen;
+	size_t plen, counted = 0;
+	double start, now, begin = -1, rate = -1;
+	int r, have_mac = 0;
+
+	memset(&mac, 0, sizeof(mac));
+	if ((c = cipher_by_name(cname)) == NULL ||
+	    cipher_keylen(c) > sizeof(key) || cipher_ivlen(c) > sizeof(iv))
+		return -1;
+	arc4random_buf(key, sizeof(key));
+	arc4random_buf(iv, sizeof(iv));
+	if ((r = cipher_init(&cc, c, key, cipher_keylen(c), iv,
+	    cipher_ivlen(c), 0, CIPHER_ENCRYPT,
+	    threaded ? CIPHER_MULTITHREAD : CIPHER_SERIAL)) != 0) {
+		debug_fr(r, "cipher_init %s", cname);
+		goto out;
+	}
+	authlen = cipher_authlen(c);
+	if (authlen == 0 && mname != NULL) {
+		if (mac_setup(&mac, (char *)mname) != 0)
+			goto out;
+		mac.name = xstrdup(mname);
+		mac.key = xmalloc(mac.key_len);
+		arc4random_buf(mac.key, mac.key_len);
+		have_mac = 1;
+		if (mac_init(&mac) != 0 || mac.mac_len > sizeof(tag))
+			goto out;
+		/* as the packet code does after authentication */
+		if (threaded && mac.etm)
+			mt = mac_mt_new(&mac);
+	}
+	plen = CAL_AADLEN + CAL_PACKET + CAL_MAXTAG;
+	src = xcalloc(1, CAL_AADLEN + CAL_PACKET);
+	out = xcalloc(CAL_BATCH, plen);
+
+	start = monotime_double();
+	for (;;) {
+		for (i = 0; i < CAL_BATCH; i++) {
+			p = out + i * plen;
+			if (cipher_can_defer(cc))
+				r = cipher_crypt_defer(cc, seqnr + i, out, p,
+				    src, CAL_PACKET, CAL_AADLEN, authlen);
+			else
+				r = cipher_crypt(cc, seqnr + i, p, src,
+				    CAL_PACKET, CAL_AADLEN, authlen);
+			if (r != 0)
+				goto fail;
+		}
+		if ((r = cipher_crypt_flush(cc, out)) != 0)
+			goto fail;
+		/* EtM over the ciphertext we just made */
+		for (i = 0; have_mac && i < CAL_BATCH; i++) {
+			p = out + i * plen;
+			if (mt != NULL)
+				r = mac_mt_enqueue(mt, seqnr + i, out, p,
+				    CAL_AADLEN + CAL_PACKET,
+				    p + CAL_AADLEN + CAL_PACKET);
+			else
+				r = mac_compute(&mac, seqnr + i, p,
+				    CAL_AADLEN + CAL_PACKET, tag, sizeof(tag));
+			if (r != 0)
+				goto fail;
+		}
+		if (mt != NULL && (r = mac_mt_flush(mt, out)) != 0)
+			goto fail;
+		seqnr += CAL_BATCH;
+
+		now = monotime_double();
+		if (begin < 0) {
+			if (now - start >= CAL_WARMUP)
+				begin = now;
+			continue;
+		}
+		counted += (size_t)CAL_BATCH * CAL_PACKET;
+		if (now - begin >= CAL_TIME) {
+			rate = (double)counted / (now - begin) /
+			    (1024 * 1024);
+			break;
+		}
+	}
+	goto out;
+ fail:
+	debug_fr(r, "%s", cname);
+ out:
+	cipher_free(cc);
+	mac_mt_free(mt);
+	if (have_mac) {
+		mac_clear(&mac);
+		freezero(mac.key, mac.key_len);
+		free(mac.name);
+	}
+	free(src);
+	free(out);
+	return rate;
+}
+
+static void
+cal_free(struct cal_entry *ents, size_t nents)
+{
+	size_t i;
+
+	for (i = 0; i < nents; i++) {
+		free(ents[i].host);
+		free(ents[i].cipher);
+		free(ents[i].mac);
+	}
+	free(ents);
+}
+
+/* read every entry in path that hasn't expired. A missing or
+ * malformed file is not an error, we just measure again */
+static void
+cal_load(const char *path, long long now, struct cal_entry **entsp,
+    size_t *nentsp)
+{
+	struct cal_entry *ents = NULL, e;
+	FILE *f;
+	char *line = NULL, *cp, *field[7];
+	const char *errstr;
+	size_t linesize = 0, nents = 0;
+	u_int i;
+
+	*entsp = NULL;
+	*nentsp = 0;
+	if ((f = fopen(path, "r")) == NULL) {
+		if (errno != ENOENT)
+			debug_f("%s: %s", path, strerror(errno));
+		return;
+	}
+	while (getline(&line, &linesize, f) != -1 &&
+	    nents < CAL_MAX_ENTRIES) {
+		if (*line == '#' || *line == '\n')
+			continue;
+		cp = line;
+		for (i = 0; i < 7; i++) {
+			while ((field[i] = strsep(&cp, " \t\n")) != NULL &&
+			    *field[i] == '\0')
+				;
+			if (field[i] == NULL)
+				break;
+		}
+		if (i != 7)
+			continue;
+		memset(&e, 0, sizeof(e));
+		e.cores = (u_int)strtonum(field[1], 1, INT_MAX, &errstr);
+		if (errstr != NULL)
+			continue;
+		e.threads = (u_int)strtonum(field[2], 0, INT_MAX, &errstr);
+		if (errstr != NULL)
+			continue;
+		e.when = strtonum(field[3], 0, LLONG_MAX, &errstr);
+		if (errstr != NULL || e.when > now ||
+		    now - e.when > CAL_MAX_AGE)
+			continue;
+		if ((e.rate = strtod(field[6], &cp)) <= 0 || *cp != '\0')
+			continue;
+		e.host = xstrdup(field[0]);
+		e.cipher = xstrdup(field[4]);
+		e.mac = xstrdup(field[5]);
+		ents = xrecallocarray(ents, nents, nents + 1, sizeof(*ents));
+		ents[nents++] = e;
+	}
+	free(line);
+	fclose(f);
+	*entsp = ents;
+	*nentsp = nents;
+}
+
+/* write the entries to path by way of a temporary file so that
+ * anyone reading it at the same time sees the old or the new one */
+static void
+cal_save(const char *path, const struct cal_entry *ents, size_t nents)
+{
+	char *tmp;
+	FILE *f;
+	size_t i;
+	int fd;
+
+	xasprintf(&tmp, "%s.XXXXXXXXXX", path);
+	if ((fd = mkstemp(tmp)) == -1) {
+		debug_f("mkstemp %s: %s", tmp, strerror(errno));
+		free(tmp);
+		return;
+	}
+	if ((f = fdopen(fd, "w")) == NULL) {
+		debug_f("fdopen %s: %s", tmp, strerror(errno));
+		close(fd);
+		goto fail;
+	}
+	fprintf(f, "# Cipher throughput in MB/s measured by CipherCalibration.\n"
+	    "# host cores threads time cipher mac rate\n");
+	for (i = 0; i < nents; i++)
+		fprintf(f, "%s %u %u %lld %s %s %.1f\n", ents[i].host,
+		    ents[i].cores, ents[i].threads, ents[i].when,
+		    ents[i].cipher, ents[i].mac, ents[i].rate);
+	if (fclose(f) != 0) {
+		debug_f("write %s: %s", tmp, strerror(errno));
+		goto fail;
+	}
+	if (rename(tmp, path) == -1) {
+		debug_f("rename %s: %s", path, strerror(errno));
+		goto fail;
+	}
+	free(tmp);
+	return;
+ fail:
+	unlink(tmp);
+	free(tmp);
+}
+
+/* fastest first, keeping the original order for ties and for the
+ * ones we couldn't measure, which go last */
+static int
+cal_cmp(const void *aa, const void *bb)
+{
+	const struct cal_cipher *a = aa, *b = bb;
+
+	if (a->rate != b->rate)
+		return a->rate > b->rate ? -1 : 1;
+	return a->idx < b->idx ? -1 : a->idx > b->idx;
+}
+
+char *
+cipher_calibrate_order(const char *ciphers, const char *macs,
+    const char *path, int threaded)
+{
+	struct cal_entry *ents, *e;
+	struct cal_cipher *list = NULL;
+	char host[256], *copy, *cp, *name, *match, *mac = NULL, *ret = NULL;
+	const char *measure, *want_mac;
+	const struct sshcipher *c;
+	size_t i, nents, nlist = 0;
+	long long now = (long long)time(NULL);
+	long ncores = 1;
+	u_int threads = (u_int)cipher_mt_threads();
+	int dirty = 0, announced = 0;
+
+	if (gethostname(host, sizeof(host)) != 0 || *host == '\0')
+		strlcpy(host, "localhost", sizeof(host));
+	host[strcspn(host, " \t\n")] = '\0';
+#ifdef _SC_NPROCESSORS_ONLN
+	if ((ncores = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncores = 1;
+#endif
+	/* the MAC most likely to be negotiated */
+	if (macs != NULL) {
+		copy = cp = xstrdup(macs);
+		while ((name = strsep(&cp, ",")) != NULL) {
+			if (*name != '\0' && strcmp(name, "none") != 0 &&
+			    mac_setup(NULL, name) == 0) {
+				mac = xstrdup(name);
+				break;
+			}
+		}
+		free(copy);
+	}
+
+	cal_load(path, now, &ents, &nents);
+	copy = cp = xstrdup(ciphers);
+	while ((name = strsep(&cp, ",")) != NULL) {
+		if (*name == '\0')
+			continue;
+		list = xrecallocarray(list, nlist, nlist + 1, sizeof(*list));
+		list[nlist].name = name;
+		list[nlist].idx = nlist;
+		list[nlist].rate = -1;
+		if (strcmp(name, "none") == 0 ||
+		    (c = cipher_by_name(name)) == NULL) {
+			nlist++;
+			continue;
+		}
+		measure = name;
+		if (strcmp(name, CAL_CHACHA) == 0 &&
+		    (match = match_list(CAL_CHACHA_MT, ciphers, NULL)) != NULL) {
+			measure = CAL_CHACHA_MT;
+			free(match);
+		}
+		want_mac = (cipher_authlen(c) != 0 || mac == NULL) ?
+		    "-" : mac;
+		for (i = 0; i < nents; i++) {
+			e = &ents[i];
+			if (strcmp(e->host, host) == 0 &&
+			    e->cores == (u_int)ncores &&
+			    e->threads == threads &&
+			    strcmp(e->cipher, measure) == 0 &&
+			    strcmp(e->mac, want_mac) == 0) {
+				list[nlist].rate = e->rate;
+				break;
+			}
+		}
+		if (i == nents) {
+			if (!announced++)
+				verbose("Measuring cipher throughput for "
+				    "CipherCalibration");
+			list[nlist].rate = cal_measure(measure,
+			    strcmp(want_mac, "-") == 0 ? NULL : want_mac,
+			    threaded);
+			debug_f("%s with %s: %.1f MB/s", measure, want_mac,
+			    list[nlist].rate);
+			if (list[nlist].rate > 0 && nents < CAL_MAX_ENTRIES) {
+				ents = xrecallocarray(ents, nents, nents + 1,
+				    sizeof(*ents));
+				e = &ents[nents++];
+				e->host = xstrdup(host);
+				e->cores = (u_int)ncores;
+				e->threads = threads;
+				e->when = now;
+				e->cipher = xstrdup(measure);
+				e->mac = xstrdup(want_mac);
+				e->rate = list[nlist].rate;
+				dirty = 1;
+			}
+		}
+		nlist++;
+	}
+	if (dirty)
+		cal_save(path, ents, nents);
+	cal_free(ents, nents);
+
+	if (nlist > 0)
+		qsort(list, nlist, sizeof(*list), cal_cmp);
+	for (i = 0; i < nlist; i++)
+		xextendf(&ret, ",", "%s", list[i].name);
+	if (ret == NULL)
+		ret = xstrdup(ciphers);
+	debug("Calibrated cipher order: %s", ret);
+	free(list);
+	free(copy);
+	free(mac);
+	return ret;
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2026 The Board of Trustees of Carnegie Mellon University.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT License.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the MIT License for more details.
+ *
+ * You should have received a copy of the MIT License along with this library;
+ * if not, see http://opensource.org/licenses/MIT.
+ *
+ */
+
+#ifndef CIPHER_CALIBRATE_H
+#define CIPHER_CALIBRATE_H
+
+/* returns a copy of the comma separated cipher list with the fastest
+ * ciphers on this host first. Throughput is read from the cache in
+ * path and anything that isn't there is measured and saved. The first
+ * usable MAC in macs is charged to the ciphers that need one. threaded
+ * is whether the parallel ciphers will be used */
+char	*cipher_calibrate_order(const char *ciphers, const char *macs,
+    const char *path, int threaded);
+
+#endif /* CIPHER_CALIBRATE_H */
@@ -26,6 +26,7 @@
 #if defined(HAVE_EVP_CHACHA20) && !defined(HAVE_BROKEN_CHACHA20)
 
 #include <sys/types.h>
+#include <limits.h>
 #include <unistd.h> /* needed for getpid under C99 */
 #include <stdarg.h> /* needed for log.h */
 #include <string.h>
@@ -40,6 +41,11 @@
 #include "ssherr.h"
 
 #include "xmalloc.h"
+#include "misc.h"
+#include "cipher.h"
+#include "cipher-xor.h"
+#include "cipher-affinity.h"
+#include "cipher-pool.h"
 #include "cipher-chachapoly.h"
 #include "cipher-chachapoly-libcrypto-mt.h"
 
@@ -52,27 +58,55 @@
 
 /* Size of keystream to pregenerate, measured in bytes
  * we want to round up to the nearest chacha block and have
- * 128 bytes for overhead */
+ * 128 bytes for overhead. This is for SSH_IOBUFSZ packets, peers
+ * that agree on bigger ones get longer keystreams (see streamlen) */
 #define ROUND_UP(x,y) (((((x)-1)/(y))+1)*(y))
 #define KEYSTREAMLEN (ROUND_UP((SSH_IOBUFSZ) + 128, (CHACHA_BLOCKLEN)))
 
 /* BEGIN TUNABLES */
 
-/* Number of worker threads to spawn. */
+/* Number of worker threads to spawn per batch. */
 /* the goal is to ensure that main is never
- * waiting on the worker threads for keystream data */
-#define NUMTHREADS 1
+ * waiting on the worker threads for keystream data.
+ * Unless the user sets CipherThreads (or SSH_CIPHER_THREADS) we
+ * start with DEFAULT_THREADS and add workers, up to a limit based on
+ * the number of cores (see cipher_pool_threads()), whenever main ends
+ * up waiting on a batch */
+#define DEFAULT_THREADS 1
 
 /* 64 seems to be a pretty blance between memory and performance
- * 128 is another option with somewhat higher memory consumption */
-#define NUMSTREAMS 64
+ * 128 is another option with somewhat higher memory consumption
+ * this can be changed with CipherStreams (or SSH_CIPHER_STREAMS)
+ * but it's always a power of 2 so batch IDs line up when the
+ * sequence number wraps */
+#define DEFAULT_STREAMS 64
+#define MIN_STREAMS 8
+#define MAX_STREAMS 1024
+
+/* we look at ADAPT_WINDOW batch swaps at a time. If main stalled
+ * on ADAPT_STALLS or more of them we add a worker. If a window has
+ * no stalls at all then after idle_limit of them we try dropping one.
+ * A wait shorter than STALL_TIME (in seconds) isn't counted */
+#define ADAPT_WINDOW 16
+#define ADAPT_STALLS 2
+#define ADAPT_IDLE_WINDOWS 8
+#define ADAPT_IDLE_MAX 1024
+#define STALL_TIME 0.00005
+
+/* while the session is interactive or idle the workers only generate
+ * the first LEAN_STREAMLEN bytes of each main keystream, which is more
+ * than a keystroke or a screen update needs, and main makes the rest of
+ * it for the odd packet that is bigger. If more than 1 in LEAN_GROW of
+ * the packets in a batch are we go back to full keystreams */
+#define LEAN_STREAMLEN 2048
+#define LEAN_GROW 4
 
 /* END TUNABLES */
 
 struct mt_keystream {
 	u_char poly_key[POLY1305_KEYLEN];     /* POLY1305_KEYLEN == 32 */
 	u_char headerStream[CHACHA_BLOCKLEN]; /* CHACHA_BLOCKLEN == 64 */
-	u_char mainStream[KEYSTREAMLEN];      /* KEYSTREAMLEN == 32768 */
+	u_char * mainStream;                  /* streamlen bytes of slab */
 };
 
 struct threadData {
@@ -83,41 +117,94 @@ struct threadData {
 
 struct mt_keystream_batch {
 	u_int batchID;
-	struct threadData tds[NUMTHREADS];
-	struct mt_keystream streams[NUMSTREAMS];
+	u_int mainlen;                 /* bytes of each mainStream made */
+	struct threadData * tds;       /* maxthreads entries */
+	struct mt_keystream * streams; /* numstreams entries */
+	u_char * slab;                 /* the main keystreams, back to back */
+};
+
+/* if OpenSSL has support for Poly1305 in the MAC EVPs
+ * use that (OSSL >= 3.0) if not then it's OSSL 1.1 so
+ * use the Poly1305 digest methods. Failing that use the
+ * internal poly1305 methods. Main and every packet worker
+ * have their own */
+struct mt_poly {
+#ifdef OPENSSL_HAVE_POLY_EVP
+	EVP_MAC_CTX    *poly_ctx;
+#elif !defined(WITH_OPENSSL3) && defined(EVP_PKEY_POLY1305)
+	EVP_PKEY_CTX   *poly_ctx;
+	EVP_MD_CTX     *md_ctx;
+	EVP_PKEY       *pkey;
+	size_t         ptaglen;
+#else
+	char           *poly_ctx;
+#endif
+};
+
+/* a packet queued for the packet workers */
+struct mt_packet_job {
+	u_int seqnr;
+	struct mt_keystream * ks;
+	size_t off;        /* in the output buffer or, if opening, the arena */
+	const u_char * src; /* ciphertext, only while the batch is opened */
+	u_int len;         /* bytes to crypt, following the aad */
+	u_int aadlen;
+	int ok;            /* tag verified */
+};
+
+/* the packet workers XOR whole packets against their keystream and
+ * compute or check the Poly1305 tags so main only has to frame them.
+ * The jobs are only written by main while the pool isn't running them,
+ * apart from ok which belongs to whoever is working on the job */
+struct mt_packets {
+	struct mt_packet_job jobs[CIPHER_POOL_BATCH];
+	int encrypt;
+	u_int njobs;       /* queued */
+	u_int taken;       /* opened packets handed back */
+	u_char * arena;    /* plaintext of opened packets */
+	size_t arena_size;
+	size_t arena_used;
+	u_char * base;     /* buffer of the batch being processed */
+	struct cipher_pool * pool;
+	struct mt_poly polys[CIPHER_POOL_MAX_THREADS]; /* one per worker */
 };
 
 struct chachapoly_ctx_mt {
 	u_int seqnr;
 	u_int batchID;
 
+	u_int numstreams;   /* keystreams per batch */
+	u_int streamlen;    /* bytes in each main keystream */
+	int maxthreads;     /* workers we have thread data for */
+	int numthreads;     /* workers used for the next batch */
+	int adaptive;       /* change numthreads based on stalls */
+	u_int swaps;        /* batch swaps in this window */
+	u_int stalls;       /* swaps in this window where main waited */
+	u_int idle_windows; /* consecutive windows without a stall */
+	u_int idle_limit;   /* idle windows before we drop a worker */
+	int shrunk;         /* last adjustment dropped a worker */
+	int lean;           /* generate short keystreams, see LEAN_STREAMLEN */
+	u_int extended;     /* packets in this batch main made keystream for */
+
 	struct mt_keystream_batch batches[2];
 
 	pthread_t manager_tid[2];
 	pthread_t self_tid;
 
 	pid_t mainpid;
-	u_char zeros[KEYSTREAMLEN]; /* KEYSTREAMLEN == 32768 */
+	u_char * zeros;     /* streamlen of them */
 
-  /* if OpenSSL has support for Poly1305 in the MAC EVPs
-   * use that (OSSL >= 3.0) if not then it's OSSL 1.1 so
-   * use the Poly1305 digest methods. Failing that use the
-   * internal poly1305 methods */
-#ifdef OPENSSL_HAVE_POLY_EVP
-	EVP_MAC_CTX    *poly_ctx;
-#elif !defined(WITH_OPENSSL3) && defined(EVP_PKEY_POLY1305)
-	EVP_PKEY_CTX   *poly_ctx;
-	EVP_MD_CTX     *md_ctx;
-	EVP_PKEY       *pkey;
-	size_t         ptaglen;
-#else
-	char           *poly_ctx;
-#endif
+	struct mt_poly poly;
+	struct mt_packets * packets; /* packet workers, once we need them */
 };
 
+static void packets_free(struct mt_packets *);
+
 struct manager_thread_args {
 	struct chachapoly_ctx_mt * ctx_mt;
 	u_int oldBatchID;
+	int numthreads;
+	u_int mainlen;
 	int retval;
 };
 
@@ -125,17 +212,21 @@ struct worker_thread_args {
 	u_int batchID;
 	struct mt_keystream_batch * batch;
 	int threadIndex;
+	int numthreads;
+	u_int numstreams;
+	u_int mainlen;
 	u_char * zeros;
 	int retval;
 };
 
 /* generate the keystream and header
  * we use nulls for the "data" (the zeros variable) in order to
- * get the raw keystream
+ * get the raw keystream. Only the first mainlen bytes of the main
+ * keystream are generated
  * Returns 0 on success and -1 on failure */
 int
 generate_keystream(struct mt_keystream * ks, u_int seqnr,
-    struct threadData * td, u_char * zeros)
+    struct threadData * td, u_char * zeros, u_int mainlen)
 {
 	/* generate poly1305 key */
 	memset(td->seqbuf, 0, sizeof(td->seqbuf));
@@ -155,7 +246,7 @@ generate_keystream(struct mt_keystream * ks, u_int seqnr,
 	/* generate main keystream for encrypting payload */
 	td->seqbuf[0] = 1;
 	if (!EVP_CipherInit(td->main_evp, NULL, NULL, td->seqbuf, 1) ||
-	    EVP_Cipher(td->main_evp, ks->mainStream, zeros, KEYSTREAMLEN) < 0)
+	    EVP_Cipher(td->main_evp, ks->mainStream, zeros, mainlen) < 0)
 		return -1;
 
 	return 0;
@@ -195,6 +286,71 @@ initialize_threadData(struct threadData * td, const u_char *key)
 	return -1;
 }
 
+static void
+mt_poly_free(struct mt_poly * poly)
+{
+#ifdef OPENSSL_HAVE_POLY_EVP
+	EVP_MAC_CTX_free(poly->poly_ctx);
+#elif !defined(WITH_OPENSSL3) && defined(EVP_PKEY_POLY1305)
+	/* poly_ctx belongs to md_ctx */
+	EVP_MD_CTX_free(poly->md_ctx);
+	EVP_PKEY_free(poly->pkey);
+#endif
+	memset(poly, 0, sizeof(*poly));
+}
+
+/* Returns 0 on success and -1 on failure */
+static int
+mt_poly_init(struct mt_poly * poly)
+{
+	memset(poly, 0, sizeof(*poly));
+#ifdef OPENSSL_HAVE_POLY_EVP
+	EVP_MAC *mac = NULL;
+	if ((mac = EVP_MAC_fetch(NULL, "POLY1305", NULL)) == NULL)
+		return -1;
+	poly->poly_ctx = EVP_MAC_CTX_new(mac);
+	EVP_MAC_free(mac); /* the context holds its own reference */
+	if (poly->poly_ctx == NULL)
+		return -1;
+#elif !defined(WITH_OPENSSL3) && defined(EVP_PKEY_POLY1305)
+	u_char zeros[POLY1305_KEYLEN] = {0};
+	if ((poly->md_ctx = EVP_MD_CTX_new()) == NULL ||
+	    (poly->pkey = EVP_PKEY_new_mac_key(EVP_PKEY_POLY1305, NULL,
+	    zeros, POLY1305_KEYLEN)) == NULL ||
+	    EVP_DigestSignInit(poly->md_ctx, &poly->poly_ctx, NULL, NULL,
+	    poly->pkey) == 0) {
+		mt_poly_free(poly);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/* compute the Poly1305 tag of m with the given one time key.
+ * Returns 0 on success and -1 on failure */
+static int
+mt_poly_tag(struct mt_poly * poly, u_char out[POLY1305_TAGLEN],
+    const u_char * m, size_t len, const u_char key[POLY1305_KEYLEN])
+{
+#if !defined(OPENSSL_HAVE_POLY_EVP) && !defined(WITH_OPENSSL3) && \
+    defined(EVP_PKEY_POLY1305)
+	if ((EVP_PKEY_CTX_ctrl(poly->poly_ctx, -1, EVP_PKEY_OP_SIGNCTX,
+	    EVP_PKEY_CTRL_SET_MAC_KEY, POLY1305_KEYLEN, (void *)key) <= 0) ||
+	    (EVP_DigestSignUpdate(poly->md_ctx, m, len) == 0)) {
+		debug_f("SSL error while computing poly1305 tag");
+		return -1;
+	}
+	poly->ptaglen = POLY1305_TAGLEN;
+	if (EVP_DigestSignFinal(poly->md_ctx, out, &poly->ptaglen) == 0) {
+		debug_f("SSL error while finalizing poly1305 tag");
+		return -1;
+	}
+#else
+	poly1305_auth(poly->poly_ctx, out, m, len, key);
+#endif
+	return 0;
+}
+
 struct worker_thread_args *
 worker_thread(struct worker_thread_args * args)
 {
@@ -208,11 +364,12 @@ worker_thread(struct worker_thread_args * args)
 
 	int threadIndex = args->threadIndex;
 	struct threadData * td = &(args->batch->tds[threadIndex]);
-	u_int refseqnr = args->batchID * NUMSTREAMS;
+	u_int refseqnr = args->batchID * args->numstreams;
 
-	for (int i = threadIndex; i < NUMSTREAMS; i += NUMTHREADS) {
+	for (u_int i = threadIndex; i < args->numstreams;
+	    i += args->numthreads) {
 		if (generate_keystream(&(args->batch->streams[i]), refseqnr + i,
-		    td, args->zeros) == -1) {
+		    td, args->zeros, args->mainlen) == -1) {
 			args->retval = 1;
 			return args;
 		}
@@ -253,21 +410,9 @@ chachapoly_free_mt(struct chachapoly_ctx_mt * ctx_mt)
 	if (ctx_mt == NULL)
 		return;
 
-#ifdef OPENSSL_HAVE_POLY_EVP
-	if (ctx_mt->poly_ctx != NULL) {
-		EVP_MAC_CTX_free(ctx_mt->poly_ctx);
-		ctx_mt->poly_ctx = NULL;
-	}
-#elif !defined(WITH_OPENSSL3) && defined(EVP_PKEY_POLY1305)
-	if (ctx_mt->md_ctx != NULL) {
-		EVP_MD_CTX_free(ctx_mt->md_ctx);
-		ctx_mt->md_ctx = NULL;
-	}
-	if (ctx_mt->pkey != NULL) {
-		EVP_PKEY_free(ctx_mt->pkey);
-		ctx_mt->pkey = NULL;
-	}
-#endif
+	packets_free(ctx_mt->packets);
+	ctx_mt->packets = NULL;
+	mt_poly_free(&ctx_mt->poly);
 
 	/*
 	 * Only cleanup the manager threads if we are the PID that initialized
@@ -285,10 +430,22 @@ chachapoly_free_mt(struct chachapoly_ctx_mt * ctx_mt)
 		}
 	}
 
-	/* Cleanup thread data structures. */
-	for (int i=0; i<2; i++)
-		for (int j=0; j<NUMTHREADS; j++)
-			free_threadData(&(ctx_mt->batches[i].tds[j]));
+	/* Cleanup thread data structures and keystreams. */
+	for (int i=0; i<2; i++) {
+		struct mt_keystream_batch * batch = &(ctx_mt->batches[i]);
+		if (batch->tds != NULL) {
+			for (int j=0; j<ctx_mt->maxthreads; j++)
+				free_threadData(&(batch->tds[j]));
+			free(batch->tds);
+		}
+		if (batch->streams != NULL)
+			freezero(batch->streams,
+			    ctx_mt->numstreams * sizeof(*batch->streams));
+		if (batch->slab != NULL)
+			freezero(batch->slab,
+			    (size_t)ctx_mt->numstreams * ctx_mt->streamlen);
+	}
+	free(ctx_mt->zeros);
 
 	/* Zero and free the whole multithreaded cipher context. */
 	freezero(ctx_mt, sizeof(*ctx_mt));
@@ -296,81 +453,106 @@ chachapoly_free_mt(struct chachapoly_ctx_mt * ctx_mt)
 	return;
 }
 
+/* batch IDs wrap along with the sequence number. numstreams is a power
+ * of 2 so there are always an even number of batches and the parity we
+ * use to pick the batch slot is preserved */
+static inline u_int
+next_batch(struct chachapoly_ctx_mt * ctx_mt, u_int batchID, u_int n)
+{
+	return (batchID + n) & (UINT_MAX / ctx_mt->numstreams);
+}
+
+/* set the number of streams and workers for this context */
+static void
+chachapoly_set_tunables(struct chachapoly_ctx_mt * ctx_mt)
+{
+	int threads = cipher_mt_threads();
+	int streams = cipher_mt_streams();
+
+	ctx_mt->streamlen = ROUND_UP(cipher_mt_max_packet() + 128,
+	    CHACHA_BLOCKLEN);
+	/* with bigger packets keep about the same amount of keystream
+	 * per batch unless we were told how many streams to use */
+	if (streams == 0)
+		streams = DEFAULT_STREAMS * KEYSTREAMLEN / ctx_mt->streamlen;
+	if (streams < MIN_STREAMS)
+		streams = MIN_STREAMS;
+	if (streams > MAX_STREAMS)
+		streams = MAX_STREAMS;
+	/* round down to a power of 2 */
+	ctx_mt->numstreams = MIN_STREAMS;
+	while (ctx_mt->numstreams * 2 <= (u_int)streams)
+		ctx_mt->numstreams *= 2;
+
+	ctx_mt->maxthreads = cipher_pool_threads();
+	if (threads == 0) {
+		ctx_mt->adaptive = 1;
+		ctx_mt->numthreads = DEFAULT_THREADS;
+	} else {
+		ctx_mt->adaptive = 0;
+		ctx_mt->numthreads = ctx_mt->maxthreads;
+	}
+	ctx_mt->idle_limit = ADAPT_IDLE_WINDOWS;
+	debug2_f("%u streams of %u bytes per batch, %d of %d workers%s",
+	    ctx_mt->numstreams, ctx_mt->streamlen, ctx_mt->numthreads,
+	    ctx_mt->maxthreads, ctx_mt->adaptive ? " (adaptive)" : "");
+}
+
 struct chachapoly_ctx_mt *
 chachapoly_new_mt(u_int startseqnr, const u_char * key, u_int keylen)
 {
-	struct chachapoly_ctx_mt * ctx_mt = xmalloc(sizeof(*ctx_mt));
-	memset(ctx_mt, 0, sizeof(*ctx_mt));
-	/* Initialize the sequence number. When rekeying, this won't be zero. */
-	ctx_mt->seqnr = startseqnr;
-	ctx_mt->batchID = startseqnr / NUMSTREAMS;
+	struct chachapoly_ctx_mt * ctx_mt = xcalloc(1, sizeof(*ctx_mt));
 	struct threadData mainData;
-	int tDataI;
 	int genKSfailed = 0;
 
-#ifdef OPENSSL_HAVE_POLY_EVP
-	EVP_MAC *mac = NULL;
-	if ((mac = EVP_MAC_fetch(NULL, "POLY1305", NULL)) == NULL)
-		goto fail;
-	if ((ctx_mt->poly_ctx = EVP_MAC_CTX_new(mac)) == NULL)
-		goto fail;
-#elif !defined(WITH_OPENSSL3) && defined(EVP_PKEY_POLY1305)
-	if ((ctx_mt->md_ctx = EVP_MD_CTX_new()) == NULL)
-		goto fail;
-	if ((ctx_mt->pkey = EVP_PKEY_new_mac_key(EVP_PKEY_POLY1305, NULL,
-	    ctx_mt->zeros, POLY1305_KEYLEN)) == NULL)
-		goto fail;
-	if (EVP_DigestSignInit(ctx_mt->md_ctx, &ctx_mt->poly_ctx, NULL, NULL,
-	    ctx_mt->pkey) == 0)
+	chachapoly_set_tunables(ctx_mt);
+	ctx_mt->zeros = xcalloc(1, ctx_mt->streamlen);
+	/* Initialize the sequence number. When rekeying, this won't be zero. */
+	ctx_mt->seqnr = startseqnr;
+	ctx_mt->batchID = startseqnr / ctx_mt->numstreams;
+
+	if (mt_poly_init(&ctx_mt->poly) != 0)
 		goto fail;
-#else
-	ctx_mt->poly_ctx = NULL;
-#endif
 
 	ctx_mt->batches[ctx_mt->batchID % 2].batchID = ctx_mt->batchID;
 	ctx_mt->batches[(ctx_mt->batchID + 1) % 2].batchID =
-	    ctx_mt->batchID + 1;
+	    next_batch(ctx_mt, ctx_mt->batchID, 1);
 
-	/* initialize batches[0] tds */
-	for (tDataI = 0; tDataI < NUMTHREADS; tDataI++) {
-		if (initialize_threadData(&(ctx_mt->batches[0].tds[tDataI]),
-		    key) != 0)
-			break;
-	}
-	if (tDataI < NUMTHREADS) {
-		/* Backtrack starting with 'tDataI - 1' */
-		for (tDataI--; tDataI >= 0; tDataI--)
-			free_threadData(&(ctx_mt->batches[0].tds[tDataI]));
-		goto fail;
-	}
-	/* initialize batches[1] tds */
-	for (tDataI = 0; tDataI < NUMTHREADS; tDataI++) {
-		if (initialize_threadData(&(ctx_mt->batches[1].tds[tDataI]),
-		    key) != 0)
-			break;
-	}
-	if (tDataI < NUMTHREADS) {
-		/* Backtrack starting with 'tDataI - 1' */
-		for (tDataI--; tDataI >= 0; tDataI--)
-			free_threadData(&(ctx_mt->batches[1].tds[tDataI]));
-		/* Free the batches[0] tds too */
-		for (tDataI = NUMTHREADS; tDataI >= 0; tDataI--)
-			free_threadData(&(ctx_mt->batches[0].tds[tDataI]));
-		goto fail;
+	/* initialize the keystreams and the tds for both batches. We
+	 * set up thread data for every worker we might use so we don't
+	 * need to hang on to the key. chachapoly_free_mt cleans up
+	 * whatever we managed to initialize if this fails */
+	for (int i=0; i<2; i++) {
+		struct mt_keystream_batch * batch = &(ctx_mt->batches[i]);
+		batch->streams = xcalloc(ctx_mt->numstreams,
+		    sizeof(*batch->streams));
+		batch->slab = xcalloc(ctx_mt->numstreams, ctx_mt->streamlen);
+		cipher_affinity_place(batch->slab,
+		    (size_t)ctx_mt->numstreams * ctx_mt->streamlen);
+		for (u_int j = 0; j < ctx_mt->numstreams; j++)
+			batch->streams[j].mainStream = batch->slab +
+			    (size_t)j * ctx_mt->streamlen;
+		batch->mainlen = ctx_mt->streamlen;
+		batch->tds = xcalloc(ctx_mt->maxthreads, sizeof(*batch->tds));
+		for (int j=0; j<ctx_mt->maxthreads; j++) {
+			if (initialize_threadData(&(batch->tds[j]), key) != 0)
+				goto fail;
+		}
 	}
 
-	if (initialize_threadData(&mainData, key) != 0) {
-		chachapoly_free_mt(ctx_mt);
-		explicit_bzero(&startseqnr, sizeof(startseqnr));
-		return NULL;
-	}
+	if (initialize_threadData(&mainData, key) != 0)
+		goto fail;
 
 	for (int i=0; i<2; i++) {
-		u_int refseqnr = ctx_mt->batches[i].batchID * NUMSTREAMS;
-		for (int j = startseqnr > refseqnr ? startseqnr - refseqnr : 0;
-		     j<NUMSTREAMS; j++) {
+		u_int refseqnr = ctx_mt->batches[i].batchID *
+		    ctx_mt->numstreams;
+		/* skip the part of the current batch we've already used */
+		u_int j = ctx_mt->batches[i].batchID == ctx_mt->batchID ?
+		    startseqnr % ctx_mt->numstreams : 0;
+		for (; j<ctx_mt->numstreams; j++) {
 			if (generate_keystream(&(ctx_mt->batches[i].streams[j]),
-			    refseqnr + j, &mainData, ctx_mt->zeros) == -1) {
+			    refseqnr + j, &mainData, ctx_mt->zeros,
+			    ctx_mt->streamlen) == -1) {
 				debug_f("generate_keystream failed in "
 				    "chacha20-poly1305@hpnssh.org");
 				genKSfailed = 1;
@@ -381,11 +563,8 @@ chachapoly_new_mt(u_int startseqnr, const u_char * key, u_int keylen)
 
 	free_threadData(&mainData);
 
-	if (genKSfailed != 0) {
-		chachapoly_free_mt(ctx_mt);
-		explicit_bzero(&startseqnr, sizeof(startseqnr));
-		return NULL;
-	}
+	if (genKSfailed != 0)
+		goto fail;
 
 	/* Store the PID so that in the future, we can tell if we're a fork */
 	ctx_mt->mainpid = getpid();
@@ -400,42 +579,12 @@ chachapoly_new_mt(u_int startseqnr, const u_char * key, u_int keylen)
 	return ctx_mt;
 
  fail:
-#ifdef OPENSSL_HAVE_POLY_EVP
-	if (ctx_mt->poly_ctx != NULL) {
-		EVP_MAC_CTX_free(ctx_mt->poly_ctx);
-		ctx_mt->poly_ctx = NULL;
-	}
-#elif !defined(WITH_OPENSSL3) && defined(EVP_PKEY_POLY1305)
-	if (ctx_mt->md_ctx != NULL) {
-		EVP_MD_CTX_free(ctx_mt->md_ctx);
-		ctx_mt->md_ctx = NULL;
-	}
-	if (ctx_mt->pkey != NULL) {
-		EVP_PKEY_free(ctx_mt->pkey);
-		ctx_mt->pkey = NULL;
-	}
-#endif
-	freezero(ctx_mt, sizeof(*ctx_mt));
+	/* mainpid isn't set yet so this won't try to join any threads */
+	chachapoly_free_mt(ctx_mt);
 	explicit_bzero(&startseqnr, sizeof(startseqnr));
 	return NULL;
 }
 
-/* a fast method to XOR the keystream against the data */
-static inline void
-fastXOR(u_char *dest, const u_char *src, const u_char *keystream, u_int len)
-{
-
-	/* XXX: this was __uint128_t but that was causing unaligned load errors.
-	 * this works but we need to explore it more. */
-	typedef uint32_t chunk;
-	size_t i;
-
-	for (i=0; i < (len / sizeof(chunk)); i++)
-		((chunk *)dest)[i]=((chunk *)src)[i]^((chunk *)keystream)[i];
-	for (i=i*(sizeof(chunk) / sizeof(char)); i < len; i++)
-		dest[i]=src[i]^keystream[i];
-}
-
 struct manager_thread_args *
 manager_thread(struct manager_thread_args * margs) {
 	/* make sure we have valid data before proceeding */
@@ -458,17 +607,37 @@ manager_thread(struct manager_thread_args * margs) {
 		return margs;
 	}
 
+	/* the workers we start inherit this */
+	cipher_affinity_apply();
+
 	margs->retval = 0;
-	u_int batchID = oldBatchID + 2;
+	u_int batchID = next_batch(ctx_mt, oldBatchID, 2);
+	int numthreads = margs->numthreads;
+
+	/* going lean. Give back the pages of the part of each keystream
+	 * we are no longer going to write */
+	if (margs->mainlen < batch->mainlen) {
+		for (u_int i = 0; i < ctx_mt->numstreams; i++)
+			cipher_mt_release(batch->streams[i].mainStream +
+			    margs->mainlen, ctx_mt->streamlen - margs->mainlen);
+	}
 
-	pthread_t tid[NUMTHREADS];
-	struct worker_thread_args * wargs = malloc(NUMTHREADS * sizeof(*wargs));
+	pthread_t tid[CIPHER_POOL_MAX_THREADS];
+	struct worker_thread_args * wargs = malloc(numthreads * sizeof(*wargs));
 	int ti;
 
-	for (ti = 0; ti < NUMTHREADS; ti++) {
+	if (wargs == NULL) {
+		margs->retval = 1;
+		return margs;
+	}
+
+	for (ti = 0; ti < numthreads; ti++) {
 		wargs[ti].batchID = batchID;
 		wargs[ti].batch = batch;
 		wargs[ti].threadIndex = ti;
+		wargs[ti].numthreads = numthreads;
+		wargs[ti].numstreams = ctx_mt->numstreams;
+		wargs[ti].mainlen = margs->mainlen;
 		wargs[ti].zeros = ctx_mt->zeros;
 		if (pthread_create(&(tid[ti]), NULL, (void *) worker_thread,
 		    &(wargs[ti])) != 0) {
@@ -476,12 +645,12 @@ manager_thread(struct manager_thread_args * margs) {
 			break;
 		}
 	}
-	for (; ti < NUMTHREADS; ti++) /* for error condition */
+	for (; ti < numthreads; ti++) /* for error condition */
 		tid[ti] = pthread_self();
 
 	struct worker_thread_args * retwargs;
 
-	for (ti = 0; ti < NUMTHREADS; ti++) {
+	for (ti = 0; ti < numthreads; ti++) {
 		if (tid[ti] == pthread_self()) {
 			margs->retval = 1; /* redundant, but harmless */
 			continue;
@@ -514,11 +683,138 @@ manager_thread(struct manager_thread_args * margs) {
 
 	if (margs->retval == 0) {
 		batch->batchID = batchID;
+		batch->mainlen = margs->mainlen;
 	}
 
 	return margs;
 }
 
+/* called every time main picks up a batch. Every ADAPT_WINDOW batches
+ * we look at how often main had to wait for the workers and adjust the
+ * number of workers used for the following batches */
+static void
+adapt_threads(struct chachapoly_ctx_mt *ctx_mt, int stalled)
+{
+	ctx_mt->swaps++;
+	if (stalled)
+		ctx_mt->stalls++;
+	if (ctx_mt->swaps < ADAPT_WINDOW)
+		return;
+
+	if (ctx_mt->stalls >= ADAPT_STALLS) {
+		ctx_mt->idle_windows = 0;
+		if (ctx_mt->numthreads < ctx_mt->maxthreads) {
+			/* we took a worker away and it hurt. Wait longer
+			 * before doing that again */
+			if (ctx_mt->shrunk && ctx_mt->idle_limit < ADAPT_IDLE_MAX)
+				ctx_mt->idle_limit *= 2;
+			ctx_mt->numthreads++;
+			ctx_mt->shrunk = 0;
+			debug2_f("main stalled on %u of %u batches, "
+			    "now using %d workers", ctx_mt->stalls,
+			    ctx_mt->swaps, ctx_mt->numthreads);
+		}
+	} else if (ctx_mt->stalls == 0 &&
+	    ++ctx_mt->idle_windows >= ctx_mt->idle_limit) {
+		ctx_mt->idle_windows = 0;
+		if (ctx_mt->numthreads > DEFAULT_THREADS) {
+			ctx_mt->numthreads--;
+			ctx_mt->shrunk = 1;
+			debug2_f("no stalls, now using %d workers",
+			    ctx_mt->numthreads);
+		}
+	}
+	ctx_mt->swaps = 0;
+	ctx_mt->stalls = 0;
+}
+
+/* make sure the manager for the current batch is done. If we have to
+ * wait on it then main has stalled and the workers aren't keeping up.
+ * Returns 0 on success */
+static int
+wait_for_batch(struct chachapoly_ctx_mt *ctx_mt)
+{
+	pthread_t * manager_tid = &(ctx_mt->manager_tid[ctx_mt->batchID % 2]);
+	double start;
+	int ret;
+
+	if (likely(*manager_tid == ctx_mt->self_tid))
+		return 0;
+	start = ctx_mt->adaptive ? monotime_double() : 0;
+	ret = join_manager_thread(*manager_tid);
+	*manager_tid = ctx_mt->self_tid;
+	if (ret == 0 && ctx_mt->adaptive)
+		adapt_threads(ctx_mt,
+		    monotime_double() - start > STALL_TIME);
+	return ret;
+}
+
+/* the batch's workers only made the first batch->mainlen bytes of the
+ * main keystream. Make enough of the rest for a len byte packet. The
+ * manager of the current batch is done so we can use its thread data.
+ * Returns 0 on success */
+static int
+extend_keystream(struct chachapoly_ctx_mt *ctx_mt,
+    struct mt_keystream_batch *batch, struct mt_keystream *ks, u_int seqnr,
+    u_int len)
+{
+	struct threadData * td = &(batch->tds[0]);
+
+	if (likely(len <= batch->mainlen))
+		return 0;
+	if (len > ctx_mt->streamlen)
+		return -1;
+	ctx_mt->extended++;
+	memset(td->seqbuf, 0, sizeof(td->seqbuf));
+	POKE_U64(td->seqbuf + 8, seqnr);
+	td->seqbuf[0] = 1;
+	if (!EVP_CipherInit(td->main_evp, NULL, NULL, td->seqbuf, 1) ||
+	    EVP_Cipher(td->main_evp, ks->mainStream, ctx_mt->zeros,
+	    ROUND_UP(len, CHACHA_BLOCKLEN)) < 0)
+		return -1;
+	return 0;
+}
+
+/* seqnr has been used. If it was the last one in the current batch
+ * hand the batch to a manager to refill and move on to the next one */
+static int
+advance_seqnr(struct chachapoly_ctx_mt *ctx_mt, u_int seqnr)
+{
+	ctx_mt->seqnr = seqnr + 1;
+
+	if (unlikely(ctx_mt->seqnr / ctx_mt->numstreams !=
+	    ctx_mt->batchID)) {
+		struct manager_thread_args * args =
+		    malloc(sizeof(*args));
+		if (args == NULL) {
+			return SSH_ERR_INTERNAL_ERROR;
+		}
+		/* enough of the packets in that batch were too big for
+		 * short keystreams that the traffic has picked up */
+		if (ctx_mt->lean &&
+		    ctx_mt->extended > ctx_mt->numstreams / LEAN_GROW) {
+			ctx_mt->lean = 0;
+			debug3_f("back to full keystreams");
+		}
+		ctx_mt->extended = 0;
+		args->ctx_mt = ctx_mt;
+		args->oldBatchID = ctx_mt->batchID;
+		/* a single worker keeps up with short keystreams */
+		args->numthreads = ctx_mt->lean ? DEFAULT_THREADS :
+		    ctx_mt->numthreads;
+		args->mainlen = ctx_mt->lean ? LEAN_STREAMLEN :
+		    ctx_mt->streamlen;
+		cipher_affinity_prepare();
+		if (pthread_create(&(ctx_mt->manager_tid[ctx_mt->batchID
+		    % 2]), NULL, (void *) manager_thread, args) != 0) {
+			free(args);
+			return SSH_ERR_INTERNAL_ERROR;
+		}
+		ctx_mt->batchID = ctx_mt->seqnr / ctx_mt->numstreams;
+	}
+	return 0;
+}
+
 int
 chachapoly_crypt_mt(struct chachapoly_ctx_mt *ctx_mt, u_int seqnr, u_char *dest,
     const u_char *src, u_int len, u_int aadlen, u_int authlen, int do_encrypt)
@@ -536,21 +832,20 @@ chachapoly_crypt_mt(struct chachapoly_ctx_mt *ctx_mt, u_int seqnr, u_char *dest,
 	}
 #endif
 
-	pthread_t * manager_tid = &(ctx_mt->manager_tid[ctx_mt->batchID % 2]);
-	if (unlikely(*manager_tid != ctx_mt->self_tid)) {
-		int ret = join_manager_thread(*manager_tid);
-		*manager_tid = ctx_mt->self_tid;
-		if (ret != 0)
-			return SSH_ERR_INTERNAL_ERROR;
-	}
+	if (unlikely(wait_for_batch(ctx_mt) != 0))
+		return SSH_ERR_INTERNAL_ERROR;
 
 	struct mt_keystream_batch * batch =
 	    &(ctx_mt->batches[ctx_mt->batchID % 2]);
 
-	struct mt_keystream * ks = &(batch->streams[seqnr % NUMSTREAMS]);
+	struct mt_keystream * ks =
+	    &(batch->streams[seqnr % ctx_mt->numstreams]);
 
 	int r = SSH_ERR_INTERNAL_ERROR;
 
+	if (unlikely(extend_keystream(ctx_mt, batch, ks, seqnr, len) != 0))
+		return SSH_ERR_INTERNAL_ERROR;
+
 #ifdef SAFETY
 	if (batch->batchID == ctx_mt->batchID) { /* Safety check */
 #endif
@@ -558,24 +853,9 @@ chachapoly_crypt_mt(struct chachapoly_ctx_mt *ctx_mt, u_int seqnr, u_char *dest,
 		if (!do_encrypt) {
 			const u_char *tag = src + aadlen + len;
 			u_char expected_tag[POLY1305_TAGLEN];
-#if !defined(WITH_OPENSSL3) && defined(EVP_PKEY_POLY1305)
-			if ((EVP_PKEY_CTX_ctrl(ctx_mt->poly_ctx, -1,
-			    EVP_PKEY_OP_SIGNCTX, EVP_PKEY_CTRL_SET_MAC_KEY,
-			    POLY1305_KEYLEN, ks->poly_key) <= 0) ||
-			    (EVP_DigestSignUpdate(ctx_mt->md_ctx, src, aadlen + len) == 0)) {
-				debug_f("SSL error while decrypting poly1305 tag");
-				return SSH_ERR_INTERNAL_ERROR;
-			}
-			ctx_mt->ptaglen = POLY1305_TAGLEN;
-			if (EVP_DigestSignFinal(ctx_mt->md_ctx, expected_tag,
-			    &ctx_mt->ptaglen) == 0) {
-				debug_f("SSL error while finalizing decyrpted poly1305");
+			if (mt_poly_tag(&ctx_mt->poly, expected_tag, src,
+			    aadlen + len, ks->poly_key) != 0)
 				return SSH_ERR_INTERNAL_ERROR;
-			}
-#else
-			poly1305_auth(ctx_mt->poly_ctx, expected_tag, src,
-			    aadlen + len, ks->poly_key);
-#endif
 			if (timingsafe_bcmp(expected_tag, tag, POLY1305_TAGLEN)
 			    != 0)
 				r = SSH_ERR_MAC_INVALID;
@@ -589,55 +869,19 @@ chachapoly_crypt_mt(struct chachapoly_ctx_mt *ctx_mt, u_int seqnr, u_char *dest,
 				for (u_int i=0; i<aadlen; i++)
 					dest[i] = ks->headerStream[i] ^ src[i];
 			/* Crypt payload */
-			fastXOR(dest+aadlen,src+aadlen,ks->mainStream,len);
+			cipher_xor(dest+aadlen,src+aadlen,ks->mainStream,len);
 			/* calculate and append tag */
-#if !defined(WITH_OPENSSL3) && defined(EVP_PKEY_POLY1305)
-			if (do_encrypt) {
-				if ((EVP_PKEY_CTX_ctrl(ctx_mt->poly_ctx, -1,
-				    EVP_PKEY_OP_SIGNCTX, EVP_PKEY_CTRL_SET_MAC_KEY,
-				    POLY1305_KEYLEN, ks->poly_key) <=0) ||
-				    (EVP_DigestSignUpdate(ctx_mt->md_ctx, dest, aadlen + len) == 0)) {
-					debug_f ("SSL error while encrypting poly1305 tag");
-					return SSH_ERR_INTERNAL_ERROR;
-				}
-				ctx_mt->ptaglen = POLY1305_TAGLEN;
-				if (EVP_DigestSignFinal(ctx_mt->md_ctx, dest+aadlen+len,
-				    &ctx_mt->ptaglen) == 0) {
-					debug_f("SSL error while finalizing decyrpted poly1305");
-					return SSH_ERR_INTERNAL_ERROR;
-				}
-			}
-#else
-			if (do_encrypt)
-				poly1305_auth(ctx_mt->poly_ctx, dest+aadlen+len,
-				    dest, aadlen+len, ks->poly_key);
-#endif
+			if (do_encrypt && mt_poly_tag(&ctx_mt->poly,
+			    dest+aadlen+len, dest, aadlen+len, ks->poly_key) != 0)
+				return SSH_ERR_INTERNAL_ERROR;
 			r=0; /* Success! */
 		}
 		if (r) /* Anything nonzero is an error. */
 			return r;
 
-		ctx_mt->seqnr = seqnr + 1;
-
-		if (unlikely(ctx_mt->seqnr / NUMSTREAMS > ctx_mt->batchID)) {
-			struct manager_thread_args * args =
-			    malloc(sizeof(*args));
-			if (args == NULL) {
-				return SSH_ERR_INTERNAL_ERROR;
-			}
-			args->ctx_mt = ctx_mt;
-			args->oldBatchID = ctx_mt->batchID;
-			if (pthread_create(&(ctx_mt->manager_tid[ctx_mt->batchID
-			    % 2]), NULL, (void *) manager_thread, args) != 0) {
-				free(args);
-				return SSH_ERR_INTERNAL_ERROR;
-			}
-			ctx_mt->batchID = ctx_mt->seqnr / NUMSTREAMS;
-		}
-
 		/* TODO: Nothing we need to sanitize here? */
 
-		return 0;
+		return advance_seqnr(ctx_mt, seqnr);
 #ifdef SAFETY
 	} else { /* Bad, it's the wrong batch. */
 		debug_f( "Pre-crypt batch miss! Seeking %u, found %u. Failing.",
@@ -662,34 +906,357 @@ chachapoly_get_length_mt(struct chachapoly_ctx_mt *ctx_mt, u_int *plenp,
 	if (len < 4)
 		return SSH_ERR_MESSAGE_INCOMPLETE;
 
-	pthread_t * manager_tid = &(ctx_mt->manager_tid[ctx_mt->batchID % 2]);
-	if (unlikely(*manager_tid != ctx_mt->self_tid)) {
-		int ret = join_manager_thread(*manager_tid);
-		*manager_tid = ctx_mt->self_tid;
-		if (ret != 0)
-			return SSH_ERR_INTERNAL_ERROR;
-	}
+	if (unlikely(wait_for_batch(ctx_mt) != 0))
+		return SSH_ERR_INTERNAL_ERROR;
 
 	u_char buf[4];
-#ifdef SAFETY
-	u_int sought_batchID = seqnr / NUMSTREAMS;
-#endif
+	u_int sought_batchID = seqnr / ctx_mt->numstreams;
 	struct mt_keystream_batch * batch =
 	    &(ctx_mt->batches[ctx_mt->batchID % 2]);
-	struct mt_keystream * ks = &(batch->streams[seqnr % NUMSTREAMS]);
-#ifdef SAFETY
+	struct mt_keystream * ks =
+	    &(batch->streams[seqnr % ctx_mt->numstreams]);
+	/* the packet code reads ahead to find packets it can open
+	 * together so this can be asked about a later batch */
 	if (batch->batchID == sought_batchID) {
-#endif
 		for (u_int i=0; i < sizeof(buf); i++)
 			buf[i]=ks->headerStream[i] ^ cp[i];
 		*plenp = PEEK_U32(buf);
 		return 0;
-#ifdef SAFETY
 	} else {
+#ifdef SAFETY
 		debug_f("Batch miss! Seeking %u, found %u. Failing.",
 		    sought_batchID, batch->batchID);
+#endif
 		return SSH_ERR_INTERNAL_ERROR;
 	}
-#endif
+}
+
+/* Whole packets on the packet workers.
+ *
+ * Every packet has its own pregenerated keystream and Poly1305 key so
+ * once main knows the sequence number the packets don't depend on each
+ * other. Outgoing packets are queued in their final place in the output
+ * buffer and, just before it is written, are XORed against their
+ * keystream and have their tags appended by the packet workers and
+ * main together. Incoming packets are found by decrypting just their
+ * lengths, which only needs the header keystream, and are then checked
+ * and decrypted together into an arena and handed back in order. The
+ * packet workers are the shared cipher pool (see cipher-pool.c).
+ *
+ * A batch never spans two keystream batches. The keystream batch is
+ * only handed back to a manager once every packet using it is done. */
+
+/* seal or open one packet. A bad tag isn't an error here, it is
+ * reported when the packet is taken */
+static int
+packet_crypt(struct mt_poly * poly, int encrypt, u_char * base,
+    struct mt_packet_job * job)
+{
+	struct mt_keystream * ks = job->ks;
+	u_char * dest = base + job->off;
+	const u_char * src = encrypt ? dest : job->src;
+	u_char expected_tag[POLY1305_TAGLEN];
+	u_int aadlen = job->aadlen, len = job->len;
+
+	job->ok = 0;
+	if (!encrypt) {
+		if (mt_poly_tag(poly, expected_tag, src, aadlen + len,
+		    ks->poly_key) != 0)
+			return SSH_ERR_INTERNAL_ERROR;
+		job->ok = timingsafe_bcmp(expected_tag, src + aadlen + len,
+		    POLY1305_TAGLEN) == 0;
+		explicit_bzero(expected_tag, sizeof(expected_tag));
+		if (!job->ok)
+			return 0;
+	}
+	for (u_int i=0; i<aadlen; i++)
+		dest[i] = ks->headerStream[i] ^ src[i];
+	cipher_xor(dest+aadlen, src+aadlen, ks->mainStream, len);
+	if (encrypt) {
+		if (mt_poly_tag(poly, dest+aadlen+len, dest, aadlen+len,
+		    ks->poly_key) != 0)
+			return SSH_ERR_INTERNAL_ERROR;
+		job->ok = 1;
+	}
+	return 0;
+}
+
+/* job i of the batch, for the pool. Main uses its own Poly1305 */
+static int
+packets_job(void * arg, int worker, u_int i)
+{
+	struct chachapoly_ctx_mt * ctx_mt = arg;
+	struct mt_packets * pk = ctx_mt->packets;
+
+	return packet_crypt(worker == 0 ? &ctx_mt->poly :
+	    &pk->polys[worker - 1], pk->encrypt, pk->base, &pk->jobs[i]);
+}
+
+static void
+packets_free(struct mt_packets * pk)
+{
+	if (pk == NULL)
+		return;
+	cipher_pool_put(pk->pool);
+	for (int i=0; i<CIPHER_POOL_MAX_THREADS; i++)
+		mt_poly_free(&pk->polys[i]);
+	if (pk->arena != NULL)
+		freezero(pk->arena, pk->arena_size);
+	freezero(pk, sizeof(*pk));
+}
+
+/* set up the packet workers the first time a packet is queued. They
+ * are the cipher pool the other direction and the MACs use too, so
+ * there are never more of them than we would use for keystream */
+static struct mt_packets *
+packets_get(struct chachapoly_ctx_mt * ctx_mt, int encrypt)
+{
+	struct mt_packets * pk = ctx_mt->packets;
+
+	if (pk != NULL)
+		return pk->encrypt == encrypt ? pk : NULL;
+	pk = xcalloc(1, sizeof(*pk));
+	pk->encrypt = encrypt;
+	pk->pool = cipher_pool_get();
+	for (int i=0; i<cipher_pool_nthreads(pk->pool); i++) {
+		if (mt_poly_init(&pk->polys[i]) != 0) {
+			packets_free(pk);
+			return NULL;
+		}
+	}
+	debug2_f("%s: %d packet workers", encrypt ? "seal" : "open",
+	    cipher_pool_nthreads(pk->pool));
+	return (ctx_mt->packets = pk);
+}
+
+/* run every queued job on the packet workers and main */
+static int
+packets_run(struct chachapoly_ctx_mt * ctx_mt, u_char * base)
+{
+	struct mt_packets * pk = ctx_mt->packets;
+	int r;
+
+	pk->base = base;
+	r = cipher_pool_run(pk->pool, packets_job, ctx_mt, pk->njobs);
+	pk->base = NULL;
+	return r;
+}
+
+/* the keystream for a len byte packet with seqnr, if it is in the
+ * current batch */
+static struct mt_keystream *
+packet_keystream(struct chachapoly_ctx_mt * ctx_mt, u_int seqnr, u_int len)
+{
+	struct mt_keystream_batch * batch;
+	struct mt_keystream * ks;
+
+	if (unlikely(wait_for_batch(ctx_mt) != 0))
+		return NULL;
+	batch = &(ctx_mt->batches[ctx_mt->batchID % 2]);
+	if (seqnr / ctx_mt->numstreams != ctx_mt->batchID ||
+	    batch->batchID != ctx_mt->batchID)
+		return NULL;
+	ks = &(batch->streams[seqnr % ctx_mt->numstreams]);
+	if (unlikely(extend_keystream(ctx_mt, batch, ks, seqnr, len) != 0))
+		return NULL;
+	return ks;
+}
+
+/*
+ * Seal every queued packet. base is the start of the output buffer
+ * the packets were queued in; it may have moved since they were queued
+ * but nothing in front of them may have been consumed.
+ */
+int
+chachapoly_flush_mt(struct chachapoly_ctx_mt * ctx_mt, u_char * base)
+{
+	struct mt_packets * pk = ctx_mt->packets;
+	int r;
+
+	if (pk == NULL || !pk->encrypt || pk->njobs == 0)
+		return 0;
+	r = packets_run(ctx_mt, base);
+	pk->njobs = 0;
+	return r;
+}
+
+/*
+ * Queue a packet for sealing. The aad and plaintext are copied to
+ * dest, which has to have room for the tag as well, and encrypted
+ * there by the next chachapoly_flush_mt().
+ */
+int
+chachapoly_seal_queue_mt(struct chachapoly_ctx_mt * ctx_mt, u_int seqnr,
+    u_char * base, u_char * dest, const u_char * src, u_int len,
+    u_int aadlen, u_int authlen)
+{
+	struct mt_packets * pk;
+	struct mt_packet_job * job;
+	struct mt_keystream * ks;
+	int r;
+
+	if (authlen != POLY1305_TAGLEN || dest < base ||
+	    (pk = packets_get(ctx_mt, 1)) == NULL)
+		return SSH_ERR_INVALID_ARGUMENT;
+	if ((ks = packet_keystream(ctx_mt, seqnr, len)) == NULL)
+		return SSH_ERR_INTERNAL_ERROR;
+	job = &pk->jobs[pk->njobs++];
+	job->seqnr = seqnr;
+	job->ks = ks;
+	job->off = dest - base;
+	job->len = len;
+	job->aadlen = aadlen;
+	if (dest != src)
+		memcpy(dest, src, aadlen + len);
+	/* the keystream batch can't be refilled until we are done with it */
+	if (pk->njobs == CIPHER_POOL_BATCH ||
+	    (seqnr + 1) / ctx_mt->numstreams != ctx_mt->batchID) {
+		if ((r = chachapoly_flush_mt(ctx_mt, base)) != 0)
+			return r;
+	}
+	return advance_seqnr(ctx_mt, seqnr);
+}
+
+/*
+ * Queue a received packet for opening. src has the aad, ciphertext and
+ * tag and has to stay put until chachapoly_open_batch_mt(). Returns
+ * SSH_ERR_NO_BUFFER_SPACE once the batch is full or seqnr is in the
+ * next keystream batch.
+ */
+int
+chachapoly_open_queue_mt(struct chachapoly_ctx_mt * ctx_mt, u_int seqnr,
+    const u_char * src, u_int len, u_int aadlen, u_int authlen)
+{
+	struct mt_packets * pk;
+	struct mt_packet_job * job;
+	struct mt_keystream * ks;
+	size_t need;
+
+	if (authlen != POLY1305_TAGLEN ||
+	    (pk = packets_get(ctx_mt, 0)) == NULL || pk->taken != 0)
+		return SSH_ERR_INVALID_ARGUMENT;
+	if (pk->njobs == CIPHER_POOL_BATCH ||
+	    (ks = packet_keystream(ctx_mt, seqnr, len)) == NULL)
+		return SSH_ERR_NO_BUFFER_SPACE;
+	if (pk->njobs != 0 && seqnr != pk->jobs[pk->njobs - 1].seqnr + 1)
+		return SSH_ERR_INVALID_ARGUMENT;
+	need = (size_t)aadlen + len;
+	if (pk->arena_used + need > pk->arena_size) {
+		size_t size = MAXIMUM(pk->arena_used + need,
+		    pk->arena_size * 2);
+
+		pk->arena = xrecallocarray(pk->arena, pk->arena_size,
+		    size, 1);
+		pk->arena_size = size;
+	}
+	job = &pk->jobs[pk->njobs++];
+	job->seqnr = seqnr;
+	job->ks = ks;
+	job->off = pk->arena_used;
+	job->src = src;
+	job->len = len;
+	job->aadlen = aadlen;
+	job->ok = 0;
+	pk->arena_used += need;
+	return 0;
+}
+
+/* check and decrypt every queued packet */
+int
+chachapoly_open_batch_mt(struct chachapoly_ctx_mt * ctx_mt)
+{
+	struct mt_packets * pk = ctx_mt->packets;
+	int r;
+
+	if (pk == NULL || pk->encrypt || pk->njobs == 0 || pk->taken != 0)
+		return 0;
+	r = packets_run(ctx_mt, pk->arena);
+	for (u_int i=0; i<pk->njobs; i++)
+		pk->jobs[i].src = NULL;
+	return r;
+}
+
+/*
+ * Hand back the next opened packet, in place of chachapoly_crypt_mt().
+ * It is copied to dest, aad included, if its tag was good.
+ */
+int
+chachapoly_open_take_mt(struct chachapoly_ctx_mt * ctx_mt, u_int seqnr,
+    u_char * dest, u_int len, u_int aadlen)
+{
+	struct mt_packets * pk = ctx_mt->packets;
+	struct mt_packet_job * job;
+	int r = 0;
+
+	if (pk == NULL || pk->encrypt || pk->taken >= pk->njobs)
+		return SSH_ERR_INTERNAL_ERROR;
+	job = &pk->jobs[pk->taken++];
+	if (job->seqnr != seqnr || job->len != len || job->aadlen != aadlen)
+		r = SSH_ERR_INTERNAL_ERROR;
+	else if (!job->ok)
+		r = SSH_ERR_MAC_INVALID;
+	else
+		memcpy(dest, pk->arena + job->off, aadlen + len);
+	explicit_bzero(pk->arena + job->off, (size_t)job->aadlen + job->len);
+	if (pk->taken == pk->njobs || r != 0) {
+		/* nothing after a bad packet is any use */
+		pk->taken = pk->njobs = 0;
+		pk->arena_used = 0;
+	}
+	if (r != 0)
+		return r;
+	return advance_seqnr(ctx_mt, seqnr);
+}
+
+/* packets queued for sealing or opened and not yet taken */
+u_int
+chachapoly_pending_mt(const struct chachapoly_ctx_mt * ctx_mt)
+{
+	if (ctx_mt == NULL || ctx_mt->packets == NULL)
+		return 0;
+	return ctx_mt->packets->njobs - ctx_mt->packets->taken;
+}
+
+/*
+ * Hint from the packet layer. Outside of a bulk transfer we switch to
+ * short keystreams (see LEAN_STREAMLEN) and a single worker, and give
+ * back the pages of the keystream we've used and of the next batch if
+ * it is already done. Full keystreams come back with the next batch
+ * after a bulk hint or once the packets get bigger.
+ */
+void
+chachapoly_set_demand_mt(struct chachapoly_ctx_mt * ctx_mt, int bulk)
+{
+	struct mt_keystream_batch * batch;
+	u_int i, used;
+
+	if (ctx_mt == NULL)
+		return;
+	ctx_mt->lean = !bulk;
+	ctx_mt->extended = 0;
+	if (bulk || ctx_mt->mainpid != getpid())
+		return;
+
+	/* the used part of the current batch, unless some of it is
+	 * waiting for the packet workers */
+	batch = &(ctx_mt->batches[ctx_mt->batchID % 2]);
+	used = ctx_mt->seqnr % ctx_mt->numstreams;
+	if (chachapoly_pending_mt(ctx_mt) == 0 &&
+	    ctx_mt->manager_tid[ctx_mt->batchID % 2] == ctx_mt->self_tid) {
+		for (i = 0; i < used; i++)
+			cipher_mt_release(batch->streams[i].mainStream,
+			    ctx_mt->streamlen);
+	}
+
+	/* the next batch, if its manager is done with it */
+	batch = &(ctx_mt->batches[(ctx_mt->batchID + 1) % 2]);
+	if (ctx_mt->manager_tid[(ctx_mt->batchID + 1) % 2] ==
+	    ctx_mt->self_tid && batch->mainlen > LEAN_STREAMLEN) {
+		for (i = 0; i < ctx_mt->numstreams; i++)
+			cipher_mt_release(batch->streams[i].mainStream +
+			    LEAN_STREAMLEN, ctx_mt->streamlen - LEAN_STREAMLEN);
+		batch->mainlen = LEAN_STREAMLEN;
+	}
+	debug3_f("short keystreams from here on");
 }
 #endif /* defined(HAVE_EVP_CHACHA20) && !defined(HAVE_BROKEN_CHACHA20) */
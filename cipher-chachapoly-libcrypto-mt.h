@@ -42,4 +42,23 @@ int    chachapoly_get_length_mt(struct chachapoly_ctx_mt *cpctx,
 				u_int *plenp, u_int seqnr, const u_char *cp, u_int len)
                                 __attribute__((__bounded__(__buffer__, 4, 5)));
 
+int    chachapoly_seal_queue_mt(struct chachapoly_ctx_mt *cpctx, u_int seqnr,
+				u_char *base, u_char *dest, const u_char *src,
+				u_int len, u_int aadlen, u_int authlen);
+
+int    chachapoly_flush_mt(struct chachapoly_ctx_mt *cpctx, u_char *base);
+
+int    chachapoly_open_queue_mt(struct chachapoly_ctx_mt *cpctx, u_int seqnr,
+				const u_char *src, u_int len, u_int aadlen,
+				u_int authlen);
+
+int    chachapoly_open_batch_mt(struct chachapoly_ctx_mt *cpctx);
+
+int    chachapoly_open_take_mt(struct chachapoly_ctx_mt *cpctx, u_int seqnr,
+			       u_char *dest, u_int len, u_int aadlen);
+
+u_int  chachapoly_pending_mt(const struct chachapoly_ctx_mt *cpctx);
+
+void   chachapoly_set_demand_mt(struct chachapoly_ctx_mt *cpctx, int bulk);
+
 #endif /* CHACHA_POLY_LIBCRYPTO_MT_H */
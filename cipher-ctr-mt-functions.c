@@ -27,12 +27,17 @@
 /* only for systems with OSSL 3 */
 #ifdef WITH_OPENSSL3
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <openssl/evp.h>
 #include "xmalloc.h"
 #include <unistd.h>
 #include "cipher-ctr-mt-functions.h"
+#include "cipher.h"
+#include "cipher-xor.h"
+#include "cipher-affinity.h"
 #include "log.h"
+#include "misc.h"
 
 /* for provider error struct */
 #include "ossl3-provider-err.h"
@@ -76,9 +81,6 @@ int numkq = 2;
 /* how we increment the id the structs we create */
 long unsigned int global_struct_id = 0;
 
-/* keep a copy of the pointers created in thread_loop to free later */
-struct aes_mt_ctx_ptrs *evp_ptrs = NULL;
-
 /* private functions */
 
 /*
@@ -98,77 +100,165 @@ ssh_ctr_add(u_char *ctr, uint32_t num, u_int len)
 	}
 }
 
+/* the cipher used by the pregen threads for a given key length */
+static const EVP_CIPHER *
+aes_mt_evp_type(int keylen)
+{
+	switch (keylen) {
+	case 256:
+		return EVP_aes_256_ctr();
+	case 192:
+		return EVP_aes_192_ctr();
+	case 128:
+		return EVP_aes_128_ctr();
+	}
+	fatal("Invalid key length of %d in AES CTR MT. Exiting", keylen);
+}
+
 /*
- * Threads may be cancelled in a pthread_cond_wait, we must free the mutex
+ * Point a bank of queues at a new key generation. Must be called
+ * with the ctx lock held. Queues that are being filled are left to the
+ * filling thread which will notice the generation change and requeue
+ * them when it is done.
  */
 static void
-thread_loop_cleanup(void *x)
+reset_bank(struct aes_mt_ctx_st *aes_mt_ctx, int bank, u_int gen,
+    const u_char *iv)
+{
+	struct kq *q;
+	int i;
+
+	for (i = 0; i < aes_mt_ctx->numkq; i++) {
+		q = &aes_mt_ctx->q[bank * aes_mt_ctx->numkq + i];
+		q->gen = gen;
+		if (iv != NULL) {
+			memcpy(q->ctr, iv, AES_BLOCK_SIZE);
+			ssh_ctr_add(q->ctr, i * KQLEN, AES_BLOCK_SIZE);
+		}
+		if (q->qstate != KQFILLING)
+			q->qstate = gen != 0 ? KQEMPTY : KQINIT;
+	}
+}
+
+/*
+ * Whether queue i of a bank is one of the depth queues we keep filled.
+ * Must be called with the ctx lock held.
+ */
+static int
+in_window(struct aes_mt_ctx_st *aes_mt_ctx, int bank, int i)
+{
+	int numkq = aes_mt_ctx->numkq;
+
+	if (bank != aes_mt_ctx->bank)
+		return i < aes_mt_ctx->depth;
+	return (i - aes_mt_ctx->qidx + numkq) % numkq < aes_mt_ctx->depth;
+}
+
+/*
+ * Find a queue that needs filling. The active bank is always
+ * served first starting from the queue the consumer will need next.
+ * Only when it is full do we work ahead on the staged bank.
+ * Must be called with the ctx lock held.
+ */
+static struct kq *
+find_empty_queue(struct aes_mt_ctx_st *aes_mt_ctx)
 {
-	pthread_mutex_unlock((pthread_mutex_t *)x);
+	struct kq *q;
+	int i, bank, numkq = aes_mt_ctx->numkq;
+
+	for (i = 0; i < aes_mt_ctx->depth; i++) {
+		q = &aes_mt_ctx->q[aes_mt_ctx->bank * numkq +
+		    (aes_mt_ctx->qidx + i) % numkq];
+		if (q->qstate == KQEMPTY && q->gen != 0)
+			return q;
+	}
+	bank = !aes_mt_ctx->bank;
+	for (i = 0; i < aes_mt_ctx->depth; i++) {
+		q = &aes_mt_ctx->q[bank * numkq + i];
+		if (q->qstate == KQEMPTY && q->gen != 0)
+			return q;
+	}
+	return NULL;
 }
 
-#ifdef __APPLE__
-/* Check if we should exit, we are doing both cancel and exit condition
- * since on OSX threads seem to occasionally fail to notice when they have
- * been cancelled. We want to have a backup to make sure that we won't hang
- * when the main process join()-s the cancelled thread.
+/*
+ * Drop back to one queue per bank. Full queues outside of that are
+ * thrown away and their pages, along with the part of the current
+ * queue that has been used, are handed back to the system. The pregen
+ * threads wait until the consumer moves on to the next queue. A queue
+ * keeps its counter until it is consumed so it can be filled again
+ * later. Must be called with the ctx lock held.
  */
 static void
-thread_loop_check_exit(struct aes_mt_ctx_st *aes_mt_ctx)
+shrink_queues(struct aes_mt_ctx_st *aes_mt_ctx)
 {
-	int exit_flag;
+	struct kq *q;
+	int i, bank;
+
+	aes_mt_ctx->depth = 1;
+	for (bank = 0; bank < 2; bank++) {
+		for (i = 0; i < aes_mt_ctx->numkq; i++) {
+			q = &aes_mt_ctx->q[bank * aes_mt_ctx->numkq + i];
+			if (in_window(aes_mt_ctx, bank, i) ||
+			    q->qstate == KQFILLING)
+				continue;
+			if (q->qstate == KQFULL)
+				q->qstate = KQEMPTY;
+			cipher_mt_release(q->keys, sizeof(q->keys));
+		}
+	}
+	q = &aes_mt_ctx->q[aes_mt_ctx->bank * aes_mt_ctx->numkq +
+	    aes_mt_ctx->qidx];
+	if (q->qstate == KQDRAINING)
+		cipher_mt_release(q->keys, aes_mt_ctx->ridx * AES_BLOCK_SIZE);
+	debug3_f("down to one queue (%lu)", aes_mt_ctx->struct_id);
+}
 
-	pthread_rwlock_rdlock(&aes_mt_ctx->stop_lock);
-	exit_flag = aes_mt_ctx->exit_flag;
-	pthread_rwlock_unlock(&aes_mt_ctx->stop_lock);
+/* return the key slot for a generation or NULL if it has been replaced */
+static struct kslot *
+find_slot(struct aes_mt_ctx_st *aes_mt_ctx, u_int gen)
+{
+	int i;
 
-	if (exit_flag)
-		pthread_exit(NULL);
+	for (i = 0; i < 2; i++)
+		if (aes_mt_ctx->slot[i].gen == gen)
+			return &aes_mt_ctx->slot[i];
+	return NULL;
 }
-#else
-# define thread_loop_check_exit(s)
-#endif /* __APPLE__ */
 
 /*
  * Helper function to terminate the helper threads
+ * The threads live for as long as the context so this is only
+ * called when the context is freed.
  */
 static void
 stop_and_join_pregen_threads(struct aes_mt_ctx_st *aes_mt_ctx)
 {
 	int i;
 
-#ifdef __APPLE__
+	if (!aes_mt_ctx->running)
+		return;
+
+	/* the threads only exist in the process that started them. A
+	 * forked child (e.g. a session about to exec the shell) must not
+	 * wait on them or on a lock one of them may have held at fork */
+	if (aes_mt_ctx->pid != getpid()) {
+		aes_mt_ctx->running = 0;
+		return;
+	}
+
 	/* notify threads that they should exit */
-	pthread_rwlock_wrlock(&aes_mt_ctx->stop_lock);
-	aes_mt_ctx->exit_flag = TRUE;
-	pthread_rwlock_unlock(&aes_mt_ctx->stop_lock);
-#endif /* __APPLE__ */
-
-	/* Cancel pregen threads */
-	for (i = 0; i < cipher_threads; i++) {
-		debug_f ("Canceled %lu (%lu,%d)", aes_mt_ctx->tid[i], aes_mt_ctx->struct_id,
-		       aes_mt_ctx->id[i]);
-		pthread_cancel(aes_mt_ctx->tid[i]);
+	pthread_mutex_lock(&aes_mt_ctx->lock);
+	aes_mt_ctx->exit_flag = 1;
+	pthread_cond_broadcast(&aes_mt_ctx->work_cond);
+	pthread_mutex_unlock(&aes_mt_ctx->lock);
+
+	for (i = 0; i < aes_mt_ctx->nthreads; i++) {
+		debug_f ("Joining %lu (%lu, %d)", aes_mt_ctx->tid[i],
+		    aes_mt_ctx->struct_id, i);
+		pthread_join(aes_mt_ctx->tid[i], NULL);
 	}
-	for (i = 0; i < cipher_threads; i++) {
-		if (pthread_kill(aes_mt_ctx->tid[i], 0) != 0)
-			debug3("AES-CTR MT pthread_join failure: Invalid thread id %lu in %s",
-			       aes_mt_ctx->tid[i], __func__);
-		else {
-			debug_f ("Joining %lu (%lu, %d)", aes_mt_ctx->tid[i], aes_mt_ctx->struct_id,
-				 aes_mt_ctx->id[i]);
-			pthread_join(aes_mt_ctx->tid[i], NULL);
-			/* this finds the entry in the hash that corresponding to the
-			 * thread id. That's used to find the pointer to the cipher struct
-			 * created in thread_loop. */
-			struct aes_mt_ctx_ptrs *ptr;
-			HASH_FIND_INT(evp_ptrs, &aes_mt_ctx->tid[i], ptr);
-			EVP_CIPHER_CTX_free(ptr->pointer);
-			HASH_DEL(evp_ptrs, ptr);
-			free(ptr);
-                }
-        }
-	pthread_rwlock_destroy(&aes_mt_ctx->tid_lock);
+	aes_mt_ctx->running = 0;
 }
 
 /* determine the number of threads to use
@@ -179,12 +269,9 @@ stop_and_join_pregen_threads(struct aes_mt_ctx_st *aes_mt_ctx)
  * it returns the value of cipher_threads but it doesn't need to */
 static int get_thread_count() {
 
-	char * aes_threads = getenv("SSH_CIPHER_THREADS");
-	debug_f ("SSH thread count is %s", aes_threads);
-        if (aes_threads != NULL && strlen(aes_threads) != 0)
-		cipher_threads = atoi(aes_threads);
-	else
-		cipher_threads = 1;
+	/* CipherThreads or SSH_CIPHER_THREADS. 0 means use the default */
+	cipher_threads = cipher_mt_threads();
+	debug_f ("SSH thread count is %d", cipher_threads);
 
 	if (cipher_threads < 1)
  		cipher_threads = 1;
@@ -205,8 +292,9 @@ static int get_thread_count() {
 
 /*
  * The life of a pregen thread:
- *    Find empty keystream queues and fill them using their counter.
- *    When done, update counter for the next fill.
+ *    Find empty keystream queues and fill them using their counter
+ *    and the key of the generation they belong to.
+ *    Exit when the context is freed.
  */
 static void *
 thread_loop(void *job)
@@ -214,128 +302,161 @@ thread_loop(void *job)
 	EVP_CIPHER_CTX *evp_ctx;
 	struct aes_mt_ctx_st *aes_mt_ctx = job;
 	struct kq *q;
-	struct aes_mt_ctx_ptrs *ptr;
-	pthread_t first_tid;
+	struct kslot *slot;
+	u_char key[32], ctr[AES_BLOCK_SIZE];
+	u_int gen, mygen = 0;
 	int outlen;
 	u_char mynull[KQLEN * AES_BLOCK_SIZE];
 	memset(&mynull, 0, KQLEN * AES_BLOCK_SIZE);
 
-	/* get the thread id to see if this is the first one */
-	pthread_rwlock_rdlock(&aes_mt_ctx->tid_lock);
-	first_tid = aes_mt_ctx->tid[0];
-	pthread_rwlock_unlock(&aes_mt_ctx->tid_lock);
-
-	/* create the context for this thread */
-	evp_ctx = EVP_CIPHER_CTX_new();
-
-	/* keep track of the pointer for the evp in this struct
-	 * so we can free it later. So we place it in a hash indexed on the
-	 * thread id, which is available to us in the free function.
-	 * Note, the thread id isn't necessary unique across rekeys but
-	 * that's okay as they are unique during a key. */
-	ptr = malloc(sizeof *ptr); /*freed in stop & prejoin */
-	ptr->tid = pthread_self(); /* index for hash */
-	ptr->pointer = evp_ctx;
-	HASH_ADD_INT(evp_ptrs, tid, ptr);
-
-	/* initialize the cipher ctx with the key provided
-	 * determinbe which cipher to use based on the key size */
-	if (aes_mt_ctx->keylen == 256)
-		EVP_EncryptInit_ex(evp_ctx, EVP_aes_256_ctr(), NULL, aes_mt_ctx->orig_key, NULL);
-	else if (aes_mt_ctx->keylen == 128)
-		EVP_EncryptInit_ex(evp_ctx, EVP_aes_128_ctr(), NULL, aes_mt_ctx->orig_key, NULL);
-	else if (aes_mt_ctx->keylen == 192)
-		EVP_EncryptInit_ex(evp_ctx, EVP_aes_192_ctr(), NULL, aes_mt_ctx->orig_key, NULL);
-	else
-		fatal("Invalid key length of %d in AES CTR MT. Exiting", aes_mt_ctx->keylen);
-
-	/*
-	 * Handle the special case of startup, one thread must fill
-	 * the first KQ then mark it as draining. Lock held throughout.
-	 */
-	if (pthread_equal(pthread_self(), first_tid)) {
-		/* get the first element of the key queue struct */
-		q = &aes_mt_ctx->q[0];
-		pthread_mutex_lock(&q->lock);
-		/* if we are in the INIT state then fill the queue */
-		if (q->qstate == KQINIT) {
-			/* set the initial counter */
-			EVP_EncryptInit_ex(evp_ctx, NULL, NULL, NULL, q->ctr);
-			/* encypher a block sized null string (mynull) with the key. This
-			 * returns the keystream because xoring the keystream
-			 * against null returns the keystream. Store that in the appropriate queue */
-			EVP_EncryptUpdate(evp_ctx, q->keys[0], &outlen, mynull, KQLEN * AES_BLOCK_SIZE);
-			/* Update the aes counter */
-			ssh_ctr_add(q->ctr, KQLEN * numkq, AES_BLOCK_SIZE);
-			/* since this is the first thread set it to draining */
-			q->qstate = KQDRAINING;
-			pthread_cond_broadcast(&q->cond);
-		}
-		pthread_mutex_unlock(&q->lock);
-	}
-
-	/*
-	 * Normal case is to find empty queues and fill them, skipping over
-	 * queues already filled by other threads and stopping to wait for
-	 * a draining queue to become empty.
-	 *
-	 * Multiple threads may be waiting on a draining queue and awoken
-	 * when empty. The first thread to wake will mark it as filling,
-	 * others will move on to fill, skip, or wait on the next queue.
-	 * We init qidx here because if we do it at the top of the function
-	 * we get a warning about it possibly being clobbered. The exact reason
-	 * doesn't make a lot of sense but it has to happen after the
-	 * first pthread_rwlock_rdlock(). Might have something to do with
-	 * incorrect compiler optimizations.
-	 */
-	int qidx;
-	for (qidx = 1;; qidx = (qidx + 1) % numkq) {
-		/* Check if I was cancelled, also checked in cond_wait */
-		pthread_testcancel();
-
-		/* Check if we should exit as well */
-		thread_loop_check_exit(aes_mt_ctx);
-
-		/* Lock queue and block if its draining */
-		q = &aes_mt_ctx->q[qidx];
-		pthread_mutex_lock(&q->lock);
-		pthread_cleanup_push(thread_loop_cleanup, &q->lock);
-		while (q->qstate == KQDRAINING || q->qstate == KQINIT) {
-			thread_loop_check_exit(aes_mt_ctx);
-			pthread_cond_wait(&q->cond, &q->lock);
-		}
-		pthread_cleanup_pop(0);
-
-		/* If filling or full, somebody else got it, skip */
-		if (q->qstate != KQEMPTY) {
-			pthread_mutex_unlock(&q->lock);
+	cipher_affinity_apply();
+
+	/* create the context for this thread. It is keyed
+	 * lazily whenever we pick up a queue for a new generation */
+	if ((evp_ctx = EVP_CIPHER_CTX_new()) == NULL)
+		fatal_f("Could not create cipher context");
+	EVP_EncryptInit_ex(evp_ctx, aes_mt_evp_type(aes_mt_ctx->keylen),
+	    NULL, NULL, NULL);
+
+	pthread_mutex_lock(&aes_mt_ctx->lock);
+	for (;;) {
+		while (!aes_mt_ctx->exit_flag &&
+		    (q = find_empty_queue(aes_mt_ctx)) == NULL)
+			pthread_cond_wait(&aes_mt_ctx->work_cond,
+			    &aes_mt_ctx->lock);
+		if (aes_mt_ctx->exit_flag)
+			break;
+
+		gen = q->gen;
+		if ((slot = find_slot(aes_mt_ctx, gen)) == NULL) {
+			/* generation was dropped. Shouldn't happen */
+			q->qstate = KQINIT;
+			q->gen = 0;
 			continue;
 		}
+		if (gen != mygen)
+			memcpy(key, slot->key, sizeof(key));
+		memcpy(ctr, q->ctr, AES_BLOCK_SIZE);
 
 		/*
 		 * Empty, let's fill it.
-		 * Queue lock is relinquished while we do this so others
+		 * The lock is relinquished while we do this so others
 		 * can see that it's being filled.
 		 */
 		q->qstate = KQFILLING;
-		pthread_cond_broadcast(&q->cond);
-		pthread_mutex_unlock(&q->lock);
+		pthread_mutex_unlock(&aes_mt_ctx->lock);
 
+		if (gen != mygen) {
+			EVP_EncryptInit_ex(evp_ctx, NULL, NULL, key, NULL);
+			mygen = gen;
+		}
 		/* set the initial counter */
-		EVP_EncryptInit_ex(evp_ctx, NULL, NULL, NULL, q->ctr);
+		EVP_EncryptInit_ex(evp_ctx, NULL, NULL, NULL, ctr);
+
+		/* encypher a block sized null string (mynull) with the key. This
+		 * returns the keystream because xoring the keystream
+		 * against null returns the keystream. Store that in the queue */
+		EVP_EncryptUpdate(evp_ctx, q->keys[0], &outlen, mynull,
+		    KQLEN * AES_BLOCK_SIZE);
+
+		/* Re-lock, mark full and signal consumer. If the queue was
+		 * moved to another key while we were filling it then what we
+		 * have is useless and it goes back into the pool */
+		pthread_mutex_lock(&aes_mt_ctx->lock);
+		if (q->gen == gen) {
+			q->qstate = KQFULL;
+			pthread_cond_broadcast(&aes_mt_ctx->ready_cond);
+		} else
+			q->qstate = q->gen != 0 ? KQEMPTY : KQINIT;
+	}
+	pthread_mutex_unlock(&aes_mt_ctx->lock);
 
-		/* see coresponding block above for useful comments */
-		EVP_EncryptUpdate(evp_ctx, q->keys[0], &outlen, mynull, KQLEN * AES_BLOCK_SIZE);
+	explicit_bzero(key, sizeof(key));
+	EVP_CIPHER_CTX_free(evp_ctx);
+	return NULL;
+}
+
+/*
+ * Start the pregen threads. They stay up for the life of the context
+ * and are handed new keys on rekey.
+ */
+static void
+start_pregen_threads(struct aes_mt_ctx_st *aes_mt_ctx)
+{
+	pthread_attr_t attr;
+	int i;
 
-		/* Re-lock, mark full and signal consumer */
-		pthread_mutex_lock(&q->lock);
-		ssh_ctr_add(q->ctr, KQLEN * numkq, AES_BLOCK_SIZE);
-		q->qstate = KQFULL;
-		pthread_cond_broadcast(&q->cond);
-		pthread_mutex_unlock(&q->lock);
+	/* Start threads. Make sure we have enough stack space (under alpine)
+	 * and aren't using more than we need (linux). This can be as low as
+	 * 512KB but that's a minimum. 1024KB gives us a little headroom if we
+	 * need it */
+#define STACK_SIZE (1024 * 1024)
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, STACK_SIZE);
+	cipher_affinity_prepare();
+	for (i = 0; i < aes_mt_ctx->nthreads; i++) {
+		if (pthread_create(&aes_mt_ctx->tid[i], &attr, thread_loop,
+		    aes_mt_ctx) != 0)
+			fatal ("AES-CTR MT Could not create thread in %s",
+			    __func__);
+		debug_f ("AES-CTR MT spawned a thread with id %lu (%lu, %d)",
+		    aes_mt_ctx->tid[i], aes_mt_ctx->struct_id, i);
 	}
+	pthread_attr_destroy(&attr);
+	aes_mt_ctx->pid = getpid();
+	aes_mt_ctx->running = 1;
+}
 
-	return NULL;
+/*
+ * Switch the context to the key and counter in aes_mt_ctx->key and
+ * aes_mt_ctx->aes_counter. If that key was staged in the inactive bank
+ * we just swap banks, otherwise the inactive bank is pointed at the
+ * new key. Either way the old bank is retired and we wait for the first
+ * queue of the new key.
+ */
+static void
+activate_key(struct aes_mt_ctx_st *aes_mt_ctx)
+{
+	struct kslot *slot;
+	struct kq *q;
+	int next = !aes_mt_ctx->cur;
+	int bytes = aes_mt_ctx->keylen / 8;
+
+	pthread_mutex_lock(&aes_mt_ctx->lock);
+	slot = &aes_mt_ctx->slot[next];
+	if (slot->gen != 0 &&
+	    memcmp(slot->key, aes_mt_ctx->key, bytes) == 0 &&
+	    memcmp(slot->iv, aes_mt_ctx->aes_counter, AES_BLOCK_SIZE) == 0) {
+		debug3_f("using staged keystream (%lu)", aes_mt_ctx->struct_id);
+	} else {
+		slot->gen = ++aes_mt_ctx->lastgen;
+		memcpy(slot->key, aes_mt_ctx->key, bytes);
+		memcpy(slot->iv, aes_mt_ctx->aes_counter, AES_BLOCK_SIZE);
+		reset_bank(aes_mt_ctx, !aes_mt_ctx->bank, slot->gen,
+		    slot->iv);
+	}
+
+	/* retire the old key */
+	reset_bank(aes_mt_ctx, aes_mt_ctx->bank, 0, NULL);
+	explicit_bzero(&aes_mt_ctx->slot[aes_mt_ctx->cur],
+	    sizeof(aes_mt_ctx->slot[aes_mt_ctx->cur]));
+	aes_mt_ctx->cur = next;
+	aes_mt_ctx->bank = !aes_mt_ctx->bank;
+	aes_mt_ctx->qidx = 0;
+	aes_mt_ctx->ridx = 0;
+	aes_mt_ctx->last_roll = monotime_double();
+	aes_mt_ctx->struct_id = global_struct_id++;
+	pthread_cond_broadcast(&aes_mt_ctx->work_cond);
+
+	if (!aes_mt_ctx->running)
+		start_pregen_threads(aes_mt_ctx);
+
+	/* wait for the first queue of the new key */
+	q = &aes_mt_ctx->q[aes_mt_ctx->bank * aes_mt_ctx->numkq];
+	while (q->qstate != KQFULL)
+		pthread_cond_wait(&aes_mt_ctx->ready_cond, &aes_mt_ctx->lock);
+	q->qstate = KQDRAINING;
+	pthread_mutex_unlock(&aes_mt_ctx->lock);
 }
 
 
@@ -358,88 +479,55 @@ thread_loop(void *job)
  * set aes_mt_ctx_st->keylen to the keylength but that doesn't seem to
  * work either. That said, this does work even if it's a bit clunky.
  * -cjr 09/08/2022 */
-void *aes_mt_newctx_256(void *provctx)
+static void *
+aes_mt_newctx(void *provctx, const EVP_CIPHER *type, int keylen)
 {
-	struct aes_mt_ctx_st *aes_mt_ctx = malloc(sizeof(*aes_mt_ctx));
+	struct aes_mt_ctx_st *aes_mt_ctx = calloc(1, sizeof(*aes_mt_ctx));
 	EVP_CIPHER_CTX *evp_ctx = EVP_CIPHER_CTX_new();
 
 	if ((aes_mt_ctx != NULL) && (evp_ctx != NULL)) {
 		get_thread_count(); /* update cipher_threads and numkq */
-		pthread_rwlock_init(&aes_mt_ctx->tid_lock, NULL);
-#ifdef __APPLE__
-		pthread_rwlock_init(&aes_mt_ctx->stop_lock, NULL);
-		aes_mt_ctx->exit_flag = FALSE;
-#endif /* __APPLE__ */
+		aes_mt_ctx->nthreads = cipher_threads;
+		aes_mt_ctx->numkq = numkq;
+		aes_mt_ctx->depth = numkq;
+		/* one bank for the current key and one for the next */
+		if ((aes_mt_ctx->q = calloc(2 * numkq,
+		    sizeof(*aes_mt_ctx->q))) == NULL)
+			goto fail;
+		cipher_affinity_place(aes_mt_ctx->q,
+		    2 * numkq * sizeof(*aes_mt_ctx->q));
+		pthread_mutex_init(&aes_mt_ctx->lock, NULL);
+		pthread_cond_init(&aes_mt_ctx->work_cond, NULL);
+		pthread_cond_init(&aes_mt_ctx->ready_cond, NULL);
 
 		aes_mt_ctx->state = HAVE_NONE;
-
-		/* initialize the mutexs and conditions for each lock in our struct */
-		for (int i = 0; i < numkq; i++) {
-			pthread_mutex_init(&aes_mt_ctx->q[i].lock, NULL);
-			pthread_cond_init(&aes_mt_ctx->q[i].cond, NULL);
-		}
+		/* the EVP ctx can't tell us its key length if the default
+		 * provider isn't loaded yet so we keep track of it ourselves */
+		aes_mt_ctx->keylen = keylen;
 		aes_mt_ctx->provctx = provctx;
-		EVP_CipherInit(evp_ctx, EVP_aes_256_ctr(), NULL, NULL, 0);
+		EVP_CipherInit(evp_ctx, type, NULL, NULL, 0);
 		EVP_CIPHER_CTX_set_app_data(evp_ctx, aes_mt_ctx);
 		return evp_ctx;
 	}
+ fail:
+	free(aes_mt_ctx);
+	EVP_CIPHER_CTX_free(evp_ctx);
 	return NULL;
 }
 
-void *aes_mt_newctx_192(void *provctx)
+void *aes_mt_newctx_256(void *provctx)
 {
-	struct aes_mt_ctx_st *aes_mt_ctx = malloc(sizeof(*aes_mt_ctx));
-	EVP_CIPHER_CTX *evp_ctx = EVP_CIPHER_CTX_new();
-
-	if ((aes_mt_ctx != NULL) && (evp_ctx != NULL)) {
-		get_thread_count(); /* update cipher_threads and numkq */
-		pthread_rwlock_init(&aes_mt_ctx->tid_lock, NULL);
-#ifdef __APPLE__
-		pthread_rwlock_init(&aes_mt_ctx->stop_lock, NULL);
-		aes_mt_ctx->exit_flag = FALSE;
-#endif /* __APPLE__ */
-
-		aes_mt_ctx->state = HAVE_NONE;
+	return aes_mt_newctx(provctx, EVP_aes_256_ctr(), 256);
+}
 
-		/* initialize the mutexs and conditions for each lock in our struct */
-		for (int i = 0; i < numkq; i++) {
-			pthread_mutex_init(&aes_mt_ctx->q[i].lock, NULL);
-			pthread_cond_init(&aes_mt_ctx->q[i].cond, NULL);
-		}
-		aes_mt_ctx->provctx = provctx;
-		EVP_CipherInit(evp_ctx, EVP_aes_192_ctr(), NULL, NULL, 0);
-		EVP_CIPHER_CTX_set_app_data(evp_ctx, aes_mt_ctx);
-		return evp_ctx;
-	}
-	return NULL;
+void *aes_mt_newctx_192(void *provctx)
+{
+	return aes_mt_newctx(provctx, EVP_aes_192_ctr(), 192);
 }
 
 void *aes_mt_newctx_128(void *provctx)
 {
-	struct aes_mt_ctx_st *aes_mt_ctx = malloc(sizeof(*aes_mt_ctx));
-	EVP_CIPHER_CTX *evp_ctx = EVP_CIPHER_CTX_new();
-
-	if ((aes_mt_ctx != NULL) && (evp_ctx != NULL)) {
-		get_thread_count(); /* update cipher_threads and numkq */
-		pthread_rwlock_init(&aes_mt_ctx->tid_lock, NULL);
-#ifdef __APPLE__
-		pthread_rwlock_init(&aes_mt_ctx->stop_lock, NULL);
-		aes_mt_ctx->exit_flag = FALSE;
-#endif /* __APPLE__ */
-
-		aes_mt_ctx->state = HAVE_NONE;
-
-		/* initialize the mutexs and conditions for each lock in our struct */
-		for (int i = 0; i < numkq; i++) {
-			pthread_mutex_init(&aes_mt_ctx->q[i].lock, NULL);
-			pthread_cond_init(&aes_mt_ctx->q[i].cond, NULL);
-		}
-		aes_mt_ctx->provctx = provctx;
-		EVP_CipherInit(evp_ctx, EVP_aes_128_ctr(), NULL, NULL, 0);
-		EVP_CIPHER_CTX_set_app_data(evp_ctx, aes_mt_ctx);
-		return evp_ctx;
-	}
-	return NULL;
+	return aes_mt_newctx(provctx, EVP_aes_128_ctr(), 128);
 }
 
 /* this function expects a void but we need the actual context
@@ -452,16 +540,24 @@ void aes_mt_freectx(void *vevp_ctx)
 
 	if ((aes_mt_ctx = EVP_CIPHER_CTX_get_app_data(evp_ctx)) != NULL) {
 		stop_and_join_pregen_threads(aes_mt_ctx);
+		/* skip the destroy in a forked child, the lock may be held */
+		if (aes_mt_ctx->pid == 0 || aes_mt_ctx->pid == getpid()) {
+			pthread_mutex_destroy(&aes_mt_ctx->lock);
+			pthread_cond_destroy(&aes_mt_ctx->work_cond);
+			pthread_cond_destroy(&aes_mt_ctx->ready_cond);
+		}
 
-		memset(aes_mt_ctx, 0, sizeof(*aes_mt_ctx));
-		free(aes_mt_ctx);
+		freezero(aes_mt_ctx->q, 2 * aes_mt_ctx->numkq *
+		    sizeof(*aes_mt_ctx->q));
+		freezero(aes_mt_ctx, sizeof(*aes_mt_ctx));
 		EVP_CIPHER_CTX_set_app_data(evp_ctx, NULL);
 	}
 	EVP_CIPHER_CTX_free(evp_ctx);
 }
 
 /* this function takes the EVP context, gets the AES context
- * and starts the various threads we need */
+ * and starts the various threads we need. If the threads are
+ * already running (rekey) they are handed the new key instead */
 int aes_mt_start_threads(void *vevp_ctx, const u_char *key,
 			 size_t keylen, const u_char *iv,
 			 size_t ivlen, const OSSL_PARAM *ossl_params)
@@ -476,25 +572,14 @@ int aes_mt_start_threads(void *vevp_ctx, const u_char *key,
 	}
 
 	/* we are initializing but the current structure already
-	 * has an IV and key so we want to kill the existing key data
-	 * and start over. This is important when we need to rekey the data stream */
-	if (aes_mt_ctx->state == (HAVE_KEY | HAVE_IV)) {
-		/* tell the pregen threads to exit */
-		stop_and_join_pregen_threads(aes_mt_ctx);
-
-#ifdef __APPLE__
-		/* reset the exit flag */
-		aes_mt_ctx->exit_flag = FALSE;
-#endif /* __APPLE__ */
-
-		/* Start over getting key & iv */
+	 * has an IV and key so start over getting them. The threads
+	 * keep running on the old key until we have both */
+	if (aes_mt_ctx->state == (HAVE_KEY | HAVE_IV))
 		aes_mt_ctx->state = HAVE_NONE;
-	}
 
 	/* set the initial key for this key stream queue */
 	if (key != NULL) {
-		aes_mt_ctx->keylen = EVP_CIPHER_CTX_key_length(evp_ctx) * 8;
-		aes_mt_ctx->orig_key = key;
+		memcpy(aes_mt_ctx->key, key, aes_mt_ctx->keylen / 8);
 		aes_mt_ctx->state |= HAVE_KEY;
 	}
 
@@ -505,49 +590,66 @@ int aes_mt_start_threads(void *vevp_ctx, const u_char *key,
 		aes_mt_ctx->state |= HAVE_IV;
 	}
 
-	if (aes_mt_ctx->state == (HAVE_KEY | HAVE_IV)) {
-		/* Clear queues */
-		/* set the first key in the key queue to the current counter */
-		memcpy(aes_mt_ctx->q[0].ctr, aes_mt_ctx->aes_counter, AES_BLOCK_SIZE);
-		/* indicate that it needs to be initialized */
-		aes_mt_ctx->q[0].qstate = KQINIT;
-		/* for each of the remaining queues set the first counter to the
-		 * counter and then add the size of the queue to the counter */
-		for (int i = 1; i < numkq; i++) {
-			memcpy(aes_mt_ctx->q[i].ctr, aes_mt_ctx->aes_counter, AES_BLOCK_SIZE);
-			ssh_ctr_add(aes_mt_ctx->q[i].ctr, i * KQLEN, AES_BLOCK_SIZE);
-			aes_mt_ctx->q[i].qstate = KQEMPTY;
-		}
-		aes_mt_ctx->qidx = 0;
-		aes_mt_ctx->ridx = 0;
-		aes_mt_ctx->struct_id = global_struct_id++;
-
-		/* Start threads. Make sure we have enough stack space (under alpine)
-		* and aren't using more than we need (linux). This can be as low as
-		* 512KB but that's a minimum. 1024KB gives us a little headroom if we
-		* need it */
-#define STACK_SIZE (1024 * 1024)
-                pthread_attr_t attr;
-                pthread_attr_init(&attr);
-                pthread_attr_setstacksize(&attr, STACK_SIZE);
-		for (int i = 0; i < cipher_threads; i++) {
-			pthread_rwlock_wrlock(&aes_mt_ctx->tid_lock);
-			if (pthread_create(&aes_mt_ctx->tid[i], &attr, thread_loop, aes_mt_ctx) != 0)
-				fatal ("AES-CTR MT Could not create thread in %s", __func__);
-			else {
-				aes_mt_ctx->id[i] = i;
-				debug_f ("AES-CTR MT spawned a thread with id %lu (%lu, %d)",
-					 aes_mt_ctx->tid[i], aes_mt_ctx->struct_id,
-					 aes_mt_ctx->id[i]);
-			}
-			pthread_rwlock_unlock(&aes_mt_ctx->tid_lock);
-		}
-		pthread_mutex_lock(&aes_mt_ctx->q[0].lock);
-		// wait for all of the threads to be initialized
-		while (aes_mt_ctx->q[0].qstate == KQINIT)
-			pthread_cond_wait(&aes_mt_ctx->q[0].cond, &aes_mt_ctx->q[0].lock);
-		pthread_mutex_unlock(&aes_mt_ctx->q[0].lock);
-	}
+	if (aes_mt_ctx->state == (HAVE_KEY | HAVE_IV))
+		activate_key(aes_mt_ctx);
+	return 1;
+}
+
+/*
+ * Hand the next key and iv (concatenated in keyiv) to the pregen
+ * threads so they can fill the inactive bank while the current key
+ * is still in use. The following init with the same key and iv
+ * will then find its keystream already waiting.
+ */
+int aes_mt_stage_keys(void *vevp_ctx, const u_char *keyiv, size_t len)
+{
+	EVP_CIPHER_CTX *evp_ctx = vevp_ctx;
+	struct aes_mt_ctx_st *aes_mt_ctx;
+	struct kslot *slot;
+	int bytes;
+
+	if ((aes_mt_ctx = EVP_CIPHER_CTX_get_app_data(evp_ctx)) == NULL)
+		return 0;
+	/* nothing to work ahead of yet */
+	if (!aes_mt_ctx->running)
+		return 1;
+	bytes = aes_mt_ctx->keylen / 8;
+	if (len != (size_t)bytes + AES_BLOCK_SIZE)
+		return 0;
+
+	pthread_mutex_lock(&aes_mt_ctx->lock);
+	slot = &aes_mt_ctx->slot[!aes_mt_ctx->cur];
+	slot->gen = ++aes_mt_ctx->lastgen;
+	memcpy(slot->key, keyiv, bytes);
+	memcpy(slot->iv, keyiv + bytes, AES_BLOCK_SIZE);
+	reset_bank(aes_mt_ctx, !aes_mt_ctx->bank, slot->gen, slot->iv);
+	pthread_cond_broadcast(&aes_mt_ctx->work_cond);
+	pthread_mutex_unlock(&aes_mt_ctx->lock);
+	debug3_f("staged next key (%lu)", aes_mt_ctx->struct_id);
+	return 1;
+}
+
+/*
+ * Hint from the packet layer. During a bulk transfer every queue is
+ * kept filled. Otherwise the session is interactive or idle so we drop
+ * to a single queue; aes_mt_do_cipher adds them back if the traffic
+ * picks up again.
+ */
+int aes_mt_set_demand(void *vevp_ctx, int bulk)
+{
+	EVP_CIPHER_CTX *evp_ctx = vevp_ctx;
+	struct aes_mt_ctx_st *aes_mt_ctx;
+
+	if ((aes_mt_ctx = EVP_CIPHER_CTX_get_app_data(evp_ctx)) == NULL)
+		return 0;
+
+	pthread_mutex_lock(&aes_mt_ctx->lock);
+	if (bulk) {
+		aes_mt_ctx->depth = aes_mt_ctx->numkq;
+		pthread_cond_broadcast(&aes_mt_ctx->work_cond);
+	} else
+		shrink_queues(aes_mt_ctx);
+	pthread_mutex_unlock(&aes_mt_ctx->lock);
 	return 1;
 }
 
@@ -557,27 +659,15 @@ int aes_mt_start_threads(void *vevp_ctx, const u_char *key,
  *                     unsigned char *out, size_t *outl, size_t outsize,
  *                     const unsigned char *in, size_t inl))
  */
-
 int aes_mt_do_cipher(void *vevp_ctx,
 			    u_char *dest, size_t *destlen, size_t destsize,
 			    const u_char *src, size_t len)
 {
-	typedef union {
-#ifdef CIPHER_INT128_OK
-		__uint128_t *u128;
-#endif
-		uint64_t *u64;
-		uint32_t *u32;
-		uint8_t *u8;
-		const uint8_t *cu8;
-		uintptr_t u;
-	} ptrs_t;
-	ptrs_t destp, srcp, bufp;
-	uintptr_t align;
 	struct aes_mt_ctx_st *aes_mt_ctx;
-	struct kq *q, *oldq;
+	struct kq *q, *bank;
 	int ridx;
-	u_char *buf;
+	size_t nblocks;
+	double now;
 	EVP_CIPHER_CTX *evp_ctx = vevp_ctx;
 
 	if (len == 0)
@@ -586,85 +676,57 @@ int aes_mt_do_cipher(void *vevp_ctx,
 	if ((aes_mt_ctx = EVP_CIPHER_CTX_get_app_data(evp_ctx)) == NULL)
 		return 0;
 
-	q = &aes_mt_ctx->q[aes_mt_ctx->qidx];
+	bank = &aes_mt_ctx->q[aes_mt_ctx->bank * aes_mt_ctx->numkq];
+	q = &bank[aes_mt_ctx->qidx];
 	ridx = aes_mt_ctx->ridx;
 
 	/* src already padded to block multiple */
-	srcp.cu8 = src;
-	destp.u8 = dest;
-	do { /* do until len is 0 */
-		buf = q->keys[ridx];
-		bufp.u8 = buf;
-
-		/* figure out the alignment on the fly */
-#ifdef CIPHER_UNALIGNED_OK
-		align = 0;
-#else
-		align = destp.u | srcp.u | bufp.u;
-#endif
-
-		/* xor the src against the key (buf)
-		 * different systems can do all 16 bytes at once or
-		 * may need to do it in 8 or 4 bytes chunks
-		 * worst case is doing it as a loop */
-#ifdef CIPHER_INT128_OK
-		/* with GCC 13 we have having consistent seg faults
-		 * in this section of code. Since this is a critical
-		 * code path we are removing this until we have a solution
-		 * in place -cjr 02/22/24
-		 * TODO: FIX THIS
-		 */
-		/* if ((align & 0xf) == 0) { */
-		/* 	destp.u128[0] = srcp.u128[0] ^ bufp.u128[0]; */
-		/* } else */
-#endif
-		/* 64 bits */
-		/* this is causing undefined behaviour in sanitizers
-		 * this is annoying because it's more efficient
-		 * but UB is not something I want to retain */
-		/* if ((align & 0x7) == 0) { */
-		/* 	destp.u64[0] = srcp.u64[0] ^ bufp.u64[0]; */
-		/* 	destp.u64[1] = srcp.u64[1] ^ bufp.u64[1]; */
-		/* /\* 32 bits *\/ */
-		/* } else */
-		if ((align & 0x3) == 0) {
-			destp.u32[0] = srcp.u32[0] ^ bufp.u32[0];
-			destp.u32[1] = srcp.u32[1] ^ bufp.u32[1];
-			destp.u32[2] = srcp.u32[2] ^ bufp.u32[2];
-			destp.u32[3] = srcp.u32[3] ^ bufp.u32[3];
-		} else {
-			/*1 byte at a time*/
-			size_t i;
-			for (i = 0; i < AES_BLOCK_SIZE; ++i)
-				dest[i] = src[i] ^ buf[i];
-		}
-
-		/* inc/decrement the pointers by the block size (16)*/
-		destp.u += AES_BLOCK_SIZE;
-		srcp.u += AES_BLOCK_SIZE;
+	while (len >= AES_BLOCK_SIZE) {
+		/* the keystream in a queue is contiguous so we can xor
+		 * everything up to the end of this queue in one go and
+		 * let cipher_xor use the widest vectors the cpu has */
+		nblocks = len / AES_BLOCK_SIZE;
+		if (nblocks > (size_t)(KQLEN - ridx))
+			nblocks = KQLEN - ridx;
+		cipher_xor(dest, src, q->keys[ridx], nblocks * AES_BLOCK_SIZE);
+		dest += nblocks * AES_BLOCK_SIZE;
+		src += nblocks * AES_BLOCK_SIZE;
+		len -= nblocks * AES_BLOCK_SIZE;
 
 		/* Increment read index, switch queues on rollover */
-		if ((ridx = (ridx + 1) % KQLEN) == 0) {
-			oldq = q;
-
-			/* Mark next queue draining, may need to wait */
-			aes_mt_ctx->qidx = (aes_mt_ctx->qidx + 1) % numkq;
-			q = &aes_mt_ctx->q[aes_mt_ctx->qidx];
-			pthread_mutex_lock(&q->lock);
+		if ((ridx = (ridx + nblocks) % KQLEN) == 0) {
+			pthread_mutex_lock(&aes_mt_ctx->lock);
+
+			/* Mark consumed queue empty and move its counter
+			 * on to the next keystream it will hold */
+			ssh_ctr_add(q->ctr, KQLEN * aes_mt_ctx->numkq,
+			    AES_BLOCK_SIZE);
+			q->qstate = KQEMPTY;
+			aes_mt_ctx->qidx = (aes_mt_ctx->qidx + 1) %
+			    aes_mt_ctx->numkq;
+
+			/* see how fast we are going */
+			now = monotime_double();
+			if (now - aes_mt_ctx->last_roll < KQ_GROW_TIME &&
+			    aes_mt_ctx->depth < aes_mt_ctx->numkq)
+				aes_mt_ctx->depth++;
+			else if (now - aes_mt_ctx->last_roll > KQ_SHRINK_TIME &&
+			    aes_mt_ctx->depth > 1)
+				shrink_queues(aes_mt_ctx);
+			aes_mt_ctx->last_roll = now;
+
+			/* signal producers. Mark next queue draining,
+			 * may need to wait */
+			pthread_cond_broadcast(&aes_mt_ctx->work_cond);
+			q = &bank[aes_mt_ctx->qidx];
 			while (q->qstate != KQFULL) {
-				pthread_cond_wait(&q->cond, &q->lock);
+				pthread_cond_wait(&aes_mt_ctx->ready_cond,
+				    &aes_mt_ctx->lock);
 			}
 			q->qstate = KQDRAINING;
-			pthread_cond_broadcast(&q->cond);
-			pthread_mutex_unlock(&q->lock);
-
-			/* Mark consumed queue empty and signal producers */
-			pthread_mutex_lock(&oldq->lock);
-			oldq->qstate = KQEMPTY;
-			pthread_cond_broadcast(&oldq->cond);
-			pthread_mutex_unlock(&oldq->lock);
+			pthread_mutex_unlock(&aes_mt_ctx->lock);
 		}
-	} while (len -= AES_BLOCK_SIZE);
+	}
 	aes_mt_ctx->ridx = ridx;
 	return 1;
 }
@@ -30,7 +30,6 @@
 #include <sys/types.h>
 #include <pthread.h>
 #include "cipher-aesctr.h"
-#include "uthash.h"
 
 #ifndef USE_BUILTIN_RIJNDAEL
 #include <openssl/aes.h>
@@ -44,26 +43,22 @@
 #define MAX_THREADS      32
 #define MAX_NUMKQ        (MAX_THREADS + 1)
 
-/* one queue holds 8192 * 4 * 16B (512KB)  of key data 
- * being that the queues are destroyed after a rekey
- * and at leats one has to be fully filled prior to
- * enciphering data we don't want this to be too large */
+/* one queue holds 8192 * 4 * 16B (512KB)  of key data.
+ * at least one queue has to be fully filled prior to
+ * enciphering data with a new key so we don't want this
+ * to be too large */
 #define KQLEN (8192 * 4)
 
+/* the pregen threads only keep depth queues of each bank filled.
+ * Moving to a new queue less than KQ_GROW_TIME seconds after the last
+ * time (about 10MB/s) adds one, more than KQ_SHRINK_TIME drops back to
+ * a single queue and gives the memory of the rest back */
+#define KQ_GROW_TIME	0.05
+#define KQ_SHRINK_TIME	2.0
+
 /* Processor cacheline length */
 #define CACHELINE_LEN	64
 
-/* Can the system do unaligned loads natively? */
-#if defined(__aarch64__) || \
-    defined(__i386__)    || \
-    defined(__powerpc__) || \
-    defined(__x86_64__)
-# define CIPHER_UNALIGNED_OK
-#endif
-#if defined(__SIZEOF_INT128__)
-# define CIPHER_INT128_OK
-#endif
-
 /* context states */
 #define HAVE_NONE       0
 #define HAVE_KEY        1
@@ -87,17 +82,36 @@ struct provider_ctx_st {
 };
 
 /* Keystream Queue struct */
+/* gen is the key generation the queue is being filled for.
+ * 0 means the queue isn't part of any key and is ignored by the
+ * pregen threads */
 struct kq {
 	u_char		keys[KQLEN][AES_BLOCK_SIZE]; /* [32768][16B] */
 	u_char		ctr[AES_BLOCK_SIZE]; /* 16B */
 	u_char          pad0[CACHELINE_LEN];
-	pthread_mutex_t	lock;
-	pthread_cond_t	cond;
+	u_int           gen;
 	int             qstate;
 	u_char          pad1[CACHELINE_LEN];
 };
 
-/* AES MT context struct */
+/* key and counter for one key generation */
+struct kslot {
+	u_int           gen;
+	u_char          key[32];
+	u_char          iv[AES_BLOCK_SIZE];
+};
+
+/* AES MT context struct
+ * The queues are split into two banks of numkq queues. The consumer
+ * drains the active bank while the pregen threads may fill the other
+ * bank with the keystream of the next key (see aes_mt_stage_keys).
+ * A rekey then swaps banks instead of restarting the threads.
+ * lock protects the key slots and the state, gen and ctr of every queue.
+ * The keystream itself is only touched by whoever owns the queue
+ * (KQFILLING for a pregen thread, KQDRAINING for the consumer).
+ * Only the depth queues of each bank starting at the one being drained
+ * (or at the first one in the staged bank) are filled, the threads wait
+ * when those are done */
 struct aes_mt_ctx_st {
 	struct provider_ctx_st *provctx;
 	long unsigned int       struct_id;
@@ -105,35 +119,32 @@ struct aes_mt_ctx_st {
 	int		        state;
 	int		        qidx;
 	int		        ridx;
-	int                     id[MAX_THREADS]; /* 32 */
-	AES_KEY                 aes_key;
-	const u_char           *orig_key;
+	int                     bank; /* active bank 0|1 */
+	int                     numkq; /* queues per bank */
+	int                     depth; /* queues per bank kept filled */
+	double                  last_roll; /* when we last changed queues */
+	int                     nthreads;
+	int                     running; /* threads have been started */
+	pid_t                   pid; /* process the threads belong to */
+	int                     exit_flag;
+	u_int                   lastgen;
+	int                     cur; /* slot index of the active key */
+	struct kslot            slot[2];
+	u_char                  key[32]; /* key & iv as passed to init */
 	u_char		        aes_counter[AES_BLOCK_SIZE]; /* 16B */
 	pthread_t	        tid[MAX_THREADS]; /* 32 */
-	pthread_rwlock_t        tid_lock;
-	struct kq	        q[MAX_NUMKQ]; /* 33 */
-#ifdef __APPLE__
-	pthread_rwlock_t        stop_lock;
-	int		        exit_flag;
-#endif /* __APPLE__ */
+	pthread_mutex_t         lock;
+	pthread_cond_t          work_cond; /* pregen threads wait on this */
+	pthread_cond_t          ready_cond; /* consumer waits on this */
+	struct kq	       *q; /* 2 * numkq */
 	int                     ongoing; /* possibly not needed */
 };
 
-/* this holds an array of evp context pointers that are
- * created in thread_loop. Since we can't effectively free those
- * contexts in thread_loop we keep a copy of those pointers here
- * and then free them in stop_and_join_pregenthreads
- * cjr 2/2/2023
- */
-struct aes_mt_ctx_ptrs {
-	EVP_CIPHER_CTX *pointer;
-        pthread_t       tid;
-	UT_hash_handle  hh;
-};
-
 int aes_mt_do_cipher(void *, u_char *, size_t *, size_t, const u_char *, size_t);
 int aes_mt_start_threads(void *, const u_char *, size_t, const u_char *, size_t, const OSSL_PARAM *);
 void aes_mt_freectx(void *);
+int aes_mt_stage_keys(void *, const u_char *, size_t);
+int aes_mt_set_demand(void *, int);
 void *aes_mt_newctx_256(void *);
 void *aes_mt_newctx_192(void *);
 void *aes_mt_newctx_128(void *);
@@ -35,6 +35,7 @@
 #include "ossl3-provider-err.h"
 #include "num.h"
 #include "cipher-ctr-mt-functions.h"
+#include "cipher.h"
 
 #define ERR_HANDLE(ctx) ((ctx)->provctx->proverr_handle)
 
@@ -175,6 +176,8 @@ static const OSSL_PARAM cipher_get_param_table[] = {
 
 static const OSSL_PARAM cipher_set_param_table[] = {
 	{ "keylen", OSSL_PARAM_UNSIGNED_INTEGER, NULL, sizeof(size_t), 0 },
+	{ CIPHER_MT_STAGE_PARAM, OSSL_PARAM_OCTET_STRING, NULL, 0, 0 },
+	{ CIPHER_MT_DEMAND_PARAM, OSSL_PARAM_INTEGER, NULL, sizeof(int), 0 },
 	{ NULL, 0, NULL, 0, 0 },
 };
 
@@ -341,19 +344,23 @@ static const OSSL_PARAM *aes_mt_gettable_ctx_params(void *cctx, void *provctx)
 
 static int aes_mt_get_ctx_params(void *vctx, OSSL_PARAM params[])
 {
-    struct aes_mt_ctx_st *ctx = vctx;
+    struct aes_mt_ctx_st *ctx;
+    OSSL_PARAM *p;
+    size_t keyl;
     int ok = 1;
 
-    if (ctx->keylen > 0) {
-        OSSL_PARAM *p;
+    if ((ctx = EVP_CIPHER_CTX_get_app_data(vctx)) == NULL)
+        return 0;
 
-        for (p = params; p->key != NULL; p++)
-            if (strcasecmp(p->key, "keylen") == 0
-                && provnum_set_size_t(p, ctx->keylen) < 0) {
-                ok = 0;
-                continue;
-            }
-    }
+    /* libcrypto expects the key length to always be filled in */
+    keyl = ctx->keylen / 8;
+
+    for (p = params; p->key != NULL; p++)
+        if (strcasecmp(p->key, "keylen") == 0
+            && provnum_set_size_t(p, keyl) < 0) {
+            ok = 0;
+            continue;
+        }
     return ok;
 }
 
@@ -363,12 +370,17 @@ static const OSSL_PARAM *aes_mt_settable_ctx_params(void *cctx, void *provctx)
     return cipher_set_param_table;
 }
 
+/* vctx is the EVP context created in aes_mt_newctx_*. Our
+ * state hangs off of its app data */
 static int aes_mt_set_ctx_params(void *vctx, const OSSL_PARAM params[])
 {
-    struct aes_mt_ctx_st *ctx = vctx;
+    struct aes_mt_ctx_st *ctx;
     const OSSL_PARAM *p;
     int ok = 1;
 
+    if ((ctx = EVP_CIPHER_CTX_get_app_data(vctx)) == NULL)
+        return 0;
+
     if (ctx->ongoing) {
         ERR_raise(ERR_HANDLE(ctx), AES_MT_ONGOING_OPERATION);
         return 0;
@@ -382,7 +394,17 @@ static int aes_mt_set_ctx_params(void *vctx, const OSSL_PARAM params[])
                 ok = 0;
                 continue;
             }
-            ctx->keylen = keyl;
+            ctx->keylen = keyl * 8; /* we keep it in bits */
+        } else if (strcasecmp(p->key, CIPHER_MT_STAGE_PARAM) == 0) {
+            if (p->data_type != OSSL_PARAM_OCTET_STRING ||
+                !aes_mt_stage_keys(vctx, p->data, p->data_size))
+                ok = 0;
+        } else if (strcasecmp(p->key, CIPHER_MT_DEMAND_PARAM) == 0) {
+            int bulk;
+
+            if (!OSSL_PARAM_get_int(p, &bulk) ||
+                !aes_mt_set_demand(vctx, bulk))
+                ok = 0;
         }
     return ok;
 }
@@ -34,7 +34,10 @@
 #include "xmalloc.h"
 #include "log.h"
 #include <unistd.h>
-#include "uthash.h"
+#include "cipher.h"
+#include "cipher-xor.h"
+#include "cipher-affinity.h"
+#include "misc.h"
 
 /* compatibility with old or broken OpenSSL versions */
 #include "openbsd-compat/openssl-compat.h"
@@ -88,25 +91,22 @@ int cipher_threads = 1;
 int numkq = 2;
 
 /* Length of a keystream queue */
-/* one queue holds 512KB (1024 * 32 * 16) of key data
- * being that the queues are destroyed after a rekey
- * and at leats one has to be fully filled prior to
- * enciphering data we don't want this to be too large */
+/* one queue holds 512KB (1024 * 32 * 16) of key data.
+ * at least one queue has to be fully filled prior to
+ * enciphering data with a new key so we don't want this
+ * to be too large */
 #define KQLEN (1024 * 32)
 
+/* the pregen threads only keep depth queues of each bank filled.
+ * Moving to a new queue less than KQ_GROW_TIME seconds after the last
+ * time (about 10MB/s) adds one, more than KQ_SHRINK_TIME drops back to
+ * a single queue and gives the memory of the rest back */
+#define KQ_GROW_TIME	0.05
+#define KQ_SHRINK_TIME	2.0
+
 /* Processor cacheline length */
 #define CACHELINE_LEN	64
 
-/* Can the system do unaligned loads natively? */
-#if defined(__aarch64__) || \
-    defined(__i386__)    || \
-    defined(__powerpc__) || \
-    defined(__x86_64__)
-# define CIPHER_UNALIGNED_OK
-#endif
-#if defined(__SIZEOF_INT128__)
-# define CIPHER_INT128_OK
-#endif
 /*-------------------- END TUNABLES --------------------*/
 
 #define HAVE_NONE       0
@@ -126,17 +126,33 @@ enum {
 };
 
 /* Keystream Queue struct */
+/* gen is the key generation the queue is being filled for.
+ * 0 means the queue isn't part of any key and is ignored by the
+ * pregen threads */
 struct kq {
 	u_char		keys[KQLEN][AES_BLOCK_SIZE]; /* [32768][16B] */
 	u_char		ctr[AES_BLOCK_SIZE]; /* 16B */
 	u_char          pad0[CACHELINE_LEN];
-	pthread_mutex_t	lock;
-	pthread_cond_t	cond;
+	u_int           gen;
 	int             qstate;
 	u_char          pad1[CACHELINE_LEN];
 };
 
-/* Context struct */
+/* key and counter for one key generation */
+struct kslot {
+	u_int           gen;
+	u_char          key[32];
+	u_char          iv[AES_BLOCK_SIZE];
+};
+
+/* Context struct
+ * The queues are split into two banks of numkq queues. The consumer
+ * drains the active bank while the pregen threads may fill the other
+ * bank with the keystream of the next key (see ssh_aes_ctr_ctrl).
+ * A rekey then swaps banks instead of restarting the threads.
+ * lock protects the key slots and the state, gen and ctr of every queue.
+ * Only the depth queues of each bank starting at the one being drained
+ * (or at the first one in the staged bank) are filled */
 struct ssh_aes_ctr_ctx_mt
 {
 	long unsigned int struct_id;
@@ -144,36 +160,30 @@ struct ssh_aes_ctr_ctx_mt
 	int		  state;
 	int		  qidx;
 	int		  ridx;
-	int               id[MAX_THREADS]; /* 32 */
-	AES_KEY           aes_key;
-	const u_char     *orig_key;
+	int               bank; /* active bank 0|1 */
+	int               numkq; /* queues per bank */
+	int               depth; /* queues per bank kept filled */
+	double            last_roll; /* when we last changed queues */
+	int               nthreads;
+	int               running; /* threads have been started */
+	pid_t             pid; /* process the threads belong to */
+	int               exit_flag;
+	u_int             lastgen;
+	int               cur; /* slot index of the active key */
+	struct kslot      slot[2];
+	u_char            key[32];
 	u_char		  aes_counter[AES_BLOCK_SIZE]; /* 16B */
-	pthread_t	  tid[MAX_THREADS]; /* 32 */
-	pthread_rwlock_t  tid_lock;
-	struct kq	  q[MAX_NUMKQ]; /* 33 */
-#ifdef __APPLE__
-	pthread_rwlock_t  stop_lock;
-	int		  exit_flag;
-#endif /* __APPLE__ */
-};
-
-/* this defines the hash and elements of evp context pointers
- * that are created in thread_loop. We use this to clear and
- * free the contexts in stop_and_prejoin
- */
-struct aes_mt_ctx_ptrs {
-	pthread_t       tid;
-	EVP_CIPHER_CTX *pointer; /* 32 */
-	UT_hash_handle hh;
+	pthread_t	  tid[MAX_THREADS];
+	pthread_mutex_t   lock;
+	pthread_cond_t    work_cond; /* pregen threads wait on this */
+	pthread_cond_t    ready_cond; /* consumer waits on this */
+	struct kq	  q[2 * MAX_NUMKQ];
 };
 
 /* globals */
 /* how we increment the id the structs we create */
 long unsigned int global_struct_id = 0;
 
-/* keep a copy of the pointers created in thread_loop to free later */
-struct aes_mt_ctx_ptrs *evp_ptrs = NULL;
-
 /*
  * Add num to counter 'ctr'
  */
@@ -192,86 +202,148 @@ ssh_ctr_add(u_char *ctr, uint32_t num, u_int len)
 }
 
 /*
- * Threads may be cancelled in a pthread_cond_wait, we must free the mutex
+ * Point a bank of queues at a new key generation. Must be called
+ * with the ctx lock held. Queues that are being filled are left to the
+ * filling thread which will notice the generation change and requeue
+ * them when it is done.
  */
 static void
-thread_loop_cleanup(void *x)
+reset_bank(struct ssh_aes_ctr_ctx_mt *c, int bank, u_int gen,
+    const u_char *iv)
 {
-	pthread_mutex_unlock((pthread_mutex_t *)x);
+	struct kq *q;
+	int i;
+
+	for (i = 0; i < c->numkq; i++) {
+		q = &c->q[bank * c->numkq + i];
+		q->gen = gen;
+		if (iv != NULL) {
+			memcpy(q->ctr, iv, AES_BLOCK_SIZE);
+			ssh_ctr_add(q->ctr, i * KQLEN, AES_BLOCK_SIZE);
+		}
+		if (q->qstate != KQFILLING)
+			q->qstate = gen != 0 ? KQEMPTY : KQINIT;
+	}
 }
 
-#ifdef __APPLE__
-/* Check if we should exit, we are doing both cancel and exit condition
- * since on OSX threads seem to occasionally fail to notice when they have
- * been cancelled. We want to have a backup to make sure that we won't hang
- * when the main process join()-s the cancelled thread.
+/*
+ * Whether queue i of a bank is one of the depth queues we keep filled.
+ * Must be called with the ctx lock held.
+ */
+static int
+in_window(struct ssh_aes_ctr_ctx_mt *c, int bank, int i)
+{
+	if (bank != c->bank)
+		return i < c->depth;
+	return (i - c->qidx + c->numkq) % c->numkq < c->depth;
+}
+
+/*
+ * Find a queue that needs filling. The active bank is always
+ * served first, only when it is full do we work ahead on the
+ * staged bank. Must be called with the ctx lock held.
+ */
+static struct kq *
+find_empty_queue(struct ssh_aes_ctr_ctx_mt *c)
+{
+	struct kq *q;
+	int i;
+
+	for (i = 0; i < c->depth; i++) {
+		q = &c->q[c->bank * c->numkq + (c->qidx + i) % c->numkq];
+		if (q->qstate == KQEMPTY && q->gen != 0)
+			return q;
+	}
+	for (i = 0; i < c->depth; i++) {
+		q = &c->q[!c->bank * c->numkq + i];
+		if (q->qstate == KQEMPTY && q->gen != 0)
+			return q;
+	}
+	return NULL;
+}
+
+/*
+ * Drop back to one queue per bank. Full queues outside of that are
+ * thrown away and their pages, along with the part of the current
+ * queue that has been used, are handed back to the system. A queue
+ * keeps its counter until it is consumed so it can be filled again
+ * later. Must be called with the ctx lock held.
  */
 static void
-thread_loop_check_exit(struct ssh_aes_ctr_ctx_mt *c)
+shrink_queues(struct ssh_aes_ctr_ctx_mt *c)
 {
-	int exit_flag;
+	struct kq *q;
+	int i, bank;
+
+	c->depth = 1;
+	for (bank = 0; bank < 2; bank++) {
+		for (i = 0; i < c->numkq; i++) {
+			q = &c->q[bank * c->numkq + i];
+			if (in_window(c, bank, i) || q->qstate == KQFILLING)
+				continue;
+			if (q->qstate == KQFULL)
+				q->qstate = KQEMPTY;
+			cipher_mt_release(q->keys, sizeof(q->keys));
+		}
+	}
+	q = &c->q[c->bank * c->numkq + c->qidx];
+	if (q->qstate == KQDRAINING)
+		cipher_mt_release(q->keys, c->ridx * AES_BLOCK_SIZE);
+	debug3_f("down to one queue (%lu)", c->struct_id);
+}
 
-	pthread_rwlock_rdlock(&c->stop_lock);
-	exit_flag = c->exit_flag;
-	pthread_rwlock_unlock(&c->stop_lock);
+/* return the key slot for a generation or NULL if it has been replaced */
+static struct kslot *
+find_slot(struct ssh_aes_ctr_ctx_mt *c, u_int gen)
+{
+	int i;
 
-	if (exit_flag)
-		pthread_exit(NULL);
+	for (i = 0; i < 2; i++)
+		if (c->slot[i].gen == gen)
+			return &c->slot[i];
+	return NULL;
 }
-#else
-# define thread_loop_check_exit(s)
-#endif /* __APPLE__ */
 
 /*
  * Helper function to terminate the helper threads
+ * The threads live for as long as the context so this is only
+ * called from cleanup.
  */
 static void
 stop_and_join_pregen_threads(struct ssh_aes_ctr_ctx_mt *c)
 {
 	int i;
 
-#ifdef __APPLE__
+	if (!c->running)
+		return;
+
+	/* the threads only exist in the process that started them. A
+	 * forked child (e.g. a session about to exec the shell) must not
+	 * wait on them or on a lock one of them may have held at fork */
+	if (c->pid != getpid()) {
+		c->running = 0;
+		return;
+	}
+
 	/* notify threads that they should exit */
-	pthread_rwlock_wrlock(&c->stop_lock);
-	c->exit_flag = TRUE;
-	pthread_rwlock_unlock(&c->stop_lock);
-#endif /* __APPLE__ */
-
-	/* Cancel pregen threads */
-	for (i = 0; i < cipher_threads; i++) {
-		debug ("Canceled %lu (%lu,%d)", c->tid[i], c->struct_id, c->id[i]);
-		pthread_cancel(c->tid[i]);
+	pthread_mutex_lock(&c->lock);
+	c->exit_flag = 1;
+	pthread_cond_broadcast(&c->work_cond);
+	pthread_mutex_unlock(&c->lock);
+
+	for (i = 0; i < c->nthreads; i++) {
+		debug ("AES-CTR MT joining %lu (%lu, %d)", c->tid[i],
+		    c->struct_id, i);
+		pthread_join(c->tid[i], NULL);
 	}
-        for (i = 0; i < numkq; i++) {
-                pthread_mutex_lock(&c->q[i].lock);
-                pthread_cond_broadcast(&c->q[i].cond);
-                pthread_mutex_unlock(&c->q[i].lock);
-        }
-	for (i = 0; i < cipher_threads; i++) {
-		if (pthread_kill(c->tid[i], 0) != 0)
-			debug3("AES-CTR MT pthread_join failure: Invalid thread id %lu in %s",
-			       c->tid[i], __FUNCTION__);
-		else {
-			debug ("Joining %lu (%lu, %d)", c->tid[i], c->struct_id, c->id[i]);
-			pthread_mutex_destroy(&c->q[i].lock);
-                        pthread_cond_destroy(&c->q[i].cond);
-                        pthread_join(c->tid[i], NULL);
-			/* this finds the entry in the hash that corresponding to the
-			 * thread id. That's used to find the pointer to the cipher struct
-			 * created in thread_loop. */
-			struct aes_mt_ctx_ptrs *ptr;
-			HASH_FIND_INT(evp_ptrs, &c->tid[i], ptr);
-			EVP_CIPHER_CTX_free(ptr->pointer);
-			HASH_DEL(evp_ptrs, ptr);
-			free(ptr);              }
-        }
-	pthread_rwlock_destroy(&c->tid_lock);
+	c->running = 0;
 }
 
 /*
  * The life of a pregen thread:
- *    Find empty keystream queues and fill them using their counter.
- *    When done, update counter for the next fill.
+ *    Find empty keystream queues and fill them using their counter
+ *    and the key of the generation they belong to.
+ *    Exit when the context is cleaned up.
  */
 /* previously this used the low level interface which is, sadly,
  * slower than the EVP interface by a long shot. The original ctx (from the
@@ -286,238 +358,218 @@ static void *
 thread_loop(void *x)
 {
 	EVP_CIPHER_CTX *aesni_ctx;
+	const EVP_CIPHER *type;
 	struct ssh_aes_ctr_ctx_mt *c = x;
 	struct kq *q;
-	struct aes_mt_ctx_ptrs *ptr;
-	int qidx;
-	pthread_t first_tid;
+	struct kslot *slot;
+	u_char key[32], ctr[AES_BLOCK_SIZE];
+	u_int gen, mygen = 0;
 	int outlen;
 	u_char mynull[KQLEN * AES_BLOCK_SIZE];
 	memset(&mynull, 0, KQLEN * AES_BLOCK_SIZE);
 
-	/* get the thread id to see if this is the first one */
-	pthread_rwlock_rdlock(&c->tid_lock);
-	first_tid = c->tid[0];
-	pthread_rwlock_unlock(&c->tid_lock);
-
-	/* create the context for this thread */
-	aesni_ctx = EVP_CIPHER_CTX_new();
-
-	/* keep track of the pointer for the evp in this struct
-	 * so we can free it later. So we place it in a hash indexed on the
-	 * thread id, which is available to us in the free function.
-	 * Note, the thread id isn't necessary unique across rekeys but
-	 * that's okay as they are unique during a key. */
-	ptr = malloc(sizeof *ptr); /*freed in stop & prejoin */
-	ptr->tid = pthread_self(); /* index for hash */
-	ptr->pointer = aesni_ctx;
-	HASH_ADD_INT(evp_ptrs, tid, ptr);
-
-	/* initialize the cipher ctx with the key provided
-	 * determine which cipher to use based on the key size */
+	cipher_affinity_apply();
+
+	/* determine which cipher to use based on the key size */
 	if (c->keylen == 256)
-		EVP_EncryptInit_ex(aesni_ctx, EVP_aes_256_ctr(), NULL, c->orig_key, NULL);
+		type = EVP_aes_256_ctr();
 	else if (c->keylen == 128)
-		EVP_EncryptInit_ex(aesni_ctx, EVP_aes_128_ctr(), NULL, c->orig_key, NULL);
+		type = EVP_aes_128_ctr();
 	else if (c->keylen == 192)
-		EVP_EncryptInit_ex(aesni_ctx, EVP_aes_192_ctr(), NULL, c->orig_key, NULL);
+		type = EVP_aes_192_ctr();
 	else {
 		logit("Invalid key length of %d in AES CTR MT. Exiting", c->keylen);
 		exit(1);
 	}
 
-	/*
-	 * Handle the special case of startup, one thread must fill
-	 * the first KQ then mark it as draining. Lock held throughout.
-	 */
-
-	if (pthread_equal(pthread_self(), first_tid)) {
-		/* get the first element of the keyque struct */
-		q = &c->q[0];
-		pthread_mutex_lock(&q->lock);
-		/* if we are in the INIT state then fill the queue */
-		if (q->qstate == KQINIT) {
-			/* set the initial counter */
-			EVP_EncryptInit_ex(aesni_ctx, NULL, NULL, NULL, q->ctr);
-
-			/* encypher a block sized null string (mynull) with the key. This
-			 * returns the keystream because xoring the keystream
-			 * against null returns the keystream. Store that in the appropriate queue */
-			EVP_EncryptUpdate(aesni_ctx, q->keys[0], &outlen, mynull, KQLEN * AES_BLOCK_SIZE);
-
-			/* add the number of blocks creates to the aes counter */
-			ssh_ctr_add(q->ctr, KQLEN * numkq, AES_BLOCK_SIZE);
-			q->qstate = KQDRAINING;
-			pthread_cond_broadcast(&q->cond);
-		}
-		pthread_mutex_unlock(&q->lock);
-	}
-
-	/*
-	 * Normal case is to find empty queues and fill them, skipping over
-	 * queues already filled by other threads and stopping to wait for
-	 * a draining queue to become empty.
-	 *
-	 * Multiple threads may be waiting on a draining queue and awoken
-	 * when empty.  The first thread to wake will mark it as filling,
-	 * others will move on to fill, skip, or wait on the next queue.
-	 */
-	for (qidx = 1;; qidx = (qidx + 1) % numkq) {
-		/* Check if I was cancelled, also checked in cond_wait */
-		pthread_testcancel();
-
-		/* Check if we should exit as well */
-		thread_loop_check_exit(c);
-
-		/* Lock queue and block if its draining */
-		q = &c->q[qidx];
-		pthread_mutex_lock(&q->lock);
-		pthread_cleanup_push(thread_loop_cleanup, &q->lock);
-		while (q->qstate == KQDRAINING || q->qstate == KQINIT) {
-			thread_loop_check_exit(c);
-			pthread_cond_wait(&q->cond, &q->lock);
-		}
-		pthread_cleanup_pop(0);
-
-		/* If filling or full, somebody else got it, skip */
-		if (q->qstate != KQEMPTY) {
-			pthread_mutex_unlock(&q->lock);
+	/* create the context for this thread. It is keyed
+	 * whenever we pick up a queue for a new generation */
+	if ((aesni_ctx = EVP_CIPHER_CTX_new()) == NULL)
+		fatal_f("Could not create cipher context");
+	EVP_EncryptInit_ex(aesni_ctx, type, NULL, NULL, NULL);
+
+	pthread_mutex_lock(&c->lock);
+	for (;;) {
+		while (!c->exit_flag && (q = find_empty_queue(c)) == NULL)
+			pthread_cond_wait(&c->work_cond, &c->lock);
+		if (c->exit_flag)
+			break;
+
+		gen = q->gen;
+		if ((slot = find_slot(c, gen)) == NULL) {
+			/* generation was dropped. Shouldn't happen */
+			q->qstate = KQINIT;
+			q->gen = 0;
 			continue;
 		}
+		if (gen != mygen)
+			memcpy(key, slot->key, sizeof(key));
+		memcpy(ctr, q->ctr, AES_BLOCK_SIZE);
 
 		/*
 		 * Empty, let's fill it.
-		 * Queue lock is relinquished while we do this so others
+		 * The lock is relinquished while we do this so others
 		 * can see that it's being filled.
 		 */
 		q->qstate = KQFILLING;
-		pthread_cond_broadcast(&q->cond);
-		pthread_mutex_unlock(&q->lock);
+		pthread_mutex_unlock(&c->lock);
 
+		if (gen != mygen) {
+			EVP_EncryptInit_ex(aesni_ctx, NULL, NULL, key, NULL);
+			mygen = gen;
+		}
 		/* set the initial counter */
-		EVP_EncryptInit_ex(aesni_ctx, NULL, NULL, NULL, q->ctr);
+		EVP_EncryptInit_ex(aesni_ctx, NULL, NULL, NULL, ctr);
 
-		/* see coresponding block above for useful comments */
+		/* encypher a block sized null string (mynull) with the key. This
+		 * returns the keystream because xoring the keystream
+		 * against null returns the keystream. Store that in the queue */
 		EVP_EncryptUpdate(aesni_ctx, q->keys[0], &outlen, mynull, KQLEN * AES_BLOCK_SIZE);
 
-		/* Re-lock, mark full and signal consumer */
-		pthread_mutex_lock(&q->lock);
-		ssh_ctr_add(q->ctr, KQLEN * numkq, AES_BLOCK_SIZE);
-		q->qstate = KQFULL;
-		pthread_cond_broadcast(&q->cond);
-		pthread_mutex_unlock(&q->lock);
+		/* Re-lock, mark full and signal consumer. If the queue was
+		 * moved to another key while we were filling it then what we
+		 * have is useless and it goes back into the pool */
+		pthread_mutex_lock(&c->lock);
+		if (q->gen == gen) {
+			q->qstate = KQFULL;
+			pthread_cond_broadcast(&c->ready_cond);
+		} else
+			q->qstate = q->gen != 0 ? KQEMPTY : KQINIT;
 	}
+	pthread_mutex_unlock(&c->lock);
 
+	explicit_bzero(key, sizeof(key));
+	EVP_CIPHER_CTX_free(aesni_ctx);
 	return NULL;
 }
 
+/*
+ * Switch the context to the key and counter in c->key and
+ * c->aes_counter. If that key was staged in the inactive bank we
+ * just swap banks, otherwise the inactive bank is pointed at the
+ * new key. Either way the old bank is retired and we wait for the first
+ * queue of the new key. The pregen threads are started on first use.
+ */
+static void
+activate_key(struct ssh_aes_ctr_ctx_mt *c)
+{
+	struct kslot *slot;
+	struct kq *q;
+	pthread_attr_t attr;
+	int i, next = !c->cur, bytes = c->keylen / 8;
+
+	pthread_mutex_lock(&c->lock);
+	slot = &c->slot[next];
+	if (slot->gen != 0 && memcmp(slot->key, c->key, bytes) == 0 &&
+	    memcmp(slot->iv, c->aes_counter, AES_BLOCK_SIZE) == 0) {
+		debug3_f("using staged keystream (%lu)", c->struct_id);
+	} else {
+		slot->gen = ++c->lastgen;
+		memcpy(slot->key, c->key, bytes);
+		memcpy(slot->iv, c->aes_counter, AES_BLOCK_SIZE);
+		reset_bank(c, !c->bank, slot->gen, slot->iv);
+	}
+
+	/* retire the old key */
+	reset_bank(c, c->bank, 0, NULL);
+	explicit_bzero(&c->slot[c->cur], sizeof(c->slot[c->cur]));
+	c->cur = next;
+	c->bank = !c->bank;
+	c->qidx = 0;
+	c->ridx = 0;
+	c->last_roll = monotime_double();
+	c->struct_id = global_struct_id++;
+	pthread_cond_broadcast(&c->work_cond);
+
+	if (!c->running) {
+		/* Start threads */
+#define STACK_SIZE (1024 * 1024)
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, STACK_SIZE);
+		cipher_affinity_prepare();
+		for (i = 0; i < c->nthreads; i++) {
+			if (pthread_create(&c->tid[i], &attr, thread_loop, c) != 0)
+				fatal ("AES-CTR MT Could not create thread in %s", __FUNCTION__);
+			debug ("AES-CTR MT spawned a thread with id %lu in %s (%lu, %d)",
+			       c->tid[i], __FUNCTION__, c->struct_id, i);
+		}
+		pthread_attr_destroy(&attr);
+		c->pid = getpid();
+		c->running = 1;
+	}
+
+	/* wait for the first queue of the new key */
+	q = &c->q[c->bank * c->numkq];
+	while (q->qstate != KQFULL)
+		pthread_cond_wait(&c->ready_cond, &c->lock);
+	q->qstate = KQDRAINING;
+	pthread_mutex_unlock(&c->lock);
+}
+
 /* this is where the data is actually enciphered and deciphered */
 /* this may also benefit from upgrading to the EVP API */
 static int
 ssh_aes_ctr(EVP_CIPHER_CTX *ctx, u_char *dest, const u_char *src,
     size_t len)
 {
-	typedef union {
-#ifdef CIPHER_INT128_OK
-		__uint128_t *u128;
-#endif
-		uint64_t *u64;
-		uint32_t *u32;
-		uint8_t *u8;
-		const uint8_t *cu8;
-		uintptr_t u;
-	} ptrs_t;
-	ptrs_t destp, srcp, bufp;
-	uintptr_t align;
 	struct ssh_aes_ctr_ctx_mt *c;
-	struct kq *q, *oldq;
+	struct kq *q, *bank;
 	int ridx;
-	u_char *buf;
+	size_t nblocks;
+	double now;
 
 	if (len == 0)
 		return 1;
 	if ((c = EVP_CIPHER_CTX_get_app_data(ctx)) == NULL)
 		return 0;
 
-	q = &c->q[c->qidx];
+	bank = &c->q[c->bank * c->numkq];
+	q = &bank[c->qidx];
 	ridx = c->ridx;
 
 	/* src already padded to block multiple */
-	srcp.cu8 = src;
-	destp.u8 = dest;
-	do { /* do until len is 0 */
-		buf = q->keys[ridx];
-		bufp.u8 = buf;
-
-		/* figure out the alignment on the fly */
-#ifdef CIPHER_UNALIGNED_OK
-		align = 0;
-#else
-		align = destp.u | srcp.u | bufp.u;
-#endif
-
-		/* xor the src against the key (buf)
-		 * different systems can do all 16 bytes at once or
-		 * may need to do it in 8 or 4 bytes chunks
-		 * worst case is doing it as a loop */
-#ifdef CIPHER_INT128_OK
-		/* with GCC 13 we have having consistent seg faults
-		 * in this section of code. Since this is a critical
-		 * code path we are removing this until we have a solution
-		 * in place -cjr 02/22/24
-		 * TODO: FIX THIS
-		 */
-		/* if ((align & 0xf) == 0) { */
-		/* 	destp.u128[0] = srcp.u128[0] ^ bufp.u128[0]; */
-		/* } else */
-#endif
-		/* this is causing undefined behaviour in sanitizers
-		 * this is annoying because it's more efficient
-		 * but UB is not something I want to retain */
-		/* 64 bits */
-		/* if ((align & 0x7) == 0) { */
-		/* 	destp.u64[0] = srcp.u64[0] ^ bufp.u64[0]; */
-		/* 	destp.u64[1] = srcp.u64[1] ^ bufp.u64[1]; */
-		/* /\* 32 bits *\/ */
-		/* } else */
-		if ((align & 0x3) == 0) {
-			destp.u32[0] = srcp.u32[0] ^ bufp.u32[0];
-			destp.u32[1] = srcp.u32[1] ^ bufp.u32[1];
-			destp.u32[2] = srcp.u32[2] ^ bufp.u32[2];
-			destp.u32[3] = srcp.u32[3] ^ bufp.u32[3];
-		} else {
-			/*1 byte at a time*/
-			size_t i;
-			for (i = 0; i < AES_BLOCK_SIZE; ++i)
-				dest[i] = src[i] ^ buf[i];
-		}
-
-		/* inc/decrement the pointers by the block size (16)*/
-		destp.u += AES_BLOCK_SIZE;
-		srcp.u += AES_BLOCK_SIZE;
+	while (len >= AES_BLOCK_SIZE) {
+		/* the keystream in a queue is contiguous so we can xor
+		 * everything up to the end of this queue in one go and
+		 * let cipher_xor use the widest vectors the cpu has */
+		nblocks = len / AES_BLOCK_SIZE;
+		if (nblocks > (size_t)(KQLEN - ridx))
+			nblocks = KQLEN - ridx;
+		cipher_xor(dest, src, q->keys[ridx], nblocks * AES_BLOCK_SIZE);
+		dest += nblocks * AES_BLOCK_SIZE;
+		src += nblocks * AES_BLOCK_SIZE;
+		len -= nblocks * AES_BLOCK_SIZE;
 
 		/* Increment read index, switch queues on rollover */
-		if ((ridx = (ridx + 1) % KQLEN) == 0) {
-			oldq = q;
-
-			/* Mark next queue draining, may need to wait */
-			c->qidx = (c->qidx + 1) % numkq;
-			q = &c->q[c->qidx];
-			pthread_mutex_lock(&q->lock);
-			while (q->qstate != KQFULL) {
-				pthread_cond_wait(&q->cond, &q->lock);
-			}
+		if ((ridx = (ridx + nblocks) % KQLEN) == 0) {
+			pthread_mutex_lock(&c->lock);
+
+			/* Mark consumed queue empty and move its counter
+			 * on to the next keystream it will hold */
+			ssh_ctr_add(q->ctr, KQLEN * c->numkq, AES_BLOCK_SIZE);
+			q->qstate = KQEMPTY;
+			c->qidx = (c->qidx + 1) % c->numkq;
+
+			/* see how fast we are going */
+			now = monotime_double();
+			if (now - c->last_roll < KQ_GROW_TIME &&
+			    c->depth < c->numkq)
+				c->depth++;
+			else if (now - c->last_roll > KQ_SHRINK_TIME &&
+			    c->depth > 1)
+				shrink_queues(c);
+			c->last_roll = now;
+
+			/* signal producers. Mark next queue draining,
+			 * may need to wait */
+			pthread_cond_broadcast(&c->work_cond);
+			q = &bank[c->qidx];
+			while (q->qstate != KQFULL)
+				pthread_cond_wait(&c->ready_cond, &c->lock);
 			q->qstate = KQDRAINING;
-			pthread_cond_broadcast(&q->cond);
-			pthread_mutex_unlock(&q->lock);
-
-			/* Mark consumed queue empty and signal producers */
-			pthread_mutex_lock(&oldq->lock);
-			oldq->qstate = KQEMPTY;
-			pthread_cond_broadcast(&oldq->cond);
-			pthread_mutex_unlock(&oldq->lock);
+			pthread_mutex_unlock(&c->lock);
 		}
-	} while (len -= AES_BLOCK_SIZE);
+	}
 	c->ridx = ridx;
 	return 1;
 }
@@ -527,70 +579,51 @@ ssh_aes_ctr_init(EVP_CIPHER_CTX *ctx, const u_char *key, const u_char *iv,
     int enc)
 {
 	struct ssh_aes_ctr_ctx_mt *c;
-	int i;
 
-	char *aes_threads = getenv("SSH_CIPHER_THREADS");
-        if (aes_threads != NULL && strlen(aes_threads) != 0)
-		cipher_threads = atoi(aes_threads);
-	else
-		cipher_threads = 1;
+	/* set up the initial state of c (our cipher stream struct) */
+ 	if ((c = EVP_CIPHER_CTX_get_app_data(ctx)) == NULL) {
+		c = xcalloc(1, sizeof(*c));
+		/* the keystream queues are most of this */
+		cipher_affinity_place(c, sizeof(*c));
 
-	if (cipher_threads < 1)
- 		cipher_threads = 1;
+		/* CipherThreads or SSH_CIPHER_THREADS. 0 means use the default */
+		cipher_threads = cipher_mt_threads();
 
-	if (cipher_threads > MAX_THREADS)
-		cipher_threads = MAX_THREADS;
+		if (cipher_threads < 1)
+			cipher_threads = 1;
 
-	numkq = cipher_threads + 1;
+		if (cipher_threads > MAX_THREADS)
+			cipher_threads = MAX_THREADS;
 
-	if (numkq > MAX_NUMKQ)
-		numkq = MAX_NUMKQ;
+		numkq = cipher_threads + 1;
 
-	debug("Starting %d threads and %d queues\n", cipher_threads, numkq);
+		if (numkq > MAX_NUMKQ)
+			numkq = MAX_NUMKQ;
 
-	/* set up the initial state of c (our cipher stream struct) */
- 	if ((c = EVP_CIPHER_CTX_get_app_data(ctx)) == NULL) {
-		c = xmalloc(sizeof(*c));
-		pthread_rwlock_init(&c->tid_lock, NULL);
-#ifdef __APPLE__
-		pthread_rwlock_init(&c->stop_lock, NULL);
-		c->exit_flag = FALSE;
-#endif /* __APPLE__ */
+		debug("Starting %d threads and %d queues\n", cipher_threads, numkq);
+		c->nthreads = cipher_threads;
+		c->numkq = numkq;
+		c->depth = numkq;
 
+		pthread_mutex_init(&c->lock, NULL);
+		pthread_cond_init(&c->work_cond, NULL);
+		pthread_cond_init(&c->ready_cond, NULL);
 		c->state = HAVE_NONE;
 
-		/* initialize the mutexs and conditions for each lock in our struct */
-		for (i = 0; i < numkq; i++) {
-			pthread_mutex_init(&c->q[i].lock, NULL);
-			pthread_cond_init(&c->q[i].cond, NULL);
-		}
-
 		/* attach our struct to the context */
 		EVP_CIPHER_CTX_set_app_data(ctx, c);
 	}
 
 	/* we are initializing but the current structure already
-	   has an IV and key so we want to kill the existing key data
-	   and start over. This is important when we need to rekey the data stream */
-	if (c->state == (HAVE_KEY | HAVE_IV)) {
-		/* tell the pregen threads to exit */
-		stop_and_join_pregen_threads(c);
-
-#ifdef __APPLE__
-		/* reset the exit flag */
-		c->exit_flag = FALSE;
-#endif /* __APPLE__ */
-
-		/* Start over getting key & iv */
+	   has an IV and key so start over getting them. The threads
+	   keep running on the old key until we have both */
+	if (c->state == (HAVE_KEY | HAVE_IV))
 		c->state = HAVE_NONE;
-	}
 
 	/* set the initial key for this key stream queue */
 	if (key != NULL) {
-		AES_set_encrypt_key(key, EVP_CIPHER_CTX_key_length(ctx) * 8,
-		   &c->aes_key);
-		c->orig_key = key;
 		c->keylen = EVP_CIPHER_CTX_key_length(ctx) * 8;
+		memcpy(c->key, key, c->keylen / 8);
 		c->state |= HAVE_KEY;
 	}
 
@@ -601,47 +634,57 @@ ssh_aes_ctr_init(EVP_CIPHER_CTX *ctx, const u_char *key, const u_char *iv,
 		c->state |= HAVE_IV;
 	}
 
-	if (c->state == (HAVE_KEY | HAVE_IV)) {
-		/* Clear queues */
-		/* set the first key in the key queue to the current counter */
-		memcpy(c->q[0].ctr, c->aes_counter, AES_BLOCK_SIZE);
-		/* indicate that it needs to be initialized */
-		c->q[0].qstate = KQINIT;
-		/* for each of the remaining queues set the first counter to the
-		 * counter and then add the size of the queue to the counter */
-		for (i = 1; i < numkq; i++) {
-			memcpy(c->q[i].ctr, c->aes_counter, AES_BLOCK_SIZE);
-			ssh_ctr_add(c->q[i].ctr, i * KQLEN, AES_BLOCK_SIZE);
-			c->q[i].qstate = KQEMPTY;
-		}
-		c->qidx = 0;
-		c->ridx = 0;
-		c->struct_id = global_struct_id++;
+	if (c->state == (HAVE_KEY | HAVE_IV))
+		activate_key(c);
+	return 1;
+}
 
+/*
+ * CIPHER_MT_STAGE_CTRL hands the next key and iv (concatenated in ptr)
+ * to the pregen threads so they can fill the inactive bank while the
+ * current key is still in use. The following init with the same key
+ * and iv will then find its keystream already waiting.
+ * CIPHER_MT_DEMAND_CTRL is the bulk transfer hint (arg). During one
+ * every queue is kept filled, otherwise we drop to a single queue and
+ * ssh_aes_ctr adds them back if the traffic picks up again.
+ */
+static int
+ssh_aes_ctr_ctrl(EVP_CIPHER_CTX *ctx, int type, int arg, void *ptr)
+{
+	struct ssh_aes_ctr_ctx_mt *c;
+	struct kslot *slot;
+	int bytes;
 
-		/* Start threads */
-#define STACK_SIZE (1024 * 1024)
-		pthread_attr_t attr;
-		pthread_attr_init(&attr);
-		pthread_attr_setstacksize(&attr, STACK_SIZE);
-		for (i = 0; i < cipher_threads; i++) {
-			pthread_rwlock_wrlock(&c->tid_lock);
-			if (pthread_create(&c->tid[i], &attr, thread_loop, c) != 0)
-				fatal ("AES-CTR MT Could not create thread in %s", __FUNCTION__);
-                                /*should die here */
-			else {
-				c->id[i] = i;
-				debug ("AES-CTR MT spawned a thread with id %lu in %s (%lu, %d)",
-				       c->tid[i], __FUNCTION__, c->struct_id, c->id[i]);
-			}
-			pthread_rwlock_unlock(&c->tid_lock);
-		}
-		pthread_mutex_lock(&c->q[0].lock);
-		// wait for all of the threads to be initialized
-		while (c->q[0].qstate == KQINIT)
-			pthread_cond_wait(&c->q[0].cond, &c->q[0].lock);
-		pthread_mutex_unlock(&c->q[0].lock);
+	if (type != CIPHER_MT_STAGE_CTRL && type != CIPHER_MT_DEMAND_CTRL)
+		return -1;
+	if ((c = EVP_CIPHER_CTX_get_app_data(ctx)) == NULL)
+		return 0;
+	if (type == CIPHER_MT_DEMAND_CTRL) {
+		pthread_mutex_lock(&c->lock);
+		if (arg) {
+			c->depth = c->numkq;
+			pthread_cond_broadcast(&c->work_cond);
+		} else
+			shrink_queues(c);
+		pthread_mutex_unlock(&c->lock);
+		return 1;
 	}
+	/* nothing to work ahead of yet */
+	if (!c->running)
+		return 1;
+	bytes = c->keylen / 8;
+	if (arg != bytes + AES_BLOCK_SIZE)
+		return 0;
+
+	pthread_mutex_lock(&c->lock);
+	slot = &c->slot[!c->cur];
+	slot->gen = ++c->lastgen;
+	memcpy(slot->key, ptr, bytes);
+	memcpy(slot->iv, (u_char *)ptr + bytes, AES_BLOCK_SIZE);
+	reset_bank(c, !c->bank, slot->gen, slot->iv);
+	pthread_cond_broadcast(&c->work_cond);
+	pthread_mutex_unlock(&c->lock);
+	debug3_f("staged next key (%lu)", c->struct_id);
 	return 1;
 }
 
@@ -652,9 +695,14 @@ ssh_aes_ctr_cleanup(EVP_CIPHER_CTX *ctx)
 
 	if ((c = EVP_CIPHER_CTX_get_app_data(ctx)) != NULL) {
 		stop_and_join_pregen_threads(c);
+		/* skip the destroy in a forked child, the lock may be held */
+		if (c->pid == 0 || c->pid == getpid()) {
+			pthread_mutex_destroy(&c->lock);
+			pthread_cond_destroy(&c->work_cond);
+			pthread_cond_destroy(&c->ready_cond);
+		}
 
-		memset(c, 0, sizeof(*c));
-		free(c);
+		freezero(c, sizeof(*c));
 		EVP_CIPHER_CTX_set_app_data(ctx, NULL);
 	}
 	return 1;
@@ -669,6 +717,7 @@ evp_aes_ctr_mt(void)
 	EVP_CIPHER_meth_set_iv_length(aes_ctr, AES_BLOCK_SIZE);
 	EVP_CIPHER_meth_set_init(aes_ctr, ssh_aes_ctr_init);
 	EVP_CIPHER_meth_set_cleanup(aes_ctr, ssh_aes_ctr_cleanup);
+	EVP_CIPHER_meth_set_ctrl(aes_ctr, ssh_aes_ctr_ctrl);
 	EVP_CIPHER_meth_set_do_cipher(aes_ctr, ssh_aes_ctr);
 #  ifndef SSH_OLD_EVP
 	EVP_CIPHER_meth_set_flags(aes_ctr, EVP_CIPH_CBC_MODE
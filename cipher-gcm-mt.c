@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2026 The Board of Trustees of Carnegie Mellon University.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT License.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the MIT License for more details.
+ *
+ * You should have received a copy of the MIT License along with this library;
+ * if not, see http://opensource.org/licenses/MIT.
+ *
+ */
+
+/* Parallel sealing and opening of AES-GCM packets.
+ *
+ * Every packet sent with aes*-gcm@openssh.com uses its own nonce, the
+ * fixed part of the IV followed by an invocation counter, so once the
+ * nonce is known the packets don't depend on each other. Instead of
+ * encrypting each packet as it is queued the packet code hands us the
+ * plaintext, already in its final place in the output buffer, along
+ * with its nonce. When the output is about to be written (or the batch
+ * is full) the queued packets are encrypted in place by main and the
+ * workers of the shared cipher pool (see cipher-pool.c). The order on
+ * the wire is the order of the output buffer so nothing has to be put
+ * back together afterwards.
+ *
+ * Incoming packets work the other way around. The lengths aren't
+ * encrypted so the packet code can find every complete packet waiting
+ * in the input buffer and queue them all. They are decrypted and their
+ * tags checked in parallel into an arena of our own, leaving the input
+ * untouched, and handed back one at a time in sequence order.
+ *
+ * The nonces still come from the serial EVP context in cipher.c so it
+ * remains the authority on the IV for rekeys and state export. */
+
+#include "includes.h"
+#ifdef WITH_OPENSSL
+#include "openbsd-compat/openssl-compat.h"
+
+#include <sys/types.h>
+#include <stdarg.h> /* needed for log.h */
+#include <string.h>
+#include <stdio.h>  /* needed for misc.h */
+
+#include <openssl/evp.h>
+
+#include "log.h"
+#include "ssherr.h"
+#include "xmalloc.h"
+#include "misc.h"
+#include "cipher.h"
+#include "cipher-gcm-mt.h"
+#include "cipher-pool.h"
+
+struct gcm_mt_job {
+	size_t off;	/* in the output buffer or, if opening, the arena */
+	const u_char *src; /* ciphertext, only while the batch is opened */
+	u_int len;	/* bytes to en/decrypt, following the aad */
+	u_int aadlen;
+	u_int authlen;
+	int ok;		/* tag verified */
+	u_char iv[GCM_MT_IVLEN];
+};
+
+/* The jobs are only written by main while the pool isn't running them,
+ * apart from ok which belongs to whoever is working on the job */
+struct gcm_mt_ctx {
+	struct gcm_mt_job jobs[CIPHER_POOL_BATCH];
+	int encrypt;
+	u_int njobs;		/* queued */
+	u_int taken;		/* opened packets handed back */
+	u_char *arena;		/* plaintext of opened packets */
+	size_t arena_size;
+	size_t arena_used;
+	u_char *base;		/* buffer of the batch being run */
+	struct cipher_pool *pool;
+	/* key schedules for main and each of the workers */
+	EVP_CIPHER_CTX *evp[CIPHER_POOL_MAX_THREADS + 1];
+};
+
+static EVP_CIPHER_CTX *
+gcm_mt_evp_new(const EVP_CIPHER *type, const u_char *key, u_int keylen,
+    int encrypt)
+{
+	EVP_CIPHER_CTX *evp;
+	int klen;
+
+	if ((evp = EVP_CIPHER_CTX_new()) == NULL)
+		return NULL;
+	if (EVP_CipherInit(evp, type, NULL, NULL, encrypt) == 0)
+		goto fail;
+	klen = EVP_CIPHER_CTX_key_length(evp);
+	if (klen > 0 && keylen != (u_int)klen &&
+	    EVP_CIPHER_CTX_set_key_length(evp, keylen) == 0)
+		goto fail;
+	if (EVP_CipherInit(evp, NULL, key, NULL, -1) == 0)
+		goto fail;
+	return evp;
+ fail:
+	EVP_CIPHER_CTX_free(evp);
+	return NULL;
+}
+
+/* encrypt one packet in place and append its tag */
+static int
+gcm_mt_seal(EVP_CIPHER_CTX *evp, u_char *base, struct gcm_mt_job *job)
+{
+	u_char *cp = base + job->off;
+
+	if (EVP_CipherInit(evp, NULL, NULL, job->iv, -1) == 0)
+		return SSH_ERR_LIBCRYPTO_ERROR;
+	if (job->aadlen && EVP_Cipher(evp, NULL, cp, job->aadlen) < 0)
+		return SSH_ERR_LIBCRYPTO_ERROR;
+	cp += job->aadlen;
+	if (EVP_Cipher(evp, cp, cp, job->len) < 0 ||
+	    EVP_Cipher(evp, NULL, NULL, 0) < 0)
+		return SSH_ERR_LIBCRYPTO_ERROR;
+	if (EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_GCM_GET_TAG, job->authlen,
+	    cp + job->len) <= 0)
+		return SSH_ERR_LIBCRYPTO_ERROR;
+	job->ok = 1;
+	return 0;
+}
+
+/* decrypt one packet into the arena and check its tag. A bad tag
+ * isn't an error here, it is reported when the packet is taken */
+static int
+gcm_mt_open(EVP_CIPHER_CTX *evp, u_char *base, struct gcm_mt_job *job)
+{
+	u_char *cp = base + job->off;
+
+	job->ok = 0;
+	if (EVP_CipherInit(evp, NULL, NULL, job->iv, -1) == 0 ||
+	    EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_GCM_SET_TAG, job->authlen,
+	    (u_char *)job->src + job->aadlen + job->len) <= 0)
+		return SSH_ERR_LIBCRYPTO_ERROR;
+	if (job->aadlen) {
+		if (EVP_Cipher(evp, NULL, job->src, job->aadlen) < 0)
+			return SSH_ERR_LIBCRYPTO_ERROR;
+		memcpy(cp, job->src, job->aadlen);
+	}
+	if (EVP_Cipher(evp, cp + job->aadlen, job->src + job->aadlen,
+	    job->len) < 0)
+		return SSH_ERR_LIBCRYPTO_ERROR;
+	if (EVP_Cipher(evp, NULL, NULL, 0) >= 0)
+		job->ok = 1;
+	return 0;
+}
+
+/* job i of the batch, for the pool */
+static int
+gcm_mt_job(void *arg, int worker, u_int i)
+{
+	struct gcm_mt_ctx *ctx = arg;
+
+	if (ctx->encrypt)
+		return gcm_mt_seal(ctx->evp[worker], ctx->base,
+		    &ctx->jobs[i]);
+	return gcm_mt_open(ctx->evp[worker], ctx->base, &ctx->jobs[i]);
+}
+
+struct gcm_mt_ctx *
+gcm_mt_new(const EVP_CIPHER *type, const u_char *key, u_int keylen,
+    int encrypt)
+{
+	struct gcm_mt_ctx *ctx = xcalloc(1, sizeof(*ctx));
+	int i, nthreads;
+
+	ctx->encrypt = encrypt;
+	ctx->pool = cipher_pool_get();
+	nthreads = cipher_pool_nthreads(ctx->pool);
+	/* every worker gets its own key schedule so we don't have to
+	 * hang on to the key until they are started */
+	for (i = 0; i <= nthreads; i++) {
+		if ((ctx->evp[i] = gcm_mt_evp_new(type, key, keylen,
+		    encrypt)) == NULL)
+			goto fail;
+	}
+	debug2_f("%s: %d workers, %d packets per batch",
+	    encrypt ? "seal" : "open", nthreads, CIPHER_POOL_BATCH);
+	return ctx;
+ fail:
+	gcm_mt_free(ctx);
+	return NULL;
+}
+
+void
+gcm_mt_free(struct gcm_mt_ctx *ctx)
+{
+	int i;
+
+	if (ctx == NULL)
+		return;
+	cipher_pool_put(ctx->pool);
+	for (i = 0; i <= CIPHER_POOL_MAX_THREADS; i++)
+		EVP_CIPHER_CTX_free(ctx->evp[i]);
+	if (ctx->arena != NULL)
+		freezero(ctx->arena, ctx->arena_size);
+	freezero(ctx, sizeof(*ctx));
+}
+
+/* packets queued for sealing or opened and not yet taken */
+u_int
+gcm_mt_pending(const struct gcm_mt_ctx *ctx)
+{
+	return ctx == NULL ? 0 : ctx->njobs - ctx->taken;
+}
+
+/* run every queued job on the workers and main */
+static int
+gcm_mt_run(struct gcm_mt_ctx *ctx, u_char *base)
+{
+	int r;
+
+	ctx->base = base;
+	r = cipher_pool_run(ctx->pool, gcm_mt_job, ctx, ctx->njobs);
+	ctx->base = NULL;
+	return r;
+}
+
+/*
+ * Seal every queued packet. base is the start of the output buffer
+ * the packets were queued in; it may have moved since they were queued
+ * but nothing in front of them may have been consumed.
+ */
+int
+gcm_mt_flush(struct gcm_mt_ctx *ctx, u_char *base)
+{
+	int r;
+
+	if (!ctx->encrypt || ctx->njobs == 0)
+		return 0;
+	r = gcm_mt_run(ctx, base);
+	ctx->njobs = 0;
+	return r;
+}
+
+/*
+ * Queue a packet for sealing. The aad and plaintext are copied to
+ * dest, which has to have room for the tag as well, and encrypted
+ * there by the next gcm_mt_flush(). iv is the nonce for this packet.
+ */
+int
+gcm_mt_enqueue(struct gcm_mt_ctx *ctx, u_char *base, u_char *dest,
+    const u_char *src, u_int len, u_int aadlen, u_int authlen,
+    const u_char *iv)
+{
+	struct gcm_mt_job *job;
+
+	if (!ctx->encrypt || dest < base)
+		return SSH_ERR_INVALID_ARGUMENT;
+	job = &ctx->jobs[ctx->njobs++];
+	job->off = dest - base;
+	job->len = len;
+	job->aadlen = aadlen;
+	job->authlen = authlen;
+	memcpy(job->iv, iv, sizeof(job->iv));
+	if (dest != src)
+		memcpy(dest, src, aadlen + len);
+	if (ctx->njobs == CIPHER_POOL_BATCH)
+		return gcm_mt_flush(ctx, base);
+	return 0;
+}
+
+/*
+ * Queue a received packet for opening. src has the aad, ciphertext and
+ * tag and has to stay put until gcm_mt_open_batch(). Returns
+ * SSH_ERR_NO_BUFFER_SPACE once the batch is full.
+ */
+int
+gcm_mt_open_queue(struct gcm_mt_ctx *ctx, const u_char *src, u_int len,
+    u_int aadlen, u_int authlen, const u_char *iv)
+{
+	struct gcm_mt_job *job;
+	size_t need;
+
+	if (ctx->encrypt || ctx->taken != 0)
+		return SSH_ERR_INVALID_ARGUMENT;
+	if (ctx->njobs == CIPHER_POOL_BATCH)
+		return SSH_ERR_NO_BUFFER_SPACE;
+	need = (size_t)aadlen + len;
+	if (ctx->arena_used + need > ctx->arena_size) {
+		size_t size = MAXIMUM(ctx->arena_used + need,
+		    ctx->arena_size * 2);
+
+		ctx->arena = xrecallocarray(ctx->arena, ctx->arena_size,
+		    size, 1);
+		ctx->arena_size = size;
+	}
+	job = &ctx->jobs[ctx->njobs++];
+	job->off = ctx->arena_used;
+	job->src = src;
+	job->len = len;
+	job->aadlen = aadlen;
+	job->authlen = authlen;
+	job->ok = 0;
+	memcpy(job->iv, iv, sizeof(job->iv));
+	ctx->arena_used += need;
+	return 0;
+}
+
+/* decrypt and verify every queued packet */
+int
+gcm_mt_open_batch(struct gcm_mt_ctx *ctx)
+{
+	u_int i;
+	int r;
+
+	if (ctx->encrypt || ctx->njobs == 0 || ctx->taken != 0)
+		return 0;
+	r = gcm_mt_run(ctx, ctx->arena);
+	for (i = 0; i < ctx->njobs; i++)
+		ctx->jobs[i].src = NULL;
+	return r;
+}
+
+/*
+ * Hand back the next opened packet. It is copied to dest, aad
+ * included, if its tag was good. iv is the nonce the caller expected
+ * it to have, as a check that we are still in step.
+ */
+int
+gcm_mt_open_take(struct gcm_mt_ctx *ctx, u_char *dest, u_int len,
+    u_int aadlen, const u_char *iv)
+{
+	struct gcm_mt_job *job;
+	int r = 0;
+
+	if (ctx->encrypt || ctx->taken >= ctx->njobs)
+		return SSH_ERR_INTERNAL_ERROR;
+	job = &ctx->jobs[ctx->taken++];
+	if (job->len != len || job->aadlen != aadlen ||
+	    memcmp(job->iv, iv, sizeof(job->iv)) != 0)
+		r = SSH_ERR_INTERNAL_ERROR;
+	else if (!job->ok)
+		r = SSH_ERR_MAC_INVALID;
+	else
+		memcpy(dest, ctx->arena + job->off, aadlen + len);
+	explicit_bzero(ctx->arena + job->off, (size_t)job->aadlen + job->len);
+	if (ctx->taken == ctx->njobs || r != 0) {
+		/* nothing after a bad packet is any use */
+		ctx->taken = ctx->njobs = 0;
+		ctx->arena_used = 0;
+	}
+	return r;
+}
+#endif /* WITH_OPENSSL */
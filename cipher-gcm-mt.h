@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2026 The Board of Trustees of Carnegie Mellon University.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT License.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the MIT License for more details.
+ *
+ * You should have received a copy of the MIT License along with this library;
+ * if not, see http://opensource.org/licenses/MIT.
+ *
+ */
+
+#ifndef CIPHER_GCM_MT_H
+#define CIPHER_GCM_MT_H
+
+#include <sys/types.h>
+
+#define GCM_MT_IVLEN	12
+
+struct gcm_mt_ctx; /* defined in cipher-gcm-mt.c */
+
+struct gcm_mt_ctx *gcm_mt_new(const EVP_CIPHER *type, const u_char *key,
+			      u_int keylen, int encrypt);
+
+void   gcm_mt_free(struct gcm_mt_ctx *ctx);
+
+int    gcm_mt_enqueue(struct gcm_mt_ctx *ctx, u_char *base, u_char *dest,
+		      const u_char *src, u_int len, u_int aadlen,
+		      u_int authlen, const u_char *iv);
+
+int    gcm_mt_flush(struct gcm_mt_ctx *ctx, u_char *base);
+
+u_int  gcm_mt_pending(const struct gcm_mt_ctx *ctx);
+
+int    gcm_mt_open_queue(struct gcm_mt_ctx *ctx, const u_char *src,
+			 u_int len, u_int aadlen, u_int authlen,
+			 const u_char *iv);
+
+int    gcm_mt_open_batch(struct gcm_mt_ctx *ctx);
+
+int    gcm_mt_open_take(struct gcm_mt_ctx *ctx, u_char *dest, u_int len,
+			u_int aadlen, const u_char *iv);
+
+#endif /* CIPHER_GCM_MT_H */
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2026 The Board of Trustees of Carnegie Mellon University.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT License.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the MIT License for more details.
+ *
+ * You should have received a copy of the MIT License along with this library;
+ * if not, see http://opensource.org/licenses/MIT.
+ *
+ */
+
+/* The worker pool behind the batched ciphers and MACs.
+ *
+ * AES-GCM (cipher-gcm-mt.c), chacha20-poly1305-mt and the EtM MACs
+ * (mac-mt.c) all queue up a batch of packets that don't depend on each
+ * other and then have them done at once, just before the output is
+ * written or after every complete packet has been read. The pool runs
+ * such a batch: the workers and main take jobs off it until there are
+ * none left and main waits for the last one to finish. What a job is
+ * belongs to the caller, the pool only hands out job numbers.
+ *
+ * There is one pool per process, shared by every context in both
+ * directions, so the batched ciphers and MACs never have more workers
+ * between them than cipher_pool_threads(). Each context holds a
+ * reference and passes its own job function with every batch. The
+ * workers are started the first time a batch is worth sharing and are
+ * kept until the last reference is dropped. */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <unistd.h> /* needed for getpid under C99 */
+#include <stdarg.h> /* needed for log.h */
+#include <string.h>
+#include <stdio.h>  /* needed for misc.h */
+#include <pthread.h>
+
+#include "log.h"
+#include "xmalloc.h"
+#include "misc.h"
+#include "cipher.h"
+#include "cipher-pool.h"
+#include "cipher-affinity.h"
+
+struct cipher_pool_worker {
+	struct cipher_pool *pool;
+	int index;		/* passed to fn, 1 and up */
+	pthread_t tid;
+};
+
+/* lock protects fn, arg, active, next, done, failed and exit_flag */
+struct cipher_pool {
+	cipher_pool_job_fn *fn;	/* of the batch being run */
+	void *arg;
+	u_int refcount;
+	u_int active;		/* jobs in the batch being run */
+	u_int next;		/* next job to hand out */
+	u_int done;		/* jobs finished */
+	int failed;		/* first error of the batch */
+	int nthreads;		/* workers, not counting main */
+	int running;		/* workers have been started */
+	int exit_flag;
+	pid_t pid;		/* process the workers belong to */
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct cipher_pool_worker workers[CIPHER_POOL_MAX_THREADS];
+};
+
+/* the process' pool, see cipher_pool_get() */
+static struct cipher_pool *shared_pool;
+
+int
+cipher_pool_threads(void)
+{
+	long ncores = 1;
+	int threads;
+
+	if ((threads = cipher_mt_threads()) == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+		if ((ncores = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+			ncores = 1;
+#endif
+		threads = (ncores - 2) / 2;
+	}
+	if (threads < 1)
+		threads = 1;
+	return MINIMUM(threads, CIPHER_POOL_MAX_THREADS);
+}
+
+/* take jobs from the active batch until there are none left.
+ * Called and returns with the lock held */
+static void
+cipher_pool_work(struct cipher_pool *pool, int worker)
+{
+	cipher_pool_job_fn *fn = pool->fn;
+	void *arg = pool->arg;
+	u_int job;
+	int r;
+
+	while (pool->next < pool->active) {
+		job = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		r = fn(arg, worker, job);
+		pthread_mutex_lock(&pool->lock);
+		if (r != 0 && pool->failed == 0)
+			pool->failed = r;
+		if (++pool->done == pool->active)
+			pthread_cond_signal(&pool->done_cond);
+	}
+}
+
+static void *
+cipher_pool_thread(void *arg)
+{
+	struct cipher_pool_worker *w = arg;
+	struct cipher_pool *pool = w->pool;
+
+	cipher_affinity_apply();
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->exit_flag && pool->next >= pool->active)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		if (pool->exit_flag)
+			break;
+		cipher_pool_work(pool, w->index);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void
+cipher_pool_start_threads(struct cipher_pool *pool)
+{
+	int i;
+
+	cipher_affinity_prepare();
+	for (i = 0; i < pool->nthreads; i++) {
+		if (pthread_create(&pool->workers[i].tid, NULL,
+		    cipher_pool_thread, &pool->workers[i]) != 0) {
+			debug_f("could only start %d of %d workers", i,
+			    pool->nthreads);
+			break;
+		}
+	}
+	pool->nthreads = i;
+	pool->pid = getpid();
+	pool->running = 1;
+	debug2_f("started %d workers", pool->nthreads);
+}
+
+/* The size is fixed when the pool is created, so the caller has to be
+ * ready for worker numbers up to cipher_pool_nthreads() of what it
+ * gets rather than what cipher_pool_threads() says now */
+struct cipher_pool *
+cipher_pool_get(void)
+{
+	struct cipher_pool *pool;
+	int i;
+
+	if ((pool = shared_pool) != NULL) {
+		pool->refcount++;
+		return pool;
+	}
+	pool = xcalloc(1, sizeof(*pool));
+	pool->refcount = 1;
+	pool->nthreads = cipher_pool_threads();
+	for (i = 0; i < pool->nthreads; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].index = i + 1;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	return (shared_pool = pool);
+}
+
+/* drop a reference, stopping the workers with the last one */
+void
+cipher_pool_put(struct cipher_pool *pool)
+{
+	int i;
+
+	if (pool == NULL || --pool->refcount > 0)
+		return;
+	if (pool == shared_pool)
+		shared_pool = NULL;
+	/* a fork doesn't have the workers, see cipher-ctr-mt-functions.c */
+	if (pool->running && pool->pid == getpid()) {
+		pthread_mutex_lock(&pool->lock);
+		pool->exit_flag = 1;
+		pthread_cond_broadcast(&pool->work_cond);
+		pthread_mutex_unlock(&pool->lock);
+		for (i = 0; i < pool->nthreads; i++)
+			pthread_join(pool->workers[i].tid, NULL);
+	}
+	if (!pool->running || pool->pid == getpid()) {
+		pthread_mutex_destroy(&pool->lock);
+		pthread_cond_destroy(&pool->work_cond);
+		pthread_cond_destroy(&pool->done_cond);
+	}
+	freezero(pool, sizeof(*pool));
+}
+
+int
+cipher_pool_nthreads(const struct cipher_pool *pool)
+{
+	return pool->nthreads;
+}
+
+/* run fn for jobs 0 to njobs - 1 on the workers and main. Returns the
+ * first error a job returned, if any */
+int
+cipher_pool_run(struct cipher_pool *pool, cipher_pool_job_fn *fn,
+    void *arg, u_int njobs)
+{
+	u_int i;
+	int r = 0;
+
+	if (njobs == 0)
+		return 0;
+	/* not worth waking anyone for a single packet. If we are
+	 * a fork the workers are gone so do it all ourselves */
+	if (njobs == 1 || pool->nthreads == 0 ||
+	    (pool->running && pool->pid != getpid()))
+		goto serial;
+	if (!pool->running)
+		cipher_pool_start_threads(pool);
+
+	pthread_mutex_lock(&pool->lock);
+	/* the workers are busy with a batch from another thread */
+	if (pool->active != 0) {
+		pthread_mutex_unlock(&pool->lock);
+		goto serial;
+	}
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->next = pool->done = 0;
+	pool->failed = 0;
+	pool->active = njobs;
+	pthread_cond_broadcast(&pool->work_cond);
+	cipher_pool_work(pool, 0);
+	while (pool->done < pool->active)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pool->active = pool->next = 0;
+	pool->fn = NULL;
+	pool->arg = NULL;
+	r = pool->failed;
+	pthread_mutex_unlock(&pool->lock);
+	return r;
+ serial:
+	for (i = 0; i < njobs && r == 0; i++)
+		r = fn(arg, 0, i);
+	return r;
+}
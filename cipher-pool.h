@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2026 The Board of Trustees of Carnegie Mellon University.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT License.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the MIT License for more details.
+ *
+ * You should have received a copy of the MIT License along with this library;
+ * if not, see http://opensource.org/licenses/MIT.
+ *
+ */
+
+#ifndef CIPHER_POOL_H
+#define CIPHER_POOL_H
+
+#include <sys/types.h>
+
+/* packets per batch. A batch is run early if it fills up before the
+ * output is written */
+#define CIPHER_POOL_BATCH 64
+
+/* most workers in a pool, not counting main */
+#define CIPHER_POOL_MAX_THREADS 16
+
+struct cipher_pool; /* defined in cipher-pool.c */
+
+/* does job number job of the batch being run. worker is 0 for main and
+ * 1 to cipher_pool_nthreads() otherwise, so the caller can give each of
+ * them its own key schedule or MAC context. Returns 0 or an ssherr.h
+ * code, which fails the whole batch */
+typedef int cipher_pool_job_fn(void *arg, int worker, u_int job);
+
+/* the number of workers to use: CipherThreads (or SSH_CIPHER_THREADS)
+ * if it is set and otherwise half of the cores main and the other
+ * direction aren't using, no more than CIPHER_POOL_MAX_THREADS */
+int	 cipher_pool_threads(void);
+
+/* a reference to the process' pool, created with cipher_pool_threads()
+ * workers if nobody holds one */
+struct cipher_pool *cipher_pool_get(void);
+
+void	 cipher_pool_put(struct cipher_pool *pool);
+
+int	 cipher_pool_nthreads(const struct cipher_pool *pool);
+
+int	 cipher_pool_run(struct cipher_pool *pool, cipher_pool_job_fn *fn,
+	     void *arg, u_int njobs);
+
+#endif /* CIPHER_POOL_H */
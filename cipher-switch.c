@@ -27,6 +27,7 @@
 #include "cipher.h"
 #include "log.h"
 #include "packet.h"
+#include "ssherr.h"
 
 
 /* if we are using a parallel cipher there can be issues in either
@@ -34,8 +35,10 @@
  * threads get lost and the application hangs. So what we do is
  * test if either the send or receive context cipher name
  * matches the known available parallel ciphers. If it does
- * then we force a rekey which automatically loads the parallel
- * cipher. */
+ * then the packet layer rebuilds both contexts as threaded ones
+ * from the current key, IV, and sequence numbers. The packets on
+ * the wire don't change so there is no need for a key exchange and
+ * the other side can switch (or not) on its own schedule. */
 
 void
 cipher_switch(struct ssh *ssh) {
@@ -45,29 +48,23 @@ cipher_switch(struct ssh *ssh) {
 	const void *recv_cc = ssh_packet_get_receive_context(ssh);
 	const char *send = cipher_ctx_name(send_cc);
 	const char *recv = cipher_ctx_name(recv_cc);
+	int r;
 
 	debug_f("Send: %s Recv: %s", send, recv);
-	
-	/* if the name of the cipher matches then we set the context
-	 * to authenticated (it likely already is though) and then
-	 * force the rekey. Either side can do this. One downside of
-	 * this method is that both sides can request a rekey so you
-	 * can end up duplicating work. This is annoying but the
-	 * performance gains make it worthwhile. Also I
-	 * use strstr here because strcmp would require a 6 part
+
+	/* I use strstr here because strcmp would require a 6 part
 	 * if statement */
-	if (strstr(send, "ctr") || strstr(recv, "ctr")) {
+	if (strstr(send, "ctr") || strstr(recv, "ctr"))
 		debug("Serial to parallel AES-CTR cipher swap");
-		/* cipher_reset_multithreaded(); */
-		ssh_packet_set_authenticated(ssh);
-		packet_request_rekeying();
-	}
-	/* do the same for multithreaded chacha20 but with strcmp */
-	if ((strcmp(send, "chacha20-poly1305@openssh.com") == 0) ||
-	    (strcmp(recv, "chacha20-poly1305@openssh.com") == 0)) {
+	else if ((strcmp(send, "chacha20-poly1305@openssh.com") == 0) ||
+	    (strcmp(recv, "chacha20-poly1305@openssh.com") == 0))
 		debug("Serial to parallel Chacha20-poly1305 cipher swap");
-		ssh_packet_set_authenticated(ssh);
-		packet_request_rekeying();
-	}
+	/* AES-GCM packets are sealed in parallel batches */
+	else if (strstr(send, "gcm") || strstr(recv, "gcm"))
+		debug("Serial to parallel AES-GCM cipher swap");
+	else
+		return;
+	if ((r = ssh_packet_start_threads(ssh)) != 0)
+		fatal_fr(r, "parallel cipher swap");
 #endif
 }
@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2026 The Board of Trustees of Carnegie Mellon University.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT License.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the MIT License for more details.
+ *
+ * You should have received a copy of the MIT License along with this library;
+ * if not, see http://opensource.org/licenses/MIT.
+ *
+ */
+
+/* Applying pregenerated keystream to the data.
+ *
+ * The threaded ciphers generate their keystream ahead of time on worker
+ * threads, which leaves XORing it against the packets as most of what
+ * the main thread does. Here we have a plain C version that any
+ * compiler can vectorise and explicit SSE2, AVX2, AVX-512 and NEON
+ * versions. The widest one the CPU supports is picked the first time
+ * cipher_xor() is called. All of them use unaligned loads and stores
+ * so the callers don't have to care about alignment.
+ *
+ * regress/unittests/cipher compares the kernels against each other
+ * and can benchmark them (test_cipher -b). */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cipher-xor.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+# define XOR_X86
+# include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+# define XOR_NEON
+# include <arm_neon.h>
+#endif
+
+typedef void (*xor_fn)(u_char *, const u_char *, const u_char *, size_t);
+
+/* memcpy is how we get unaligned access without undefined behaviour.
+ * The compiler turns these into plain loads and stores */
+static void
+xor_generic(u_char *dest, const u_char *src, const u_char *ks, size_t len)
+{
+	uint64_t a, b;
+	size_t i = 0;
+
+	for (; i + sizeof(a) <= len; i += sizeof(a)) {
+		memcpy(&a, src + i, sizeof(a));
+		memcpy(&b, ks + i, sizeof(b));
+		a ^= b;
+		memcpy(dest + i, &a, sizeof(a));
+	}
+	for (; i < len; i++)
+		dest[i] = src[i] ^ ks[i];
+}
+
+#ifdef XOR_X86
+__attribute__((target("sse2")))
+static void
+xor_sse2(u_char *dest, const u_char *src, const u_char *ks, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 64 <= len; i += 64) {
+		__m128i a0 = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i a1 = _mm_loadu_si128((const __m128i *)(src + i + 16));
+		__m128i a2 = _mm_loadu_si128((const __m128i *)(src + i + 32));
+		__m128i a3 = _mm_loadu_si128((const __m128i *)(src + i + 48));
+		a0 = _mm_xor_si128(a0,
+		    _mm_loadu_si128((const __m128i *)(ks + i)));
+		a1 = _mm_xor_si128(a1,
+		    _mm_loadu_si128((const __m128i *)(ks + i + 16)));
+		a2 = _mm_xor_si128(a2,
+		    _mm_loadu_si128((const __m128i *)(ks + i + 32)));
+		a3 = _mm_xor_si128(a3,
+		    _mm_loadu_si128((const __m128i *)(ks + i + 48)));
+		_mm_storeu_si128((__m128i *)(dest + i), a0);
+		_mm_storeu_si128((__m128i *)(dest + i + 16), a1);
+		_mm_storeu_si128((__m128i *)(dest + i + 32), a2);
+		_mm_storeu_si128((__m128i *)(dest + i + 48), a3);
+	}
+	for (; i + 16 <= len; i += 16)
+		_mm_storeu_si128((__m128i *)(dest + i), _mm_xor_si128(
+		    _mm_loadu_si128((const __m128i *)(src + i)),
+		    _mm_loadu_si128((const __m128i *)(ks + i))));
+	xor_generic(dest + i, src + i, ks + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void
+xor_avx2(u_char *dest, const u_char *src, const u_char *ks, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 128 <= len; i += 128) {
+		__m256i a0 = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i a1 = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+		__m256i a2 = _mm256_loadu_si256((const __m256i *)(src + i + 64));
+		__m256i a3 = _mm256_loadu_si256((const __m256i *)(src + i + 96));
+		a0 = _mm256_xor_si256(a0,
+		    _mm256_loadu_si256((const __m256i *)(ks + i)));
+		a1 = _mm256_xor_si256(a1,
+		    _mm256_loadu_si256((const __m256i *)(ks + i + 32)));
+		a2 = _mm256_xor_si256(a2,
+		    _mm256_loadu_si256((const __m256i *)(ks + i + 64)));
+		a3 = _mm256_xor_si256(a3,
+		    _mm256_loadu_si256((const __m256i *)(ks + i + 96)));
+		_mm256_storeu_si256((__m256i *)(dest + i), a0);
+		_mm256_storeu_si256((__m256i *)(dest + i + 32), a1);
+		_mm256_storeu_si256((__m256i *)(dest + i + 64), a2);
+		_mm256_storeu_si256((__m256i *)(dest + i + 96), a3);
+	}
+	for (; i + 32 <= len; i += 32)
+		_mm256_storeu_si256((__m256i *)(dest + i), _mm256_xor_si256(
+		    _mm256_loadu_si256((const __m256i *)(src + i)),
+		    _mm256_loadu_si256((const __m256i *)(ks + i))));
+	xor_sse2(dest + i, src + i, ks + i, len - i);
+}
+
+__attribute__((target("avx512f")))
+static void
+xor_avx512(u_char *dest, const u_char *src, const u_char *ks, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 256 <= len; i += 256) {
+		__m512i a0 = _mm512_loadu_si512((const void *)(src + i));
+		__m512i a1 = _mm512_loadu_si512((const void *)(src + i + 64));
+		__m512i a2 = _mm512_loadu_si512((const void *)(src + i + 128));
+		__m512i a3 = _mm512_loadu_si512((const void *)(src + i + 192));
+		a0 = _mm512_xor_si512(a0,
+		    _mm512_loadu_si512((const void *)(ks + i)));
+		a1 = _mm512_xor_si512(a1,
+		    _mm512_loadu_si512((const void *)(ks + i + 64)));
+		a2 = _mm512_xor_si512(a2,
+		    _mm512_loadu_si512((const void *)(ks + i + 128)));
+		a3 = _mm512_xor_si512(a3,
+		    _mm512_loadu_si512((const void *)(ks + i + 192)));
+		_mm512_storeu_si512((void *)(dest + i), a0);
+		_mm512_storeu_si512((void *)(dest + i + 64), a1);
+		_mm512_storeu_si512((void *)(dest + i + 128), a2);
+		_mm512_storeu_si512((void *)(dest + i + 192), a3);
+	}
+	for (; i + 64 <= len; i += 64)
+		_mm512_storeu_si512((void *)(dest + i), _mm512_xor_si512(
+		    _mm512_loadu_si512((const void *)(src + i)),
+		    _mm512_loadu_si512((const void *)(ks + i))));
+	xor_sse2(dest + i, src + i, ks + i, len - i);
+}
+#endif /* XOR_X86 */
+
+#ifdef XOR_NEON
+static void
+xor_neon(u_char *dest, const u_char *src, const u_char *ks, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 64 <= len; i += 64) {
+		uint8x16_t a0 = vld1q_u8(src + i);
+		uint8x16_t a1 = vld1q_u8(src + i + 16);
+		uint8x16_t a2 = vld1q_u8(src + i + 32);
+		uint8x16_t a3 = vld1q_u8(src + i + 48);
+		vst1q_u8(dest + i, veorq_u8(a0, vld1q_u8(ks + i)));
+		vst1q_u8(dest + i + 16, veorq_u8(a1, vld1q_u8(ks + i + 16)));
+		vst1q_u8(dest + i + 32, veorq_u8(a2, vld1q_u8(ks + i + 32)));
+		vst1q_u8(dest + i + 48, veorq_u8(a3, vld1q_u8(ks + i + 48)));
+	}
+	for (; i + 16 <= len; i += 16)
+		vst1q_u8(dest + i, veorq_u8(vld1q_u8(src + i),
+		    vld1q_u8(ks + i)));
+	xor_generic(dest + i, src + i, ks + i, len - i);
+}
+#endif /* XOR_NEON */
+
+static int
+xor_always(void)
+{
+	return 1;
+}
+
+#ifdef XOR_X86
+static int
+xor_have_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+static int
+xor_have_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+static int
+xor_have_avx512(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f");
+}
+#endif
+
+/* widest first */
+static const struct {
+	const char *name;
+	xor_fn fn;
+	int (*usable)(void);
+} kernels[] = {
+#ifdef XOR_X86
+	{ "avx512", xor_avx512, xor_have_avx512 },
+	{ "avx2", xor_avx2, xor_have_avx2 },
+	{ "sse2", xor_sse2, xor_have_sse2 },
+#endif
+#ifdef XOR_NEON
+	{ "neon", xor_neon, xor_always },
+#endif
+	{ "generic", xor_generic, xor_always },
+};
+#define NKERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static void xor_resolve(u_char *, const u_char *, const u_char *, size_t);
+
+/* the threads can race to resolve this but they all store the same
+ * thing */
+static xor_fn xor_impl = xor_resolve;
+static const char *xor_impl_name;
+
+static void
+xor_pick(void)
+{
+	size_t i;
+
+	for (i = 0; i < NKERNELS; i++) {
+		if (kernels[i].usable()) {
+			xor_impl_name = kernels[i].name;
+			xor_impl = kernels[i].fn;
+			return;
+		}
+	}
+}
+
+static void
+xor_resolve(u_char *dest, const u_char *src, const u_char *ks, size_t len)
+{
+	xor_pick();
+	xor_impl(dest, src, ks, len);
+}
+
+void
+cipher_xor(u_char *dest, const u_char *src, const u_char *keystream,
+    size_t len)
+{
+	xor_impl(dest, src, keystream, len);
+}
+
+const char *
+cipher_xor_name(void)
+{
+	if (xor_impl_name == NULL)
+		xor_pick();
+	return xor_impl_name;
+}
+
+int
+cipher_xor_select(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < NKERNELS; i++) {
+		if (strcmp(kernels[i].name, name) != 0)
+			continue;
+		if (!kernels[i].usable())
+			return -1;
+		xor_impl_name = kernels[i].name;
+		xor_impl = kernels[i].fn;
+		return 0;
+	}
+	return -1;
+}
+
+const char * const *
+cipher_xor_kernels(void)
+{
+	static const char *names[NKERNELS + 1];
+	size_t i;
+
+	for (i = 0; i < NKERNELS; i++)
+		names[i] = kernels[i].name;
+	names[i] = NULL;
+	return names;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2026 The Board of Trustees of Carnegie Mellon University.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT License.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the MIT License for more details.
+ *
+ * You should have received a copy of the MIT License along with this library;
+ * if not, see http://opensource.org/licenses/MIT.
+ *
+ */
+
+#ifndef CIPHER_XOR_H
+#define CIPHER_XOR_H
+
+#include <sys/types.h>
+
+/* dest = src ^ keystream for len bytes. None of the pointers need to
+ * be aligned and dest may be src */
+void	 cipher_xor(u_char *dest, const u_char *src, const u_char *keystream,
+    size_t len);
+
+/* the kernel cipher_xor() uses */
+const char *cipher_xor_name(void);
+
+/* use the named kernel. Returns -1 if it isn't available on this CPU */
+int	 cipher_xor_select(const char *name);
+
+/* every kernel we were built with, NULL terminated */
+const char * const *cipher_xor_kernels(void);
+
+#endif /* CIPHER_XOR_H */
@@ -38,12 +38,20 @@
 #include "includes.h"
 
 #include <sys/types.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
+#include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include "cipher.h"
+#include "cipher-gcm-mt.h"
 #include "misc.h"
 #include "sshbuf.h"
 #include "ssherr.h"
@@ -72,9 +80,12 @@ struct sshcipher_ctx {
 	int	encrypt;
 	EVP_CIPHER_CTX *evp;
 	const EVP_CIPHER *meth_ptr; /*used to free memory in aes_ctr_mt */
+	int	threaded; /* evp is an aes_ctr_mt context */
 	struct chachapoly_ctx *cp_ctx;
 #ifdef WITH_OPENSSL
 	struct chachapoly_ctx_mt *cp_ctx_mt;
+	struct gcm_mt_ctx *gcm_mt; /* parallel sealing/opening for aes-gcm */
+	u_char gcm_iv[GCM_MT_IVLEN]; /* nonce of the next packet to open */
 #endif
 	struct aesctr_ctx ac_ctx; /* XXX union with evp? */
 	const struct sshcipher *cipher;
@@ -133,6 +144,17 @@ static struct sshcipher ciphers[] = {
 
 /*--*/
 
+/* Runtime tunables for the parallel ciphers. These are set from
+ * the CipherThreads and CipherStreams options. A value of 0 means
+ * the option wasn't set and we fall back to the environment and then
+ * to whatever the cipher itself thinks is best */
+static int cipher_mt_threads_cfg = 0;
+static int cipher_mt_streams_cfg = 0;
+/* biggest packet the peer agreed to, 0 for the default */
+static u_int cipher_mt_max_packet_cfg = 0;
+
+/*--*/
+
 /* Returns a comma-separated list of supported ciphers. */
 char *
 cipher_alg_list(char sep, int auth_only)
@@ -172,6 +194,89 @@ cipher_ctx_name(const struct sshcipher_ctx *cc)
         return cc->cipher->name;
 }
 
+/* called by the client and server once the config has been read */
+void
+cipher_set_mt_tunables(int threads, int streams)
+{
+	cipher_mt_threads_cfg = threads > 0 ? threads : 0;
+	cipher_mt_streams_cfg = streams > 0 ? streams : 0;
+	debug_f("threads %d streams %d", cipher_mt_threads_cfg,
+	    cipher_mt_streams_cfg);
+}
+
+/* read a positive integer tunable from the environment.
+ * returns 0 if it isn't set or doesn't make sense */
+static int
+cipher_mt_getenv(const char *name)
+{
+	const char *val, *errstr = NULL;
+	int ret;
+
+	if ((val = getenv(name)) == NULL || *val == '\0')
+		return 0;
+	ret = (int)strtonum(val, 1, INT_MAX, &errstr);
+	if (errstr != NULL) {
+		debug_f("ignoring %s=%s: %s", name, val, errstr);
+		return 0;
+	}
+	return ret;
+}
+
+/* number of worker threads the parallel ciphers should use.
+ * The config option wins, then SSH_CIPHER_THREADS. 0 means auto */
+int
+cipher_mt_threads(void)
+{
+	if (cipher_mt_threads_cfg > 0)
+		return cipher_mt_threads_cfg;
+	return cipher_mt_getenv("SSH_CIPHER_THREADS");
+}
+
+/* number of packets per keystream batch in the parallel chacha20
+ * cipher. Same precedence as above with SSH_CIPHER_STREAMS */
+int
+cipher_mt_streams(void)
+{
+	if (cipher_mt_streams_cfg > 0)
+		return cipher_mt_streams_cfg;
+	return cipher_mt_getenv("SSH_CIPHER_STREAMS");
+}
+
+/* called by the packet layer when an HPN peer agrees to packets bigger
+ * than SSH_IOBUFSZ so the parallel ciphers can size their keystreams */
+void
+cipher_set_mt_max_packet(u_int len)
+{
+	cipher_mt_max_packet_cfg = len;
+}
+
+/* the biggest packet the parallel ciphers need to handle in one go */
+u_int
+cipher_mt_max_packet(void)
+{
+	return MAXIMUM(cipher_mt_max_packet_cfg, SSH_IOBUFSZ);
+}
+
+/* hand the pages of a keystream buffer we won't read again back to the
+ * system. Only whole pages inside the buffer are released and they
+ * read as zeros until the workers write to them again */
+void
+cipher_mt_release(void *p, size_t len)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_DONTNEED)
+	uintptr_t start, end;
+	long pagesz;
+
+	if ((pagesz = sysconf(_SC_PAGESIZE)) <= 0)
+		return;
+	start = ((uintptr_t)p + pagesz - 1) & ~((uintptr_t)pagesz - 1);
+	end = ((uintptr_t)p + len) & ~((uintptr_t)pagesz - 1);
+	if (end > start &&
+	    madvise((void *)start, end - start, MADV_DONTNEED) != 0)
+		debug_f("madvise: %s", strerror(errno));
+#endif
+}
+
 u_int
 cipher_blocksize(const struct sshcipher *c)
 {
@@ -384,7 +489,9 @@ cipher_init(struct sshcipher_ctx **ccp, const struct sshcipher *cipher,
 					      OSSL_provider_init) != 1) {
 			fatal("Failed to add HPNSSH provider for AES-CTR");
 		}
-		aes_mt_provider = OSSL_PROVIDER_load(aes_lib, "hpnssh");
+		/* keep the fallback to the default provider in case this
+		 * is the first thing to use libcrypto */
+		aes_mt_provider = OSSL_PROVIDER_try_load(aes_lib, "hpnssh", 1);
 
 		if (aes_mt_provider != NULL) {
 			/* use the previous key length to determine which cipher to load */
@@ -414,6 +521,7 @@ cipher_init(struct sshcipher_ctx **ccp, const struct sshcipher *cipher,
 		 * works for now. TODO: This. cjr 02.22.2023 */
 		cc->meth_ptr = type;
 #endif /* WITH_OPENSSL3 */
+		cc->threaded = 1;
 	} /* if (strstr()) */
 	if (EVP_CipherInit(cc->evp, type, NULL, (u_char *)iv,
 	    (do_encrypt == CIPHER_ENCRYPT)) == 0) {
@@ -437,6 +545,14 @@ cipher_init(struct sshcipher_ctx **ccp, const struct sshcipher *cipher,
 		ret = SSH_ERR_LIBCRYPTO_ERROR;
 		goto out;
 	}
+	/* post-auth aes-gcm packets are sealed and opened in batches by
+	 * cipher-gcm-mt.c. The evp above still hands out the nonces */
+	if (cipher_authlen(cipher) && enable_threads &&
+	    (cc->gcm_mt = gcm_mt_new(type, key, keylen,
+	    do_encrypt == CIPHER_ENCRYPT)) == NULL) {
+		ret = SSH_ERR_LIBCRYPTO_ERROR;
+		goto out;
+	}
 	ret = 0;
 #endif /* WITH_OPENSSL */
  out:
@@ -454,6 +570,111 @@ cipher_init(struct sshcipher_ctx **ccp, const struct sshcipher *cipher,
 	return ret;
 }
 
+/*
+ * Rekey an existing AES-CTR-MT context in place. The pregen threads
+ * are kept and, if the key was staged with cipher_stage_keys(), the
+ * keystream for it is already waiting. Returns SSH_ERR_INVALID_ARGUMENT
+ * if the context can't be reused and the caller should cipher_init() a
+ * new one instead.
+ */
+int
+cipher_reinit(struct sshcipher_ctx *cc, const struct sshcipher *cipher,
+    const u_char *key, u_int keylen, const u_char *iv, u_int ivlen,
+    int enable_threads)
+{
+#ifdef WITH_OPENSSL
+	if (cc == NULL || !cc->threaded || !enable_threads ||
+	    cc->cipher != cipher || keylen < cipher->key_len ||
+	    iv == NULL || ivlen < cipher_ivlen(cipher))
+		return SSH_ERR_INVALID_ARGUMENT;
+	if (EVP_CipherInit(cc->evp, NULL, key, iv, -1) == 0)
+		return SSH_ERR_LIBCRYPTO_ERROR;
+	return 0;
+#else
+	return SSH_ERR_INVALID_ARGUMENT;
+#endif
+}
+
+/*
+ * Let a running AES-CTR-MT context start generating the keystream
+ * for the next key while the current one is still in use. This is
+ * only a hint; contexts that can't use it ignore it.
+ */
+int
+cipher_stage_keys(struct sshcipher_ctx *cc, const struct sshcipher *cipher,
+    const u_char *key, u_int keylen, const u_char *iv, u_int ivlen)
+{
+#ifdef WITH_OPENSSL
+	u_char keyiv[64];
+	size_t len;
+	int r = 0;
+#ifdef WITH_OPENSSL3
+	OSSL_PARAM params[2];
+#endif
+
+	if (cc == NULL || !cc->threaded || cc->cipher != cipher ||
+	    key == NULL || iv == NULL)
+		return 0;
+	if (keylen < cipher->key_len || ivlen < cipher_ivlen(cipher) ||
+	    cipher->key_len + cipher_ivlen(cipher) > sizeof(keyiv))
+		return SSH_ERR_INVALID_ARGUMENT;
+	len = cipher->key_len + cipher_ivlen(cipher);
+	memcpy(keyiv, key, cipher->key_len);
+	memcpy(keyiv + cipher->key_len, iv, cipher_ivlen(cipher));
+#ifdef WITH_OPENSSL3
+	params[0] = OSSL_PARAM_construct_octet_string(CIPHER_MT_STAGE_PARAM,
+	    keyiv, len);
+	params[1] = OSSL_PARAM_construct_end();
+	if (EVP_CIPHER_CTX_set_params(cc->evp, params) != 1)
+		r = SSH_ERR_LIBCRYPTO_ERROR;
+#else
+	if (EVP_CIPHER_CTX_ctrl(cc->evp, CIPHER_MT_STAGE_CTRL, len,
+	    keyiv) <= 0)
+		r = SSH_ERR_LIBCRYPTO_ERROR;
+#endif
+	explicit_bzero(keyiv, sizeof(keyiv));
+	return r;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Tell the threaded ciphers whether a bulk transfer is under way. If
+ * not they shrink their keystream buffers to the minimum and park
+ * their workers until the traffic shows they need more. Like
+ * cipher_stage_keys() this is only a hint.
+ */
+int
+cipher_set_demand(struct sshcipher_ctx *cc, int bulk)
+{
+#ifdef WITH_OPENSSL
+#ifdef WITH_OPENSSL3
+	OSSL_PARAM params[2];
+#endif
+
+	if (cc == NULL)
+		return 0;
+	if (cc->cp_ctx_mt != NULL) {
+		chachapoly_set_demand_mt(cc->cp_ctx_mt, bulk);
+		return 0;
+	}
+	if (!cc->threaded)
+		return 0;
+#ifdef WITH_OPENSSL3
+	params[0] = OSSL_PARAM_construct_int(CIPHER_MT_DEMAND_PARAM, &bulk);
+	params[1] = OSSL_PARAM_construct_end();
+	if (EVP_CIPHER_CTX_set_params(cc->evp, params) != 1)
+		return SSH_ERR_LIBCRYPTO_ERROR;
+#else
+	if (EVP_CIPHER_CTX_ctrl(cc->evp, CIPHER_MT_DEMAND_CTRL, bulk,
+	    NULL) <= 0)
+		return SSH_ERR_LIBCRYPTO_ERROR;
+#endif
+#endif
+	return 0;
+}
+
 /*
  * cipher_crypt() operates as following:
  * Copy 'aadlen' bytes (without en/decryption) from 'src' to 'dest'.
@@ -532,6 +753,173 @@ cipher_crypt(struct sshcipher_ctx *cc, u_int seqnr, u_char *dest,
 #endif
 }
 
+/*
+ * Like cipher_crypt() for contexts that can seal packets in batches
+ * (see cipher_can_defer()). The packet is copied to 'dest', which lies
+ * in the buffer starting at 'base', and is encrypted there, with its tag
+ * appended, by a later cipher_crypt_flush(). Packets are sealed in the
+ * order they were queued.
+ */
+int
+cipher_crypt_defer(struct sshcipher_ctx *cc, u_int seqnr, u_char *base,
+    u_char *dest, const u_char *src, u_int len, u_int aadlen, u_int authlen)
+{
+#ifdef WITH_OPENSSL
+	u_char iv[GCM_MT_IVLEN];
+
+	if (cc->cp_ctx_mt != NULL && cc->encrypt)
+		return chachapoly_seal_queue_mt(cc->cp_ctx_mt, seqnr, base,
+		    dest, src, len, aadlen, authlen);
+	if (cc->gcm_mt == NULL || !cc->encrypt ||
+	    authlen != cipher_authlen(cc->cipher) ||
+	    len % cc->cipher->block_size)
+		return SSH_ERR_INVALID_ARGUMENT;
+	/* the nonce for this packet, same as cipher_crypt() would use */
+	if (EVP_CIPHER_CTX_ctrl(cc->evp, EVP_CTRL_GCM_IV_GEN,
+	    sizeof(iv), iv) <= 0)
+		return SSH_ERR_LIBCRYPTO_ERROR;
+	return gcm_mt_enqueue(cc->gcm_mt, base, dest, src, len, aadlen,
+	    authlen, iv);
+#else
+	return SSH_ERR_INVALID_ARGUMENT;
+#endif
+}
+
+/*
+ * Seal the packets queued with cipher_crypt_defer(). 'base' is the
+ * current start of the buffer they were queued in.
+ */
+int
+cipher_crypt_flush(struct sshcipher_ctx *cc, u_char *base)
+{
+#ifdef WITH_OPENSSL
+	if (cc == NULL)
+		return 0;
+	if (cc->cp_ctx_mt != NULL)
+		return chachapoly_flush_mt(cc->cp_ctx_mt, base);
+	if (cc->gcm_mt == NULL)
+		return 0;
+	return gcm_mt_flush(cc->gcm_mt, base);
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Queue a received packet to be decrypted and verified by the next
+ * cipher_open_batch(). 'src' holds 'aadlen' bytes of aad, 'len' bytes
+ * of ciphertext and the tag and must not move until then. Packets must
+ * be queued in sequence order. Returns SSH_ERR_NO_BUFFER_SPACE when no
+ * more packets fit in the batch.
+ */
+int
+cipher_open_queue(struct sshcipher_ctx *cc, u_int seqnr, const u_char *src,
+    u_int len, u_int aadlen, u_int authlen)
+{
+#ifdef WITH_OPENSSL
+	u_char *iv = cc->gcm_iv;
+	int r;
+
+	if (cc->cp_ctx_mt != NULL && !cc->encrypt)
+		return chachapoly_open_queue_mt(cc->cp_ctx_mt, seqnr, src,
+		    len, aadlen, authlen);
+	if (cc->gcm_mt == NULL || cc->encrypt ||
+	    authlen != cipher_authlen(cc->cipher) ||
+	    len % cc->cipher->block_size)
+		return SSH_ERR_INVALID_ARGUMENT;
+	if (gcm_mt_pending(cc->gcm_mt) == 0) {
+		/* peek at the nonce of the next packet. The evp only moves
+		 * on when packets are taken so it stays correct for state
+		 * export and rekeying */
+		if (EVP_CIPHER_CTX_ctrl(cc->evp, EVP_CTRL_GCM_IV_GEN,
+		    GCM_MT_IVLEN, iv) <= 0 ||
+		    EVP_CIPHER_CTX_ctrl(cc->evp, EVP_CTRL_GCM_SET_IV_FIXED,
+		    -1, iv) <= 0)
+			return SSH_ERR_LIBCRYPTO_ERROR;
+	}
+	if ((r = gcm_mt_open_queue(cc->gcm_mt, src, len, aadlen, authlen,
+	    iv)) != 0)
+		return r;
+	/* the invocation counter is the last 8 bytes of the nonce */
+	POKE_U64(iv + 4, PEEK_U64(iv + 4) + 1);
+	return 0;
+#else
+	return SSH_ERR_INVALID_ARGUMENT;
+#endif
+}
+
+/* Decrypt and verify the packets queued with cipher_open_queue() */
+int
+cipher_open_batch(struct sshcipher_ctx *cc)
+{
+#ifdef WITH_OPENSSL
+	if (cc == NULL)
+		return 0;
+	if (cc->cp_ctx_mt != NULL)
+		return chachapoly_open_batch_mt(cc->cp_ctx_mt);
+	if (cc->gcm_mt == NULL)
+		return 0;
+	return gcm_mt_open_batch(cc->gcm_mt);
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Take the next packet opened by cipher_open_batch(), in place of
+ * cipher_crypt(). The aad and plaintext are copied to 'dest'. Returns
+ * SSH_ERR_MAC_INVALID if the tag didn't verify.
+ */
+int
+cipher_open_take(struct sshcipher_ctx *cc, u_int seqnr, u_char *dest,
+    u_int len, u_int aadlen)
+{
+#ifdef WITH_OPENSSL
+	u_char iv[GCM_MT_IVLEN];
+
+	if (cc->cp_ctx_mt != NULL)
+		return chachapoly_open_take_mt(cc->cp_ctx_mt, seqnr, dest,
+		    len, aadlen);
+	if (cc->gcm_mt == NULL)
+		return SSH_ERR_INVALID_ARGUMENT;
+	if (EVP_CIPHER_CTX_ctrl(cc->evp, EVP_CTRL_GCM_IV_GEN,
+	    sizeof(iv), iv) <= 0)
+		return SSH_ERR_LIBCRYPTO_ERROR;
+	return gcm_mt_open_take(cc->gcm_mt, dest, len, aadlen, iv);
+#else
+	return SSH_ERR_INVALID_ARGUMENT;
+#endif
+}
+
+/* Packets queued for sealing, or opened but not yet taken */
+u_int
+cipher_crypt_pending(const struct sshcipher_ctx *cc)
+{
+#ifdef WITH_OPENSSL
+	if (cc == NULL)
+		return 0;
+	if (cc->cp_ctx_mt != NULL)
+		return chachapoly_pending_mt(cc->cp_ctx_mt);
+	return gcm_mt_pending(cc->gcm_mt);
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Whether packets can be handled in batches: with cipher_crypt_defer()
+ * if the context encrypts, the cipher_open_*() functions if it decrypts.
+ */
+int
+cipher_can_defer(const struct sshcipher_ctx *cc)
+{
+#ifdef WITH_OPENSSL
+	return cc != NULL && (cc->gcm_mt != NULL || cc->cp_ctx_mt != NULL);
+#else
+	return 0;
+#endif
+}
+
 /* Extract the packet length, including any decryption necessary beforehand */
 int
 cipher_get_length(struct sshcipher_ctx *cc, u_int *plenp, u_int seqnr,
@@ -574,6 +962,8 @@ cipher_free(struct sshcipher_ctx *cc)
 	} else if ((cc->cipher->flags & CFLAG_AESCTR) != 0)
 		explicit_bzero(&cc->ac_ctx, sizeof(cc->ac_ctx));
 #ifdef WITH_OPENSSL
+	gcm_mt_free(cc->gcm_mt);
+	cc->gcm_mt = NULL;
 	EVP_CIPHER_CTX_free(cc->evp);
 	cc->evp = NULL;
 	/* if meth_ptr isn't null then we are using the aes_ctr_mt
@@ -53,6 +53,15 @@
 #define CIPHER_MULTITHREAD	1
 #define CIPHER_SERIAL		0
 
+/* used to hand the next key and iv to a running AES-CTR-MT context.
+ * The parameter is for the OSSL 3 provider, the ctrl for OSSL 1.1 */
+#define CIPHER_MT_STAGE_PARAM	"hpnssh-stage-keyiv"
+#define CIPHER_MT_STAGE_CTRL	0x4850
+/* and whether it is in the middle of a bulk transfer (see
+ * cipher_set_demand) */
+#define CIPHER_MT_DEMAND_PARAM	"hpnssh-demand"
+#define CIPHER_MT_DEMAND_CTRL	0x4851
+
 struct sshcipher;
 struct sshcipher_ctx;
 
@@ -65,6 +74,16 @@ int	 cipher_init(struct sshcipher_ctx **, const struct sshcipher *,
     const u_char *, u_int, const u_char *, u_int, u_int, int, int);
 int	 cipher_crypt(struct sshcipher_ctx *, u_int, u_char *, const u_char *,
     u_int, u_int, u_int);
+int	 cipher_crypt_defer(struct sshcipher_ctx *, u_int, u_char *, u_char *,
+    const u_char *, u_int, u_int, u_int);
+int	 cipher_crypt_flush(struct sshcipher_ctx *, u_char *);
+u_int	 cipher_crypt_pending(const struct sshcipher_ctx *);
+int	 cipher_can_defer(const struct sshcipher_ctx *);
+int	 cipher_open_queue(struct sshcipher_ctx *, u_int, const u_char *,
+    u_int, u_int, u_int);
+int	 cipher_open_batch(struct sshcipher_ctx *);
+int	 cipher_open_take(struct sshcipher_ctx *, u_int, u_char *, u_int,
+    u_int);
 int	 cipher_get_length(struct sshcipher_ctx *, u_int *, u_int,
     const u_char *, u_int);
 void	 cipher_free(struct sshcipher_ctx *);
@@ -77,6 +96,17 @@ u_int	 cipher_ivlen(const struct sshcipher *);
 u_int	 cipher_is_cbc(const struct sshcipher *);
 void	 cipher_reset_multithreaded(void);
 const char *cipher_ctx_name(const struct sshcipher_ctx *);
+void	 cipher_set_mt_tunables(int, int);
+int	 cipher_mt_threads(void);
+int	 cipher_mt_streams(void);
+void	 cipher_set_mt_max_packet(u_int);
+u_int	 cipher_mt_max_packet(void);
+void	 cipher_mt_release(void *, size_t);
+int	 cipher_set_demand(struct sshcipher_ctx *, int);
+int	 cipher_reinit(struct sshcipher_ctx *, const struct sshcipher *,
+    const u_char *, u_int, const u_char *, u_int, int);
+int	 cipher_stage_keys(struct sshcipher_ctx *, const struct sshcipher *,
+    const u_char *, u_int, const u_char *, u_int);
 
 u_int	 cipher_ctx_is_plaintext(struct sshcipher_ctx *);
 
@@ -695,7 +695,8 @@ client_wait_until_can_do_something(struct ssh *ssh, struct pollfd **pfdp,
     sigset_t *sigsetp, int *conn_in_readyp, int *conn_out_readyp)
 {
 	struct timespec timeout;
-	int ret, oready;
+	int ret, oready, write_delay;
+	time_t secs;
 	u_int p;
 
 	*conn_in_readyp = *conn_out_readyp = 0;
@@ -721,8 +722,11 @@ client_wait_until_can_do_something(struct ssh *ssh, struct pollfd **pfdp,
 	(*pfdp)[0].fd = connection_in;
 	(*pfdp)[0].events = POLLIN;
 	(*pfdp)[1].fd = connection_out;
-	(*pfdp)[1].events = (oready && ssh_packet_have_data_to_write(ssh)) ?
-	    POLLOUT : 0;
+	/* output held back by the send rate limit waits for its deadline */
+	if ((write_delay = ssh_packet_write_delay_ms(ssh)) > 0)
+		ptimeout_deadline_ms(&timeout, write_delay);
+	(*pfdp)[1].events = (oready && write_delay == 0 &&
+	    ssh_packet_have_data_to_write(ssh)) ? POLLOUT : 0;
 
 	/*
 	 * Wait for something to happen.  This will suspend the process until
@@ -738,6 +742,8 @@ client_wait_until_can_do_something(struct ssh *ssh, struct pollfd **pfdp,
 		ptimeout_deadline_sec(&timeout,
 		    ssh_packet_get_rekey_timeout(ssh));
 	}
+	if ((secs = ssh_packet_get_idle_timeout(ssh)) > 0)
+		ptimeout_deadline_sec(&timeout, secs);
 
 	ret = ppoll(*pfdp, *npfd_activep, ptimeout_get_tsp(&timeout), sigsetp);
 
@@ -757,7 +763,8 @@ client_wait_until_can_do_something(struct ssh *ssh, struct pollfd **pfdp,
 	}
 
 	*conn_in_readyp = (*pfdp)[0].revents != 0;
-	*conn_out_readyp = (*pfdp)[1].revents != 0;
+	*conn_out_readyp = (*pfdp)[1].revents != 0 || (oready &&
+	    write_delay > 0 && ssh_packet_write_delay_ms(ssh) == 0);
 
 	if (options.server_alive_interval > 0 && !*conn_in_readyp &&
 	    monotime() >= server_alive_time) {
@@ -1507,6 +1514,11 @@ client_loop(struct ssh *ssh, int have_pty, int escape_char_arg,
 	exit_status = -1;
 	connection_in = ssh_packet_get_connection_in(ssh);
 	connection_out = ssh_packet_get_connection_out(ssh);
+	if (options.zerocopy)
+		ssh_packet_set_zerocopy(ssh);
+	ssh_packet_set_read_high_water(ssh, options.read_high_water);
+	ssh_packet_set_notsent_lowat(ssh, options.notsent_lowat);
+	ssh_packet_set_send_rate(ssh, options.rate_limit);
 
 	quit_pending = 0;
 
@@ -1631,6 +1643,7 @@ client_loop(struct ssh *ssh, int have_pty, int escape_char_arg,
 		/* A timeout may have triggered rekeying */
 		if ((r = ssh_packet_check_rekey(ssh)) != 0)
 			fatal_fr(r, "cannot start rekeying");
+		ssh_packet_check_idle(ssh);
 
 		/*
 		 * Send as much buffered packet data as possible to the
@@ -2694,6 +2707,7 @@ client_process_request_metrics (struct ssh *ssh, int type, u_int32_t seq, void *
 	time_t now;
 	struct tm *info;
 	char timestamp[40];
+	char label[64];
 	char *metricsstring = NULL;
 	size_t tcpi_len, len = 0;
 	binn *metricsobj = NULL;
@@ -2754,7 +2768,9 @@ client_process_request_metrics (struct ssh *ssh, int type, u_int32_t seq, void *
 
 	/* have we printed the header? */
 	if (metrics_hdr_remote_flag == 0) {
-		metrics_print_header(remfptr, "REMOTE CONNECTION", kernel_version);
+		metrics_header_label(label, sizeof(label),
+		    "REMOTE CONNECTION", (void *)blob);
+		metrics_print_header(remfptr, label, kernel_version);
 		metrics_hdr_remote_flag = 1;
 	}
 	fprintf(remfptr, "%s, ", timestamp);
@@ -2793,6 +2809,7 @@ localonly:
 	/* we write and read to a binn object because it lets us
 	 * format the data consistently */
 	metrics_write_binn_object(&local_tcp_info, metricsobj);
+	metrics_write_congestion(sock_in, metricsobj);
 
 	/* create a string of the data from the binn object metricsobj */
 	metrics_read_binn_object((void *)metricsobj, metricsstring);
@@ -2801,7 +2818,9 @@ localonly:
 	kernel_version = binn_object_int32(metricsobj, "kernel_version");
 
 	if (metrics_hdr_local_flag == 0) {
-		metrics_print_header(localfptr, "LOCAL CONNECTION", kernel_version);
+		metrics_header_label(label, sizeof(label),
+		    "LOCAL CONNECTION", metricsobj);
+		metrics_print_header(localfptr, label, kernel_version);
 		metrics_hdr_local_flag = 1;
 	}
 
@@ -292,6 +292,22 @@ kex_set_server_sig_algs(struct ssh *ssh, const char *allowed_algs)
 		ssh->kex->server_sig_algs = xstrdup("");
 }
 
+/* offer an HPN peer bigger channel packets */
+static int
+kex_compose_ext_info_hpn(struct kex *kex, struct sshbuf *m)
+{
+	char offer[16];
+	int r;
+
+	if (kex->hpn_packet_offer == 0)
+		return 0;
+	snprintf(offer, sizeof(offer), "%u", kex->hpn_packet_offer);
+	if ((r = sshbuf_put_cstring(m, "hpn-max-packet@hpnssh.org")) != 0 ||
+	    (r = sshbuf_put_cstring(m, offer)) != 0)
+		return r;
+	return 0;
+}
+
 static int
 kex_compose_ext_info_server(struct ssh *ssh, struct sshbuf *m)
 {
@@ -300,14 +316,16 @@ kex_compose_ext_info_server(struct ssh *ssh, struct sshbuf *m)
 	if (ssh->kex->server_sig_algs == NULL &&
 	    (ssh->kex->server_sig_algs = sshkey_alg_list(0, 1, 1, ',')) == NULL)
 		return SSH_ERR_ALLOC_FAIL;
-	if ((r = sshbuf_put_u32(m, 3)) != 0 ||
+	if ((r = sshbuf_put_u32(m,
+	    ssh->kex->hpn_packet_offer != 0 ? 4 : 3)) != 0 ||
 	    (r = sshbuf_put_cstring(m, "server-sig-algs")) != 0 ||
 	    (r = sshbuf_put_cstring(m, ssh->kex->server_sig_algs)) != 0 ||
 	    (r = sshbuf_put_cstring(m,
 	    "publickey-hostbound@openssh.com")) != 0 ||
 	    (r = sshbuf_put_cstring(m, "0")) != 0 ||
 	    (r = sshbuf_put_cstring(m, "ping@openssh.com")) != 0 ||
-	    (r = sshbuf_put_cstring(m, "0")) != 0) {
+	    (r = sshbuf_put_cstring(m, "0")) != 0 ||
+	    (r = kex_compose_ext_info_hpn(ssh->kex, m)) != 0) {
 		error_fr(r, "compose");
 		return r;
 	}
@@ -319,9 +337,11 @@ kex_compose_ext_info_client(struct ssh *ssh, struct sshbuf *m)
 {
 	int r;
 
-	if ((r = sshbuf_put_u32(m, 1)) != 0 ||
+	if ((r = sshbuf_put_u32(m,
+	    ssh->kex->hpn_packet_offer != 0 ? 2 : 1)) != 0 ||
 	    (r = sshbuf_put_cstring(m, "ext-info-in-auth@openssh.com")) != 0 ||
-	    (r = sshbuf_put_cstring(m, "0")) != 0) {
+	    (r = sshbuf_put_cstring(m, "0")) != 0 ||
+	    (r = kex_compose_ext_info_hpn(ssh->kex, m)) != 0) {
 		error_fr(r, "compose");
 		goto out;
 	}
@@ -422,6 +442,35 @@ kex_ext_info_check_ver(struct kex *kex, const char *name,
 	return 0;
 }
 
+/* the peer's offer of bigger channel packets. We take the smaller of
+ * theirs and ours, if we made one */
+static int
+kex_ext_info_hpn_packet(struct ssh *ssh, const char *name,
+    const u_char *val, size_t len)
+{
+	struct kex *kex = ssh->kex;
+	const char *errstr;
+	u_int offer;
+
+	if (memchr(val, '\0', len) != NULL) {
+		error("SSH2_MSG_EXT_INFO: %s value contains nul byte", name);
+		return SSH_ERR_INVALID_FORMAT;
+	}
+	debug_f("%s=<%s>", name, val);
+	if (kex->hpn_packet_offer == 0)
+		return 0;
+	offer = (u_int)strtonum((const char *)val, KEX_HPN_PACKET_MIN,
+	    KEX_HPN_PACKET_MAX, &errstr);
+	if (errstr != NULL) {
+		debug_f("%s is %s, ignoring", name, errstr);
+		return 0;
+	}
+	kex->hpn_max_packet = MINIMUM(kex->hpn_packet_offer, offer);
+	debug("HPN peer, channel packets up to %u bytes", kex->hpn_max_packet);
+	ssh_packet_set_hpn_max_packet(ssh, kex->hpn_max_packet);
+	return 0;
+}
+
 static int
 kex_ext_info_client_parse(struct ssh *ssh, const char *name,
     const u_char *value, size_t vlen)
@@ -450,6 +499,11 @@ kex_ext_info_client_parse(struct ssh *ssh, const char *name,
 		    "0", KEX_HAS_PING)) != 0) {
 			return r;
 		}
+	} else if (ssh->kex->ext_info_received == 1 &&
+	    strcmp(name, "hpn-max-packet@hpnssh.org") == 0) {
+		if ((r = kex_ext_info_hpn_packet(ssh, name, value,
+		    vlen)) != 0)
+			return r;
 	} else
 		debug_f("%s (unrecognised)", name);
 
@@ -467,6 +521,10 @@ kex_ext_info_server_parse(struct ssh *ssh, const char *name,
 		    "0", KEX_HAS_EXT_INFO_IN_AUTH)) != 0) {
 			return r;
 		}
+	} else if (strcmp(name, "hpn-max-packet@hpnssh.org") == 0) {
+		if ((r = kex_ext_info_hpn_packet(ssh, name, value,
+		    vlen)) != 0)
+			return r;
 	} else
 		debug_f("%s (unrecognised)", name);
 	return 0;
@@ -1284,6 +1342,7 @@ kex_derive_keys(struct ssh *ssh, u_char *hash, u_int hashlen,
 		kex->newkeys[mode]->enc.key = keys[ctos ? 2 : 3];
 		kex->newkeys[mode]->mac.key = keys[ctos ? 4 : 5];
 	}
+	ssh_packet_stage_newkeys(ssh);
 	return 0;
 }
 
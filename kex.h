@@ -115,6 +115,14 @@ enum kex_exchange {
 #define KEX_HAS_PING			0x0020
 #define KEX_HAS_EXT_INFO_IN_AUTH	0x0040
 
+/* HPN peers can agree on channel packets bigger than the 32KB default
+ * with the hpn-max-packet@hpnssh.org extension. We offer KEX_HPN_PACKET
+ * and use the smaller of that and the peer's offer, which has to fall
+ * between KEX_HPN_PACKET_MIN and KEX_HPN_PACKET_MAX */
+#define KEX_HPN_PACKET			(256*1024)
+#define KEX_HPN_PACKET_MIN		(32*1024)
+#define KEX_HPN_PACKET_MAX		(1024*1024)
+
 /* kex->pq */
 #define KEX_NOT_PQ			0
 #define KEX_IS_PQ			1
@@ -158,6 +166,8 @@ struct kex {
 	int	ext_info_s;
 	int	kex_strict;
 	int	ext_info_received;
+	u_int	hpn_packet_offer;	/* 0 to not offer bigger packets */
+	u_int	hpn_max_packet;		/* what we agreed on, 0 if nothing */
 	struct sshbuf *my;
 	struct sshbuf *peer;
 	struct sshbuf *client_version;
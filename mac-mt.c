@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2026 The Board of Trustees of Carnegie Mellon University.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT License.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the MIT License for more details.
+ *
+ * You should have received a copy of the MIT License along with this library;
+ * if not, see http://opensource.org/licenses/MIT.
+ *
+ */
+
+/* Parallel computation and checking of Encrypt-then-MAC tags.
+ *
+ * With an EtM MAC the tag of a packet only depends on its sequence
+ * number and its ciphertext, so once a packet has been encrypted its
+ * tag can be computed at any time before the packet is written. The
+ * packet code reserves room for the tag in the output buffer and hands
+ * us the packet. When the output is about to be written (or the batch
+ * is full) all of the queued tags are computed by main and the workers
+ * of the shared cipher pool (see cipher-pool.c), each with its own copy
+ * of the MAC context.
+ *
+ * Incoming packets have their lengths in the clear, so the packet code
+ * can find every complete packet in the input buffer and queue them
+ * all. Their tags are checked together and the results are handed back
+ * one packet at a time, in sequence order, before each is decrypted. */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <stdarg.h> /* needed for log.h */
+#include <string.h>
+#include <stdio.h>  /* needed for misc.h */
+
+#include "log.h"
+#include "ssherr.h"
+#include "xmalloc.h"
+#include "misc.h"
+#include "digest.h"
+#include "mac.h"
+#include "mac-mt.h"
+#include "cipher-pool.h"
+
+struct mac_mt_job {
+	u_int32_t seqno;
+	size_t off;		/* of the data in the output buffer */
+	size_t mac_off;		/* of the tag in the output buffer */
+	const u_char *data;	/* incoming data, only while checking */
+	const u_char *theirmac;	/* incoming tag, only while checking */
+	u_int len;
+	int ok;			/* tag verified */
+};
+
+/* The jobs are only written by main while the pool isn't running them,
+ * apart from ok which belongs to whoever is working on the job */
+struct mac_mt_ctx {
+	struct mac_mt_job jobs[CIPHER_POOL_BATCH];
+	int checking;		/* jobs are incoming packets */
+	u_int njobs;		/* queued */
+	u_int taken;		/* checked packets handed back */
+	u_char *base;		/* output buffer of the batch being run */
+	struct cipher_pool *pool;
+	/* MAC contexts for main and each of the workers */
+	struct sshmac macs[CIPHER_POOL_MAX_THREADS + 1];
+};
+
+/* a private copy of mac that can be used alongside it. The name and
+ * key are borrowed and only needed here */
+static int
+mac_mt_clone(struct sshmac *copy, struct sshmac *mac)
+{
+	int r;
+
+	memset(copy, 0, sizeof(*copy));
+	if ((r = mac_setup(copy, mac->name)) != 0)
+		return r;
+	copy->key = mac->key;
+	r = mac_init(copy);
+	copy->key = NULL;
+	copy->enabled = mac->enabled;
+	return r;
+}
+
+/* compute or check the tag of job i. A bad tag isn't an error
+ * here, it is reported when the packet is taken */
+static int
+mac_mt_job(void *arg, int worker, u_int i)
+{
+	struct mac_mt_ctx *ctx = arg;
+	struct sshmac *mac = &ctx->macs[worker];
+	struct mac_mt_job *job = &ctx->jobs[i];
+	int r;
+
+	if (!ctx->checking) {
+		if ((r = mac_compute(mac, job->seqno, ctx->base + job->off,
+		    job->len, ctx->base + job->mac_off, mac->mac_len)) != 0)
+			return r;
+		job->ok = 1;
+		return 0;
+	}
+	r = mac_check(mac, job->seqno, job->data, job->len,
+	    job->theirmac, mac->mac_len);
+	job->ok = r == 0;
+	return r == SSH_ERR_MAC_INVALID ? 0 : r;
+}
+
+/* set up batched tags for mac, which has to be an initialised EtM MAC.
+ * The pool's workers are started the first time there is more than one
+ * packet to do. Returns NULL if this MAC can't be done in parallel */
+struct mac_mt_ctx *
+mac_mt_new(struct sshmac *mac)
+{
+	struct mac_mt_ctx *ctx;
+	int i, nthreads;
+
+	if (!mac->etm || mac->key == NULL)
+		return NULL;
+	ctx = xcalloc(1, sizeof(*ctx));
+	ctx->pool = cipher_pool_get();
+	nthreads = cipher_pool_nthreads(ctx->pool);
+	for (i = 0; i <= nthreads; i++) {
+		if (mac_mt_clone(&ctx->macs[i], mac) != 0)
+			goto fail;
+	}
+	debug2_f("%s: %d workers, %d packets per batch", mac->name,
+	    nthreads, CIPHER_POOL_BATCH);
+	return ctx;
+ fail:
+	mac_mt_free(ctx);
+	return NULL;
+}
+
+void
+mac_mt_free(struct mac_mt_ctx *ctx)
+{
+	int i;
+
+	if (ctx == NULL)
+		return;
+	cipher_pool_put(ctx->pool);
+	for (i = 0; i <= CIPHER_POOL_MAX_THREADS; i++)
+		mac_clear(&ctx->macs[i]);
+	freezero(ctx, sizeof(*ctx));
+}
+
+/* packets queued for their tags or checked and not yet taken */
+u_int
+mac_mt_pending(const struct mac_mt_ctx *ctx)
+{
+	return ctx == NULL ? 0 : ctx->njobs - ctx->taken;
+}
+
+/* run every queued job on the workers and main */
+static int
+mac_mt_run(struct mac_mt_ctx *ctx, u_char *base)
+{
+	int r;
+
+	ctx->base = base;
+	r = cipher_pool_run(ctx->pool, mac_mt_job, ctx, ctx->njobs);
+	ctx->base = NULL;
+	return r;
+}
+
+/*
+ * Compute every queued tag. base is the start of the output buffer
+ * the packets were queued in; it may have moved since they were queued
+ * but nothing in front of them may have been consumed.
+ */
+int
+mac_mt_flush(struct mac_mt_ctx *ctx, u_char *base)
+{
+	int r;
+
+	if (ctx->checking || ctx->njobs == 0)
+		return 0;
+	r = mac_mt_run(ctx, base);
+	ctx->njobs = 0;
+	return r;
+}
+
+/*
+ * Queue an outgoing packet. data is the aad and ciphertext and digest
+ * is where its tag goes, both in the buffer starting at base. The tag
+ * is written by the next mac_mt_flush().
+ */
+int
+mac_mt_enqueue(struct mac_mt_ctx *ctx, u_int32_t seqno, u_char *base,
+    const u_char *data, u_int datalen, u_char *digest)
+{
+	struct mac_mt_job *job;
+
+	if (ctx->checking && ctx->njobs != 0)
+		return SSH_ERR_INVALID_ARGUMENT;
+	if (data < base || digest < base)
+		return SSH_ERR_INVALID_ARGUMENT;
+	ctx->checking = 0;
+	job = &ctx->jobs[ctx->njobs++];
+	job->seqno = seqno;
+	job->off = data - base;
+	job->mac_off = digest - base;
+	job->len = datalen;
+	job->ok = 0;
+	if (ctx->njobs == CIPHER_POOL_BATCH)
+		return mac_mt_flush(ctx, base);
+	return 0;
+}
+
+/*
+ * Queue an incoming packet to have its tag checked by the next
+ * mac_mt_check_batch(). data and theirmac have to stay put until then.
+ * Returns SSH_ERR_NO_BUFFER_SPACE once the batch is full.
+ */
+int
+mac_mt_check_queue(struct mac_mt_ctx *ctx, u_int32_t seqno,
+    const u_char *data, u_int datalen, const u_char *theirmac)
+{
+	struct mac_mt_job *job;
+
+	if ((!ctx->checking && ctx->njobs != 0) || ctx->taken != 0)
+		return SSH_ERR_INVALID_ARGUMENT;
+	if (ctx->njobs == CIPHER_POOL_BATCH)
+		return SSH_ERR_NO_BUFFER_SPACE;
+	ctx->checking = 1;
+	job = &ctx->jobs[ctx->njobs++];
+	job->seqno = seqno;
+	job->data = data;
+	job->theirmac = theirmac;
+	job->len = datalen;
+	job->ok = 0;
+	return 0;
+}
+
+/* check the tags of every queued packet */
+int
+mac_mt_check_batch(struct mac_mt_ctx *ctx)
+{
+	u_int i;
+	int r;
+
+	if (!ctx->checking || ctx->njobs == 0 || ctx->taken != 0)
+		return 0;
+	r = mac_mt_run(ctx, NULL);
+	for (i = 0; i < ctx->njobs; i++)
+		ctx->jobs[i].data = ctx->jobs[i].theirmac = NULL;
+	if (r != 0)
+		ctx->njobs = 0;
+	return r;
+}
+
+/*
+ * Hand back the result for the next checked packet: 0 if its tag was
+ * good and SSH_ERR_MAC_INVALID if not. seqno and datalen are what the
+ * caller expected, as a check that we are still in step.
+ */
+int
+mac_mt_check_take(struct mac_mt_ctx *ctx, u_int32_t seqno, u_int datalen)
+{
+	struct mac_mt_job *job;
+	int r = 0;
+
+	if (!ctx->checking || ctx->taken >= ctx->njobs)
+		return SSH_ERR_INTERNAL_ERROR;
+	job = &ctx->jobs[ctx->taken++];
+	if (job->seqno != seqno || job->len != datalen)
+		r = SSH_ERR_INTERNAL_ERROR;
+	else if (!job->ok)
+		r = SSH_ERR_MAC_INVALID;
+	if (ctx->taken == ctx->njobs || r != 0) {
+		/* nothing after a bad packet is any use */
+		ctx->taken = ctx->njobs = 0;
+	}
+	return r;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2026 The Board of Trustees of Carnegie Mellon University.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT License.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the MIT License for more details.
+ *
+ * You should have received a copy of the MIT License along with this library;
+ * if not, see http://opensource.org/licenses/MIT.
+ *
+ */
+
+#ifndef MAC_MT_H
+#define MAC_MT_H
+
+#include <sys/types.h>
+
+struct sshmac;
+struct mac_mt_ctx; /* defined in mac-mt.c */
+
+struct mac_mt_ctx *mac_mt_new(struct sshmac *mac);
+
+void   mac_mt_free(struct mac_mt_ctx *ctx);
+
+int    mac_mt_enqueue(struct mac_mt_ctx *ctx, u_int32_t seqno, u_char *base,
+		      const u_char *data, u_int datalen, u_char *digest);
+
+int    mac_mt_flush(struct mac_mt_ctx *ctx, u_char *base);
+
+u_int  mac_mt_pending(const struct mac_mt_ctx *ctx);
+
+int    mac_mt_check_queue(struct mac_mt_ctx *ctx, u_int32_t seqno,
+			  const u_char *data, u_int datalen,
+			  const u_char *theirmac);
+
+int    mac_mt_check_batch(struct mac_mt_ctx *ctx);
+
+int    mac_mt_check_take(struct mac_mt_ctx *ctx, u_int32_t seqno,
+			 u_int datalen);
+
+#endif /* MAC_MT_H */
@@ -35,6 +35,7 @@
 #include "hmac.h"
 #include "umac.h"
 #include "mac.h"
+#include "mac-mt.h"
 #include "misc.h"
 #include "ssherr.h"
 #include "sshbuf.h"
@@ -157,7 +158,8 @@ mac_compute(struct sshmac *mac, u_int32_t seqno,
     const u_char *data, int datalen,
     u_char *digest, size_t dlen)
 {
-	static union {
+	/* not static, the EtM workers call this concurrently */
+	union {
 		u_char m[SSH_DIGEST_MAX_LENGTH];
 		u_int64_t for_align;
 	} u;
@@ -195,6 +197,7 @@ mac_compute(struct sshmac *mac, u_int32_t seqno,
 			dlen = mac->mac_len;
 		memcpy(digest, u.m, dlen);
 	}
+	explicit_bzero(&u, sizeof(u));
 	return 0;
 }
 
@@ -219,6 +222,8 @@ mac_check(struct sshmac *mac, u_int32_t seqno,
 void
 mac_clear(struct sshmac *mac)
 {
+	mac_mt_free(mac->mt);
+	mac->mt = NULL;
 	if (mac->type == SSH_UMAC) {
 		if (mac->umac_ctx != NULL)
 			umac_delete(mac->umac_ctx);
@@ -38,6 +38,7 @@ struct sshmac {
 	int	etm;		/* Encrypt-then-MAC */
 	struct ssh_hmac_ctx	*hmac_ctx;
 	struct umac_ctx		*umac_ctx;
+	struct mac_mt_ctx	*mt;	/* EtM tags in parallel, see mac-mt.c */
 };
 
 int	 mac_valid(const char *);
@@ -18,8 +18,10 @@
 #include "includes.h"
 #include "metrics.h"
 #include "ssherr.h"
+#include "misc.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 /* kernel version macro moved to defines.h */
 
@@ -244,6 +246,68 @@ metrics_write_binn_object(struct tcp_info *data, struct binn_struct *binnobj) {
 #endif /*endif for TCP_INFO */
 }
 
+/* fill in the parts of tcp_info the channel window autotuning uses.
+ * rtt is the minimum RTT where the kernel tracks one (linux 4.6+) so
+ * that queueing doesn't inflate it. delivery_rate is only reported on
+ * linux 4.9 and later, and only when the connection was actually
+ * sending as fast as it could; it is 0 otherwise.
+ * returns 0 on success or -1 if tcp_info isn't available */
+int
+metrics_read_transport(int sock, struct metrics_transport *mt) {
+#if !defined TCP_INFO
+	return -1;
+#else
+	struct tcp_info data;
+	socklen_t len = sizeof(data);
+
+	memset(mt, 0, sizeof(*mt));
+	if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, (void *)&data, &len) != 0)
+		return -1;
+	mt->rtt = data.tcpi_rtt;
+	mt->rcv_space = data.tcpi_rcv_space;
+#ifdef __linux__
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
+	if (data.tcpi_min_rtt > 0 && data.tcpi_min_rtt < mt->rtt)
+		mt->rtt = data.tcpi_min_rtt;
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,9,0)
+	if (!data.tcpi_delivery_rate_app_limited)
+		mt->delivery_rate = data.tcpi_delivery_rate;
+#endif
+#endif
+	return 0;
+#endif /* TCP_INFO */
+}
+
+/* add the name of the congestion control algorithm in use on sock to
+ * the serialized object. Older peers won't send this so readers have
+ * to cope with it missing */
+void
+metrics_write_congestion(int sock, struct binn_struct *binnobj) {
+	char *cc;
+
+	if ((cc = get_sock_congestion(sock)) == NULL)
+		return;
+	binn_object_set_str(binnobj, "tcp_congestion", cc);
+	free(cc);
+}
+
+/* build the label printed above the header. includes the congestion
+ * control algorithm if the object has one */
+void
+metrics_header_label(char *output, size_t len, const char *label,
+    void *binnobj) {
+	char *cc = NULL;
+
+	if (binnobj != NULL)
+		binn_object_get(binnobj, "tcp_congestion", BINN_STRING,
+		    &cc, NULL);
+	if (cc != NULL)
+		snprintf(output, len, "%s (congestion control: %s)", label, cc);
+	else
+		snprintf(output, len, "%s", label);
+}
+
 /* this reads out the tcp_info binn object and formats it into a single line
  * the object will not necessarily have all of the elements. If it's empty it
  * current just spits out 0. This isn't optimal as 0 can also be a valid value */
@@ -37,9 +37,19 @@ typedef struct tcp_info {
 } tcp_info;
 #endif
 
+/* the tcp_info values the channel window autotuning works from */
+struct metrics_transport {
+	u_int32_t rtt;			/* RTT in usec */
+	u_int32_t rcv_space;		/* bytes received per RTT */
+	u_int64_t delivery_rate;	/* bytes/s delivered, 0 if unknown */
+};
+
 void metrics_write_binn_object(struct tcp_info *, struct binn_struct *);
 void metrics_read_binn_object(void *, char *);
 void metrics_print_header(FILE *, char *, int);
+void metrics_write_congestion(int, struct binn_struct *);
+int metrics_read_transport(int, struct metrics_transport *);
+void metrics_header_label(char *, size_t, const char *, void *);
 
 
 #endif /* define metrics_h */
@@ -401,6 +401,98 @@ set_sock_tos(int fd, int tos)
 #endif /* IP_TOS_IS_BROKEN */
 }
 
+/*
+ * Sets the TCP congestion control algorithm of a socket and, if bufsize
+ * is not 0, its send and receive buffer sizes. Fixed buffer sizes turn
+ * off the kernel's buffer autotuning for the socket.
+ */
+void
+set_sock_transport(int fd, const char *congestion, int bufsize)
+{
+	if (get_sock_af(fd) == -1)
+		return; /* not a socket */
+	if (congestion != NULL) {
+#ifdef TCP_CONGESTION
+		debug3_f("set socket %d TCP_CONGESTION %s", fd, congestion);
+		if (setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, congestion,
+		    strlen(congestion)) == -1) {
+			error("setsockopt socket %d TCP_CONGESTION %s: %s",
+			    fd, congestion, strerror(errno));
+		}
+#else
+		debug_f("TCP_CONGESTION not supported on this platform");
+#endif
+	}
+	if (bufsize > 0) {
+		debug3_f("set socket %d buffers to %d", fd, bufsize);
+		if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+		    &bufsize, sizeof(bufsize)) == -1 ||
+		    setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+		    &bufsize, sizeof(bufsize)) == -1) {
+			error("setsockopt socket %d buffers %d: %s",
+			    fd, bufsize, strerror(errno));
+		}
+	}
+}
+
+/* Returns 1 if name could be a TCP congestion control algorithm name */
+int
+valid_congestion_name(const char *name)
+{
+	size_t len = strlen(name);
+
+	/* TCP_CA_NAME_MAX is 16 including the NUL */
+	return len > 0 && len < 16 && strspn(name, "abcdefghijklmnopqrstuvwxyz"
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") == len;
+}
+
+/*
+ * Returns the name of the congestion control algorithm in use on a
+ * socket, or NULL if it can't be found. Caller must free.
+ */
+char *
+get_sock_congestion(int fd)
+{
+#ifdef TCP_CONGESTION
+	char name[64];
+	socklen_t len = sizeof(name) - 1;
+
+	memset(name, 0, sizeof(name));
+	if (getsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, name, &len) == -1)
+		return NULL;
+	return xstrdup(name);
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * Fills in what a TransportProfile implies for the settings that are
+ * still unset (NULL, or -1): "bulk" uses BBR and leaves the buffers to
+ * autotuning, "interactive" uses CUBIC with 256K socket buffers and a
+ * 16K TCP_NOTSENT_LOWAT. Explicitly set values, including "none" and 0,
+ * are left alone; callers default whatever is still -1 afterwards.
+ */
+void
+transport_profile_defaults(int profile, char **congestionp,
+    int64_t *bufsizep, int64_t *lowatp)
+{
+	switch (profile) {
+	case TRANSPORT_PROFILE_BULK:
+		if (*congestionp == NULL)
+			*congestionp = xstrdup("bbr");
+		break;
+	case TRANSPORT_PROFILE_INTERACTIVE:
+		if (*congestionp == NULL)
+			*congestionp = xstrdup("cubic");
+		if (*bufsizep == -1)
+			*bufsizep = 256 * 1024;
+		if (*lowatp == -1)
+			*lowatp = 16 * 1024;
+		break;
+	}
+}
+
 /*
  * Wait up to *timeoutp milliseconds for events on fd. Updates
  * *timeoutp with time remaining.
@@ -2651,6 +2743,46 @@ parse_pattern_interval(const char *s, char **typep, int *secsp)
 	return 0;
 }
 
+/*
+ * Parse a "pattern=weight" clause (e.g. a ChannelWeights) with the weight
+ * between 1 and maxweight. Returns 0 on success or non-zero on failure.
+ * Caller must free *typep.
+ */
+int
+parse_pattern_weight(const char *s, u_int maxweight, char **typep,
+    u_int *weightp)
+{
+	char *cp, *sdup;
+	const char *errstr;
+	u_int weight;
+
+	if (typep != NULL)
+		*typep = NULL;
+	if (weightp != NULL)
+		*weightp = 0;
+	if (s == NULL)
+		return -1;
+	sdup = xstrdup(s);
+
+	if ((cp = strchr(sdup, '=')) == NULL || cp == sdup) {
+		free(sdup);
+		return -1;
+	}
+	*cp++ = '\0';
+	weight = (u_int)strtonum(cp, 1, maxweight, &errstr);
+	if (errstr != NULL) {
+		free(sdup);
+		return -1;
+	}
+	/* success */
+	if (typep != NULL)
+		*typep = xstrdup(sdup);
+	if (weightp != NULL)
+		*weightp = weight;
+	free(sdup);
+	return 0;
+}
+
 /* check if path is absolute */
 int
 path_absolute(const char *path)
@@ -39,6 +39,11 @@ struct Forward {
 	int	  handle;		/* Handle for dynamic listen ports */
 };
 
+/* TransportProfile values, see transport_profile_defaults() */
+#define TRANSPORT_PROFILE_DEFAULT	0
+#define TRANSPORT_PROFILE_BULK		1
+#define TRANSPORT_PROFILE_INTERACTIVE	2
+
 int forward_equals(const struct Forward *, const struct Forward *);
 int permitopen_port(const char *p);
 
@@ -67,6 +72,10 @@ char	*get_rdomain(int);
 int	 set_rdomain(int, const char *);
 int	 get_sock_af(int);
 void	 set_sock_tos(int, int);
+void	 set_sock_transport(int, const char *, int);
+char	*get_sock_congestion(int);
+int	 valid_congestion_name(const char *);
+void	 transport_profile_defaults(int, char **, int64_t *, int64_t *);
 int	 waitrfd(int, int *, volatile sig_atomic_t *);
 int	 timeout_connect(int, const struct sockaddr *, socklen_t, int *);
 int	 a2port(const char *);
@@ -105,6 +114,7 @@ const char *atoi_err(const char *, int *);
 int	 parse_absolute_time(const char *, uint64_t *);
 void	 format_absolute_time(uint64_t, char *, size_t);
 int	 parse_pattern_interval(const char *, char **, int *);
+int	 parse_pattern_weight(const char *, u_int, char **, u_int *);
 int	 path_absolute(const char *);
 int	 stdfd_devnull(int, int, int);
 int	 lib_contains_symbol(const char *, const char *);
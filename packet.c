@@ -46,6 +46,7 @@
 
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <errno.h>
@@ -62,6 +63,9 @@
 #ifdef HAVE_UTIL_H
 # include <util.h>
 #endif
+#ifdef HAVE_LINUX_ERRQUEUE_H
+# include <linux/errqueue.h>
+#endif
 
 /*
  * Explicitly include OpenSSL before zlib as some versions of OpenSSL have
@@ -87,6 +91,7 @@
 #include "kex.h"
 #include "digest.h"
 #include "mac.h"
+#include "mac-mt.h"
 #include "log.h"
 #include "canohost.h"
 #include "misc.h"
@@ -116,6 +121,24 @@ u_int packet_max_size = 256 * 1024;
 /* global to support forced rekeying */
 int rekey_requested = 0;
 
+/* a connection that moves less than IDLE_BYTES in IDLE_SECS seconds is
+ * quiet and the threaded ciphers are asked to shrink their keystream
+ * buffers. See ssh_packet_check_idle() */
+#define IDLE_SECS	10
+#define IDLE_BYTES	(64 * 1024)
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+# define PACKET_ZEROCOPY
+#endif
+/* MSG_ZEROCOPY only pays for itself on big sends so smaller output is
+ * written the usual way. ZC_WINDOW bounds the sends the kernel can be
+ * holding on to, and with it the memory pinned, and ZC_MAX_IOV the
+ * buffers gathered into one sendmsg() */
+#define ZC_MIN_SEND	(64 * 1024)
+#define ZC_WINDOW	64
+#define ZC_MAX_IOV	16
+
 
 struct packet_state {
 	u_int32_t seqnr;
@@ -130,6 +153,14 @@ struct packet {
 	struct sshbuf *payload;
 };
 
+/* output handed to the kernel with MSG_ZEROCOPY */
+struct zc_buf {
+	TAILQ_ENTRY(zc_buf) next;
+	struct sshbuf *buf;	/* the part not yet sent */
+	int pinned;		/* sent from in place at least once */
+	u_int32_t last;		/* id of the last such send */
+};
+
 struct session_state {
 	/*
 	 * This variable contains the file descriptors used for
@@ -189,6 +220,17 @@ struct session_state {
 	/* Set to true if we are authenticated. */
 	int after_authentication;
 
+	/* set once the serial cipher contexts have been swapped for the
+	 * threaded ones (see ssh_packet_start_threads()) */
+	int threads_started;
+
+	/* FIPS mode, -1 until first checked (see ssh_packet_threads_ok()) */
+	int fips;
+
+	/* channel data an HPN peer agreed to take in one packet, 0 if we
+	 * didn't agree on anything (see ssh_packet_set_hpn_max_packet()) */
+	u_int hpn_max_packet;
+
 	int keep_alive_timeouts;
 
 	/* The maximum time that we will wait to send or receive a packet */
@@ -225,6 +267,40 @@ struct session_state {
 	/* QoS handling */
 	int qos_interactive, qos_other;
 
+	/* bulk transfer hint for the threaded ciphers, -1 until we get one */
+	int cipher_demand;
+
+	/*
+	 * Receive batching, see ssh_packet_set_read_high_water(). When
+	 * read_high_water is set a wakeup keeps reading until the socket
+	 * is empty or that much is buffered. read_size is the size of
+	 * the next read, doubled while reads come back full.
+	 */
+	size_t read_high_water;
+	size_t read_size;
+
+	/*
+	 * TCP_NOTSENT_LOWAT in bytes, or 0. When set the kernel holds at
+	 * most about this much unsent data and bulk output queued here is
+	 * held to the same amount, see ssh_packet_set_notsent_lowat().
+	 */
+	size_t notsent_lowat;
+
+	/*
+	 * Send rate limit in bytes per second, or 0, see
+	 * ssh_packet_set_send_rate(). When the kernel can't pace the
+	 * socket itself output is metered here with a token bucket of
+	 * rate_burst bytes, refilled at send_rate.
+	 */
+	u_int64_t send_rate;
+	int send_paced;
+	double rate_tokens, rate_burst, rate_last;
+
+	/* quiet connection tracking for ssh_packet_check_idle() */
+	u_int64_t idle_bytes;
+	time_t idle_since;
+	int ciphers_trimmed;
+
 	/* Used in packet_set_maxsize */
 	int set_maxsize_called;
 
@@ -245,6 +321,20 @@ struct session_state {
 	void *hook_in_ctx;
 
 	TAILQ_HEAD(, packet) outgoing;
+
+	/*
+	 * MSG_ZEROCOPY transmit, see ssh_packet_set_zerocopy(). Large
+	 * output is moved onto zc_bufs and sent from there. A buffer is
+	 * only freed or reused once it has all been sent and the kernel
+	 * has reported every send that used it complete. Send ids below
+	 * zc_done are complete, zc_complete flags later ones that are.
+	 */
+	int zerocopy;
+	TAILQ_HEAD(, zc_buf) zc_bufs;
+	size_t zc_unsent;
+	u_int32_t zc_next, zc_done;
+	u_char zc_complete[ZC_WINDOW];
+	struct sshbuf *zc_spare;
 };
 
 struct ssh *
@@ -273,6 +363,7 @@ ssh_alloc_session_state(void)
 	sshbuf_type(state->outgoing_packet, BUF_PACKET_OUTGOING);
 
 	TAILQ_INIT(&state->outgoing);
+	TAILQ_INIT(&state->zc_bufs);
 	TAILQ_INIT(&ssh->private_keys);
 	TAILQ_INIT(&ssh->public_keys);
 	state->connection_in = -1;
@@ -281,6 +372,8 @@ ssh_alloc_session_state(void)
 	state->packet_timeout_ms = -1;
 	state->interactive_mode = 1;
 	state->qos_interactive = state->qos_other = -1;
+	state->cipher_demand = -1;
+	state->fips = -1;
 	state->p_send.packets = state->p_read.packets = 0;
 	state->initialized = 1;
 	/*
@@ -702,6 +795,331 @@ ssh_packet_rdomain_in(struct ssh *ssh)
 	return ssh->rdomain_in;
 }
 
+/*
+ * Sends large blocks of output with MSG_ZEROCOPY on Linux so the kernel
+ * transmits straight from our pages rather than copying them into the
+ * socket buffer first. Only worth it on fast links with big sends and
+ * off by default.
+ */
+void
+ssh_packet_set_zerocopy(struct ssh *ssh)
+{
+#ifdef PACKET_ZEROCOPY
+	struct session_state *state = ssh->state;
+	int on = 1;
+
+	if (state->zerocopy || !ssh_packet_connection_is_on_socket(ssh))
+		return;
+	if (setsockopt(state->connection_out, SOL_SOCKET, SO_ZEROCOPY,
+	    &on, sizeof(on)) == -1) {
+		debug_f("setsockopt SO_ZEROCOPY: %s", strerror(errno));
+		return;
+	}
+	debug_f("sending large output with MSG_ZEROCOPY");
+	state->zerocopy = 1;
+#else
+	debug_f("MSG_ZEROCOPY not supported on this platform");
+#endif
+}
+
+/*
+ * Keeps the unsent part of the socket buffer down to about len bytes so
+ * that an interactive packet queued behind bulk data goes out after at
+ * most len bytes rather than after the whole send buffer. The data in
+ * flight, which is what keeps the link busy, is not limited. Bulk output
+ * waiting in the packet layer is capped to the same amount in
+ * ssh_packet_not_very_much_data_to_write().
+ */
+void
+ssh_packet_set_notsent_lowat(struct ssh *ssh, size_t len)
+{
+#ifdef TCP_NOTSENT_LOWAT
+	struct session_state *state = ssh->state;
+	int val;
+
+	if (len == 0 || !ssh_packet_connection_is_on_socket(ssh))
+		return;
+	val = (int)MINIMUM(len, INT_MAX);
+	if (setsockopt(state->connection_out, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+	    &val, sizeof(val)) == -1) {
+		debug_f("setsockopt TCP_NOTSENT_LOWAT: %s", strerror(errno));
+		return;
+	}
+	debug_f("holding unsent output to %d bytes", val);
+	state->notsent_lowat = len;
+#else
+	if (len != 0)
+		debug_f("TCP_NOTSENT_LOWAT not supported on this platform");
+#endif
+}
+
+/*
+ * Limits what is sent on the connection to rate bytes per second. On a
+ * socket that takes SO_MAX_PACING_RATE the kernel spaces the segments
+ * out (with the fq qdisc or TCP's own pacing), which is smoother than
+ * anything done from here. Otherwise ssh_packet_write_poll() meters the
+ * output through a token bucket holding 50ms worth of data, and the
+ * event loops wait ssh_packet_write_delay_ms() before writing again.
+ */
+void
+ssh_packet_set_send_rate(struct ssh *ssh, u_int64_t rate)
+{
+	struct session_state *state = ssh->state;
+#ifdef SO_MAX_PACING_RATE
+	u_int32_t val;
+#endif
+
+	state->send_rate = rate;
+	state->send_paced = 0;
+	if (rate == 0)
+		return;
+#ifdef SO_MAX_PACING_RATE
+	val = (u_int32_t)MINIMUM(rate, UINT32_MAX);
+	if (ssh_packet_connection_is_on_socket(ssh)) {
+		if (setsockopt(state->connection_out, SOL_SOCKET,
+		    SO_MAX_PACING_RATE, &val, sizeof(val)) == 0) {
+			debug_f("kernel pacing output to %u bytes/s", val);
+			state->send_paced = 1;
+			return;
+		}
+		debug_f("setsockopt SO_MAX_PACING_RATE: %s", strerror(errno));
+	}
+#endif
+	state->rate_burst = MAXIMUM((double)rate / 20, 8192);
+	state->rate_tokens = state->rate_burst;
+	state->rate_last = monotime_double();
+	debug_f("metering output to %llu bytes/s", (unsigned long long)rate);
+}
+
+/* Returns how many bytes the token bucket lets us write now */
+static size_t
+ssh_packet_rate_allowance(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+	double now;
+
+	if (state->send_rate == 0 || state->send_paced)
+		return SIZE_MAX;
+	now = monotime_double();
+	state->rate_tokens = MINIMUM(state->rate_burst, state->rate_tokens +
+	    (now - state->rate_last) * state->send_rate);
+	state->rate_last = now;
+	/* wait for a worthwhile amount rather than dribbling it out */
+	if (state->rate_tokens < MINIMUM(sshbuf_len(state->output),
+	    state->rate_burst / 4))
+		return 0;
+	return (size_t)state->rate_tokens;
+}
+
+/*
+ * Returns how many milliseconds to wait before the token bucket allows
+ * pending output to be written, or 0 if it can be written now.
+ */
+int
+ssh_packet_write_delay_ms(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+	double ms;
+
+	if (sshbuf_len(state->output) == 0 ||
+	    ssh_packet_rate_allowance(ssh) != 0)
+		return 0;
+	ms = (MINIMUM(sshbuf_len(state->output), state->rate_burst / 4) -
+	    state->rate_tokens) * 1000 / state->send_rate;
+	/* round up, a wakeup just short of the refill would be wasted */
+	return (int)ms + (ms > (int)ms);
+}
+
+/* free buffers that are sent and that the kernel is done with */
+static void
+ssh_packet_zc_release(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+	struct zc_buf *zb;
+
+	while (state->zc_done != state->zc_next &&
+	    state->zc_complete[state->zc_done % ZC_WINDOW]) {
+		state->zc_complete[state->zc_done % ZC_WINDOW] = 0;
+		state->zc_done++;
+	}
+	while ((zb = TAILQ_FIRST(&state->zc_bufs)) != NULL) {
+		if (sshbuf_len(zb->buf) != 0 ||
+		    (zb->pinned && (int32_t)(zb->last - state->zc_done) >= 0))
+			break;
+		TAILQ_REMOVE(&state->zc_bufs, zb, next);
+		/* keep one, it has already grown to the size we need */
+		if (state->zc_spare == NULL)
+			state->zc_spare = zb->buf;
+		else
+			sshbuf_free(zb->buf);
+		free(zb);
+	}
+}
+
+static void
+ssh_packet_zc_free(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+	struct zc_buf *zb;
+
+	ssh_packet_zc_release(ssh);
+	while ((zb = TAILQ_FIRST(&state->zc_bufs)) != NULL) {
+		TAILQ_REMOVE(&state->zc_bufs, zb, next);
+		/*
+		 * the kernel may still be sending from this one. Leave it
+		 * allocated rather than let the memory be reused under it.
+		 */
+		if (!zb->pinned)
+			sshbuf_free(zb->buf);
+		free(zb);
+	}
+	sshbuf_free(state->zc_spare);
+	state->zc_spare = NULL;
+	state->zc_unsent = 0;
+}
+
+#ifdef PACKET_ZEROCOPY
+/* collect the kernel's notices of zerocopy sends it has finished with */
+static int
+ssh_packet_zc_reap(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+	struct sock_extended_err *serr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	u_char control[128];
+	u_int32_t n;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(state->connection_out, &msg, MSG_ERRQUEUE) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return SSH_ERR_SYSTEM_ERROR;
+		}
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!(cmsg->cmsg_level == SOL_IP &&
+			    cmsg->cmsg_type == IP_RECVERR) &&
+			    !(cmsg->cmsg_level == SOL_IPV6 &&
+			    cmsg->cmsg_type == IPV6_RECVERR))
+				continue;
+			serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (serr->ee_errno != 0 ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			/* ee_info to ee_data is the range of send ids */
+			for (n = 0; n <= serr->ee_data - serr->ee_info &&
+			    n < ZC_WINDOW; n++)
+				state->zc_complete[(serr->ee_info + n) %
+				    ZC_WINDOW] = 1;
+			/*
+			 * the kernel had to copy the data anyway (loopback or
+			 * a NIC that can't gather) so we only pay for the
+			 * notifications. Stop asking.
+			 */
+			if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) &&
+			    state->zerocopy) {
+				debug_f("kernel is copying zerocopy sends, "
+				    "going back to plain writes");
+				state->zerocopy = 0;
+			}
+		}
+	}
+	ssh_packet_zc_release(ssh);
+	return 0;
+}
+
+/*
+ * Moves large sealed output onto the zerocopy queue and sends what is
+ * queued with one gathering sendmsg(). Anything left in state->output
+ * goes out after the queue has drained.
+ */
+static int
+ssh_packet_write_zerocopy(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+	struct iovec iov[ZC_MAX_IOV];
+	struct msghdr msg;
+	struct zc_buf *zb;
+	struct sshbuf *next;
+	size_t len, take;
+	ssize_t sent;
+	int r, flags, niov = 0;
+
+	if ((r = ssh_packet_zc_reap(ssh)) != 0)
+		return r;
+	len = sshbuf_len(state->output);
+	if (state->zerocopy && len >= ZC_MIN_SEND &&
+	    state->zc_next - state->zc_done < ZC_WINDOW) {
+		if (state->zc_spare != NULL) {
+			next = state->zc_spare;
+			state->zc_spare = NULL;
+		} else if ((next = sshbuf_new()) == NULL)
+			return SSH_ERR_ALLOC_FAIL;
+		sshbuf_relabel(next, "output");
+		sshbuf_type(next, BUF_PACKET_OUTPUT);
+		zb = xcalloc(1, sizeof(*zb));
+		zb->buf = state->output;
+		TAILQ_INSERT_TAIL(&state->zc_bufs, zb, next);
+		state->zc_unsent += len;
+		state->output = next;
+	}
+	if (state->zc_unsent == 0)
+		return 0;
+
+	TAILQ_FOREACH(zb, &state->zc_bufs, next) {
+		if (sshbuf_len(zb->buf) == 0)
+			continue;
+		iov[niov].iov_base = sshbuf_mutable_ptr(zb->buf);
+		iov[niov].iov_len = sshbuf_len(zb->buf);
+		if (++niov == ZC_MAX_IOV)
+			break;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = niov;
+	flags = (state->zerocopy &&
+	    state->zc_next - state->zc_done < ZC_WINDOW) ? MSG_ZEROCOPY : 0;
+	sent = sendmsg(state->connection_out, &msg, flags);
+	if (sent == -1 && errno == ENOBUFS && flags != 0) {
+		/* over the locked memory limit, copy this one */
+		flags = 0;
+		sent = sendmsg(state->connection_out, &msg, flags);
+	}
+	if (sent == -1) {
+		if (errno == EINTR || errno == EAGAIN ||
+		    errno == EWOULDBLOCK)
+			return 0;
+		return SSH_ERR_SYSTEM_ERROR;
+	}
+	if (sent == 0)
+		return SSH_ERR_CONN_CLOSED;
+	TAILQ_FOREACH(zb, &state->zc_bufs, next) {
+		if (sent == 0)
+			break;
+		if ((take = MINIMUM((size_t)sent, sshbuf_len(zb->buf))) == 0)
+			continue;
+		if (flags != 0) {
+			zb->pinned = 1;
+			zb->last = state->zc_next;
+		}
+		if ((r = sshbuf_consume(zb->buf, take)) != 0)
+			return r;
+		state->zc_unsent -= take;
+		sent -= take;
+	}
+	if (flags != 0)
+		state->zc_next++;
+	ssh_packet_zc_release(ssh);
+	return 0;
+}
+#endif /* PACKET_ZEROCOPY */
+
 /* Closes the connection and clears and frees internal data structures. */
 
 static void
@@ -731,6 +1149,7 @@ ssh_packet_close_internal(struct ssh *ssh, int do_close)
 		TAILQ_REMOVE(&state->outgoing, p, next);
 		free(p);
 	}
+	ssh_packet_zc_free(ssh);
 	for (mode = 0; mode < MODE_MAX; mode++) {
 		kex_free_newkeys(state->newkeys[mode]);	/* current keys */
 		state->newkeys[mode] = NULL;
@@ -996,6 +1415,144 @@ ssh_clear_newkeys(struct ssh *ssh, int mode)
 	}
 }
 
+/*
+ * Seal any packets the send cipher has queued in the output buffer
+ * (see cipher_crypt_defer()). This has to happen before anything reads
+ * from state->output or the send context goes away.
+ */
+static int
+ssh_packet_seal_output(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+	struct sshmac *mac = NULL;
+	int r;
+
+	if (cipher_crypt_pending(state->send_context) != 0 &&
+	    (r = cipher_crypt_flush(state->send_context,
+	    sshbuf_mutable_ptr(state->output))) != 0)
+		return r;
+	/* EtM tags are over the ciphertext so they come second */
+	if (state->newkeys[MODE_OUT] != NULL)
+		mac = &state->newkeys[MODE_OUT]->mac;
+	if (mac == NULL || mac_mt_pending(mac->mt) == 0)
+		return 0;
+	return mac_mt_flush(mac->mt, sshbuf_mutable_ptr(state->output));
+}
+
+/*
+ * Queue every complete packet waiting in the input buffer, starting
+ * with the one at the front, to be decrypted and verified together
+ * (see cipher_open_queue()). Only for AEAD ciphers, which keep the
+ * packet length out of the encrypted payload. Anything that looks
+ * wrong is left for the serial path to complain about.
+ */
+static int
+ssh_packet_open_ahead(struct ssh *ssh, u_int block_size, u_int authlen)
+{
+	struct session_state *state = ssh->state;
+	const u_char *cp = sshbuf_ptr(state->input);
+	size_t left = sshbuf_len(state->input);
+	u_int seqnr = state->p_read.seqnr;
+	u_int len;
+	int r;
+
+	while (left >= 4) {
+		/* the cipher may not be able to decrypt lengths this far
+		 * ahead, in which case we stop here */
+		if (cipher_get_length(state->receive_context, &len, seqnr,
+		    cp, left) != 0)
+			break;
+		if (len < 1 + 4 || len > packet_max_size ||
+		    len % block_size != 0 || left - 4 < (size_t)len + authlen)
+			break;
+		if ((r = cipher_open_queue(state->receive_context, seqnr, cp,
+		    len, 4, authlen)) == SSH_ERR_NO_BUFFER_SPACE)
+			break;
+		else if (r != 0)
+			return r;
+		cp += 4 + len + authlen;
+		left -= 4 + len + authlen;
+		seqnr++;
+	}
+	return cipher_open_batch(state->receive_context);
+}
+
+/*
+ * Queue every complete packet waiting in the input buffer, starting
+ * with the one at the front, to have its EtM tag checked along with the
+ * others (see mac-mt.c). Anything that looks wrong is left for the
+ * serial path to complain about.
+ */
+static int
+ssh_packet_check_ahead(struct ssh *ssh, struct sshmac *mac)
+{
+	struct session_state *state = ssh->state;
+	const u_char *cp = sshbuf_ptr(state->input);
+	size_t left = sshbuf_len(state->input);
+	u_int seqnr = state->p_read.seqnr;
+	u_int len;
+	int r;
+
+	while (left >= 4) {
+		len = PEEK_U32(cp);
+		if (len < 1 + 4 || len > packet_max_size ||
+		    left - 4 < (size_t)len + mac->mac_len)
+			break;
+		if ((r = mac_mt_check_queue(mac->mt, seqnr, cp, 4 + len,
+		    cp + 4 + len)) == SSH_ERR_NO_BUFFER_SPACE)
+			break;
+		else if (r != 0)
+			return r;
+		cp += 4 + len + mac->mac_len;
+		left -= 4 + len + mac->mac_len;
+		seqnr++;
+	}
+	return mac_mt_check_batch(mac->mt);
+}
+
+/*
+ * Called once the new keys have been derived but before they are
+ * switched in. Gives the threaded ciphers a head start on the
+ * keystream for the new keys.
+ */
+void
+ssh_packet_stage_newkeys(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+	struct sshenc *enc;
+	int mode, r;
+
+	if (!state->after_authentication)
+		return;
+	for (mode = 0; mode < MODE_MAX; mode++) {
+		if (ssh->kex->newkeys[mode] == NULL)
+			continue;
+		enc = &ssh->kex->newkeys[mode]->enc;
+		if ((r = cipher_stage_keys(mode == MODE_OUT ?
+		    state->send_context : state->receive_context, enc->cipher,
+		    enc->key, enc->key_len, enc->iv, enc->iv_len)) != 0)
+			debug_fr(r, "cipher_stage_keys");
+	}
+}
+
+/*
+ * Whether a cipher may run on worker threads: only after authentication
+ * and, in FIPS mode, only the AES-GCM ciphers since they still use the
+ * OpenSSL implementation. Both the rekey path and the in-place switch
+ * ask here so they agree whenever either happens first.
+ */
+static int
+ssh_packet_threads_ok(struct ssh *ssh, const struct sshenc *enc)
+{
+	struct session_state *state = ssh->state;
+
+	if (!state->after_authentication)
+		return 0;
+	if (state->fips == -1)
+		state->fips = fips_enabled();
+	return !state->fips || strstr(enc->name, "gcm") != NULL;
+}
+
 int
 ssh_set_newkeys(struct ssh *ssh, int mode)
 {
@@ -1007,13 +1564,16 @@ ssh_set_newkeys(struct ssh *ssh, int mode)
 	struct packet_state *ps;
 	u_int64_t *max_blocks;
 	const char *wmsg;
-	int r, crypt_type;
+	int r, crypt_type, threads;
 	const char *dir = mode == MODE_OUT ? "out" : "in";
 	char blocks_s[FMT_SCALED_STRSIZE], bytes_s[FMT_SCALED_STRSIZE];
 
 	debug2_f("mode %d", mode);
 
 	if (mode == MODE_OUT) {
+		/* the old key still has to seal what it queued */
+		if ((r = ssh_packet_seal_output(ssh)) != 0)
+			return r;
 		ccp = &state->send_context;
 		crypt_type = CIPHER_ENCRYPT;
 		ps = &state->p_send;
@@ -1053,26 +1613,39 @@ ssh_set_newkeys(struct ssh *ssh, int mode)
 	 * from the CPU -cjr 3/21/2023 */
 	if (ssh->none_mac != 1)
 		mac->enabled = 1;
+	threads = ssh_packet_threads_ok(ssh, enc);
+	/* after authentication EtM tags are done in parallel batches */
+	if (threads && mac->enabled && mac->etm &&
+	    cipher_authlen(enc->cipher) == 0)
+		mac->mt = mac_mt_new(mac);
 
 	DBG(debug_f("cipher_init: %s", dir));
-	cipher_free(*ccp);
-	*ccp = NULL;
 #ifdef WITH_OPENSSL
 	if (strcmp(enc->name, "chacha20-poly1305-mt@hpnssh.org") == 0) {
-		if (state->after_authentication)
+		if (threads)
 			enc->cipher = cipher_by_name(
 			    "chacha20-poly1305-mt@hpnssh.org");
 		else
 			enc->cipher = cipher_by_name(
 			    "chacha20-poly1305@openssh.com");
 		if (enc->cipher == NULL)
-			return r;
+			return SSH_ERR_INTERNAL_ERROR;
 	}
 #endif
-	if ((r = cipher_init(ccp, enc->cipher, enc->key, enc->key_len, enc->iv,
-	    enc->iv_len, crypt_type ? state->p_send.seqnr : state->p_read.seqnr,
-	    crypt_type, state->after_authentication)) != 0)
-		return r;
+	/* the threaded ciphers can take the new key without
+	 * tearing down their threads. Otherwise start from scratch */
+	if (cipher_reinit(*ccp, enc->cipher, enc->key, enc->key_len,
+	    enc->iv, enc->iv_len, threads) != 0) {
+		cipher_free(*ccp);
+		*ccp = NULL;
+		if ((r = cipher_init(ccp, enc->cipher, enc->key, enc->key_len,
+		    enc->iv, enc->iv_len,
+		    crypt_type ? state->p_send.seqnr : state->p_read.seqnr,
+		    crypt_type, threads)) != 0)
+			return r;
+	}
+	if (state->cipher_demand != -1)
+		cipher_set_demand(*ccp, state->cipher_demand);
 	if (!state->cipher_warning_done &&
 	    (wmsg = cipher_warning_message(*ccp)) != NULL) {
 		error("Warning: %s", wmsg);
@@ -1117,6 +1690,74 @@ ssh_set_newkeys(struct ssh *ssh, int mode)
 	return 0;
 }
 
+/*
+ * Swap the serial cipher contexts for the threaded ones in place. The
+ * key and the current IV are taken from the serial context the same way
+ * they are when the packet state crosses the privsep boundary (see
+ * newkeys_to_blob()) and the sequence numbers carry on, so nothing
+ * changes on the wire and the peer doesn't need to know. This replaces
+ * the extra key exchange we used to force after authentication.
+ * It has to be called from the process that will run the session and
+ * after any fork, since the worker threads don't survive one. In FIPS
+ * mode only AES-GCM contexts are swapped.
+ */
+int
+ssh_packet_start_threads(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+	struct sshcipher_ctx **ccp;
+	const struct sshcipher *c;
+	struct sshenc *enc;
+	struct sshmac *mac;
+	int mode, r;
+
+	ssh_packet_set_authenticated(ssh);
+	if (state->threads_started)
+		return 0;
+	/* anything queued belongs to the serial context */
+	if ((r = ssh_packet_seal_output(ssh)) != 0)
+		return r;
+	for (mode = 0; mode < MODE_MAX; mode++) {
+		if (state->newkeys[mode] == NULL)
+			continue;
+		enc = &state->newkeys[mode]->enc;
+		mac = &state->newkeys[mode]->mac;
+		if (!ssh_packet_threads_ok(ssh, enc)) {
+			debug_f("%s stays serial in FIPS mode",
+			    mode == MODE_OUT ? "out" : "in");
+			continue;
+		}
+		ccp = mode == MODE_OUT ? &state->send_context :
+		    &state->receive_context;
+		if ((r = cipher_get_keyiv(*ccp, enc->iv, enc->iv_len)) != 0)
+			return r;
+		c = enc->cipher;
+#ifdef WITH_OPENSSL
+		if (strcmp(enc->name, "chacha20-poly1305-mt@hpnssh.org") == 0 &&
+		    (c = cipher_by_name(enc->name)) == NULL)
+			return SSH_ERR_INTERNAL_ERROR;
+#endif
+		if (mac->enabled && mac->etm && mac->mt == NULL &&
+		    cipher_authlen(c) == 0)
+			mac->mt = mac_mt_new(mac);
+		cipher_free(*ccp);
+		*ccp = NULL;
+		if ((r = cipher_init(ccp, c, enc->key, enc->key_len,
+		    enc->iv, enc->iv_len, mode == MODE_OUT ?
+		    state->p_send.seqnr : state->p_read.seqnr,
+		    mode == MODE_OUT ? CIPHER_ENCRYPT : CIPHER_DECRYPT,
+		    CIPHER_MULTITHREAD)) != 0)
+			return r;
+		enc->cipher = c;
+		if (state->cipher_demand != -1)
+			cipher_set_demand(*ccp, state->cipher_demand);
+		debug_f("%s now %s", mode == MODE_OUT ? "out" : "in",
+		    cipher_ctx_name(*ccp));
+	}
+	state->threads_started = 1;
+	return 0;
+}
+
 /* this supports the forced rekeying required for the NONE cipher */
 void
 packet_request_rekeying(void)
@@ -1373,12 +2014,32 @@ ssh_packet_send2_wrapped(struct ssh *ssh)
 	if ((r = sshbuf_reserve(state->output,
 	    sshbuf_len(state->outgoing_packet) + authlen, &cp)) != 0)
 		goto out;
-	if ((r = cipher_crypt(state->send_context, state->p_send.seqnr, cp,
-	    sshbuf_ptr(state->outgoing_packet), len - aadlen, aadlen, authlen))
-	    != 0)
+	if (cipher_can_defer(state->send_context)) {
+		/* sealed along with its neighbours before it is written */
+		if ((r = cipher_crypt_defer(state->send_context,
+		    state->p_send.seqnr, sshbuf_mutable_ptr(state->output), cp,
+		    sshbuf_ptr(state->outgoing_packet), len - aadlen, aadlen,
+		    authlen)) != 0)
+			goto out;
+	} else if ((r = cipher_crypt(state->send_context,
+	    state->p_send.seqnr, cp, sshbuf_ptr(state->outgoing_packet),
+	    len - aadlen, aadlen, authlen)) != 0)
 		goto out;
 	/* append unencrypted MAC */
-	if (mac && mac->enabled) {
+	if (mac && mac->enabled && mac->etm && mac->mt != NULL) {
+		/* EtM: computed along with its neighbours before it is
+		 * written. Reserving may move the buffer */
+		size_t off = cp - sshbuf_ptr(state->output);
+		u_char *base, *macp;
+
+		if ((r = sshbuf_reserve(state->output, mac->mac_len,
+		    &macp)) != 0)
+			goto out;
+		base = sshbuf_mutable_ptr(state->output);
+		if ((r = mac_mt_enqueue(mac->mt, state->p_send.seqnr, base,
+		    base + off, len, macp)) != 0)
+			goto out;
+	} else if (mac && mac->enabled) {
 		if (mac->etm) {
 			/* EtM: compute mac over aadlen + cipher text */
 			if ((r = mac_compute(mac, state->p_send.seqnr,
@@ -1766,10 +2427,19 @@ ssh_packet_read_poll2(struct ssh *ssh, u_char *typep, u_int32_t *seqnr_p)
 #endif
 	/* EtM: check mac over encrypted input */
 	if (mac && mac->enabled && mac->etm) {
-		if ((r = mac_check(mac, state->p_read.seqnr,
-		    sshbuf_ptr(state->input), aadlen + need,
-		    sshbuf_ptr(state->input) + aadlen + need + authlen,
-		    maclen)) != 0) {
+		/* and over every whole packet after it, if we can */
+		if (mac->mt != NULL && mac_mt_pending(mac->mt) == 0 &&
+		    (r = ssh_packet_check_ahead(ssh, mac)) != 0)
+			goto out;
+		if (mac_mt_pending(mac->mt) != 0)
+			r = mac_mt_check_take(mac->mt, state->p_read.seqnr,
+			    aadlen + need);
+		else
+			r = mac_check(mac, state->p_read.seqnr,
+			    sshbuf_ptr(state->input), aadlen + need,
+			    sshbuf_ptr(state->input) + aadlen + need + authlen,
+			    maclen);
+		if (r != 0) {
 			if (r == SSH_ERR_MAC_INVALID)
 				logit("Corrupted MAC on input.");
 			goto out;
@@ -1778,8 +2448,18 @@ ssh_packet_read_poll2(struct ssh *ssh, u_char *typep, u_int32_t *seqnr_p)
 	if ((r = sshbuf_reserve(state->incoming_packet, aadlen + need,
 	    &cp)) != 0)
 		goto out;
-	if ((r = cipher_crypt(state->receive_context, state->p_read.seqnr, cp,
-	    sshbuf_ptr(state->input), need, aadlen, authlen)) != 0)
+	/* AEAD packets may have been opened along with the ones before */
+	if (authlen && cipher_can_defer(state->receive_context) &&
+	    cipher_crypt_pending(state->receive_context) == 0 &&
+	    (r = ssh_packet_open_ahead(ssh, block_size, authlen)) != 0)
+		goto out;
+	if (cipher_crypt_pending(state->receive_context) != 0) {
+		if ((r = cipher_open_take(state->receive_context,
+		    state->p_read.seqnr, cp, need, aadlen)) != 0)
+			goto out;
+	} else if ((r = cipher_crypt(state->receive_context,
+	    state->p_read.seqnr, cp, sshbuf_ptr(state->input), need, aadlen,
+	    authlen)) != 0)
 		goto out;
 	if ((r = sshbuf_consume(state->input, aadlen + need + authlen)) != 0)
 		goto out;
@@ -2011,6 +2691,65 @@ ssh_packet_process_incoming(struct ssh *ssh, const char *buf, u_int len)
 	return 0;
 }
 
+/*
+ * Sets how much a single wakeup may pull off the socket. 0 goes back to
+ * one read of at most packet_max_size. Only for non-blocking sockets.
+ */
+void
+ssh_packet_set_read_high_water(struct ssh *ssh, size_t len)
+{
+	struct session_state *state = ssh->state;
+
+	state->read_high_water = len;
+	state->read_size = 0;
+	if (len != 0)
+		debug_f("reading up to %zu bytes per wakeup", len);
+}
+
+/*
+ * Reads until the socket is empty or read_high_water bytes are waiting
+ * in the input buffer. Each read asks for read_size bytes, which
+ * doubles while reads come back full and halves when they come back
+ * mostly empty, so a busy connection gets one large read per wakeup and
+ * an idle one doesn't hold a large buffer.
+ */
+static int
+ssh_packet_read_batch(struct ssh *ssh, int fd)
+{
+	struct session_state *state = ssh->state;
+	size_t want, have, rlen, total = 0;
+	int r;
+
+	if (state->read_size < packet_max_size)
+		state->read_size = packet_max_size;
+	for (;;) {
+		have = sshbuf_len(state->input);
+		/* always take at least a packet's worth */
+		want = state->read_high_water > have ?
+		    state->read_high_water - have : 0;
+		want = MINIMUM(MAXIMUM(want, packet_max_size),
+		    state->read_size);
+		if ((r = sshbuf_read(fd, state->input, want, &rlen)) != 0) {
+			/* the socket is empty or closed; report it next time */
+			if (total != 0 && r == SSH_ERR_SYSTEM_ERROR)
+				return 0;
+			return r;
+		}
+		total += rlen;
+		if (rlen < want) {
+			if (rlen < want / 4)
+				state->read_size = MAXIMUM(state->read_size / 2,
+				    packet_max_size);
+			return 0;
+		}
+		if (state->read_size < state->read_high_water)
+			state->read_size = MINIMUM(state->read_size * 2,
+			    state->read_high_water);
+		if (sshbuf_len(state->input) >= state->read_high_water)
+			return 0;
+	}
+}
+
 /* Reads and buffers data from the specified fd */
 int
 ssh_packet_process_read(struct ssh *ssh, int fd)
@@ -2019,6 +2758,10 @@ ssh_packet_process_read(struct ssh *ssh, int fd)
 	int r;
 	size_t rlen;
 
+	if (state->read_high_water > packet_max_size &&
+	    !state->packet_discard)
+		return ssh_packet_read_batch(ssh, fd);
+
 	if ((r = sshbuf_read(fd, state->input, packet_max_size, &rlen)) != 0)
 		return r;
 
@@ -2225,9 +2968,26 @@ int
 ssh_packet_write_poll(struct ssh *ssh)
 {
 	struct session_state *state = ssh->state;
-	int len = sshbuf_len(state->output);
+	size_t allow;
+	int len;
 	int r;
 
+	if ((r = ssh_packet_seal_output(ssh)) != 0)
+		return r;
+#ifdef PACKET_ZEROCOPY
+	/* metered output is written a slice at a time, see below */
+	if ((state->zerocopy && (state->send_rate == 0 ||
+	    state->send_paced)) || !TAILQ_EMPTY(&state->zc_bufs)) {
+		if ((r = ssh_packet_write_zerocopy(ssh)) != 0)
+			return r;
+		/* the queue goes out before anything newer */
+		if (state->zc_unsent != 0)
+			return 0;
+	}
+#endif
+	len = MINIMUM(sshbuf_len(state->output), INT_MAX);
+	if (len > 0 && (allow = ssh_packet_rate_allowance(ssh)) < (size_t)len)
+		len = allow;
 	if (len > 0) {
 		len = write(state->connection_out,
 		    sshbuf_ptr(state->output), len);
@@ -2241,6 +3001,8 @@ ssh_packet_write_poll(struct ssh *ssh)
 			return SSH_ERR_CONN_CLOSED;
 		if ((r = sshbuf_consume(state->output, len)) != 0)
 			return r;
+		if (state->send_rate != 0 && !state->send_paced)
+			state->rate_tokens -= len;
 	}
 	return 0;
 }
@@ -2252,7 +3014,7 @@ ssh_packet_write_poll(struct ssh *ssh)
 int
 ssh_packet_write_wait(struct ssh *ssh)
 {
-	int ret, r, ms_remain = 0;
+	int ret, r, ms_remain = 0, delay;
 	struct timeval start;
 	struct timespec timespec, *timespecp = NULL;
 	struct session_state *state = ssh->state;
@@ -2261,6 +3023,14 @@ ssh_packet_write_wait(struct ssh *ssh)
 	if ((r = ssh_packet_write_poll(ssh)) != 0)
 		return r;
 	while (ssh_packet_have_data_to_write(ssh)) {
+		/* held back by the send rate limit rather than the socket */
+		if ((delay = ssh_packet_write_delay_ms(ssh)) > 0) {
+			ms_to_timespec(&timespec, delay);
+			nanosleep(&timespec, NULL);
+			if ((r = ssh_packet_write_poll(ssh)) != 0)
+				return r;
+			continue;
+		}
 		pfd.fd = state->connection_out;
 		pfd.events = POLLOUT;
 
@@ -2299,7 +3069,8 @@ ssh_packet_write_wait(struct ssh *ssh)
 int
 ssh_packet_have_data_to_write(struct ssh *ssh)
 {
-	return sshbuf_len(ssh->state->output) != 0;
+	return sshbuf_len(ssh->state->output) != 0 ||
+	    ssh->state->zc_unsent != 0;
 }
 
 /* Returns true if there is not too much data to write to the connection. */
@@ -2307,10 +3078,15 @@ ssh_packet_have_data_to_write(struct ssh *ssh)
 int
 ssh_packet_not_very_much_data_to_write(struct ssh *ssh)
 {
+	size_t len = sshbuf_len(ssh->state->output) + ssh->state->zc_unsent;
+
 	if (ssh->state->interactive_mode)
-		return sshbuf_len(ssh->state->output) < 16384;
+		return len < 16384;
+	else if (ssh->state->notsent_lowat != 0)
+		return len < MINIMUM(128 * 1024,
+		    MAXIMUM(ssh->state->notsent_lowat, 16384));
 	else
-		return sshbuf_len(ssh->state->output) < 128 * 1024;
+		return len < 128 * 1024;
 }
 
 /*
@@ -2349,6 +3125,10 @@ ssh_packet_set_interactive(struct ssh *ssh, int interactive)
 
 	state->interactive_mode = interactive;
 	apply_qos(ssh);
+	/* the threaded ciphers size their keystream buffers on this */
+	state->cipher_demand = !interactive;
+	cipher_set_demand(state->send_context, state->cipher_demand);
+	cipher_set_demand(state->receive_context, state->cipher_demand);
 }
 
 /* Set QoS flags to be used for interactive and non-interactive sessions */
@@ -2419,6 +3199,56 @@ ssh_packet_get_rekey_timeout(struct ssh *ssh)
 	return (seconds <= 0 ? 1 : seconds);
 }
 
+/*
+ * Seconds until ssh_packet_check_idle() may find the connection quiet,
+ * 0 if it doesn't need to be called before there is more traffic
+ */
+time_t
+ssh_packet_get_idle_timeout(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+	time_t seconds;
+
+	if (!state->after_authentication || state->ciphers_trimmed)
+		return 0;
+	seconds = state->idle_since + IDLE_SECS - monotime();
+	return (seconds <= 0 ? 1 : seconds);
+}
+
+/*
+ * Called on every pass through the client and server loops. Once the
+ * connection goes quiet the threaded ciphers shrink their keystream
+ * buffers and park their workers. When the traffic picks up again a
+ * bulk session gets them back straight away, otherwise the ciphers
+ * grow them as they need to.
+ */
+void
+ssh_packet_check_idle(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+	u_int64_t bytes = state->p_send.bytes + state->p_read.bytes;
+	time_t now;
+
+	if (!state->after_authentication)
+		return;
+	now = monotime();
+	if (state->idle_since == 0 || bytes - state->idle_bytes >= IDLE_BYTES) {
+		state->idle_bytes = bytes;
+		state->idle_since = now;
+		if (state->ciphers_trimmed && state->cipher_demand == 1) {
+			cipher_set_demand(state->send_context, 1);
+			cipher_set_demand(state->receive_context, 1);
+		}
+		state->ciphers_trimmed = 0;
+	} else if (!state->ciphers_trimmed &&
+	    now - state->idle_since >= IDLE_SECS) {
+		debug3_f("connection is quiet, trimming cipher buffers");
+		cipher_set_demand(state->send_context, 0);
+		cipher_set_demand(state->receive_context, 0);
+		state->ciphers_trimmed = 1;
+	}
+}
+
 void
 ssh_packet_set_server(struct ssh *ssh)
 {
@@ -2439,6 +3269,32 @@ ssh_packet_set_authenticated(struct ssh *ssh)
 {
 	ssh->state->after_authentication = 1;
 	packet_max_size = SSH_IOBUFSZ + 1024;
+	/* unless an HPN peer agreed to send us more */
+	if (ssh->state->hpn_max_packet != 0)
+		packet_max_size = MAXIMUM(packet_max_size,
+		    ssh->state->hpn_max_packet + 1024);
+}
+
+/* The peer is HPN and agreed to channel packets of up to len bytes of
+ * data (see hpn-max-packet@hpnssh.org in kex.c). Take packets that big
+ * and let the channels and parallel ciphers use them */
+void
+ssh_packet_set_hpn_max_packet(struct ssh *ssh, u_int len)
+{
+	struct session_state *state = ssh->state;
+
+	debug_f("%u", len);
+	state->hpn_max_packet = len;
+	/* room for the framing, padding and MAC */
+	packet_max_size = MAXIMUM(packet_max_size, len + 1024);
+	state->max_packet_size = MAXIMUM(state->max_packet_size, len);
+	cipher_set_mt_max_packet(len);
+}
+
+u_int
+ssh_packet_get_hpn_max_packet(struct ssh *ssh)
+{
+	return ssh->state->hpn_max_packet;
 }
 
 void *
@@ -2450,6 +3306,10 @@ ssh_packet_get_input(struct ssh *ssh)
 void *
 ssh_packet_get_output(struct ssh *ssh)
 {
+	int r;
+
+	if ((r = ssh_packet_seal_output(ssh)) != 0)
+		fatal_fr(r, "seal output");
 	return (void *)ssh->state->output;
 }
 
@@ -2487,7 +3347,8 @@ kex_to_blob(struct sshbuf *m, struct kex *kex)
 	    (r = sshbuf_put_stringb(m, kex->client_version)) != 0 ||
 	    (r = sshbuf_put_stringb(m, kex->server_version)) != 0 ||
 	    (r = sshbuf_put_stringb(m, kex->session_id)) != 0 ||
-	    (r = sshbuf_put_u32(m, kex->flags)) != 0)
+	    (r = sshbuf_put_u32(m, kex->flags)) != 0 ||
+	    (r = sshbuf_put_u32(m, kex->hpn_max_packet)) != 0)
 		return r;
 	return 0;
 }
@@ -2544,7 +3405,8 @@ ssh_packet_get_state(struct ssh *ssh, struct sshbuf *m)
 	int r;
 
 #define ENCODE_INT(v) (((v) < 0) ? 0xFFFFFFFF : (u_int)v)
-	if ((r = kex_to_blob(m, ssh->kex)) != 0 ||
+	if ((r = ssh_packet_seal_output(ssh)) != 0 ||
+	    (r = kex_to_blob(m, ssh->kex)) != 0 ||
 	    (r = newkeys_to_blob(m, ssh, MODE_OUT)) != 0 ||
 	    (r = newkeys_to_blob(m, ssh, MODE_IN)) != 0 ||
 	    (r = sshbuf_put_u64(m, state->rekey_limit)) != 0 ||
@@ -2654,7 +3516,8 @@ kex_from_blob(struct sshbuf *m, struct kex **kexp)
 	    (r = sshbuf_get_stringb(m, kex->client_version)) != 0 ||
 	    (r = sshbuf_get_stringb(m, kex->server_version)) != 0 ||
 	    (r = sshbuf_get_stringb(m, kex->session_id)) != 0 ||
-	    (r = sshbuf_get_u32(m, &kex->flags)) != 0)
+	    (r = sshbuf_get_u32(m, &kex->flags)) != 0 ||
+	    (r = sshbuf_get_u32(m, &kex->hpn_max_packet)) != 0)
 		goto out;
 	kex->server = 1;
 	kex->done = 1;
@@ -2710,6 +3573,8 @@ ssh_packet_set_state(struct ssh *ssh, struct sshbuf *m)
 
 	if ((r = ssh_packet_set_postauth(ssh)) != 0)
 		return r;
+	if (ssh->kex->hpn_max_packet != 0)
+		ssh_packet_set_hpn_max_packet(ssh, ssh->kex->hpn_max_packet);
 
 	sshbuf_reset(state->input);
 	sshbuf_reset(state->output);
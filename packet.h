@@ -126,6 +126,13 @@ void	 ssh_packet_set_interactive(struct ssh *, int);
 void	 ssh_packet_set_qos(struct ssh *, int, int);
 void     ssh_packet_set_server(struct ssh *);
 void     ssh_packet_set_authenticated(struct ssh *);
+void	 ssh_packet_set_hpn_max_packet(struct ssh *, u_int);
+void	 ssh_packet_set_zerocopy(struct ssh *);
+void	 ssh_packet_set_read_high_water(struct ssh *, size_t);
+void	 ssh_packet_set_notsent_lowat(struct ssh *, size_t);
+void	 ssh_packet_set_send_rate(struct ssh *, u_int64_t);
+int	 ssh_packet_write_delay_ms(struct ssh *);
+u_int	 ssh_packet_get_hpn_max_packet(struct ssh *);
 void     ssh_packet_set_mux(struct ssh *);
 int	 ssh_packet_get_mux(struct ssh *);
 int	 ssh_packet_set_log_preamble(struct ssh *, const char *, ...)
@@ -149,6 +156,8 @@ void     ssh_packet_disconnect(struct ssh *, const char *fmt, ...)
 void     ssh_packet_send_debug(struct ssh *, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
 
 int	 ssh_set_newkeys(struct ssh *, int mode);
+int	 ssh_packet_start_threads(struct ssh *);
+void	 ssh_packet_stage_newkeys(struct ssh *);
 void	 ssh_packet_get_bytes(struct ssh *, u_int64_t *, u_int64_t *);
 
 int	 ssh_packet_write_poll(struct ssh *);
@@ -182,6 +191,8 @@ char	*ssh_remote_hostname(struct ssh *);
 
 void	 ssh_packet_set_rekey_limits(struct ssh *, u_int64_t, u_int32_t);
 time_t	 ssh_packet_get_rekey_timeout(struct ssh *);
+time_t	 ssh_packet_get_idle_timeout(struct ssh *);
+void	 ssh_packet_check_idle(struct ssh *);
 
 void	*ssh_packet_get_input(struct ssh *);
 void	*ssh_packet_get_output(struct ssh *);
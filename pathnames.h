@@ -81,6 +81,12 @@
 /* backward compat for protocol 2 */
 #define _PATH_SSH_USER_HOSTFILE2	"~/" _PATH_SSH_USER_DIR "/known_hosts2"
 
+/*
+ * Per-user cache of how fast each cipher is on the hosts the user runs
+ * the client on. Written when CipherCalibration is enabled.
+ */
+#define _PATH_SSH_USER_CIPHER_CALIBRATION "~/" _PATH_SSH_USER_DIR "/cipher_calibration"
+
 /*
  * Name of the default file containing client-side authentication key. This
  * file should only be readable by the user him/herself.
@@ -19,6 +19,7 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/un.h>
+#include "openbsd-compat/sys-queue.h"
 
 #include <net/if.h>
 #include <netinet/in.h>
@@ -53,6 +54,7 @@
 #include "ssh.h"
 #include "ssherr.h"
 #include "cipher.h"
+#include "cipher-affinity.h"
 #include "pathnames.h"
 #include "log.h"
 #include "sshkey.h"
@@ -65,6 +67,7 @@
 #include "myproposal.h"
 #include "digest.h"
 #include "sshbuf.h"
+#include "channels.h"
 #include "version.h"
 
 /* Format of the configuration file:
@@ -167,7 +170,11 @@ typedef enum {
 	oLocalCommand, oPermitLocalCommand, oRemoteCommand,
 	oTcpRcvBufPoll, oHPNDisabled,
 	oNoneEnabled, oNoneMacEnabled, oNoneSwitch,
-	oDisableMTAES, oUseMPTCP, oHappyEyes, oHappyDelay,
+	oDisableMTAES, oCipherThreads, oCipherStreams, oCipherThreadAffinity,
+	oCipherCalibration, oZeroCopy, oReadHighWater, oNotSentLowat,
+	oRateLimit, oChannelWeights, oTCPCongestion, oTCPBufferSize,
+	oTransportProfile,
+	oUseMPTCP, oHappyEyes, oHappyDelay,
 	oMetrics, oMetricsPath, oMetricsInterval, oFallback, oFallbackPort,
 	oVisualHostKey,
 	oKexAlgorithms, oIPQoS, oRequestTTY, oSessionType, oStdinNull,
@@ -311,6 +318,18 @@ static struct {
 	{ "happyeyes", oHappyEyes },
 	{ "happydelay", oHappyDelay },
 	{ "disablemtaes", oDisableMTAES },
+	{ "cipherthreads", oCipherThreads },
+	{ "cipherstreams", oCipherStreams },
+	{ "cipherthreadaffinity", oCipherThreadAffinity },
+	{ "ciphercalibration", oCipherCalibration },
+	{ "zerocopy", oZeroCopy },
+	{ "readhighwater", oReadHighWater },
+	{ "notsentlowat", oNotSentLowat },
+	{ "ratelimit", oRateLimit },
+	{ "channelweights", oChannelWeights },
+	{ "tcpcongestion", oTCPCongestion },
+	{ "tcpbuffersize", oTCPBufferSize },
+	{ "transportprofile", oTransportProfile },
 	{ "metrics", oMetrics },
 	{ "metricspath", oMetricsPath },
 	{ "metricsinterval", oMetricsInterval },
@@ -1085,6 +1104,12 @@ static const struct multistate multistate_requesttty[] = {
 	{ "auto",			REQUEST_TTY_AUTO },
 	{ NULL, -1 }
 };
+static const struct multistate multistate_transport_profile[] = {
+	{ "default",			TRANSPORT_PROFILE_DEFAULT },
+	{ "bulk",			TRANSPORT_PROFILE_BULK },
+	{ "interactive",		TRANSPORT_PROFILE_INTERACTIVE },
+	{ NULL, -1 }
+};
 static const struct multistate multistate_sessiontype[] = {
 	{ "none",			SESSION_TYPE_NONE },
 	{ "subsystem",			SESSION_TYPE_SUBSYSTEM },
@@ -1169,7 +1194,8 @@ process_config_line_depth(Options *options, struct passwd *pw, const char *host,
 	int remotefwd, dynamicfwd, ca_only = 0, found = 0;
 	LogLevel *log_level_ptr;
 	SyslogFacility *log_facility_ptr;
-	long long val64;
+	long long val64, maxsize;
+	int64_t *i64ptr;
 	size_t len;
 	struct Forward fwd;
 	const struct multistate *multistate_ptr;
@@ -1389,6 +1415,133 @@ parse_time:
 		intptr = &options->disable_multithreaded;
 		goto parse_flag;
 
+	case oCipherThreads:
+		intptr = &options->cipher_threads;
+		goto parse_int;
+
+	case oCipherStreams:
+		intptr = &options->cipher_streams;
+		goto parse_int;
+
+	case oCipherThreadAffinity:
+		arg = argv_next(&ac, &av);
+		if (!arg || *arg == '\0') {
+			error("%.200s line %d: Missing argument.",
+			    filename, linenum);
+			goto out;
+		}
+		if (cipher_affinity_valid(arg) != 0) {
+			error("%s line %d: Bad CipherThreadAffinity value: %s",
+			    filename, linenum, arg);
+			goto out;
+		}
+		if (*activep && options->cipher_thread_affinity == NULL)
+			options->cipher_thread_affinity = xstrdup(arg);
+		break;
+
+	case oCipherCalibration:
+		intptr = &options->cipher_calibration;
+		goto parse_flag;
+
+	case oZeroCopy:
+		intptr = &options->zerocopy;
+		goto parse_flag;
+
+	case oReadHighWater:
+		i64ptr = &options->read_high_water;
+		maxsize = READ_HIGH_WATER_MAX;
+ parse_size:
+		arg = argv_next(&ac, &av);
+		if (!arg || *arg == '\0') {
+			error("%.200s line %d: Missing argument.", filename,
+			    linenum);
+			goto out;
+		}
+		if (strcmp(arg, "none") == 0) {
+			val64 = 0;
+		} else {
+			if (scan_scaled(arg, &val64) == -1) {
+				error("%.200s line %d: Bad number '%s': %s",
+				    filename, linenum, arg, strerror(errno));
+				goto out;
+			}
+			if (val64 < 0 || val64 > maxsize) {
+				error("%.200s line %d: %s out of range",
+				    filename, linenum, keyword);
+				goto out;
+			}
+		}
+		if (*activep && *i64ptr == -1)
+			*i64ptr = val64;
+		break;
+
+	case oNotSentLowat:
+		i64ptr = &options->notsent_lowat;
+		maxsize = NOTSENT_LOWAT_MAX;
+		goto parse_size;
+
+	case oRateLimit:
+		i64ptr = &options->rate_limit;
+		maxsize = RATE_LIMIT_MAX;
+		goto parse_size;
+
+	case oTCPBufferSize:
+		i64ptr = &options->tcp_buffer_size;
+		maxsize = TCP_BUFFER_SIZE_MAX;
+		goto parse_size;
+
+	case oTCPCongestion:
+		arg = argv_next(&ac, &av);
+		if (!arg || *arg == '\0') {
+			error("%.200s line %d: Missing argument.",
+			    filename, linenum);
+			goto out;
+		}
+		if (strcmp(arg, "none") != 0 && !valid_congestion_name(arg)) {
+			error("%s line %d: Bad TCPCongestion value: %s",
+			    filename, linenum, arg);
+			goto out;
+		}
+		if (*activep && options->tcp_congestion == NULL)
+			options->tcp_congestion = xstrdup(arg);
+		break;
+
+	case oTransportProfile:
+		intptr = &options->transport_profile;
+		multistate_ptr = multistate_transport_profile;
+		goto parse_multistate;
+
+	case oChannelWeights:
+		found = options->num_channel_weights == 0;
+		while ((arg = argv_next(&ac, &av)) != NULL) {
+			/* Allow "none" only in first position */
+			if (strcasecmp(arg, "none") == 0) {
+				if (nstrs > 0 || ac > 0) {
+					error("%s line %d: keyword %s \"none\" "
+					    "argument must appear alone.",
+					    filename, linenum, keyword);
+					goto out;
+				}
+			} else if (parse_pattern_weight(arg, CHANNEL_WEIGHT_MAX,
+			    NULL, NULL) != 0) {
+				fatal("%s line %d: invalid channel weight %s",
+				    filename, linenum, arg);
+			}
+			opt_array_append(filename, linenum, keyword,
+			    &strs, &nstrs, arg);
+		}
+		if (nstrs == 0) {
+			fatal("%s line %d: no %s specified",
+			    filename, linenum, keyword);
+		}
+		if (found && *activep) {
+			options->channel_weights = strs;
+			options->num_channel_weights = nstrs;
+			strs = NULL; /* transferred */
+			nstrs = 0;
+		}
+		break;
+
 	case oMetrics:
 		intptr = &options->metrics;
 		goto parse_flag;
@@ -2873,6 +3026,19 @@ initialize_options(Options * options)
 	options->use_happyeyes = -1;
 	options->happy_delay = -1;
 	options->disable_multithreaded = -1;
+	options->cipher_threads = -1;
+	options->cipher_streams = -1;
+	options->cipher_thread_affinity = NULL;
+	options->cipher_calibration = -1;
+	options->zerocopy = -1;
+	options->read_high_water = -1;
+	options->notsent_lowat = -1;
+	options->rate_limit = -1;
+	options->tcp_congestion = NULL;
+	options->tcp_buffer_size = -1;
+	options->transport_profile = -1;
+	options->channel_weights = NULL;
+	options->num_channel_weights = 0;
 	options->metrics = -1;
 	options->metrics_path = NULL;
 	options->metrics_interval = -1;
@@ -3082,6 +3248,27 @@ fill_default_options(Options * options)
 		options->happy_delay = 250; /* default 250ms as per RFC 8305 Section 5 */
 	if (options->disable_multithreaded == -1)
 		options->disable_multithreaded = 0;
+	if (options->cipher_threads == -1)
+		options->cipher_threads = 0;
+	if (options->cipher_streams == -1)
+		options->cipher_streams = 0;
+	if (options->cipher_calibration == -1)
+		options->cipher_calibration = 0;
+	if (options->zerocopy == -1)
+		options->zerocopy = 0;
+	if (options->read_high_water == -1)
+		options->read_high_water = READ_HIGH_WATER_DEFAULT;
+	if (options->transport_profile == -1)
+		options->transport_profile = TRANSPORT_PROFILE_DEFAULT;
+	transport_profile_defaults(options->transport_profile,
+	    &options->tcp_congestion, &options->tcp_buffer_size,
+	    &options->notsent_lowat);
+	if (options->tcp_buffer_size == -1)
+		options->tcp_buffer_size = 0;
+	if (options->notsent_lowat == -1)
+		options->notsent_lowat = 0;
+	if (options->rate_limit == -1)
+		options->rate_limit = 0;
 	if (options->metrics == -1)
 		options->metrics = 0;
 	if (options->metrics_interval == -1)
@@ -3214,7 +3401,9 @@ fill_default_options(Options * options)
 	CLEAR_ON_NONE(options->pkcs11_provider);
 	CLEAR_ON_NONE(options->sk_provider);
 	CLEAR_ON_NONE(options->known_hosts_command);
+	CLEAR_ON_NONE(options->tcp_congestion);
 	CLEAR_ON_NONE_ARRAY(channel_timeouts, num_channel_timeouts, "none");
+	CLEAR_ON_NONE_ARRAY(channel_weights, num_channel_weights, "none");
 #undef CLEAR_ON_NONE
 #undef CLEAR_ON_NONE_ARRAY
 	if (options->jump_host != NULL &&
@@ -3287,6 +3476,7 @@ free_options(Options *o)
 	free(o->preferred_authentications);
 	free(o->bind_address);
 	free(o->bind_interface);
+	free(o->cipher_thread_affinity);
 	free(o->pkcs11_provider);
 	free(o->sk_provider);
 	for (i = 0; i < o->num_identity_files; i++) {
@@ -3683,6 +3873,8 @@ fmt_intarg(OpCodes code, int val)
 		return fmt_multistate_int(val, multistate_requesttty);
 	case oSessionType:
 		return fmt_multistate_int(val, multistate_sessiontype);
+	case oTransportProfile:
+		return fmt_multistate_int(val, multistate_transport_profile);
 	case oCanonicalizeHostname:
 		return fmt_multistate_int(val, multistate_canonicalizehostname);
 	case oAddKeysToAgent:
@@ -3877,6 +4069,9 @@ dump_client_config(Options *o, const char *host)
 	dump_cfg_fmtint(oMetrics, o->metrics);
 	dump_cfg_fmtint(oUseMPTCP, o->use_mptcp);
 	dump_cfg_fmtint(oHappyEyes, o->use_happyeyes);
+	dump_cfg_fmtint(oCipherCalibration, o->cipher_calibration);
+	dump_cfg_fmtint(oZeroCopy, o->zerocopy);
+	dump_cfg_fmtint(oTransportProfile, o->transport_profile);
 	dump_cfg_fmtint(oWarnWeakCrypto, o->warn_weak_crypto);
 	
 	/* Integer options */
@@ -3892,10 +4087,13 @@ dump_client_config(Options *o, const char *host)
 	dump_cfg_int(oMetricsInterval, o->metrics_interval);
 	dump_cfg_int(oFallbackPort, o->fallback_port);
 	dump_cfg_int(oHappyDelay, o->happy_delay);
+	dump_cfg_int(oCipherThreads, o->cipher_threads);
+	dump_cfg_int(oCipherStreams, o->cipher_streams);
 	
 	/* String options */
 	dump_cfg_string(oBindAddress, o->bind_address);
 	dump_cfg_string(oBindInterface, o->bind_interface);
+	dump_cfg_string(oCipherThreadAffinity, o->cipher_thread_affinity);
 	dump_cfg_string(oCiphers, o->ciphers);
 	dump_cfg_string(oControlPath, o->control_path);
 	dump_cfg_string(oHostKeyAlgorithms, o->hostkeyalgorithms);
@@ -3916,6 +4114,7 @@ dump_client_config(Options *o, const char *host)
 	dump_cfg_string(oSecurityKeyProvider, o->sk_provider);
 	dump_cfg_string(oPreferredAuthentications, o->preferred_authentications);
 	dump_cfg_string(oPubkeyAcceptedAlgorithms, o->pubkey_accepted_algos);
+	dump_cfg_string(oTCPCongestion, o->tcp_congestion);
 	dump_cfg_string(oRevokedHostKeys, o->revoked_host_keys);
 	dump_cfg_string(oXAuthLocation, o->xauth_location);
 	dump_cfg_string(oKnownHostsCommand, o->known_hosts_command);
@@ -3940,6 +4139,8 @@ dump_client_config(Options *o, const char *host)
 	    o->num_log_verbose, o->log_verbose);
 	dump_cfg_strarray_oneline(oChannelTimeout,
 	    o->num_channel_timeouts, o->channel_timeouts);
+	dump_cfg_strarray_oneline(oChannelWeights,
+	    o->num_channel_weights, o->channel_weights);
 
 	/* Special cases */
 
@@ -4015,6 +4216,20 @@ dump_client_config(Options *o, const char *host)
 	printf("rekeylimit %llu %d\n",
 	    (unsigned long long)o->rekey_limit, o->rekey_interval);
 
+	/* oReadHighWater */
+	printf("readhighwater %llu\n",
+	    (unsigned long long)o->read_high_water);
+
+	/* oNotSentLowat */
+	printf("notsentlowat %llu\n",
+	    (unsigned long long)o->notsent_lowat);
+
+	/* oRateLimit */
+	printf("ratelimit %llu\n", (unsigned long long)o->rate_limit);
+
+	/* oTCPBufferSize */
+	printf("tcpbuffersize %llu\n", (unsigned long long)o->tcp_buffer_size);
+
 	/* oStreamLocalBindMask */
 	printf("streamlocalbindmask 0%o\n",
 	    o->fwd_opts.streamlocal_bind_mask);
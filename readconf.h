@@ -20,6 +20,11 @@
 
 #define SSH_MAX_HOSTS_FILES	32
 #define PATH_MAX_SUN		(sizeof((struct sockaddr_un *)0)->sun_path)
+#define READ_HIGH_WATER_DEFAULT	(2 * 1024 * 1024) /* Default for ReadHighWater */
+#define READ_HIGH_WATER_MAX	(64 * 1024 * 1024)
+#define NOTSENT_LOWAT_MAX	(64 * 1024 * 1024)
+#define RATE_LIMIT_MAX		(4LL * 1024 * 1024 * 1024 - 1)
+#define TCP_BUFFER_SIZE_MAX	(1024 * 1024 * 1024)
 
 struct allowed_cname {
 	char *source_list;
@@ -129,6 +134,17 @@ typedef struct {
 	int     none_enabled;   /* Allow none to be used */
 	int     nonemac_enabled;   /* Allow none to be used */
 	int     disable_multithreaded; /* Disable multithreaded aes-ctr */
+	int     cipher_threads; /* workers per parallel cipher (0 = auto) */
+	int     cipher_streams; /* keystreams per chacha20-mt batch */
+	char   *cipher_thread_affinity; /* where the cipher workers run */
+	int     cipher_calibration; /* order Ciphers by measured speed */
+	int     zerocopy; /* send large output with MSG_ZEROCOPY */
+	int64_t read_high_water; /* bytes read per wakeup (0 = one read) */
+	int64_t notsent_lowat; /* TCP_NOTSENT_LOWAT (0 = off) */
+	int64_t rate_limit; /* send rate in bytes/s (0 = unlimited) */
+	char   *tcp_congestion; /* TCP_CONGESTION for the connection */
+	int64_t tcp_buffer_size; /* SO_SNDBUF/SO_RCVBUF (0 = autotune) */
+	int     transport_profile; /* TRANSPORT_PROFILE_* */
         int     metrics; /* enable metrics */
         int     metrics_interval; /* time in seconds between polls */
         char   *metrics_path; /* path for the metrics files */
@@ -202,6 +218,8 @@ typedef struct {
 
 	char	**channel_timeouts;	/* inactivity timeout by channel type */
 	u_int	num_channel_timeouts;
+	char	**channel_weights;	/* output weight by channel type */
+	u_int	num_channel_weights;
 
 	char	*version_addendum;
 
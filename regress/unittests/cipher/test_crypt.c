@@ -0,0 +1,729 @@
+/*
+ * Regress test and benchmark for packet encryption and MACs, serial
+ * and on the worker threads.
+ *
+ * Placed in the public domain.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../test_helper/test_helper.h"
+
+#include "xmalloc.h"
+#include "ssherr.h"
+#include "cipher.h"
+#include "mac.h"
+#include "mac-mt.h"
+#include "cipher-pool.h"
+
+void test_crypt(void);
+void bench_crypt(void);
+
+/* the length field is the aad, as with EtM and the AEAD ciphers */
+#define CRYPT_AADLEN	4
+#define CRYPT_MAXAUTH	64
+#define CRYPT_NPACKETS	200
+#define CRYPT_BENCHLEN	(1024 * 1024)
+
+static const u_int test_sizes[] = { 16, 64, 1024, 32768 };
+static const u_int bench_sizes[] = { 64, 1024, 32768 };
+static const int bench_threads[] = { 1, 2, 4 };
+
+#define NELEM(a) (sizeof(a) / sizeof(a[0]))
+
+static void
+fill(u_char *p, size_t len, u_int seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		p[i] = (u_char)(seed + i * 131 + (i >> 8));
+}
+
+/* whether cipher_init() with threads enabled does anything different */
+static int
+has_threads(const char *name)
+{
+	return strstr(name, "-ctr") != NULL || strstr(name, "-gcm@") != NULL;
+}
+
+/* a context for name with the given key and IV, starting at seqnr */
+static struct sshcipher_ctx *
+crypt_init_at(const char *name, const u_char *key, const u_char *iv,
+    u_int seqnr, int encrypt, int threads)
+{
+	const struct sshcipher *c;
+	struct sshcipher_ctx *cc = NULL;
+
+	ASSERT_PTR_NE(c = cipher_by_name(name), NULL);
+	ASSERT_INT_EQ(cipher_init(&cc, c, key, cipher_keylen(c), iv,
+	    cipher_ivlen(c), seqnr, encrypt, threads), 0);
+	return cc;
+}
+
+static struct sshcipher_ctx *
+crypt_init(const char *name, int encrypt, int threads)
+{
+	u_char key[64], iv[32];
+
+	fill(key, sizeof(key), 11);
+	fill(iv, sizeof(iv), 13);
+	return crypt_init_at(name, key, iv, 0, encrypt, threads);
+}
+
+/* size of one packet in a buffer laid out the way the output buffer is */
+static size_t
+packet_len(u_int len)
+{
+	return CRYPT_AADLEN + len + CRYPT_MAXAUTH;
+}
+
+/* encrypt npackets of len bytes from src into out, the same way
+ * ssh_packet_send2_wrapped() does */
+static void
+seal_packets(struct sshcipher_ctx *cc, u_int *seqnr, u_char *out,
+    const u_char *src, u_int len, u_int npackets)
+{
+	u_int i, authlen = cipher_authlen(cipher_by_name(
+	    cipher_ctx_name(cc)));
+	u_char *dest;
+
+	for (i = 0; i < npackets; i++) {
+		dest = out + i * packet_len(len);
+		if (cipher_can_defer(cc))
+			ASSERT_INT_EQ(cipher_crypt_defer(cc, (*seqnr)++, out,
+			    dest, src, len, CRYPT_AADLEN, authlen), 0);
+		else
+			ASSERT_INT_EQ(cipher_crypt(cc, (*seqnr)++, dest, src,
+			    len, CRYPT_AADLEN, authlen), 0);
+	}
+	ASSERT_INT_EQ(cipher_crypt_flush(cc, out), 0);
+}
+
+/* seal with 'sealer' and open each packet with a serial context for
+ * 'opener', checking we get src back */
+static void
+check_crypt(const char *sealer, const char *opener, int threads)
+{
+	struct sshcipher_ctx *enc, *dec;
+	u_char *src, *out, *back;
+	u_int i, s, seal_seq = 0, open_seq = 0, len, authlen;
+
+	authlen = cipher_authlen(cipher_by_name(opener));
+	enc = crypt_init(sealer, CIPHER_ENCRYPT, threads);
+	dec = crypt_init(opener, CIPHER_DECRYPT, CIPHER_SERIAL);
+	for (s = 0; s < NELEM(test_sizes); s++) {
+		len = test_sizes[s];
+		src = xmalloc(CRYPT_AADLEN + len);
+		out = xcalloc(CRYPT_NPACKETS, packet_len(len));
+		back = xmalloc(packet_len(len));
+		fill(src, CRYPT_AADLEN + len, len);
+		seal_packets(enc, &seal_seq, out, src, len, CRYPT_NPACKETS);
+		for (i = 0; i < CRYPT_NPACKETS; i++) {
+			ASSERT_INT_EQ(cipher_crypt(dec, open_seq++, back,
+			    out + i * packet_len(len), len, CRYPT_AADLEN,
+			    authlen), 0);
+			ASSERT_MEM_EQ(back, src, CRYPT_AADLEN + len);
+		}
+		free(src);
+		free(out);
+		free(back);
+	}
+	cipher_free(enc);
+	cipher_free(dec);
+}
+
+/*
+ * Seal with a serial context for 'sealer' and open with a threaded one
+ * for 'opener' in batches of at most 'batch' packets, as
+ * ssh_packet_open_ahead() does; 0 fills every batch. If 'bad' isn't -1
+ * the tag of that packet is damaged and it, and only it, has to fail.
+ */
+static void
+check_open(const char *sealer, const char *opener, u_int batch, int bad)
+{
+	struct sshcipher_ctx *enc, *dec;
+	u_char *src, *out, *back;
+	u_int i, n, s, seal_seq = 0, open_seq = 0, len, authlen;
+	size_t plen;
+	int r;
+
+	authlen = cipher_authlen(cipher_by_name(opener));
+	enc = crypt_init(sealer, CIPHER_ENCRYPT, CIPHER_SERIAL);
+	dec = crypt_init(opener, CIPHER_DECRYPT, CIPHER_MULTITHREAD);
+	ASSERT_INT_EQ(cipher_can_defer(dec), 1);
+	plen = packet_len(test_sizes[NELEM(test_sizes) - 1]);
+	src = xmalloc(plen);
+	out = xcalloc(CRYPT_NPACKETS, plen);
+	back = xmalloc(plen);
+	for (s = 0; s < NELEM(test_sizes); s++) {
+		len = test_sizes[s];
+		plen = packet_len(len);
+		fill(src, CRYPT_AADLEN + len, len);
+		seal_packets(enc, &seal_seq, out, src, len, CRYPT_NPACKETS);
+		if (bad != -1)
+			out[bad * plen + CRYPT_AADLEN + len] ^= 0x10;
+		for (i = 0; i < CRYPT_NPACKETS;) {
+			for (n = 0; i + n < CRYPT_NPACKETS &&
+			    (batch == 0 || n < batch); n++) {
+				r = cipher_open_queue(dec, open_seq + n,
+				    out + (i + n) * plen, len, CRYPT_AADLEN,
+				    authlen);
+				if (r == SSH_ERR_NO_BUFFER_SPACE)
+					break;
+				ASSERT_INT_EQ(r, 0);
+			}
+			ASSERT_U_INT_GT(n, 0);
+			ASSERT_U_INT_LE(n, CIPHER_POOL_BATCH);
+			ASSERT_INT_EQ(cipher_open_batch(dec), 0);
+			ASSERT_U_INT_EQ(cipher_crypt_pending(dec), n);
+			for (; n > 0; n--, i++) {
+				memset(back, 0, plen);
+				r = cipher_open_take(dec, open_seq++, back,
+				    len, CRYPT_AADLEN);
+				if ((int)i == bad) {
+					ASSERT_INT_EQ(r, SSH_ERR_MAC_INVALID);
+					/* the rest of the batch is dropped */
+					ASSERT_U_INT_EQ(
+					    cipher_crypt_pending(dec), 0);
+					/* and so is the connection */
+					goto done;
+				}
+				ASSERT_INT_EQ(r, 0);
+				ASSERT_MEM_EQ(back, src, CRYPT_AADLEN + len);
+			}
+		}
+	}
+	ASSERT_INT_EQ(bad, -1);
+ done:
+	free(src);
+	free(out);
+	free(back);
+	cipher_free(enc);
+	cipher_free(dec);
+}
+
+/* a take that doesn't match the next queued packet is refused and
+ * drops the batch rather than handing back the wrong plaintext */
+static void
+check_open_order(const char *sealer, const char *opener)
+{
+	struct sshcipher_ctx *enc, *dec;
+	u_char *src, *out, *back;
+	u_int i, seqnr = 0, len = 64, authlen;
+	size_t plen = packet_len(len);
+
+	authlen = cipher_authlen(cipher_by_name(opener));
+	enc = crypt_init(sealer, CIPHER_ENCRYPT, CIPHER_SERIAL);
+	dec = crypt_init(opener, CIPHER_DECRYPT, CIPHER_MULTITHREAD);
+	src = xmalloc(CRYPT_AADLEN + len);
+	out = xcalloc(4, plen);
+	back = xmalloc(plen);
+	fill(src, CRYPT_AADLEN + len, len);
+	seal_packets(enc, &seqnr, out, src, len, 4);
+	for (i = 0; i < 4; i++)
+		ASSERT_INT_EQ(cipher_open_queue(dec, i, out + i * plen, len,
+		    CRYPT_AADLEN, authlen), 0);
+	ASSERT_INT_EQ(cipher_open_batch(dec), 0);
+	ASSERT_INT_EQ(cipher_open_take(dec, 0, back, len, CRYPT_AADLEN), 0);
+	ASSERT_MEM_EQ(back, src, CRYPT_AADLEN + len);
+	/* packet 2 while packet 1 is next. GCM takes its nonces from
+	 * the context rather than seqnr, so ask for the wrong size too */
+	ASSERT_INT_NE(cipher_open_take(dec, 2, back, len - 16,
+	    CRYPT_AADLEN), 0);
+	ASSERT_U_INT_EQ(cipher_crypt_pending(dec), 0);
+	free(src);
+	free(out);
+	free(back);
+	cipher_free(enc);
+	cipher_free(dec);
+}
+
+/*
+ * Encrypt some packets, then carry on with a threaded context built
+ * from the key, the current IV and the sequence number, the way
+ * ssh_packet_start_threads() does. What follows has to be the same as
+ * from a fresh serial context at that IV and seqnr, and the same as if
+ * the first context had kept going.
+ */
+static void
+check_switch(const char *name, const char *mtname)
+{
+	struct sshcipher_ctx *ser, *ref, *mt, *fresh;
+	const struct sshcipher *c = cipher_by_name(name);
+	u_char key[64], iv[32], *src, *out, *want;
+	u_int len = 1024, n = 37, seqnr = 0, mt_seq, ref_seq = 0, fresh_seq;
+	size_t plen = packet_len(len);
+
+	fill(key, sizeof(key), 11);
+	fill(iv, sizeof(iv), 13);
+	src = xmalloc(CRYPT_AADLEN + len);
+	out = xcalloc(n, plen);
+	want = xcalloc(n, plen);
+	fill(src, CRYPT_AADLEN + len, len);
+	ser = crypt_init_at(name, key, iv, 0, CIPHER_ENCRYPT, CIPHER_SERIAL);
+	ref = crypt_init_at(name, key, iv, 0, CIPHER_ENCRYPT, CIPHER_SERIAL);
+	seal_packets(ser, &seqnr, out, src, len, n);
+	seal_packets(ref, &ref_seq, want, src, len, n);
+	ASSERT_MEM_EQ(out, want, n * plen);
+
+	ASSERT_INT_EQ(cipher_get_keyiv(ser, iv, cipher_ivlen(c)), 0);
+	mt_seq = fresh_seq = seqnr;
+	mt = crypt_init_at(mtname, key, iv, seqnr, CIPHER_ENCRYPT,
+	    CIPHER_MULTITHREAD);
+	fresh = crypt_init_at(name, key, iv, seqnr, CIPHER_ENCRYPT,
+	    CIPHER_SERIAL);
+	seal_packets(mt, &mt_seq, out, src, len, n);
+	seal_packets(fresh, &fresh_seq, want, src, len, n);
+	ASSERT_MEM_EQ(out, want, n * plen);
+	seal_packets(ref, &ref_seq, want, src, len, n);
+	ASSERT_MEM_EQ(out, want, n * plen);
+
+	cipher_free(ser);
+	cipher_free(ref);
+	cipher_free(mt);
+	cipher_free(fresh);
+	free(src);
+	free(out);
+	free(want);
+}
+
+/*
+ * Rekey a threaded AES-CTR context with cipher_reinit(), which keeps
+ * its threads, optionally after staging the new keys. What it
+ * encrypts afterwards has to match a fresh serial context at the new
+ * key and IV.
+ */
+static void
+check_reinit(const char *name, int stage)
+{
+	struct sshcipher_ctx *mt, *fresh;
+	const struct sshcipher *c = cipher_by_name(name);
+	u_char key[64], iv[32], *src, *out, *want;
+	u_int len = 1024, n = 37, seqnr = 0, fresh_seq = 0;
+	size_t plen = packet_len(len);
+
+	src = xmalloc(CRYPT_AADLEN + len);
+	out = xcalloc(n, plen);
+	want = xcalloc(n, plen);
+	fill(src, CRYPT_AADLEN + len, len);
+	mt = crypt_init(name, CIPHER_ENCRYPT, CIPHER_MULTITHREAD);
+	seal_packets(mt, &seqnr, out, src, len, n);
+
+	fill(key, sizeof(key), 23);
+	fill(iv, sizeof(iv), 29);
+	if (stage)
+		ASSERT_INT_EQ(cipher_stage_keys(mt, c, key, cipher_keylen(c),
+		    iv, cipher_ivlen(c)), 0);
+	ASSERT_INT_EQ(cipher_reinit(mt, c, key, cipher_keylen(c), iv,
+	    cipher_ivlen(c), 1), 0);
+	fresh = crypt_init_at(name, key, iv, seqnr, CIPHER_ENCRYPT,
+	    CIPHER_SERIAL);
+	fresh_seq = seqnr;
+	seal_packets(mt, &seqnr, out, src, len, n);
+	seal_packets(fresh, &fresh_seq, want, src, len, n);
+	ASSERT_MEM_EQ(out, want, n * plen);
+
+	cipher_free(mt);
+	cipher_free(fresh);
+	free(src);
+	free(out);
+	free(want);
+}
+
+static void
+mac_start(struct sshmac *mac, const char *name)
+{
+	u_char key[128];
+
+	memset(mac, 0, sizeof(*mac));
+	ASSERT_INT_EQ(mac_setup(mac, (char *)name), 0);
+	mac->name = xstrdup(name);
+	ASSERT_SIZE_T_LE(mac->key_len, sizeof(key));
+	fill(key, sizeof(key), 17);
+	mac->key = xmalloc(mac->key_len);
+	memcpy(mac->key, key, mac->key_len);
+	ASSERT_INT_EQ(mac_init(mac), 0);
+}
+
+static void
+mac_done(struct sshmac *mac)
+{
+	mac_clear(mac);
+	freezero(mac->key, mac->key_len);
+	free(mac->name);
+}
+
+/* tags from the pool have to match mac_compute() */
+static void
+check_mac_mt(const char *name)
+{
+	struct sshmac mac;
+	struct mac_mt_ctx *mt;
+	u_char *buf, want[CRYPT_MAXAUTH];
+	u_int i, s, len, seqnr = 0;
+	size_t plen;
+
+	mac_start(&mac, name);
+	ASSERT_SIZE_T_LE(mac.mac_len, CRYPT_MAXAUTH);
+	ASSERT_PTR_NE(mt = mac_mt_new(&mac), NULL);
+	for (s = 0; s < NELEM(test_sizes); s++) {
+		len = test_sizes[s];
+		plen = packet_len(len);
+		buf = xcalloc(CRYPT_NPACKETS, plen);
+		for (i = 0; i < CRYPT_NPACKETS; i++) {
+			fill(buf + i * plen, CRYPT_AADLEN + len, i);
+			ASSERT_INT_EQ(mac_mt_enqueue(mt, seqnr + i, buf,
+			    buf + i * plen, CRYPT_AADLEN + len,
+			    buf + i * plen + CRYPT_AADLEN + len), 0);
+		}
+		ASSERT_INT_EQ(mac_mt_flush(mt, buf), 0);
+		ASSERT_U_INT_EQ(mac_mt_pending(mt), 0);
+		for (i = 0; i < CRYPT_NPACKETS; i++) {
+			ASSERT_INT_EQ(mac_compute(&mac, seqnr + i,
+			    buf + i * plen, CRYPT_AADLEN + len, want,
+			    sizeof(want)), 0);
+			ASSERT_MEM_EQ(buf + i * plen + CRYPT_AADLEN + len,
+			    want, mac.mac_len);
+		}
+		seqnr += CRYPT_NPACKETS;
+		free(buf);
+	}
+	mac_mt_free(mt);
+	mac_done(&mac);
+}
+
+/*
+ * Tags checked by the pool have to agree with mac_check(). If 'bad'
+ * isn't -1 that packet's tag is damaged and it, and only it, has to
+ * fail.
+ */
+static void
+check_mac_mt_verify(const char *name, int bad)
+{
+	struct sshmac mac;
+	struct mac_mt_ctx *mt;
+	u_char *buf, *p;
+	u_int i, n, s, len, seqnr = 0;
+	size_t plen;
+	int r;
+
+	mac_start(&mac, name);
+	ASSERT_PTR_NE(mt = mac_mt_new(&mac), NULL);
+	for (s = 0; s < NELEM(test_sizes); s++) {
+		len = test_sizes[s];
+		plen = packet_len(len);
+		buf = xcalloc(CRYPT_NPACKETS, plen);
+		for (i = 0; i < CRYPT_NPACKETS; i++) {
+			p = buf + i * plen;
+			fill(p, CRYPT_AADLEN + len, i);
+			ASSERT_INT_EQ(mac_compute(&mac, seqnr + i, p,
+			    CRYPT_AADLEN + len, p + CRYPT_AADLEN + len,
+			    mac.mac_len), 0);
+		}
+		if (bad != -1)
+			buf[bad * plen + CRYPT_AADLEN + len] ^= 0x10;
+		for (i = 0; i < CRYPT_NPACKETS;) {
+			for (n = 0; i + n < CRYPT_NPACKETS; n++) {
+				p = buf + (i + n) * plen;
+				r = mac_mt_check_queue(mt, seqnr + i + n, p,
+				    CRYPT_AADLEN + len,
+				    p + CRYPT_AADLEN + len);
+				if (r == SSH_ERR_NO_BUFFER_SPACE)
+					break;
+				ASSERT_INT_EQ(r, 0);
+			}
+			ASSERT_U_INT_GT(n, 0);
+			ASSERT_INT_EQ(mac_mt_check_batch(mt), 0);
+			ASSERT_U_INT_EQ(mac_mt_pending(mt), n);
+			for (; n > 0; n--, i++) {
+				p = buf + i * plen;
+				r = mac_mt_check_take(mt, seqnr + i,
+				    CRYPT_AADLEN + len);
+				ASSERT_INT_EQ(r, mac_check(&mac, seqnr + i, p,
+				    CRYPT_AADLEN + len,
+				    p + CRYPT_AADLEN + len, mac.mac_len));
+				if ((int)i == bad) {
+					ASSERT_INT_EQ(r, SSH_ERR_MAC_INVALID);
+					ASSERT_U_INT_EQ(mac_mt_pending(mt), 0);
+					free(buf);
+					goto done;
+				}
+				ASSERT_INT_EQ(r, 0);
+			}
+		}
+		ASSERT_INT_EQ(bad, -1);
+		seqnr += CRYPT_NPACKETS;
+		free(buf);
+	}
+ done:
+	mac_mt_free(mt);
+	mac_done(&mac);
+}
+
+void
+test_crypt(void)
+{
+	char *list, *cp, *name, title[128];
+	struct sshmac mac;
+	int etm;
+
+	list = cipher_alg_list(',', 0);
+	for (cp = list; (name = strsep(&cp, ",")) != NULL;) {
+		snprintf(title, sizeof(title), "cipher_crypt %s", name);
+		TEST_START(title);
+		check_crypt(name, name, CIPHER_SERIAL);
+		TEST_DONE();
+
+		if (!has_threads(name))
+			continue;
+		snprintf(title, sizeof(title), "cipher_crypt %s threaded",
+		    name);
+		TEST_START(title);
+		cipher_set_mt_tunables(2, 0);
+		check_crypt(name, name, CIPHER_MULTITHREAD);
+		cipher_set_mt_tunables(0, 0);
+		TEST_DONE();
+
+		snprintf(title, sizeof(title), "cipher switch %s", name);
+		TEST_START(title);
+		cipher_set_mt_tunables(2, 0);
+		check_switch(name, name);
+		cipher_set_mt_tunables(0, 0);
+		TEST_DONE();
+
+		if (strstr(name, "-ctr") != NULL) {
+			snprintf(title, sizeof(title), "cipher_reinit %s",
+			    name);
+			TEST_START(title);
+			cipher_set_mt_tunables(2, 0);
+			check_reinit(name, 0);
+			check_reinit(name, 1);
+			cipher_set_mt_tunables(0, 0);
+			TEST_DONE();
+		}
+		if (strstr(name, "-gcm@") == NULL)
+			continue;
+		snprintf(title, sizeof(title), "cipher_open %s threaded",
+		    name);
+		TEST_START(title);
+		cipher_set_mt_tunables(2, 0);
+		check_open(name, name, 0, -1);
+		check_open(name, name, 1, -1);
+		check_open(name, name, 7, -1);
+		check_open_order(name, name);
+		cipher_set_mt_tunables(0, 0);
+		TEST_DONE();
+
+		snprintf(title, sizeof(title), "cipher_open %s bad tag",
+		    name);
+		TEST_START(title);
+		cipher_set_mt_tunables(2, 0);
+		check_open(name, name, 0, 0);
+		check_open(name, name, 0, 70);
+		check_open(name, name, 7, 199);
+		cipher_set_mt_tunables(0, 0);
+		TEST_DONE();
+	}
+	free(list);
+
+	/* on the wire it's the same as the serial one */
+	TEST_START("cipher_crypt chacha20-poly1305-mt");
+	cipher_set_mt_tunables(2, 0);
+	check_crypt("chacha20-poly1305-mt@hpnssh.org",
+	    "chacha20-poly1305@openssh.com", CIPHER_MULTITHREAD);
+	cipher_set_mt_tunables(0, 0);
+	TEST_DONE();
+
+	TEST_START("cipher switch chacha20-poly1305-mt");
+	cipher_set_mt_tunables(2, 0);
+	check_switch("chacha20-poly1305@openssh.com",
+	    "chacha20-poly1305-mt@hpnssh.org");
+	cipher_set_mt_tunables(0, 0);
+	TEST_DONE();
+
+	TEST_START("cipher_open chacha20-poly1305-mt threaded");
+	cipher_set_mt_tunables(2, 0);
+	check_open("chacha20-poly1305@openssh.com",
+	    "chacha20-poly1305-mt@hpnssh.org", 0, -1);
+	check_open("chacha20-poly1305@openssh.com",
+	    "chacha20-poly1305-mt@hpnssh.org", 1, -1);
+	check_open("chacha20-poly1305@openssh.com",
+	    "chacha20-poly1305-mt@hpnssh.org", 7, -1);
+	check_open_order("chacha20-poly1305@openssh.com",
+	    "chacha20-poly1305-mt@hpnssh.org");
+	cipher_set_mt_tunables(0, 0);
+	TEST_DONE();
+
+	TEST_START("cipher_open chacha20-poly1305-mt bad tag");
+	cipher_set_mt_tunables(2, 0);
+	check_open("chacha20-poly1305@openssh.com",
+	    "chacha20-poly1305-mt@hpnssh.org", 0, 0);
+	check_open("chacha20-poly1305@openssh.com",
+	    "chacha20-poly1305-mt@hpnssh.org", 0, 70);
+	check_open("chacha20-poly1305@openssh.com",
+	    "chacha20-poly1305-mt@hpnssh.org", 7, 199);
+	cipher_set_mt_tunables(0, 0);
+	TEST_DONE();
+
+	list = mac_alg_list(',');
+	for (cp = list; (name = strsep(&cp, ",")) != NULL;) {
+		/* nothing to compute */
+		if (strcmp(name, "none") == 0)
+			continue;
+		mac_start(&mac, name);
+		etm = mac.etm;
+		mac_done(&mac);
+		if (!etm)
+			continue;
+		snprintf(title, sizeof(title), "mac_mt %s", name);
+		TEST_START(title);
+		cipher_set_mt_tunables(2, 0);
+		check_mac_mt(name);
+		cipher_set_mt_tunables(0, 0);
+		TEST_DONE();
+
+		snprintf(title, sizeof(title), "mac_mt %s check", name);
+		TEST_START(title);
+		cipher_set_mt_tunables(2, 0);
+		check_mac_mt_verify(name, -1);
+		check_mac_mt_verify(name, 0);
+		check_mac_mt_verify(name, 70);
+		check_mac_mt_verify(name, 199);
+		cipher_set_mt_tunables(0, 0);
+		TEST_DONE();
+	}
+	free(list);
+}
+
+/*
+ * The benchmarks are named kind/algorithm/mode/size, with a thread
+ * count on the end of the threaded ones, so that -O can pick them out
+ * and the results (-M) can be compared from run to run. Each run is
+ * 1MiB of payload in packets of the given size.
+ */
+
+static void
+bench_cipher(const char *name, int threads)
+{
+	struct sshcipher_ctx *cc;
+	u_char *src, *out;
+	u_int s, len, n, seqnr;
+	char title[128];
+
+	for (s = 0; s < NELEM(bench_sizes); s++) {
+		len = bench_sizes[s];
+		n = CRYPT_BENCHLEN / len;
+		seqnr = 0;
+		if (threads)
+			cipher_set_mt_tunables(threads, 0);
+		cc = crypt_init(name, CIPHER_ENCRYPT, threads ?
+		    CIPHER_MULTITHREAD : CIPHER_SERIAL);
+		src = xmalloc(CRYPT_AADLEN + len);
+		out = xcalloc(n, packet_len(len));
+		fill(src, CRYPT_AADLEN + len, len);
+		if (threads)
+			snprintf(title, sizeof(title), "cipher/%s/mt/%u/t%d",
+			    name, len, threads);
+		else
+			snprintf(title, sizeof(title), "cipher/%s/serial/%u",
+			    name, len);
+		BENCH_START(title);
+		seal_packets(cc, &seqnr, out, src, len, n);
+		BENCH_FINISH("MiB");
+		cipher_free(cc);
+		cipher_set_mt_tunables(0, 0);
+		free(src);
+		free(out);
+	}
+}
+
+static void
+bench_mac(const char *name, int threads)
+{
+	struct sshmac mac;
+	struct mac_mt_ctx *mt = NULL;
+	u_char *buf, *p, tag[CRYPT_MAXAUTH];
+	u_int i, s, len, n, seqnr = 0;
+	char title[128];
+	size_t plen;
+
+	mac_start(&mac, name);
+	if (threads) {
+		cipher_set_mt_tunables(threads, 0);
+		ASSERT_PTR_NE(mt = mac_mt_new(&mac), NULL);
+		cipher_set_mt_tunables(0, 0);
+	}
+	for (s = 0; s < NELEM(bench_sizes); s++) {
+		len = bench_sizes[s];
+		n = CRYPT_BENCHLEN / len;
+		plen = packet_len(len);
+		buf = xcalloc(n, plen);
+		fill(buf, n * plen, len);
+		if (threads)
+			snprintf(title, sizeof(title), "mac/%s/mt/%u/t%d",
+			    name, len, threads);
+		else
+			snprintf(title, sizeof(title), "mac/%s/serial/%u",
+			    name, len);
+		BENCH_START(title);
+		for (i = 0; i < n; i++) {
+			p = buf + i * plen;
+			if (mt != NULL)
+				ASSERT_INT_EQ(mac_mt_enqueue(mt, seqnr++, buf,
+				    p, CRYPT_AADLEN + len,
+				    p + CRYPT_AADLEN + len), 0);
+			else
+				ASSERT_INT_EQ(mac_compute(&mac, seqnr++, p,
+				    CRYPT_AADLEN + len, tag, sizeof(tag)), 0);
+		}
+		if (mt != NULL)
+			ASSERT_INT_EQ(mac_mt_flush(mt, buf), 0);
+		BENCH_FINISH("MiB");
+		free(buf);
+	}
+	mac_mt_free(mt);
+	mac_done(&mac);
+}
+
+void
+bench_crypt(void)
+{
+	char *list, *cp, *name;
+	struct sshmac mac;
+	size_t t;
+	int etm;
+
+	list = cipher_alg_list(',', 0);
+	for (cp = list; (name = strsep(&cp, ",")) != NULL;) {
+		if (strstr(name, "-mt@") == NULL)
+			bench_cipher(name, 0);
+		if (!has_threads(name) && strstr(name, "-mt@") == NULL)
+			continue;
+		for (t = 0; t < NELEM(bench_threads); t++)
+			bench_cipher(name, bench_threads[t]);
+	}
+	free(list);
+
+	list = mac_alg_list(',');
+	for (cp = list; (name = strsep(&cp, ",")) != NULL;) {
+		/* nothing to compute */
+		if (strcmp(name, "none") == 0)
+			continue;
+		bench_mac(name, 0);
+		mac_start(&mac, name);
+		etm = mac.etm;
+		mac_done(&mac);
+		if (!etm)
+			continue;
+		for (t = 0; t < NELEM(bench_threads); t++)
+			bench_mac(name, bench_threads[t]);
+	}
+	free(list);
+}
@@ -0,0 +1,145 @@
+/*
+ * Regress test and benchmark for the keystream XOR kernels.
+ *
+ * Placed in the public domain.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../test_helper/test_helper.h"
+
+#include "xmalloc.h"
+#include "cipher-xor.h"
+
+void test_xor(void);
+void bench_xor(void);
+
+#define XOR_BUFLEN	(1024 + 64)
+#define XOR_BENCHLEN	(1024 * 1024)
+
+static void
+fill(u_char *p, size_t len, u_int seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		p[i] = (u_char)(seed + i * 131 + (i >> 8));
+}
+
+/* every length up to a couple of the widest vectors, at every
+ * alignment up to 16 for each of the three pointers */
+static void
+check_kernel(const char *name)
+{
+	u_char src[XOR_BUFLEN], ks[XOR_BUFLEN], dest[XOR_BUFLEN];
+	u_char want[XOR_BUFLEN];
+	size_t len, i, o;
+
+	for (len = 0; len <= 600; len += (len < 300) ? 1 : 37) {
+		for (o = 0; o < 16; o++) {
+			fill(src, sizeof(src), 1);
+			fill(ks, sizeof(ks), 7);
+			memset(dest, 0xa5, sizeof(dest));
+			memcpy(want, dest, sizeof(want));
+			for (i = 0; i < len; i++)
+				want[o + 3 + i] = src[o + i] ^ ks[(o * 7) % 16 + i];
+			cipher_xor(dest + o + 3, src + o, ks + (o * 7) % 16,
+			    len);
+			if (memcmp(dest, want, sizeof(dest)) != 0) {
+				fprintf(stderr, "kernel %s len %zu offset %zu\n",
+				    name, len, o);
+				ASSERT_INT_EQ(memcmp(dest, want,
+				    sizeof(dest)), 0);
+			}
+		}
+	}
+
+	/* in place, which is how the ciphers usually call it */
+	fill(dest, sizeof(dest), 3);
+	fill(ks, sizeof(ks), 9);
+	for (i = 0; i < sizeof(want); i++)
+		want[i] = dest[i] ^ ks[i];
+	cipher_xor(dest, dest, ks, sizeof(dest));
+	ASSERT_MEM_EQ(dest, want, sizeof(dest));
+}
+
+void
+test_xor(void)
+{
+	const char * const *names = cipher_xor_kernels();
+	const char *dflt = cipher_xor_name();
+	char title[64];
+	size_t i;
+
+	TEST_START("cipher_xor default kernel");
+	ASSERT_PTR_NE(dflt, NULL);
+	check_kernel(dflt);
+	TEST_DONE();
+
+	for (i = 0; names[i] != NULL; i++) {
+		/* built in but not usable on this CPU */
+		if (cipher_xor_select(names[i]) != 0)
+			continue;
+		snprintf(title, sizeof(title), "cipher_xor %s", names[i]);
+		TEST_START(title);
+		ASSERT_STRING_EQ(cipher_xor_name(), names[i]);
+		check_kernel(names[i]);
+		TEST_DONE();
+	}
+
+	TEST_START("cipher_xor unknown kernel");
+	ASSERT_INT_EQ(cipher_xor_select("no-such-kernel"), -1);
+	TEST_DONE();
+
+	ASSERT_INT_EQ(cipher_xor_select(dflt), 0);
+}
+
+void
+bench_xor(void)
+{
+	const char * const *names = cipher_xor_kernels();
+	const char *dflt = cipher_xor_name();
+	u_char *buf, *ks;
+	char title[64];
+	size_t i, off;
+
+	buf = xmalloc(XOR_BENCHLEN + 1);
+	ks = xmalloc(XOR_BENCHLEN);
+	fill(buf, XOR_BENCHLEN + 1, 1);
+	fill(ks, XOR_BENCHLEN, 2);
+
+	for (i = 0; names[i] != NULL; i++) {
+		if (cipher_xor_select(names[i]) != 0) {
+			printf("%s: not supported on this CPU\n", names[i]);
+			continue;
+		}
+		snprintf(title, sizeof(title), "xor %s 1MiB", names[i]);
+		BENCH_START(title);
+		cipher_xor(buf, buf, ks, XOR_BENCHLEN);
+		BENCH_FINISH("MiB");
+
+		/* the packets the ciphers see are rarely aligned */
+		snprintf(title, sizeof(title), "xor %s 1MiB unaligned",
+		    names[i]);
+		BENCH_START(title);
+		cipher_xor(buf + 1, buf + 1, ks, XOR_BENCHLEN);
+		BENCH_FINISH("MiB");
+
+		/* the same MiB a packet's worth at a time */
+		snprintf(title, sizeof(title), "xor %s 1MiB in 32KiB",
+		    names[i]);
+		BENCH_START(title);
+		for (off = 0; off < XOR_BENCHLEN; off += 32 * 1024)
+			cipher_xor(buf + off, buf + off, ks + off, 32 * 1024);
+		BENCH_FINISH("MiB");
+	}
+	cipher_xor_select(dflt);
+	free(buf);
+	free(ks);
+}
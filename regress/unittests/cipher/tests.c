@@ -0,0 +1,30 @@
+/*
+ * Regress test and benchmarks for the HPN cipher helpers.
+ *
+ * Placed in the public domain.
+ */
+
+#include "includes.h"
+
+#include <stdio.h>
+
+#include "../test_helper/test_helper.h"
+
+void test_xor(void);
+void bench_xor(void);
+void test_crypt(void);
+void bench_crypt(void);
+
+void
+tests(void)
+{
+	test_xor();
+	test_crypt();
+}
+
+void
+benchmarks(void)
+{
+	bench_xor();
+	bench_crypt();
+}
@@ -135,6 +135,7 @@ static char subtest_info[512];
 static int fast = 0;
 static int slow = 0;
 static int benchmark_detail_statistics = 0;
+static int benchmark_machine = 0;
 
 static int benchmark = 0;
 static const char *bench_name = NULL;
@@ -167,7 +168,7 @@ main(int argc, char **argv)
 		}
 	}
 
-	while ((ch = getopt(argc, argv, "O:bBFfvqd:")) != -1) {
+	while ((ch = getopt(argc, argv, "O:bBMFfvqd:")) != -1) {
 		switch (ch) {
 		case 'b':
 			benchmark = 1;
@@ -175,6 +176,9 @@ main(int argc, char **argv)
 		case 'B':
 			benchmark = benchmark_detail_statistics = 1;
 			break;
+		case 'M':
+			benchmark = benchmark_machine = 1;
+			break;
 		case 'O':
 			benchmark_pattern = xstrdup(optarg);
 			break;
@@ -197,13 +201,13 @@ main(int argc, char **argv)
 			break;
 		default:
 			fprintf(stderr, "Unrecognised command line option\n");
-			fprintf(stderr, "Usage: %s [-vqfFbB] [-d data_dir] "
+			fprintf(stderr, "Usage: %s [-vqfFbBM] [-d data_dir] "
 			    "[-O pattern]\n", __progname);
 			exit(1);
 		}
 	}
 	setvbuf(stdout, NULL, _IONBF, 0);
-	if (!quiet_mode)
+	if (!quiet_mode && !benchmark_machine)
 		printf("%s: ", __progname);
 	if (verbose_mode)
 		printf("\n");
@@ -725,7 +729,12 @@ bench_finish(const char *file, int line, const char *unit)
 	}
 	std_dev /= (double)bench_nruns;
 	std_dev = sqrt(std_dev);
-	if (benchmark_detail_statistics) {
+	if (benchmark_machine) {
+		/* one tab separated line per benchmark for scripts */
+		printf("%s\t%s\t%d\t%0.3f\t%0.2f\t%0.2f\t%0.03f\t%s/s\n",
+		    __progname, bench_name, bench_nruns, bench_accum_secs,
+		    mean_rps, med_rps, std_dev * 1000, unit);
+	} else if (benchmark_detail_statistics) {
 		printf("%s: %d runs in %0.3fs, %0.03f/%0.03f ms/%s "
 		    "(mean/median), std.dev %0.03f ms, "
 		    "%0.2f/%0.2f %s/s (mean/median)\n",
@@ -53,6 +53,7 @@
 #include "servconf.h"
 #include "pathnames.h"
 #include "cipher.h"
+#include "cipher-affinity.h"
 #include "sshkey.h"
 #include "kex.h"
 #include "mac.h"
@@ -209,6 +210,18 @@ initialize_server_options(ServerOptions *options)
 	options->nonemac_enabled = -1;
 	options->use_mptcp = -1;
 	options->disable_multithreaded = -1;
+	options->cipher_threads = -1;
+	options->cipher_streams = -1;
+	options->cipher_thread_affinity = NULL;
+	options->zerocopy = -1;
+	options->read_high_water = -1;
+	options->notsent_lowat = -1;
+	options->rate_limit = -1;
+	options->tcp_congestion = NULL;
+	options->tcp_buffer_size = -1;
+	options->transport_profile = -1;
+	options->channel_weights = NULL;
+	options->num_channel_weights = 0;
 	options->ip_qos_interactive = -1;
 	options->ip_qos_bulk = -1;
 	options->version_addendum = NULL;
@@ -484,10 +497,27 @@ fill_default_server_options(ServerOptions *options)
 		options->tcp_rcv_buf_poll = 1;
 	if (options->disable_multithreaded == -1)
 		options->disable_multithreaded = 0;
+	if (options->cipher_threads == -1)
+		options->cipher_threads = 0;
+	if (options->cipher_streams == -1)
+		options->cipher_streams = 0;
 	if (options->hpn_disabled == -1)
 		options->hpn_disabled = 0;
 	if (options->use_mptcp == -1)
 		options->use_mptcp = 0;
+	if (options->zerocopy == -1)
+		options->zerocopy = 0;
+	if (options->read_high_water == -1)
+		options->read_high_water = READ_HIGH_WATER_DEFAULT;
+	if (options->rate_limit == -1)
+		options->rate_limit = 0;
+	/*
+	 * NotSentLowat, TCPBufferSize and TCPCongestion stay unset here:
+	 * server_loop2() fills them from the TransportProfile, which a
+	 * Match block may still change.
+	 */
+	if (options->transport_profile == -1)
+		options->transport_profile = TRANSPORT_PROFILE_DEFAULT;
 	if (options->ip_qos_interactive == -1)
 		options->ip_qos_interactive = IPTOS_DSCP_EF;
 	if (options->ip_qos_bulk == -1)
@@ -546,6 +576,7 @@ fill_default_server_options(ServerOptions *options)
 	CLEAR_ON_NONE(options->adm_forced_command);
 	CLEAR_ON_NONE(options->chroot_directory);
 	CLEAR_ON_NONE(options->routing_domain);
+	CLEAR_ON_NONE(options->cipher_thread_affinity);
 	CLEAR_ON_NONE(options->host_key_agent);
 	CLEAR_ON_NONE(options->per_source_penalty_exempt);
 
@@ -555,6 +586,7 @@ fill_default_server_options(ServerOptions *options)
 		CLEAR_ON_NONE(options->host_cert_files[i]);
 
 	CLEAR_ON_NONE_ARRAY(channel_timeouts, num_channel_timeouts, "none");
+	CLEAR_ON_NONE_ARRAY(channel_weights, num_channel_weights, "none");
 	CLEAR_ON_NONE_ARRAY(auth_methods, num_auth_methods, "any");
 #undef CLEAR_ON_NONE
 #undef CLEAR_ON_NONE_ARRAY
@@ -573,7 +605,10 @@ typedef enum {
 	sKbdInteractiveAuthentication, sListenAddress, sAddressFamily,
 	sPrintMotd, sPrintLastLog, sIgnoreRhosts,
 	sNoneEnabled, sNoneMacEnabled, sTcpRcvBufPoll, sHPNDisabled,
-	sDisableMTAES, sUseMPTCP,
+	sDisableMTAES, sCipherThreads, sCipherStreams, sCipherThreadAffinity,
+	sUseMPTCP, sZeroCopy, sReadHighWater, sNotSentLowat,
+	sRateLimit, sChannelWeights, sTCPCongestion, sTCPBufferSize,
+	sTransportProfile,
 	sX11Forwarding, sX11DisplayOffset, sX11UseLocalhost,
 	sPermitTTY, sStrictModes, sEmptyPasswd, sTCPKeepAlive,
 	sPermitUserEnvironment, sAllowTcpForwarding, sCompression,
@@ -752,6 +787,17 @@ static struct {
 	{ "nonemacenabled", sNoneMacEnabled, SSHCFG_ALL },
 	{ "usemptcp", sUseMPTCP, SSHCFG_GLOBAL },
 	{ "disableMTAES", sDisableMTAES, SSHCFG_ALL },
+	{ "cipherthreads", sCipherThreads, SSHCFG_GLOBAL },
+	{ "cipherstreams", sCipherStreams, SSHCFG_GLOBAL },
+	{ "cipherthreadaffinity", sCipherThreadAffinity, SSHCFG_GLOBAL },
+	{ "zerocopy", sZeroCopy, SSHCFG_GLOBAL },
+	{ "readhighwater", sReadHighWater, SSHCFG_GLOBAL },
+	{ "notsentlowat", sNotSentLowat, SSHCFG_GLOBAL },
+	{ "ratelimit", sRateLimit, SSHCFG_GLOBAL },
+	{ "channelweights", sChannelWeights, SSHCFG_GLOBAL },
+	{ "tcpcongestion", sTCPCongestion, SSHCFG_ALL },
+	{ "tcpbuffersize", sTCPBufferSize, SSHCFG_ALL },
+	{ "transportprofile", sTransportProfile, SSHCFG_ALL },
 	{ "kexalgorithms", sKexAlgorithms, SSHCFG_GLOBAL },
 	{ "include", sInclude, SSHCFG_ALL },
 	{ "ipqos", sIPQoS, SSHCFG_ALL },
@@ -1338,6 +1384,13 @@ static const struct multistate multistate_tcpfwd[] = {
 	{ NULL, -1 }
 };
 
+static const struct multistate multistate_transport_profile[] = {
+	{ "default",			TRANSPORT_PROFILE_DEFAULT },
+	{ "bulk",			TRANSPORT_PROFILE_BULK },
+	{ "interactive",		TRANSPORT_PROFILE_INTERACTIVE },
+	{ NULL, -1 }
+};
+
 static int
 process_server_config_line_depth(ServerOptions *options, char *line,
     const char *filename, int linenum, int *activep,
@@ -1352,7 +1405,8 @@ process_server_config_line_depth(ServerOptions *options, char *line,
 	ServerOpCodes opcode;
 	u_int i, *uintptr, flags = 0;
 	size_t len;
-	long long val64;
+	long long val64, maxsize;
+	int64_t *i64ptr;
 	const struct multistate *multistate_ptr;
 	const char *errstr;
 	struct include_item *item;
@@ -1605,10 +1659,121 @@ process_server_config_line_depth(ServerOptions *options, char *line,
 		intptr = &options->disable_multithreaded;
 		goto parse_flag;
 
+	case sCipherThreads:
+		intptr = &options->cipher_threads;
+		goto parse_int;
+
+	case sCipherStreams:
+		intptr = &options->cipher_streams;
+		goto parse_int;
+
+	case sCipherThreadAffinity:
+		arg = argv_next(&ac, &av);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: %s missing argument.",
+			    filename, linenum, keyword);
+		if (cipher_affinity_valid(arg) != 0)
+			fatal("%s line %d: Bad %s value: %s",
+			    filename, linenum, keyword, arg);
+		if (*activep && options->cipher_thread_affinity == NULL)
+			options->cipher_thread_affinity = xstrdup(arg);
+		break;
+
 	case sUseMPTCP:
 		intptr = &options->use_mptcp;
 		goto parse_flag;
 
+	case sZeroCopy:
+		intptr = &options->zerocopy;
+		goto parse_flag;
+
+	case sReadHighWater:
+		i64ptr = &options->read_high_water;
+		maxsize = READ_HIGH_WATER_MAX;
+ parse_size:
+		arg = argv_next(&ac, &av);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: %s missing argument.",
+			    filename, linenum, keyword);
+		if (strcmp(arg, "none") == 0) {
+			val64 = 0;
+		} else {
+			if (scan_scaled(arg, &val64) == -1)
+				fatal("%.200s line %d: Bad %s number '%s': %s",
+				    filename, linenum, keyword,
+				    arg, strerror(errno));
+			if (val64 < 0 || val64 > maxsize)
+				fatal("%.200s line %d: %s out of range",
+				    filename, linenum, keyword);
+		}
+		if (*activep && *i64ptr == -1)
+			*i64ptr = val64;
+		break;
+
+	case sNotSentLowat:
+		i64ptr = &options->notsent_lowat;
+		maxsize = NOTSENT_LOWAT_MAX;
+		goto parse_size;
+
+	case sRateLimit:
+		i64ptr = &options->rate_limit;
+		maxsize = RATE_LIMIT_MAX;
+		goto parse_size;
+
+	case sTCPBufferSize:
+		i64ptr = &options->tcp_buffer_size;
+		maxsize = TCP_BUFFER_SIZE_MAX;
+		goto parse_size;
+
+	case sTCPCongestion:
+		charptr = &options->tcp_congestion;
+		arg = argv_next(&ac, &av);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: %s missing argument.",
+			    filename, linenum, keyword);
+		if (strcmp(arg, "none") != 0 && !valid_congestion_name(arg))
+			fatal("%s line %d: Bad %s value: %s",
+			    filename, linenum, keyword, arg);
+		if (*activep && *charptr == NULL)
+			*charptr = xstrdup(arg);
+		break;
+
+	case sTransportProfile:
+		intptr = &options->transport_profile;
+		multistate_ptr = multistate_transport_profile;
+		goto parse_multistate;
+
+	case sChannelWeights:
+		found = options->num_channel_weights == 0;
+		while ((arg = argv_next(&ac, &av)) != NULL) {
+			/* Allow "none" only in first position */
+			if (strcasecmp(arg, "none") == 0) {
+				if (nstrs > 0 || ac > 0) {
+					error("%s line %d: keyword %s \"none\" "
+					    "argument must appear alone.",
+					    filename, linenum, keyword);
+					goto out;
+				}
+			} else if (parse_pattern_weight(arg, CHANNEL_WEIGHT_MAX,
+			    NULL, NULL) != 0) {
+				fatal("%s line %d: invalid channel weight %s",
+				    filename, linenum, arg);
+			}
+			opt_array_append(filename, linenum, keyword,
+			    &strs, &nstrs, arg);
+		}
+		if (nstrs == 0) {
+			fatal("%s line %d: no %s specified",
+			    filename, linenum, keyword);
+		}
+		if (found && *activep) {
+			options->channel_weights = strs;
+			options->num_channel_weights = nstrs;
+			strs = NULL; /* transferred */
+			nstrs = 0;
+		}
+		break;
+
 	case sIgnoreUserKnownHosts:
 		intptr = &options->ignore_user_known_hosts;
  parse_flag:
@@ -3008,6 +3173,8 @@ copy_set_server_options(ServerOptions *dst, ServerOptions *src, int preauth)
 	M_CP_INTOPT(required_rsa_size);
 	M_CP_INTOPT(unused_connection_timeout);
 	M_CP_INTOPT(refuse_connection);
+	M_CP_INTOPT(tcp_buffer_size);
+	M_CP_INTOPT(transport_profile);
 
 	/*
 	 * The bind_mask is a mode_t that may be unsigned, so we can't use
@@ -3142,6 +3309,8 @@ fmt_intarg(ServerOpCodes code, int val)
 		return fmt_multistate_int(val, multistate_compression);
 	case sAllowTcpForwarding:
 		return fmt_multistate_int(val, multistate_tcpfwd);
+	case sTransportProfile:
+		return fmt_multistate_int(val, multistate_transport_profile);
 	case sAllowStreamLocalForwarding:
 		return fmt_multistate_int(val, multistate_tcpfwd);
 	case sIgnoreRhosts:
@@ -3265,9 +3434,18 @@ format_listen_addrs(struct listenaddr *la)
 void
 dump_config(ServerOptions *o)
 {
-	char *s;
+	char *s, *congestion = NULL;
+	int64_t bufsize, lowat;
 	u_int i;
 
+	/* settings left unset come from the TransportProfile */
+	if (o->tcp_congestion != NULL)
+		congestion = xstrdup(o->tcp_congestion);
+	bufsize = o->tcp_buffer_size;
+	lowat = o->notsent_lowat;
+	transport_profile_defaults(o->transport_profile, &congestion,
+	    &bufsize, &lowat);
+
 	/* these are usually at the top of the config */
 	for (i = 0; i < o->num_ports; i++)
 		printf("port %d\n", o->ports[i]);
@@ -3293,6 +3471,8 @@ dump_config(ServerOptions *o)
 	dump_cfg_int(sRequiredRSASize, o->required_rsa_size);
 	dump_cfg_oct(sStreamLocalBindMask, o->fwd_opts.streamlocal_bind_mask);
 	dump_cfg_int(sUnusedConnectionTimeout, o->unused_connection_timeout);
+	dump_cfg_int(sCipherThreads, o->cipher_threads);
+	dump_cfg_int(sCipherStreams, o->cipher_streams);
 
 	/* formatted integer arguments */
 	dump_cfg_fmtint(sPermitRootLogin, o->permit_root_login);
@@ -3344,6 +3524,8 @@ dump_config(ServerOptions *o)
 	dump_cfg_fmtint(sNoneEnabled, o->none_enabled);
 	dump_cfg_fmtint(sNoneMacEnabled, o->nonemac_enabled);
 	dump_cfg_fmtint(sUseMPTCP, o->use_mptcp);
+	dump_cfg_fmtint(sZeroCopy, o->zerocopy);
+	dump_cfg_fmtint(sTransportProfile, o->transport_profile);
 	dump_cfg_fmtint(sRefuseConnection, o->refuse_connection);
 
 	/* string arguments */
@@ -3353,6 +3535,7 @@ dump_config(ServerOptions *o)
 	dump_cfg_string(sCiphers, o->ciphers);
 	dump_cfg_string(sMacs, o->macs);
 	dump_cfg_string(sBanner, o->banner);
+	dump_cfg_string(sTCPCongestion, congestion);
 	dump_cfg_string(sForceCommand, o->adm_forced_command);
 	dump_cfg_string(sChrootDirectory, o->chroot_directory);
 	dump_cfg_string(sTrustedUserCAKeys, o->trusted_user_ca_keys);
@@ -3375,6 +3558,7 @@ dump_config(ServerOptions *o)
 #if defined(__OpenBSD__) || defined(HAVE_SYS_SET_PROCESS_RDOMAIN)
 	dump_cfg_string(sRDomain, o->routing_domain);
 #endif
+	dump_cfg_string(sCipherThreadAffinity, o->cipher_thread_affinity);
 	dump_cfg_string(sSshdSessionPath, o->sshd_session_path);
 	dump_cfg_string(sSshdAuthPath, o->sshd_auth_path);
 	dump_cfg_string(sPerSourcePenaltyExemptList, o->per_source_penalty_exempt);
@@ -3402,6 +3586,8 @@ dump_config(ServerOptions *o)
 	    o->num_log_verbose, o->log_verbose);
 	dump_cfg_strarray_oneline(sChannelTimeout,
 	    o->num_channel_timeouts, o->channel_timeouts);
+	dump_cfg_strarray_oneline(sChannelWeights,
+	    o->num_channel_weights, o->channel_weights);
 
 	/* other arguments */
 	for (i = 0; i < o->num_subsystems; i++)
@@ -3433,6 +3619,14 @@ dump_config(ServerOptions *o)
 	printf("rekeylimit %llu %d\n", (unsigned long long)o->rekey_limit,
 	    o->rekey_interval);
 
+	printf("readhighwater %llu\n",
+	    (unsigned long long)o->read_high_water);
+	printf("notsentlowat %llu\n",
+	    (unsigned long long)(lowat == -1 ? 0 : lowat));
+	printf("ratelimit %llu\n", (unsigned long long)o->rate_limit);
+	printf("tcpbuffersize %llu\n",
+	    (unsigned long long)(bufsize == -1 ? 0 : bufsize));
+
 	printf("permitopen");
 	if (o->num_permitted_opens == 0)
 		printf(" any");
@@ -3488,4 +3682,5 @@ dump_config(ServerOptions *o)
 		    "deny-all" : "permissive");
 	} else
 		printf("persourcepenalties no\n");
+	free(congestion);
 }
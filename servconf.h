@@ -38,6 +38,11 @@
 
 #define DEFAULT_AUTH_FAIL_MAX	6	/* Default for MaxAuthTries */
 #define DEFAULT_SESSIONS_MAX	10	/* Default for MaxSessions */
+#define READ_HIGH_WATER_DEFAULT	(2 * 1024 * 1024) /* Default for ReadHighWater */
+#define READ_HIGH_WATER_MAX	(64 * 1024 * 1024)
+#define NOTSENT_LOWAT_MAX	(64 * 1024 * 1024)
+#define RATE_LIMIT_MAX		(4LL * 1024 * 1024 * 1024 - 1)
+#define TCP_BUFFER_SIZE_MAX	(1024 * 1024 * 1024)
 
 /* Magic name for internal sftp-server */
 #define INTERNAL_SFTP_NAME	"internal-sftp"
@@ -220,6 +225,16 @@ typedef struct {
 	int     nonemac_enabled;        /* Enable NONE MAC switch */
 	int     use_mptcp;              /* Use MPTCP - Linux only */
 	int     disable_multithreaded;  /* Disable multithreaded aes-ctr cipher */
+	int     cipher_threads;         /* workers per parallel cipher (0 = auto) */
+	int     cipher_streams;         /* keystreams per chacha20-mt batch */
+	char   *cipher_thread_affinity; /* where the cipher workers run */
+	int     zerocopy;               /* send large output with MSG_ZEROCOPY */
+	int64_t read_high_water;        /* bytes read per wakeup (0 = one read) */
+	int64_t notsent_lowat;          /* TCP_NOTSENT_LOWAT (0 = off) */
+	int64_t rate_limit;             /* send rate in bytes/s (0 = unlimited) */
+	char   *tcp_congestion;         /* TCP_CONGESTION for the connection */
+	int64_t tcp_buffer_size;        /* SO_SNDBUF/SO_RCVBUF (0 = autotune) */
+	int     transport_profile;      /* TRANSPORT_PROFILE_* */
 
 	int	permit_tun;
 
@@ -253,6 +268,8 @@ typedef struct {
 
 	char	**channel_timeouts;	/* inactivity timeout by channel type */
 	u_int	num_channel_timeouts;
+	char	**channel_weights;	/* output weight by channel type */
+	u_int	num_channel_weights;
 
 	int	unused_connection_timeout;
 
@@ -309,6 +326,7 @@ TAILQ_HEAD(include_list, include_item);
 		M_CP_STROPT(routing_domain); \
 		M_CP_STROPT(permit_user_env_allowlist); \
 		M_CP_STROPT(pam_service_name); \
+		M_CP_STROPT(tcp_congestion); \
 		M_CP_STRARRAYOPT(authorized_keys_files, num_authkeys_files); \
 		M_CP_STRARRAYOPT(allow_users, num_allow_users); \
 		M_CP_STRARRAYOPT(deny_users, num_deny_users); \
@@ -156,10 +156,10 @@ wait_until_can_do_something(struct ssh *ssh,
 {
 	struct timespec timeout;
 	char remote_id[512];
-	int ret;
+	int ret, write_delay;
 	int client_alive_scheduled = 0;
 	u_int p;
-	time_t now;
+	time_t now, secs;
 	static time_t last_client_time, unused_connection_expiry;
 
 	*conn_in_readyp = *conn_out_readyp = 0;
@@ -174,6 +174,8 @@ wait_until_can_do_something(struct ssh *ssh,
 		ptimeout_deadline_sec(&timeout,
 		    ssh_packet_get_rekey_timeout(ssh));
 	}
+	if ((secs = ssh_packet_get_idle_timeout(ssh)) > 0)
+		ptimeout_deadline_sec(&timeout, secs);
 
 	/*
 	 * If no channels are open and UnusedConnectionTimeout is set, then
@@ -212,7 +214,11 @@ wait_until_can_do_something(struct ssh *ssh,
 	(*pfdp)[0].fd = connection_in;
 	(*pfdp)[0].events = POLLIN;
 	(*pfdp)[1].fd = connection_out;
-	(*pfdp)[1].events = ssh_packet_have_data_to_write(ssh) ? POLLOUT : 0;
+	/* output held back by the send rate limit waits for its deadline */
+	if ((write_delay = ssh_packet_write_delay_ms(ssh)) > 0)
+		ptimeout_deadline_ms(&timeout, write_delay);
+	(*pfdp)[1].events = (write_delay == 0 &&
+	    ssh_packet_have_data_to_write(ssh)) ? POLLOUT : 0;
 
 	/*
 	 * If child has terminated and there is enough buffer space to read
@@ -233,7 +239,8 @@ wait_until_can_do_something(struct ssh *ssh,
 	}
 
 	*conn_in_readyp = (*pfdp)[0].revents != 0;
-	*conn_out_readyp = (*pfdp)[1].revents != 0;
+	*conn_out_readyp = (*pfdp)[1].revents != 0 ||
+	    (write_delay > 0 && ssh_packet_write_delay_ms(ssh) == 0);
 
 	now = monotime(); /* need to reset after ppoll() */
 	/* ClientAliveInterval probing */
@@ -335,8 +342,10 @@ server_loop2(struct ssh *ssh, Authctxt *authctxt)
 	struct pollfd *pfd = NULL;
 	u_int npfd_alloc = 0, npfd_active = 0;
 	int r, conn_in_ready, conn_out_ready;
-	u_int connection_in, connection_out;
+	u_int connection_in, connection_out, i, weight;
 	sigset_t bsigset, osigset;
+	char *type, *congestion;
+	int64_t bufsize, lowat;
 
 	debug("Entering interactive session for SSH2.");
 	ssh->start_time = monotime_double();
@@ -353,6 +362,43 @@ server_loop2(struct ssh *ssh, Authctxt *authctxt)
 	child_terminated = 0;
 	connection_in = ssh_packet_get_connection_in(ssh);
 	connection_out = ssh_packet_get_connection_out(ssh);
+	if (options.zerocopy)
+		ssh_packet_set_zerocopy(ssh);
+	ssh_packet_set_read_high_water(ssh, options.read_high_water);
+
+	/* Match blocks may have chosen a different transport profile */
+	congestion = options.tcp_congestion == NULL ?
+	    NULL : xstrdup(options.tcp_congestion);
+	bufsize = options.tcp_buffer_size;
+	lowat = options.notsent_lowat;
+	transport_profile_defaults(options.transport_profile,
+	    &congestion, &bufsize, &lowat);
+	if (congestion != NULL && strcmp(congestion, "none") == 0) {
+		free(congestion);
+		congestion = NULL;
+	}
+	if (bufsize == -1)
+		bufsize = 0;
+	if (lowat == -1)
+		lowat = 0;
+	if (ssh_packet_connection_is_on_socket(ssh))
+		set_sock_transport(connection_in, congestion, (int)bufsize);
+	free(congestion);
+	ssh_packet_set_notsent_lowat(ssh, lowat);
+	ssh_packet_set_send_rate(ssh, options.rate_limit);
+
+	channel_clear_weights(ssh);
+	for (i = 0; i < options.num_channel_weights; i++) {
+		if (parse_pattern_weight(options.channel_weights[i],
+		    CHANNEL_WEIGHT_MAX, &type, &weight) != 0) {
+			fatal_f("internal error: bad weight %s",
+			    options.channel_weights[i]);
+		}
+		channel_add_weight(ssh, type, weight);
+		free(type);
+	}
+	channel_set_dynamic_windows(ssh,
+	    options.tcp_rcv_buf_poll && !options.hpn_disabled);
 
 	server_init_dispatch(ssh);
 
@@ -388,6 +434,7 @@ server_loop2(struct ssh *ssh, Authctxt *authctxt)
 		/* A timeout may have triggered rekeying */
 		if ((r = ssh_packet_check_rekey(ssh)) != 0)
 			fatal_fr(r, "cannot start rekeying");
+		ssh_packet_check_idle(ssh);
 		if (conn_out_ready)
 			process_output(ssh, connection_out);
 	}
@@ -719,6 +766,7 @@ server_input_metrics_request(struct ssh *ssh, struct sshbuf **respp)
 	}
 	/* write the tcp_info data to the binn object */
 	metrics_write_binn_object(&tcp_info, metricsobj);
+	metrics_write_congestion(sock_in, metricsobj);
 	if ((r = sshbuf_put_string(resp, binn_ptr(metricsobj),
 				   binn_size(metricsobj))) != 0) {
 		error_fr(r, "Failed to build tcp_info object");
@@ -523,15 +523,15 @@ do_exec_no_pty(struct ssh *ssh, Session *s, const char *command)
 	    s->is_subsystem, 0);
 #endif
 	/* switch to the parallel ciphers if necessary
-	 * If FIPS mode exists and is enabled then no parallel ciphers.
+	 * If FIPS mode exists and is enabled then only AES-GCM.
 	 */
 	fips = fips_enabled();
 	if (fips)
-		debug2_f("FIPS mode is enabled. Parallel ciphers are disabled");
+		debug2_f("FIPS mode is enabled. Only AES-GCM runs in parallel");
 	else
 		debug2_f("FIPS mode not found or disabled. Parallel ciphers are enabled");
 
-	if ((options.disable_multithreaded == 0) && (fips == 0))
+	if (options.disable_multithreaded == 0)
 		cipher_switch(ssh);
 	return 0;
 }
@@ -635,15 +635,15 @@ do_exec_pty(struct ssh *ssh, Session *s, const char *command)
 	s->ptymaster = ptymaster;
 	session_set_fds(ssh, s, ptyfd, fdout, -1, 1, 1);
 	/* switch to the parallel cipher if appropriate
-	 * If FIPS mode exists and is enabled then no parallel ciphers.
+	 * If FIPS mode exists and is enabled then only AES-GCM.
 	 */
 	fips = fips_enabled();
 	if (fips)
-		debug2_f("FIPS mode is enabled. Parallel ciphers are disabled");
+		debug2_f("FIPS mode is enabled. Only AES-GCM runs in parallel");
 	else
 		debug2_f("FIPS mode not found or disabled. Parallel ciphers are enabled");
 
-	if ((options.disable_multithreaded == 0) && (fips == 0))
+	if (options.disable_multithreaded == 0)
 		cipher_switch(ssh);
 	return 0;
 }
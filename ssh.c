@@ -83,6 +83,7 @@
 #include "canohost.h"
 #include "compat.h"
 #include "cipher.h"
+#include "cipher-affinity.h"
 #include "packet.h"
 #include "sshbuf.h"
 #include "channels.h"
@@ -698,7 +699,7 @@ main(int ac, char **av)
 	struct Forward fwd;
 	struct addrinfo *addrs = NULL;
 	size_t n, len;
-	u_int j;
+	u_int j, weight;
 	struct utsname utsname;
 	struct ssh_conn_info *cinfo = NULL;
 
@@ -1724,6 +1725,24 @@ main(int ac, char **av)
 		free(cp);
 	}
 
+	/* Apply channel output weights, if set */
+	channel_clear_weights(ssh);
+	for (j = 0; j < options.num_channel_weights; j++) {
+		debug3("applying channel weight %s",
+		    options.channel_weights[j]);
+		if (parse_pattern_weight(options.channel_weights[j],
+		    CHANNEL_WEIGHT_MAX, &cp, &weight) != 0) {
+			fatal_f("internal error: bad weight %s",
+			    options.channel_weights[j]);
+		}
+		channel_add_weight(ssh, cp, weight);
+		free(cp);
+	}
+
+	/* Forwarded channels get HPN dynamic windows as sessions do */
+	channel_set_dynamic_windows(ssh,
+	    options.tcp_rcv_buf_poll > 0 && !options.hpn_disabled);
+
 	/* Open a connection to the remote host. */
 	/* we try initially on the default hpnssh port returned by
 	 * default_ssh_port() which now returns HPNSSH_DEFAULT_PORT
@@ -1970,15 +1989,15 @@ fork_postauth(struct ssh *ssh)
 		error_f("stdfd_devnull failed");
 	/* we do the cipher switch here in the event that the client
 	 * is forking or has a delayed fork.
-	 * If FIPS mode exists and is enabled then no parallel ciphers.
+	 * If FIPS mode exists and is enabled then only AES-GCM.
 	 */
 	fips = fips_enabled();
 	if (fips)
-		debug2_f("FIPS mode is enabled. Parallel ciphers are disabled");
+		debug2_f("FIPS mode is enabled. Only AES-GCM runs in parallel");
 	else
 		debug2_f("FIPS mode not found or disabled. Parallel ciphers are enabled");
 
-	if ((options.disable_multithreaded == 0) && (fips == 0))
+	if (options.disable_multithreaded == 0)
 		cipher_switch(ssh);
 }
 
@@ -2281,12 +2300,14 @@ ssh_session2_setup(struct ssh *ssh, int id, int success, void *arg)
 }
 
 /* this used to do a lot more but now it just checks to see
- * if we are disabling hpn */
+ * if we are disabling hpn and passes the parallel cipher tunables */
 static void
 hpn_options_init(struct ssh *ssh)
 {
 	channel_set_hpn_disabled(options.hpn_disabled);
 	debug_f("HPN disabled: %d", options.hpn_disabled);
+	cipher_set_mt_tunables(options.cipher_threads, options.cipher_streams);
+	cipher_affinity_set(options.cipher_thread_affinity);
 }
 
 /* open new channel for a session */
@@ -2446,15 +2467,14 @@ ssh_session2(struct ssh *ssh, const struct ssh_conn_info *cinfo)
 		/* check to see if we are switching ciphers to
 		 * one of our parallel versions. If the client is
 		 * forking then we handle it in fork_postauth()
-		 * If FIPS mode exists and is enabled then no parallel ciphers.
+		 * If FIPS mode exists and is enabled then only AES-GCM.
 		 */
 		fips = fips_enabled();
 		if (fips)
-			debug2_f("FIPS mode is enabled. Parallel ciphers are disabled");
+			debug2_f("FIPS mode is enabled. Only AES-GCM runs in parallel");
 		else
 			debug2_f("FIPS mode not found or disabled. Parallel ciphers are enabled");
-		if ((options.disable_multithreaded == 0)
-		    && (fips == 0))
+		if (options.disable_multithreaded == 0)
 			cipher_switch(ssh);
 	}
 	return client_loop(ssh, tty_flag, tty_flag ?
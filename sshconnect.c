@@ -372,6 +372,10 @@ ssh_create_socket(struct addrinfo *ai)
 	if (options.ip_qos_interactive != INT_MAX)
 		set_sock_tos(sock, options.ip_qos_interactive);
 
+	/* Set before connect(2) so the buffer size affects window scaling */
+	set_sock_transport(sock, options.tcp_congestion,
+	    (int)options.tcp_buffer_size);
+
 	/* Bind the socket to an alternative local IP address */
 	if (options.bind_address == NULL && options.bind_interface == NULL)
 		return sock;
@@ -75,6 +75,7 @@
 #include "ssh-sk.h"
 #include "sk-api.h"
 #include "cipher-switch.h"
+#include "cipher-calibrate.h"
 
 #ifdef GSSAPI
 #include "ssh-gss.h"
@@ -227,7 +228,7 @@ ssh_kex2(struct ssh *ssh, char *host, struct sockaddr *hostaddr, u_short port,
     const struct ssh_conn_info *cinfo)
 {
 	char *myproposal[PROPOSAL_MAX];
-	char *all_key, *hkalgs = NULL;
+	char *all_key, *hkalgs = NULL, *ciphers = NULL;
 	int r, use_known_hosts_order = 0;
 
 	xxx_host = host;
@@ -258,12 +259,27 @@ ssh_kex2(struct ssh *ssh, char *host, struct sockaddr *hostaddr, u_short port,
 	if (use_known_hosts_order)
 		hkalgs = order_hostkeyalgs(host, hostaddr, port, cinfo);
 
+	/* fastest cipher on this host first */
+	if (options.cipher_calibration) {
+		char *path = tilde_expand_filename(
+		    _PATH_SSH_USER_CIPHER_CALIBRATION, getuid());
+
+		/* the workers the calibration starts should match the
+		 * ones the session will use */
+		cipher_set_mt_tunables(options.cipher_threads,
+		    options.cipher_streams);
+		ciphers = cipher_calibrate_order(options.ciphers,
+		    options.macs, path, !options.disable_multithreaded);
+		free(path);
+	}
+
 	kex_proposal_populate_entries(ssh, myproposal,
-	    options.kex_algorithms, options.ciphers, options.macs,
-	    compression_alg_list(options.compression),
+	    options.kex_algorithms, ciphers ? ciphers : options.ciphers,
+	    options.macs, compression_alg_list(options.compression),
 	    hkalgs ? hkalgs : options.hostkeyalgorithms);
 
 	free(hkalgs);
+	free(ciphers);
 
 	/* start key exchange */
 	if ((r = kex_setup(ssh, myproposal)) != 0)
@@ -284,6 +300,9 @@ ssh_kex2(struct ssh *ssh, char *host, struct sockaddr *hostaddr, u_short port,
 	ssh->kex->kex[KEX_KEM_SNTRUP761X25519_SHA512] = kex_gen_client;
 	ssh->kex->kex[KEX_KEM_MLKEM768X25519_SHA256] = kex_gen_client;
 	ssh->kex->verify_host_key=&verify_host_key_callback;
+	/* bigger channel packets if the server is HPN too */
+	if (!options.hpn_disabled)
+		ssh->kex->hpn_packet_offer = KEX_HPN_PACKET;
 
 	ssh_dispatch_run_fatal(ssh, DISPATCH_BLOCK, &ssh->kex->done);
 	kex_proposal_free_entries(myproposal);
@@ -863,6 +863,9 @@ do_ssh2_kex(struct ssh *ssh)
 	kex->load_host_private_key=&get_hostkey_private_by_type;
 	kex->host_key_index=&get_hostkey_index;
 	kex->sign = sshd_hostkey_sign;
+	/* bigger channel packets if the client is HPN too */
+	if (!options.hpn_disabled)
+		kex->hpn_packet_offer = KEX_HPN_PACKET;
 
 	ssh_dispatch_run_fatal(ssh, DISPATCH_BLOCK, &kex->done);
 	kex_proposal_free_entries(myproposal);
@@ -77,6 +77,7 @@
 #include "uidswap.h"
 #include "compat.h"
 #include "cipher.h"
+#include "cipher-affinity.h"
 #include "digest.h"
 #include "sshkey.h"
 #include "kex.h"
@@ -1242,6 +1243,8 @@ main(int ac, char **av)
 
 	/* set the HPN options for the child */
 	channel_set_hpn_disabled(options.hpn_disabled);
+	cipher_set_mt_tunables(options.cipher_threads, options.cipher_streams);
+	cipher_affinity_set(options.cipher_thread_affinity);
 
 	/*
 	 * We don't want to listen forever unless the other side